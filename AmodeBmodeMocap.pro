@@ -1,4 +1,4 @@
-QT       += core gui 3dcore 3drender 3dinput 3dextras datavisualization
+QT       += core gui 3dcore 3drender 3dinput 3dextras datavisualization concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets printsupport
 
@@ -11,51 +11,81 @@ CONFIG += c++17
 DEFINES += QCUSTOMPLOT_USE_LIBRARY
 
 SOURCES += \
+    amodebeamcaster.cpp \
     amodeconfig.cpp \
     amodeconnection.cpp \
     amodedatamanipulator.cpp \
+    amodeframereader.cpp \
+    amodeframewriter.cpp \
     amodemocaprecorder.cpp \
+    amodemocapsynchronizer.cpp \
     amodetimedrecorder.cpp \
     bmode3dvisualizer.cpp \
     bmodeconnection.cpp \
+    bonedistancefield.cpp \
+    bonekdtree.cpp \
+    brickedvolume.cpp \
+    csvrowwriter.cpp \
     datawriter.cpp \
+    framebufferpool.cpp \
     imagewriter.cpp \
+    livevolumereconstructor.cpp \
     main.cpp \
     mainwindow.cpp \
+    marchingcubes.cpp \
     measurementwindow.cpp \
     mhareader.cpp \
     mhawriter.cpp \
+    poselog.cpp \
     qcustomplotintervalwindow.cpp \
     qualisysconnection.cpp \
     qualisystransformationmanager.cpp \
     viconconnection.cpp \
     volume3dcontroller.cpp \
     volumeamodecontroller.cpp \
-    volumeamodevisualizer.cpp
+    volumeamodevisualizer.cpp \
+    volumereconstructor.cpp \
+    volumereslicer.cpp
 
 HEADERS += \
+    amodebeamcaster.h \
     amodeconfig.h \
     amodeconnection.h \
     amodedatamanipulator.h \
+    amodeframereader.h \
+    amodeframewriter.h \
     amodemocaprecorder.h \
+    amodemocapsynchronizer.h \
     amodetimedrecorder.h \
     bmode3dvisualizer.h \
     bmodeconnection.h \
+    bonedistancefield.h \
+    bonekdtree.h \
+    brickedvolume.h \
+    csvrowwriter.h \
     datawriter.h \
+    framebufferpool.h \
     imagewriter.h \
+    latestmailbox.h \
+    livevolumereconstructor.h \
     mainwindow.h \
+    marchingcubes.h \
     measurementwindow.h \
     mhareader.h \
     mhawriter.h \
     mocapconnection.h \
+    poselog.h \
     qcustomplotintervalwindow.h \
     qualisysconnection.h \
     qualisystransformationmanager.h \
+    spscqueue.h \
     ultrasoundconfig.h \
     viconconnection.h \
     volume3dcontroller.h \
     volumeamodecontroller.h \
-    volumeamodevisualizer.h
+    volumeamodevisualizer.h \
+    volumereconstructor.h \
+    volumereslicer.h
 
 FORMS += \
     mainwindow.ui \
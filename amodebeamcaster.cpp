@@ -0,0 +1,71 @@
+#include "amodebeamcaster.h"
+#include <QtMath>
+
+#include "ultrasoundconfig.h"
+
+AmodeBeamCaster::AmodeBeamCaster(const std::vector<AmodeConfig::Data>& amodegroupdata)
+    : maxDepth_(UltrasoundConfig::N_SAMPLE * UltrasoundConfig::DS)
+{
+    // the transducers don't move in the holder, their transformations are computed once
+    T_ustip_holder_.reserve(amodegroupdata.size());
+    for (const AmodeConfig::Data& amodedata : amodegroupdata)
+        T_ustip_holder_.push_back(transducerToHolder(amodedata));
+}
+
+Eigen::Isometry3d AmodeBeamCaster::transducerToHolder(const AmodeConfig::Data& amodedata)
+{
+    // get the local_R data from amodeconfig, convert it to radians, and to a rotation matrix
+    Eigen::Vector3d local_R_euler(amodedata.local_R.at(0), amodedata.local_R.at(1), amodedata.local_R.at(2));
+    Eigen::Vector3d local_R_radians = local_R_euler * (M_PI / 180.0);
+    Eigen::Matrix3d local_R_matrix;
+    local_R_matrix = Eigen::AngleAxisd(local_R_radians.x(), Eigen::Vector3d::UnitX()) *
+                     Eigen::AngleAxisd(local_R_radians.y(), Eigen::Vector3d::UnitY()) *
+                     Eigen::AngleAxisd(local_R_radians.z(), Eigen::Vector3d::UnitZ());
+
+    // convert local_t from amode config data in with Eigen
+    Eigen::Vector3d local_t(amodedata.local_t.at(0), amodedata.local_t.at(1), amodedata.local_t.at(2));
+
+    // pack local_R and local_t into transformation matrix with Eigen
+    Eigen::Isometry3d T_ustip_holder = Eigen::Isometry3d::Identity();
+    T_ustip_holder.linear() = local_R_matrix;
+    T_ustip_holder.translation() = local_t;
+    return T_ustip_holder;
+}
+
+const std::vector<Eigen::Isometry3d>& AmodeBeamCaster::getTransducersToHolder() const
+{
+    return T_ustip_holder_;
+}
+
+void AmodeBeamCaster::setVolume(const BrickedVolume* volume)
+{
+    volume_ = volume;
+}
+
+void AmodeBeamCaster::setThreshold(int threshold)
+{
+    threshold_ = threshold;
+}
+
+bool AmodeBeamCaster::hasVolume() const
+{
+    return volume_ != nullptr && !volume_->empty();
+}
+
+void AmodeBeamCaster::cast(const Eigen::Isometry3d& T_holder_ref, std::vector<std::optional<double>>& depths) const
+{
+    depths.assign(T_ustip_holder_.size(), std::nullopt);
+    if (!hasVolume()) return;
+
+    for (std::size_t i = 0; i < T_ustip_holder_.size(); ++i) {
+        // the beam starts at the tip and goes along the local z axis of the transducer
+        const Eigen::Isometry3d T_ustip_ref = T_holder_ref * T_ustip_holder_[i];
+        const Eigen::Vector3d origin    = T_ustip_ref.translation();
+        const Eigen::Vector3d direction = T_ustip_ref.linear().col(2);
+
+        // the points of the bone are > threshold, the same as the surface (Volume3DController)
+        double depth = 0.0;
+        if (volume_->castRay(origin, direction, maxDepth_, threshold_ + 1, depth))
+            depths[i] = depth;
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef AMODEBEAMCASTER_H
+#define AMODEBEAMCASTER_H
+
+#include <vector>
+#include <optional>
+
+#include <Eigen/Dense>
+
+#include "amodeconfig.h"
+#include "brickedvolume.h"
+
+/**
+ * @class AmodeBeamCaster
+ * @brief Predicts where every A-mode transducer of a holder should see the bone, by following its beam through the
+ * reconstructed volume.
+ *
+ * For the context. The user has to find the bone peak in the signal of every transducer and put the interval window
+ * around it (QCustomPlotIntervalWindow), for up to 30 transducers. But we already have the bone: the reconstructed
+ * volume is in the Reference coordinate system, and so is the holder (VolumeAmodeController). The beam of a transducer
+ * starts at its tip and goes along its local z axis (that is how the 3D signal is drawn, see VolumeAmodeVisualizer),
+ * so the depth of the bone along the beam is where the first crossing of the bone threshold is.
+ *
+ * Every beam is ray-marched through the BrickedVolume (BrickedVolume::castRay(), trilinear samples, the bricks that
+ * can't reach the threshold are jumped over). A beam is a few microseconds, all beams of a holder are done for every
+ * mocap frame in the thread that gets the frames, so they are simply done one after another.
+ *
+ */
+
+class AmodeBeamCaster
+{
+public:
+
+    /**
+     * @brief Constructor function. Requires the A-mode group data, the local transformation of every transducer.
+     */
+    explicit AmodeBeamCaster(const std::vector<AmodeConfig::Data>& amodegroupdata);
+
+    /**
+     * @brief The transformation of a transducer tip relative to the holder, from its local_R (euler, degrees) and local_t
+     */
+    static Eigen::Isometry3d transducerToHolder(const AmodeConfig::Data& amodedata);
+
+    /**
+     * @brief GET the transformation of every transducer tip relative to the holder
+     */
+    const std::vector<Eigen::Isometry3d>& getTransducersToHolder() const;
+
+    /**
+     * @brief SET the volume (it must live as long as it is set, nullptr to remove it) and the bone threshold (the
+     * threshold of Volume3DController, the bone is over it)
+     */
+    void setVolume(const BrickedVolume* volume);
+    void setThreshold(int threshold);
+
+    /**
+     * @brief There is a volume to cast through
+     */
+    bool hasVolume() const;
+
+    /**
+     * @brief Casts the beam of every transducer, the holder is in the coordinate system of the volume (Reference).
+     * depths[i] is the depth (mm) of the bone along the beam of transducer i, or empty if the beam doesn't hit it.
+     */
+    void cast(const Eigen::Isometry3d& T_holder_ref, std::vector<std::optional<double>>& depths) const;
+
+private:
+
+    std::vector<Eigen::Isometry3d> T_ustip_holder_;     //!< Transformation of every transducer tip relative to the holder
+    const BrickedVolume* volume_ = nullptr;             //!< The reconstructed volume, owned by MHAReader
+    int threshold_ = 0;                                 //!< The bone is over this intensity
+    double maxDepth_;                                   //!< The depth of the last sample of the signal (mm)
+};
+
+#endif // AMODEBEAMCASTER_H
@@ -8,6 +8,7 @@
 #include "qdebug.h"
 #include "qlogging.h"
 #include "ultrasoundconfig.h"
+#include "csvrowwriter.h"
 
 AmodeConfig::AmodeConfig(const std::string& filepath, const std::string& filedir_window) {
     // get the filename and the file dir
@@ -85,27 +86,40 @@ bool AmodeConfig::exportWindow(const std::string& newfilepath_window)
         return false;
     }
 
+    // The rows are formatted into one buffer and written to the file in one go (see CsvRowWriter)
+    CsvRowWriter csv({"Number", "Group", "GroupName", "IsSet", "LowerBound", "Middle", "UpperBound"},
+                     [&file](const char* data, std::size_t size) {
+                         file.write(data, static_cast<std::streamsize>(size));
+                         return !file.fail();
+                     });
+
     // Write CSV header
-    file << "Number,Group,GroupName,IsSet,LowerBound,Middle,UpperBound\n";
+    csv.writeHeader();
 
     // Write data
     for (const auto& pair : dataWindow) {
         const Window& window = pair.second;
-        file << window.number << ","
-             << window.group << ","
-             << window.groupname << ","
-             << window.isset << ","
-             << window.lowerbound << ","
-             << window.middle << ","
-             << window.upperbound << "\n";
-
-        if (file.fail()) {
+        csv.add(window.number)
+           .add(window.group)
+           .add(window.groupname)
+           .add(window.isset)
+           .add(window.lowerbound)
+           .add(window.middle)
+           .add(window.upperbound);
+
+        if (!csv.endRow()) {
             qDebug() << "AmodeConfig::exportWindow() Error: Failed to write data to file";
             file.close();
             return false;
         }
     }
 
+    if (!csv.flush()) {
+        qDebug() << "AmodeConfig::exportWindow() Error: Failed to write data to file";
+        file.close();
+        return false;
+    }
+
     file.close();
 
     if (file.fail()) {
@@ -0,0 +1,111 @@
+#include "amodeframereader.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <limits>
+#include <string>
+
+AmodeFrameReader::AmodeFrameReader(const QString &filename)
+    : file_(filename),
+    data_(nullptr),
+    size_(0),
+    index_(nullptr),
+    frameCount_(0),
+    frameBytes_(0)
+{
+    if (!file_.open(QIODevice::ReadOnly))
+        throw std::runtime_error("AmodeFrameReader::AmodeFrameReader() Could not open file: " + filename.toStdString());
+
+    size_ = file_.size();
+    if (size_ < static_cast<qint64>(sizeof(AmodeFrameWriter::FileHeader)))
+        throw std::runtime_error("AmodeFrameReader::AmodeFrameReader() File is too small to be a container: " + filename.toStdString());
+
+    // map the whole file, the OS will only bring the pages that we really touch into memory
+    data_ = file_.map(0, size_);
+    if (data_ == nullptr)
+        throw std::runtime_error("AmodeFrameReader::AmodeFrameReader() Could not map file: " + filename.toStdString());
+
+    std::memcpy(&header_, data_, sizeof(header_));
+    if (std::memcmp(header_.magic, "AMODEREC", 8) != 0 || header_.version != AmodeFrameWriter::FORMAT_VERSION || header_.bytesPerSample != sizeof(uint16_t))
+        throw std::runtime_error("AmodeFrameReader::AmodeFrameReader() Not a valid A-mode container: " + filename.toStdString());
+
+    // the frames start after the header, which must be in the file
+    if (header_.headerSize < sizeof(AmodeFrameWriter::FileHeader) || header_.headerSize > static_cast<uint64_t>(size_))
+        throw std::runtime_error("AmodeFrameReader::AmodeFrameReader() Invalid header size: " + filename.toStdString());
+
+    // rows * cols * 2 can't overflow, the numbers are 32 bit
+    const uint64_t samples = static_cast<uint64_t>(header_.rows) * header_.cols;
+    if (samples == 0 || samples > static_cast<uint64_t>(std::numeric_limits<qint64>::max()) / header_.bytesPerSample)
+        throw std::runtime_error("AmodeFrameReader::AmodeFrameReader() Invalid frame geometry: " + filename.toStdString());
+    frameBytes_ = static_cast<qint64>(samples * header_.bytesPerSample);
+
+    if (header_.indexOffset != 0)
+    {
+        // the writer completes the header after the index, so a header with an index that doesn't fit in the file (or
+        // with frames outside of it) is a broken file, not an incomplete recording. Checked once here, so frame() can
+        // simply trust the index.
+        const uint64_t fileSize = static_cast<uint64_t>(size_);
+        if (header_.indexOffset < header_.headerSize || header_.indexOffset > fileSize ||
+            header_.frameCount > (fileSize - header_.indexOffset) / sizeof(AmodeFrameWriter::IndexEntry))
+            throw std::runtime_error("AmodeFrameReader::AmodeFrameReader() The index is outside of the file: " + filename.toStdString());
+
+        const AmodeFrameWriter::IndexEntry* index = reinterpret_cast<const AmodeFrameWriter::IndexEntry*>(data_ + header_.indexOffset);
+        for (uint64_t i = 0; i < header_.frameCount; ++i)
+        {
+            if (index[i].offset < header_.headerSize || static_cast<uint64_t>(frameBytes_) > fileSize ||
+                index[i].offset > fileSize - static_cast<uint64_t>(frameBytes_))
+                throw std::runtime_error("AmodeFrameReader::AmodeFrameReader() Frame " + std::to_string(i) + " is outside of the file: " + filename.toStdString());
+        }
+
+        index_      = index;
+        frameCount_ = static_cast<std::size_t>(header_.frameCount);
+    }
+    else
+    {
+        // incomplete recording, count the complete frames that made it to the disk
+        frameCount_ = static_cast<std::size_t>((size_ - header_.headerSize) / frameBytes_);
+    }
+}
+
+AmodeFrameReader::~AmodeFrameReader()
+{
+    if (data_ != nullptr)
+        file_.unmap(const_cast<uchar*>(data_));
+}
+
+int AmodeFrameReader::rows() const
+{
+    return static_cast<int>(header_.rows);
+}
+
+int AmodeFrameReader::cols() const
+{
+    return static_cast<int>(header_.cols);
+}
+
+std::size_t AmodeFrameReader::frameCount() const
+{
+    return frameCount_;
+}
+
+bool AmodeFrameReader::hasIndex() const
+{
+    return index_ != nullptr;
+}
+
+const uint16_t* AmodeFrameReader::frame(std::size_t i) const
+{
+    if (i >= frameCount_)
+        return nullptr;
+
+    qint64 offset = index_ ? static_cast<qint64>(index_[i].offset) : header_.headerSize + static_cast<qint64>(i) * frameBytes_;
+    return reinterpret_cast<const uint16_t*>(data_ + offset);
+}
+
+int64_t AmodeFrameReader::timestamp(std::size_t i) const
+{
+    if (index_ == nullptr || i >= frameCount_)
+        return 0;
+
+    return index_[i].timestamp;
+}
@@ -0,0 +1,77 @@
+#ifndef AMODEFRAMEREADER_H
+#define AMODEFRAMEREADER_H
+
+#include <QString>
+#include <QFile>
+#include <cstdint>
+#include <cstddef>
+
+#include "amodeframewriter.h"
+
+/**
+ * @class AmodeFrameReader
+ * @brief For reading the A-mode container file (.amode) written by AmodeFrameWriter.
+ *
+ * For the context. The container is memory-mapped, so opening a recording with hundreds of thousands of frames is
+ * instant and nothing is copied; frame(i) just returns a pointer into the mapped file. Please check AmodeFrameWriter
+ * for the layout of the file.
+ *
+ * If the recording was not stopped properly (e.g. the program crashed), the header is not completed and there is no
+ * index. In that case the frames are counted from the file size, and the timestamps are not available (returns 0).
+ */
+class AmodeFrameReader
+{
+public:
+
+    /**
+     * @brief Constructor function. Opens and maps the file, throws std::runtime_error if it is not a valid container
+     * (also if the header, the index or a frame of the index is outside of the file, e.g. a truncated copy).
+     */
+    AmodeFrameReader(const QString &filename);
+
+    /**
+     * @brief Destructor function, unmaps the file.
+     */
+    ~AmodeFrameReader();
+
+    /**
+     * @brief GET the number of rows of a frame (number of transducers).
+     */
+    int rows() const;
+
+    /**
+     * @brief GET the number of columns of a frame (number of samples per transducer).
+     */
+    int cols() const;
+
+    /**
+     * @brief GET the number of frames in the container.
+     */
+    std::size_t frameCount() const;
+
+    /**
+     * @brief GET whether the index is available (the recording was stopped properly).
+     */
+    bool hasIndex() const;
+
+    /**
+     * @brief GET the pointer to frame i (rows*cols uint16, row-major), directly from the mapped file.
+     */
+    const uint16_t* frame(std::size_t i) const;
+
+    /**
+     * @brief GET the timestamp (microseconds since epoch) of frame i, 0 if there is no index.
+     */
+    int64_t timestamp(std::size_t i) const;
+
+private:
+    QFile file_;                                        //!< The container file
+    const uchar* data_;                                 //!< The mapped file
+    qint64 size_;                                       //!< Size of the mapped file
+    AmodeFrameWriter::FileHeader header_;               //!< Copy of the header
+    const AmodeFrameWriter::IndexEntry* index_;         //!< Points to the index inside the mapped file, nullptr if not available
+    std::size_t frameCount_;                            //!< Number of frames
+    qint64 frameBytes_;                                 //!< Size of one frame in bytes
+};
+
+#endif // AMODEFRAMEREADER_H
@@ -0,0 +1,274 @@
+#include "amodeframewriter.h"
+#include <QDebug>
+#include <QMutexLocker>
+#include <QMetaObject>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+
+static_assert(sizeof(AmodeFrameWriter::FileHeader) == 64, "AmodeFrameWriter::FileHeader must be 64 bytes");
+static_assert(sizeof(AmodeFrameWriter::IndexEntry) == 24, "AmodeFrameWriter::IndexEntry must be 24 bytes");
+
+// Size of the write buffer. One A-mode frame (30x3500 uint16) is about 200KB, so this is ~40 frames per write.
+static constexpr qint64 WRITEBUFFER_SIZE = 8 * 1024 * 1024;
+
+// How long the writing thread sleeps at most when the queue is empty, before it checks again whether it has to stop
+static constexpr int IDLE_WAIT_MILLISECONDS = 100;
+
+AmodeFrameWriter::AmodeFrameWriter(QObject *parent)
+    : QObject(parent),
+    m_frameQueue(256, OverflowPolicy::DropNewest),  // 256 frames of 30x3500 uint16 is ~50MB, more than one second at 200Hz.
+                                                    // The frames come from the GUI thread, so a full queue drops the new frame
+                                                    // (and AmodeMocapRecorder its row) instead of waiting for the disk.
+    m_isWriting(false),
+    m_writeBufferUsed(0),
+    m_frameBytes(0),
+    m_nextOffset(0),
+    m_flushedFrames(0),
+    m_writeFailed(false)
+{
+    std::memset(&m_header, 0, sizeof(m_header));
+}
+
+AmodeFrameWriter::~AmodeFrameWriter()
+{
+    // Make sure the processing loop can exit, and that the file is completed if it is still open.
+    stopWriting();
+    if (m_file.isOpen())
+        finalizeFile();
+}
+
+void AmodeFrameWriter::setFileName(const QString &fileName)
+{
+    QMutexLocker locker(&m_mutex);
+    m_file.setFileName(fileName);
+}
+
+bool AmodeFrameWriter::writeHeader(int rows, int cols)
+{
+    QMutexLocker locker(&m_mutex);
+
+    // No frame is taken until the header, the buffers and the slots are ready, enqueueFrame() checks this
+    m_frameBytes = 0;
+
+    if (rows <= 0 || cols <= 0)
+    {
+        qWarning() << "AmodeFrameWriter::writeHeader() Invalid frame geometry:" << rows << "x" << cols;
+        return false;
+    }
+
+    // We manage the buffering ourselves (one big buffer), so no need for another buffer from QFile
+    if (!m_file.isOpen() && !m_file.open(QIODevice::WriteOnly | QIODevice::Unbuffered))
+    {
+        qWarning() << "AmodeFrameWriter::writeHeader() Failed to open file:" << m_file.fileName();
+        return false;
+    }
+
+    // Fill the header, the number of frames and the index offset are completed when we stop writing
+    std::memset(&m_header, 0, sizeof(m_header));
+    std::memcpy(m_header.magic, "AMODEREC", 8);
+    m_header.version        = FORMAT_VERSION;
+    m_header.headerSize     = sizeof(FileHeader);
+    m_header.rows           = static_cast<uint32_t>(rows);
+    m_header.cols           = static_cast<uint32_t>(cols);
+    m_header.bytesPerSample = sizeof(uint16_t);
+
+    if (m_file.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header)) != sizeof(m_header))
+    {
+        qWarning() << "AmodeFrameWriter::writeHeader() Failed to write the header:" << m_file.fileName();
+        m_file.close();
+        return false;
+    }
+
+    // Prepare everything for the frames, so nothing needs to be allocated while writing (except the index, which is small)
+    const qint64 frameBytes = static_cast<qint64>(rows) * cols * sizeof(uint16_t);
+    m_nextOffset      = sizeof(FileHeader);
+    m_writeBufferUsed = 0;
+
+    // One frame buffer for every slot of the queue, plus one for the frame the writing thread is holding. The buffers
+    // only move between the slots and m_currentFrame (swap), they never go back to the heap while recording.
+    try
+    {
+        m_writeBuffer.resize(std::max(WRITEBUFFER_SIZE, frameBytes));
+    }
+    catch (const std::bad_alloc&)
+    {
+        qWarning() << "AmodeFrameWriter::writeHeader() Failed to allocate the write buffer.";
+        m_file.close();
+        return false;
+    }
+    if (!m_framePool.reset(static_cast<std::size_t>(frameBytes), m_frameQueue.capacity() + 1))
+    {
+        qWarning() << "AmodeFrameWriter::writeHeader() Failed to allocate the frame buffers.";
+        m_file.close();
+        return false;
+    }
+    m_frameQueue.initializeSlots([this](FrameItem &slot) {
+        slot.timestamp = 0;
+        slot.samples   = reinterpret_cast<uint16_t*>(m_framePool.acquire());
+    });
+    m_currentFrame.timestamp = 0;
+    m_currentFrame.samples   = reinterpret_cast<uint16_t*>(m_framePool.acquire());
+    m_index.clear();
+    m_index.reserve(200 * 60 * 10); // 10 minutes of 200Hz
+    m_flushedFrames = 0;
+    m_writeFailed   = false;
+
+    // Only now the slots point to the buffers of this geometry
+    m_frameBytes = frameBytes;
+    return true;
+}
+
+bool AmodeFrameWriter::enqueueFrame(qint64 timestamp, const std::vector<uint16_t> &frame)
+{
+    // Every frame in the container must have the same size, otherwise we can't find them by offset anymore
+    if (m_frameBytes == 0 || static_cast<qint64>(frame.size() * sizeof(uint16_t)) != m_frameBytes)
+    {
+        qWarning() << "AmodeFrameWriter::enqueueFrame() Frame size does not match the header, frame is skipped.";
+        return false;
+    }
+
+    // Copy the frame into the pool buffer of a free slot of the queue, nothing is allocated here
+    const qint64 frameBytes = m_frameBytes;
+    return m_frameQueue.push([&](FrameItem &slot) {
+        slot.timestamp = timestamp;
+        std::memcpy(slot.samples, frame.data(), static_cast<std::size_t>(frameBytes));
+    });
+}
+
+void AmodeFrameWriter::setQueuePolicy(OverflowPolicy policy, int capacity)
+{
+    m_frameQueue.setPolicy(policy);
+    m_frameQueue.setCapacity(static_cast<std::size_t>(std::max(2, capacity)));
+}
+
+SpscQueueStats AmodeFrameWriter::queueStats() const
+{
+    return m_frameQueue.stats();
+}
+
+void AmodeFrameWriter::startWriting()
+{
+    qDebug() << "AmodeFrameWriter::startWriting() called and attempting to start writing";
+
+    if (m_isWriting.exchange(true)) return; // If already writing, do nothing, otherwise set the flag to indicate that writing is active
+    m_frameQueue.resetStats();
+
+    // Start the processing loop in this object's thread using a queued connection.
+    QMetaObject::invokeMethod(this, "processQueue", Qt::QueuedConnection);
+}
+
+void AmodeFrameWriter::stopWriting()
+{
+    qDebug() << "AmodeFrameWriter::stopWriting() called and attempting to stop writing.";
+
+    m_isWriting = false;            // Set the flag to indicate that writing should stop
+    m_frameQueue.wakeConsumer();    // Wake up the thread if it's currently waiting for more frames
+}
+
+void AmodeFrameWriter::processQueue()
+{
+    qDebug() << "AmodeFrameWriter::processQueue() started.";
+
+    // The frames are swapped out of the queue into m_currentFrame, and its previous buffer goes back to the queue to be reused
+    FrameItem &item = m_currentFrame;
+    while (true)
+    {
+        if (!m_frameQueue.pop(item))
+        {
+            if (!m_isWriting && m_frameQueue.empty())
+            {
+                // If writing has stopped and the queue is empty, exit the loop
+                qDebug() << "AmodeFrameWriter::processQueue() exiting loop.";
+                break;
+            }
+
+            // If the queue is empty but writing is still active, wait for new frames to be enqueued
+            m_frameQueue.waitForData(std::chrono::milliseconds(IDLE_WAIT_MILLISECONDS));
+            continue;
+        }
+
+        // After a failed write the file can't be trusted anymore, the frames are only taken out of the queue
+        if (m_writeFailed)
+            continue;
+
+        // Not enough space in the buffer, write it to the disk first
+        if (m_writeBufferUsed + m_frameBytes > static_cast<qint64>(m_writeBuffer.size()) && !flushBuffer())
+            continue;
+
+        std::memcpy(m_writeBuffer.data() + m_writeBufferUsed, item.samples, m_frameBytes);
+        m_writeBufferUsed += m_frameBytes;
+
+        // Register the frame in the index
+        IndexEntry entry;
+        entry.timestamp   = item.timestamp;
+        entry.frameNumber = m_index.size();
+        entry.offset      = static_cast<uint64_t>(m_nextOffset);
+        m_index.push_back(entry);
+        m_nextOffset += m_frameBytes;
+    }
+
+    // Everything is written, now complete the file
+    finalizeFile();
+
+    // Tell how the queue behaved, so we know if the disk was too slow during the recording
+    SpscQueueStats stats = m_frameQueue.stats();
+    qDebug() << "AmodeFrameWriter::processQueue() queue: pushed" << stats.pushed << "frames, high-water mark" << stats.highWater
+             << "of" << stats.capacity << ", blocked" << stats.blocked << "times";
+    if (stats.dropped > 0)
+        qWarning() << "AmodeFrameWriter::processQueue()" << stats.dropped << "frames were dropped because the queue was full.";
+
+    qDebug() << "AmodeFrameWriter::processQueue() emitting finished signal.";
+    emit finished(); // Emit the finished signal to indicate that the writing process is complete
+}
+
+bool AmodeFrameWriter::flushBuffer()
+{
+    if (m_writeBufferUsed == 0)
+        return true;
+
+    qint64 written = m_file.write(m_writeBuffer.data(), m_writeBufferUsed);
+    if (written != m_writeBufferUsed)
+    {
+        // The frames of the buffer are not (completely) in the file. They go out of the index, and the index will be
+        // written right after the last complete frame, so every offset in it points to a frame that is really there.
+        qWarning() << "AmodeFrameWriter::flushBuffer() Failed to write frames to" << m_file.fileName()
+                   << ", the recording ends after frame" << m_flushedFrames;
+        m_index.resize(m_flushedFrames);
+        m_nextOffset      = sizeof(FileHeader) + static_cast<qint64>(m_flushedFrames) * m_frameBytes;
+        m_writeBufferUsed = 0;
+        m_writeFailed     = true;
+        m_file.seek(m_nextOffset);
+        return false;
+    }
+
+    m_writeBufferUsed = 0;
+    m_flushedFrames   = m_index.size();
+    return true;
+}
+
+void AmodeFrameWriter::finalizeFile()
+{
+    if (!m_file.isOpen())
+        return;
+
+    // Write what is left in the buffer
+    flushBuffer();
+
+    // Append the index right after the last frame
+    m_header.frameCount  = m_index.size();
+    m_header.indexOffset = static_cast<uint64_t>(m_nextOffset);
+    qint64 indexBytes    = static_cast<qint64>(m_index.size() * sizeof(IndexEntry));
+    if (indexBytes > 0 && m_file.write(reinterpret_cast<const char*>(m_index.data()), indexBytes) != indexBytes)
+    {
+        qWarning() << "AmodeFrameWriter::finalizeFile() Failed to write the index to" << m_file.fileName();
+        m_header.indexOffset = 0;
+    }
+
+    // Go back to the beginning and complete the header
+    if (!m_file.seek(0) || m_file.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header)) != sizeof(m_header))
+        qWarning() << "AmodeFrameWriter::finalizeFile() Failed to complete the header of" << m_file.fileName();
+
+    m_file.close();
+    qDebug() << "AmodeFrameWriter::finalizeFile()" << m_header.frameCount << "frames written to" << m_file.fileName();
+}
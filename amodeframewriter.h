@@ -0,0 +1,196 @@
+#ifndef AMODEFRAMEWRITER_H
+#define AMODEFRAMEWRITER_H
+
+#include <QObject>
+#include <QFile>
+#include <QMutex>
+#include <vector>
+#include <cstdint>
+#include <atomic>
+
+#include "spscqueue.h"
+#include "framebufferpool.h"
+
+/**
+ * @brief AmodeFrameWriter class implementation.
+ *
+ * This class is responsible for writing the recorded A-mode frames into ONE container file, instead of one TIFF file
+ * per frame (which is what ImageWriter did, the recorder doesn't use it anymore). With thousands of small files, the filesystem overhead dominates, and
+ * two frames which arrive in the same millisecond overwrite each other because they get the same file name.
+ *
+ * The container is append-only and looks like this (all values are little-endian):
+ *
+ *   [FileHeader, 64 bytes]   magic "AMODEREC", version, geometry (rows x cols of uint16), number of frames, index offset
+ *   [frame 0]                rows*cols uint16, row-major (one row = one transducer), exactly like the old TIFF image
+ *   [frame 1]
+ *   ...
+ *   [IndexEntry x nframes]   timestamp (microseconds since epoch), frame number, byte offset of the frame
+ *
+ * Every frame has the same size, so frame i is at headerSize + i*frameBytes, and the whole file can simply be
+ * memory-mapped and read in place (see AmodeFrameReader). The frames are collected into a big buffer and written to
+ * disk with large sequential writes. The number of frames and the index offset in the header are filled when the
+ * writing is stopped; if the program crashes before that, the frames are still there and can be counted from the
+ * file size, only the index is lost.
+ *
+ * Same as the other writers, this class works in a separate thread. The frames go to that thread through a bounded
+ * lock-free queue of preallocated frame slots (see SpscQueue), the overflow policy decides what happens when it is full.
+ * The memory of the frames comes from a FrameBufferPool sized from the geometry in writeHeader(): every slot of the
+ * queue (and the frame that the writing thread is working on) owns one buffer of the pool, enqueueFrame() copies the
+ * frame into the buffer of a free slot, and the writing thread swaps it out and gives its previous buffer back to the
+ * ring. So nothing is allocated per frame.
+ */
+class AmodeFrameWriter : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    /**
+     * @brief The fixed header at the beginning of the container file.
+     */
+    #pragma pack(push, 1)
+    struct FileHeader
+    {
+        char magic[8];          //!< "AMODEREC"
+        uint32_t version;       //!< Version of the container format, currently 1
+        uint32_t headerSize;    //!< Size of this header in bytes, the first frame starts here
+        uint32_t rows;          //!< Number of rows of a frame (number of transducers)
+        uint32_t cols;          //!< Number of columns of a frame (number of samples per transducer)
+        uint32_t bytesPerSample;//!< Always 2 (uint16)
+        uint32_t reserved;      //!< Not used
+        uint64_t frameCount;    //!< Number of frames, filled when the writing is stopped
+        uint64_t indexOffset;   //!< Byte offset of the index, filled when the writing is stopped (0 if the file is incomplete)
+        char padding[16];       //!< Pads the header to 64 bytes
+    };
+
+    /**
+     * @brief One entry of the index at the end of the container file.
+     */
+    struct IndexEntry
+    {
+        int64_t timestamp;      //!< Timestamp of the frame (microseconds since epoch)
+        uint64_t frameNumber;   //!< Sequential number of the frame, starting from 0
+        uint64_t offset;        //!< Byte offset of the frame in the file
+    };
+    #pragma pack(pop)
+
+    static constexpr uint32_t FORMAT_VERSION = 1;   //!< Current version of the container format
+
+    /**
+     * @brief Constructor of the class
+     * @param parent
+     */
+    explicit AmodeFrameWriter(QObject *parent = nullptr);
+
+    /**
+     * @brief Destructor of the class
+     */
+    ~AmodeFrameWriter();
+
+    /**
+     * @brief Sets the file name of the container file.
+     * @param fileName A QString representing the path and name of the file.
+     */
+    void setFileName(const QString &fileName);
+
+    /**
+     * @brief Opens the container file and writes the header with the frame geometry.
+     *
+     * All the frames that are enqueued later must have exactly rows*cols samples. The frame buffers are allocated here,
+     * so if the queue policy is changed, it has to be changed before this is called.
+     * @param rows Number of rows of a frame (number of transducers).
+     * @param cols Number of columns of a frame (number of samples per transducer).
+     * @return true if the file is opened and the header is written.
+     */
+    bool writeHeader(int rows, int cols);
+
+    /**
+     * @brief Adds a new frame to the queue for writing. The frame is copied into a free slot of the queue, it must be
+     * called from one thread only (the producer).
+     * @param timestamp Timestamp of the frame in microseconds since epoch, it goes to the index.
+     * @param frame The A-mode frame, rows*cols samples.
+     * @return false if the queue was full and the frame was dropped.
+     */
+    bool enqueueFrame(qint64 timestamp, const std::vector<uint16_t> &frame);
+
+    /**
+     * @brief Sets the size of the queue and what happens when it is full. It has to be set before writeHeader() is called.
+     * @param policy DropNewest (default, the new frame is dropped), Block (the producer sleeps a bit) or DropOldest. With
+     *        DropOldest, a frame whose row AmodeMocapRecorder already wrote can go, so the rows don't match the frames anymore.
+     * @param capacity Number of frames the queue can hold.
+     */
+    void setQueuePolicy(OverflowPolicy policy, int capacity);
+
+    /**
+     * @brief GET the counters of the queue (depth, high-water mark, dropped frames, ...).
+     */
+    SpscQueueStats queueStats() const;
+
+public slots:
+    /**
+     * @brief Starts the writing process.
+     *
+     * This function initiates the writing process if it is not already active. It sets the writing flag to true
+     * and invokes the processing loop via Qt's queued connection, ensuring that the function runs in the correct thread.
+     */
+    void startWriting();
+
+    /**
+     * @brief Stops the writing process.
+     *
+     * This function stops the writing process by setting the writing flag to false. The queue is still written
+     * completely, then the index is appended and the header is completed.
+     */
+    void stopWriting();
+
+signals:
+    /**
+     * @brief A signal which emitted when everything is finished
+     */
+    void finished();
+
+private slots:
+    /**
+     * @brief Processes the frame queue and appends the frames to the container.
+     */
+    void processQueue();
+
+private:
+    /**
+     * @brief Writes the content of the write buffer to the file. If that fails, the frames of the buffer are taken out
+     * of the index again, the file is cut after the last frame that was written, and no more frames are written.
+     */
+    bool flushBuffer();
+
+    /**
+     * @brief Appends the index, completes the header, and closes the file.
+     */
+    void finalizeFile();
+
+    QFile m_file;                                           //!< The container file
+    /**
+     * @brief One slot of the queue, a frame and its timestamp.
+     */
+    struct FrameItem
+    {
+        qint64 timestamp = 0;
+        uint16_t *samples = nullptr;    //!< Buffer from m_framePool, rows*cols samples
+    };
+
+    QMutex m_mutex;                                         //!< Protects the file and the header
+    SpscQueue<FrameItem> m_frameQueue;                      //!< Frames waiting to be written, with their timestamps
+    FrameBufferPool m_framePool;                            //!< The memory of the frames, one buffer per slot of the queue
+    FrameItem m_currentFrame;                               //!< The frame the writing thread is working on (also owns a buffer)
+    std::atomic<bool> m_isWriting;                          //!< Indicates whether the writing is active
+
+    FileHeader m_header;                                    //!< The header of the container, completed at the end
+    std::vector<IndexEntry> m_index;                        //!< The index, kept in memory and appended at the end
+    std::vector<char> m_writeBuffer;                        //!< Big buffer, so we write to the disk in large sequential chunks
+    qint64 m_writeBufferUsed;                               //!< How many bytes of m_writeBuffer are used
+    qint64 m_frameBytes;                                    //!< Size of one frame in bytes
+    qint64 m_nextOffset;                                    //!< Byte offset where the next frame will be placed
+    std::size_t m_flushedFrames;                            //!< Number of frames in the index that are really in the file
+    bool m_writeFailed;                                     //!< A write failed, the index ends with the frames that made it
+};
+
+#endif // AMODEFRAMEWRITER_H
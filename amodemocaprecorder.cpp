@@ -1,25 +1,31 @@
 #include "AmodeMocapRecorder.h"
 #include <QDebug>
 #include <QDateTime>
+#include <limits>
+#include <algorithm>
 
 AmodeMocapRecorder::AmodeMocapRecorder(QObject *parent)
     : QObject(parent),
     m_filePath(""),
-    m_hasLatestTManager(false),
-    m_hasLatestUSData(false),
+    m_clockEpochMicros(0),
     m_isRecording(false),
     m_pendingRecordingRequest(false),
+    m_rowsMismatched(false),
     m_dataWriterThread(nullptr),
     m_dataWriter(nullptr),
-    m_imageWriterThread(nullptr),
-    m_imageWriter(nullptr)
+    m_frameWriterThread(nullptr),
+    m_frameWriter(nullptr)
 {
+    // Start the clock for timestamping the incoming data, anchored to the epoch so the timestamps are still meaningful outside this program.
+    m_clockEpochMicros = QDateTime::currentMSecsSinceEpoch() * 1000;
+    m_clock.start();
+
     // ==========================================================
     // Initialize the DataWriter and move it to a separate thread
     // ==========================================================
 
-    // Create the DataWriter instance which will handle the CSV data writing.
-    // The data writer is responsible for storing data into a CSV file during recording sessions.
+    // Create the DataWriter instance which will handle the rigid body data writing.
+    // The data writer is responsible for storing data into a pose log (or CSV) file during recording sessions.
     m_dataWriter = new DataWriter();
     m_dataWriterThread = new QThread();              // Create a new thread for DataWriter to avoid blocking the main UI thread.
     m_dataWriter->moveToThread(m_dataWriterThread);  // Move the DataWriter to the new thread to run its operations concurrently with the main program.
@@ -36,27 +42,27 @@ AmodeMocapRecorder::AmodeMocapRecorder(QObject *parent)
     m_dataWriterThread->start();
     qDebug() << "AmodeMocapRecorder::AmodeMocapRecorder() m_dataWriterThread started.";
 
-    // ===========================================================
-    // Initialize the ImageWriter and move it to a separate thread
-    // ===========================================================
-
-    // Create the ImageWriter instance which will handle the image writing.
-    // The ImageWriter is responsible for saving ultrasound images captured during the recording sessions.
-    m_imageWriter = new ImageWriter();
-    m_imageWriterThread = new QThread();                // Create a new thread for ImageWriter to avoid blocking the main UI thread.
-    m_imageWriter->moveToThread(m_imageWriterThread);   // Move the ImageWriter to the new thread to ensure its operations do not interfere with the main program.
-
-    // Connect signals and slots for ImageWriter.
-    // These connections ensure that the ImageWriter starts or stops writing when we emit the corresponding signals.
-    connect(this, &AmodeMocapRecorder::startWriter, m_imageWriter, &ImageWriter::startWriting);                      // Start writing when recording starts.
-    connect(this, &AmodeMocapRecorder::stopWriter, m_imageWriter, &ImageWriter::stopWriting, Qt::DirectConnection);  // Stop writing immediately when requested using a direct connection.
-    connect(m_imageWriter, &ImageWriter::finished, m_imageWriterThread, &QThread::quit);                             // Quit the ImageWriter thread when writing is finished.
-    connect(m_imageWriterThread, &QThread::finished, m_imageWriter, &QObject::deleteLater);                          // Clean up ImageWriter after the thread finishes to free memory.
-    connect(m_imageWriterThread, &QThread::finished, m_imageWriterThread, &QObject::deleteLater);                    // Clean up the thread object itself after it is finished.
-
-    // Start the ImageWriter thread so that it is ready to handle writing tasks.
-    m_imageWriterThread->start();
-    qDebug() << "AmodeMocapRecorder::AmodeMocapRecorder() m_imageWriterThread started.";
+    // ================================================================
+    // Initialize the AmodeFrameWriter and move it to a separate thread
+    // ================================================================
+
+    // Create the AmodeFrameWriter instance which will handle the A-mode frame writing.
+    // All the frames captured during the recording session go into a single container file (instead of one TIFF per frame).
+    m_frameWriter = new AmodeFrameWriter();
+    m_frameWriterThread = new QThread();                // Create a new thread for AmodeFrameWriter to avoid blocking the main UI thread.
+    m_frameWriter->moveToThread(m_frameWriterThread);   // Move the AmodeFrameWriter to the new thread to ensure its operations do not interfere with the main program.
+
+    // Connect signals and slots for AmodeFrameWriter.
+    // These connections ensure that the AmodeFrameWriter starts or stops writing when we emit the corresponding signals.
+    connect(this, &AmodeMocapRecorder::startWriter, m_frameWriter, &AmodeFrameWriter::startWriting);                      // Start writing when recording starts.
+    connect(this, &AmodeMocapRecorder::stopWriter, m_frameWriter, &AmodeFrameWriter::stopWriting, Qt::DirectConnection);  // Stop writing immediately when requested using a direct connection.
+    connect(m_frameWriter, &AmodeFrameWriter::finished, m_frameWriterThread, &QThread::quit);                             // Quit the AmodeFrameWriter thread when writing is finished.
+    connect(m_frameWriterThread, &QThread::finished, m_frameWriter, &QObject::deleteLater);                               // Clean up AmodeFrameWriter after the thread finishes to free memory.
+    connect(m_frameWriterThread, &QThread::finished, m_frameWriterThread, &QObject::deleteLater);                         // Clean up the thread object itself after it is finished.
+
+    // Start the AmodeFrameWriter thread so that it is ready to handle writing tasks.
+    m_frameWriterThread->start();
+    qDebug() << "AmodeMocapRecorder::AmodeMocapRecorder() m_frameWriterThread started.";
 }
 
 AmodeMocapRecorder::~AmodeMocapRecorder()
@@ -77,27 +83,46 @@ AmodeMocapRecorder::~AmodeMocapRecorder()
         qDebug() << "AmodeMocapRecorder::~AmodeMocapRecorder() m_dataWriterThread has finished.";
     }
 
-    // Wait for the ImageWriter thread to finish before destructing to ensure all pending tasks are completed.
-    if (m_imageWriterThread && m_imageWriterThread->isRunning())
+    // Wait for the AmodeFrameWriter thread to finish before destructing to ensure all pending tasks are completed.
+    if (m_frameWriterThread && m_frameWriterThread->isRunning())
     {
-        qDebug() << "AmodeMocapRecorder::~AmodeMocapRecorder() Waiting for m_imageWriterThread to finish.";
-        m_imageWriterThread->wait();  // Wait for the thread to finish its operations safely.
-        qDebug() << "AmodeMocapRecorder::~AmodeMocapRecorder() m_imageWriterThread has finished.";
+        qDebug() << "AmodeMocapRecorder::~AmodeMocapRecorder() Waiting for m_frameWriterThread to finish.";
+        m_frameWriterThread->wait();  // Wait for the thread to finish its operations safely.
+        qDebug() << "AmodeMocapRecorder::~AmodeMocapRecorder() m_frameWriterThread has finished.";
     }
 }
 
 void AmodeMocapRecorder::setFilePath(const QString &filePath)
 {
     // Store the provided file path to be used later when writing files.
-    // This path is where the CSV files and image files will be saved during recording.
+    // This path is where the rigid body data file and the A-mode container file will be saved during recording.
     m_filePath = filePath;
 }
 
+void AmodeMocapRecorder::setPoseLogFormat(DataWriter::Format format)
+{
+    // The format is decided when the recording starts, changing it in the middle of a recording does nothing.
+    m_dataWriter->setFormat(format);
+}
+
+void AmodeMocapRecorder::setPoseInterpolation(bool interpolate)
+{
+    QMutexLocker locker(&m_dataMutex);
+    m_synchronizer.setInterpolation(interpolate);
+}
+
+qint64 AmodeMocapRecorder::currentTimestamp() const
+{
+    return m_clockEpochMicros + m_clock.nsecsElapsed() / 1000;
+}
+
 void AmodeMocapRecorder::onRigidBodyReceived(const QualisysTransformationManager &tmanager)
 {
+    // Timestamp the data as soon as it arrives, before anything else, so the pairing is as accurate as possible.
+    qint64 timestamp = currentTimestamp();
+
     QMutexLocker locker(&m_dataMutex);  // Lock the mutex to ensure that shared data is accessed in a thread-safe manner.
     m_latestTManager = tmanager;        // Store the latest Rigid Body data received from the Qualisys system.
-    m_hasLatestTManager = true;         // Set the flag to indicate that the latest rigid body data is available.
 
     // Check if there is a pending request to start recording and verify that recording is not already active.
     // If both conditions are true and both rigid body and ultrasound data are available, start recording.
@@ -113,15 +138,21 @@ void AmodeMocapRecorder::onRigidBodyReceived(const QualisysTransformationManager
         }
     }
 
-    // Attempt to process the latest data pair of rigid body and ultrasound data.
-    tryProcessDataPair();
+    // Store the pose in the synchronizer. We keep the poses even when we are not recording, so that the very first
+    // A-mode frames of a recording already have poses around them.
+    m_synchronizer.addPose(timestamp, tmanager);
+
+    // A new pose might be the one that the pending A-mode frames are waiting for.
+    processSynchronizedFrames();
 }
 
 void AmodeMocapRecorder::onAmodeSignalReceived(const std::vector<uint16_t> &usdata_uint16_)
 {
+    // Timestamp the data as soon as it arrives, before anything else, so the pairing is as accurate as possible.
+    qint64 timestamp = currentTimestamp();
+
     QMutexLocker locker(&m_dataMutex);      // Lock the mutex to ensure that shared data is accessed in a thread-safe manner.
     m_latestUSData = usdata_uint16_;        // Store the latest Ultrasound data received from the sensor.
-    m_hasLatestUSData = true;               // Set the flag to indicate that the latest ultrasound data is available.
 
     // Check if there is a pending request to start recording and verify that recording is not already active.
     // If both conditions are true and both rigid body and ultrasound data are available, start recording.
@@ -137,102 +168,115 @@ void AmodeMocapRecorder::onAmodeSignalReceived(const std::vector<uint16_t> &usda
         }
     }
 
-    // Attempt to process the latest data pair of rigid body and ultrasound data.
-    tryProcessDataPair();
+    // We only keep the A-mode frames while recording, every one of them will be written once its pose is decided.
+    if (!m_isRecording)
+        return;
+
+    m_synchronizer.addAmode(timestamp, usdata_uint16_);
+    processSynchronizedFrames();
 }
 
-void AmodeMocapRecorder::tryProcessDataPair()
+void AmodeMocapRecorder::processSynchronizedFrames(bool flushAll)
 {
-    // Check if both the latest rigid body data and ultrasound data are available.
-    // If both are available, process the data pair to extract relevant information.
-    if (m_hasLatestTManager && m_hasLatestUSData)
-    {
-        processDataPair(m_latestTManager, m_latestUSData);  // Process the available data.
+    // Take every A-mode frame whose pose can be decided now. Unlike before, no frame is thrown away if one of the
+    // streams is faster than the other, the frame just waits in the synchronizer until a pose around it arrives.
+    while (m_synchronizer.popSynced(m_syncedFrame))
+        processDataPair(m_syncedFrame);
 
-        // Reset the flags as we have used the current data, indicating that we need new data for further processing.
-        m_hasLatestTManager = false;
-        m_hasLatestUSData = false;
+    // When stopping, there is no newer pose coming anymore, so release the rest with the nearest pose we have.
+    if (flushAll)
+    {
+        while (m_synchronizer.popRemaining(m_syncedFrame))
+            processDataPair(m_syncedFrame);
     }
-    // If either data is not available, wait until both are received before processing.
 }
 
-void AmodeMocapRecorder::processDataPair(const QualisysTransformationManager &tmanager, const std::vector<uint16_t> &usdata)
+void AmodeMocapRecorder::processDataPair(const AmodeMocapSynchronizer::SyncedFrame &frame)
 {
     // Only process the data if recording is currently active and exit the function without processing if not recording.
     if (!m_isRecording)
         return;
 
-    // Check the size of the ultrasound data to determine reshaping parameters.
-    // We expect the data to be reshaped into an image format, with a fixed height of 30.
+    const QualisysTransformationManager &tmanager = frame.tmanager;
+    const std::vector<uint16_t> &usdata = frame.usdata;
+
+    // Check the size of the ultrasound data, we expect it to be an image with a fixed height of 30 (one row per transducer).
     int height = 30;
-    int width = usdata.size() / height;
     if (usdata.size() % height != 0)
     {
         qWarning() << "Data size is not divisible by the height. Cannot reshape.";
         return;  // Exit if the data cannot be reshaped correctly into the expected dimensions.
     }
 
-    // Get the current timestamp in milliseconds since epoch for logging and file naming purposes.
-    qint64 timestamp_currentEpochMillis = QDateTime::currentMSecsSinceEpoch();
-    QString timestamp_currentEpochMillis_str = QString::number(timestamp_currentEpochMillis);
-
     // Extract transformations from the tmanager to get the position and orientation data of the rigid body.
     // This information is essential for analyzing the movement and orientation of the tracked object.
     std::vector<Eigen::Isometry3d> transformations_values = tmanager.getAllTransformations();
     std::vector<std::string> transformations_id = tmanager.getAllIds();
 
     // ==========================================================
-    // Handle rigid body data writing to CSV file
+    // Handle rigid body data writing to the pose log
     // ==========================================================
 
-    // Prepare a row of data to write into the CSV file.
-    // The row contains a timestamp followed by the position and orientation (quaternion) of each tracked rigid body.
-    QStringList dataRow;
-    dataRow << timestamp_currentEpochMillis_str;  // Add the timestamp to indicate when the data was recorded.
+    // Prepare a row of data, following the schema that was fixed when the recording started.
+    // The row contains the timestamps followed by the orientation (quaternion) and position of each rigid body in the schema.
+    // Both timestamps are the arrival time of each data (in milliseconds since epoch, same as before).
+    // A rigid body that is not in this pose (e.g. it was not visible) gets NaN, so the columns never shift.
+    std::fill(m_dataRow.begin(), m_dataRow.end(), std::numeric_limits<double>::quiet_NaN());
+    m_dataRow[0] = static_cast<double>(frame.timestamp_amode / 1000);  // The timestamp of the A-mode data.
+    m_dataRow[1] = static_cast<double>(frame.timestamp_mocap / 1000);  // The timestamp of the pose that is paired with the A-mode data.
 
-    // Iterate over each transformation and add the relevant data to the CSV row.
+    // Iterate over each transformation and put the relevant data to its columns.
     for (size_t i = 0; i < transformations_values.size(); ++i)
     {
         const Eigen::Isometry3d &transform = transformations_values[i];  // Extract the transformation data.
         const std::string &id = transformations_id[i];                   // Extract the unique ID of the transformation.
 
+        // Find the columns of this rigid body, skip it if it was not there when the recording started.
+        auto it = m_schemaColumn.find(id);
+        if (it == m_schemaColumn.end())
+            continue;
+        double *columns = m_dataRow.data() + it->second;
+
         // Extract translation (position) components (x, y, z).
         Eigen::Vector3d translation = transform.translation();
 
         // Extract rotation matrix and convert it to a quaternion representation (x, y, z, w).
         Eigen::Quaterniond quaternion(transform.rotation());
 
-        // Append quaternion components q1, q2, q3, q4 (which represent the rotation of the rigid body).
-        dataRow << QString::number(quaternion.x());
-        dataRow << QString::number(quaternion.y());
-        dataRow << QString::number(quaternion.z());
-        dataRow << QString::number(quaternion.w());
+        // Quaternion components q1, q2, q3, q4 (which represent the rotation of the rigid body).
+        columns[0] = quaternion.x();
+        columns[1] = quaternion.y();
+        columns[2] = quaternion.z();
+        columns[3] = quaternion.w();
 
-        // Append translation components t1, t2, t3 (which represent the position of the rigid body).
-        dataRow << QString::number(translation.x());
-        dataRow << QString::number(translation.y());
-        dataRow << QString::number(translation.z());
+        // Translation components t1, t2, t3 (which represent the position of the rigid body).
+        columns[4] = translation.x();
+        columns[5] = translation.y();
+        columns[6] = translation.z();
     }
-    // Enqueue data to be written into the CSV file via DataWriter.
-    // The DataWriter runs in a separate thread to ensure smooth data handling without blocking the main thread.
-    m_dataWriter->enqueueData(dataRow);
-
     // ==========================================================
-    // Handle ultrasound image writing
+    // Handle ultrasound frame writing
     // ==========================================================
 
-    // Create an OpenCV matrix (cv::Mat) from the ultrasound data.
-    // This matrix represents the ultrasound image which will be saved for analysis.
-    cv::Mat amodeImage(height, width, CV_16UC1, const_cast<uint16_t*>(usdata.data()));
-
-    // Generate the filename for the ultrasound image using the current timestamp to make it unique.
-    QString imageFilename = "AmodeRecording_" + timestamp_currentEpochMillis_str + ".tiff";
-    QString imageFilepath = m_filePath.isEmpty() ? "D:/" : m_filePath;  // Use the specified file path or a default path if none is provided.
-    QString filepath_filename = imageFilepath + imageFilename;          // Combine the path and filename to get the full path.
+    // Enqueue the frame to be appended to the container file, together with its timestamp (microseconds) for the index.
+    // The frames go into the container in the same order as the rows of the rigid body data, so row i is frame i of the container.
+    // That is why the pair is only written if both queues take it: the slot of the row is checked first (it stays free, this is
+    // the only producer), then the row is only written if the frame was accepted (it can be skipped if its size is wrong, or
+    // dropped if the queue is full). Neither queue ever waits, this is the GUI thread.
+    // The AmodeFrameWriter runs in a separate thread to ensure that saving the frame does not block the main application.
+    if (!m_dataWriter->canEnqueueData())
+        return;
+    if (!m_frameWriter->enqueueFrame(frame.timestamp_amode, usdata))
+        return;
 
-    // Enqueue the image to be written in the image writer thread.
-    // The ImageWriter runs in a separate thread to ensure that saving the image does not block the main application.
-    m_imageWriter->enqueueImage(amodeImage, filepath_filename);
+    // Enqueue data to be written into the file via DataWriter.
+    // The DataWriter runs in a separate thread to ensure smooth data handling without blocking the main thread.
+    if (!m_dataWriter->enqueueData(m_dataRow))
+    {
+        // Can't happen with the reserved slot, but if it does, from here on row i is not frame i anymore
+        m_rowsMismatched = true;
+        qWarning() << "AmodeMocapRecorder::processDataPair() a frame was written without its row, the rows don't match the frames anymore.";
+    }
 }
 
 void AmodeMocapRecorder::startRecording()
@@ -260,26 +304,47 @@ void AmodeMocapRecorder::startRecording()
 
 void AmodeMocapRecorder::proceedToStartRecording()
 {
-    // Set the flag indicating that recording is now active.
-    m_isRecording = true;
-
-    // Set up the CSV file to store recorded data.
+    // Set up the file (pose log or CSV) to store recorded data.
     // The filename includes a timestamp to make it unique and easy to identify later.
-    QString filename = "MocapRecording_" + QDateTime::currentDateTime().toString("yyyy-MM-dd_HH-mm-ss_zzz") + ".csv";
+    QString datetime = QDateTime::currentDateTime().toString("yyyy-MM-dd_HH-mm-ss_zzz");
+    QString extension = (m_dataWriter->format() == DataWriter::Format::Binary) ? ".poselog" : ".csv";
+    QString filename = "MocapRecording_" + datetime + extension;
     QString filepath = m_filePath.isEmpty() ? "D:/" : m_filePath;   // Use the specified file path or a default path if none is provided.
     QString filepath_filename = filepath + filename;                // Combine the path and filename to get the full path.
     m_dataWriter->setFileName(filepath_filename);                   // Set the filename for the DataWriter to use.
 
-    // Prepare the header row for the CSV file to describe the data structure.
-    // The header includes a timestamp followed by identifiers for each transformation's position and orientation.
+    // Set up the container file to store the A-mode frames, with the same timestamp in the name as the rigid body data file.
+    // All the frames must have the same geometry as the A-mode data that we have right now (30 rows, one per transducer).
+    QString frameFilename = "AmodeRecording_" + datetime + ".amode";
+    m_frameWriter->setFileName(filepath + frameFilename);
+    if (!m_frameWriter->writeHeader(30, static_cast<int>(m_latestUSData.size() / 30)))
+    {
+        // Nothing would be written, so the recording doesn't start at all
+        m_pendingRecordingRequest = false;
+        qWarning() << "AmodeMocapRecorder::proceedToStartRecording() the A-mode container can't be prepared, recording is not started.";
+        emit recordingFailed("The A-mode recording file " + filepath + frameFilename + " can't be created (check the folder and the free memory). Recording is not started.");
+        return;
+    }
+
+    // Set the flag indicating that recording is now active.
+    m_isRecording = true;
+    m_rowsMismatched = false;
+
+    // Prepare the header (the schema) to describe the data structure. It is fixed for the whole recording.
+    // The header includes the timestamps followed by identifiers for each transformation's position and orientation.
     m_csvHeader.clear();
-    m_csvHeader << "timestamp";  // The first column in the CSV is the timestamp.
+    m_csvHeader << "timestamp";        // The first column is the timestamp of the A-mode data.
+    m_csvHeader << "timestamp_mocap";  // The second column is the timestamp of the pose paired with it.
 
-    // Get the IDs of all the transformations and add them to the CSV header.
+    // Get the IDs of all the transformations and add them to the header.
     // Each transformation includes quaternion components (q1, q2, q3, q4) and translation components (t1, t2, t3).
+    // We also remember where the columns of each rigid body start, so the rows can be filled by name.
+    m_schemaColumn.clear();
     std::vector<std::string> transformations_id = m_latestTManager.getAllIds();
     for (const std::string &id : transformations_id)
     {
+        m_schemaColumn[id] = static_cast<int>(m_csvHeader.size());
+
         QString q1 = QString::fromStdString(id) + "_q1";
         QString q2 = QString::fromStdString(id) + "_q2";
         QString q3 = QString::fromStdString(id) + "_q3";
@@ -290,12 +355,13 @@ void AmodeMocapRecorder::proceedToStartRecording()
 
         m_csvHeader << q1 << q2 << q3 << q4 << t1 << t2 << t3;  // Add each component to the header.
     }
+    m_dataRow.assign(m_csvHeader.size(), 0.0);
 
-    // Write the header to the CSV file using the DataWriter.
+    // Write the header to the file using the DataWriter.
     m_dataWriter->writeHeader(m_csvHeader);
 
     // Emit the signal to start writing data to the file.
-    // This will trigger the DataWriter to start its writing operation.
+    // This will trigger the DataWriter and AmodeFrameWriter to start their writing operation.
     emit startWriter();
 
     qDebug() << "AmodeMocapRecorder::proceedToStartRecording() recording started.";
@@ -309,12 +375,21 @@ void AmodeMocapRecorder::stopRecording()
     if (!m_isRecording && !m_pendingRecordingRequest)
         return;
 
+    // Write the A-mode frames which are still waiting for a pose, using the nearest pose that we have.
+    {
+        QMutexLocker locker(&m_dataMutex);
+        processSynchronizedFrames(true);
+    }
+
+    if (m_rowsMismatched)
+        qWarning() << "AmodeMocapRecorder::stopRecording() some frames have no row, the rows of this recording don't match the frames of the container.";
+
     // Set the flags to indicate that recording is stopping.
     m_isRecording = false;
     m_pendingRecordingRequest = false;
 
     // Emit the signal to stop writing.
-    // This will trigger both DataWriter and ImageWriter to stop their respective writing tasks.
+    // This will trigger both DataWriter and AmodeFrameWriter to stop their respective writing tasks.
     emit stopWriter();
     qDebug() << "AmodeMocapRecorder::stopRecording() emits stopWriter()";
 }
@@ -5,21 +5,27 @@
 #include <QThread>
 #include <QMutex>
 #include <QDateTime>
+#include <QElapsedTimer>
 #include <vector>
+#include <unordered_map>
+#include <string>
 #include <QStringList>
 #include <Eigen/Geometry>
 
 #include "QualisysTransformationManager.h"
+#include "amodemocapsynchronizer.h"
 #include "datawriter.h"
-#include "imagewriter.h"
+#include "amodeframewriter.h"
 
 /**
  * @brief The AmodeMocapRecorder class.
  *
  * This class is responsible for managing the process of recording data from two sources:
  * Rigid Body data and Ultrasound data. It manages separate threads for handling data writing
- * (CSV files) and image writing (TIFF files). The class listens for incoming data, processes it,
+ * (binary pose log or CSV files) and A-mode frame writing (one container file, see AmodeFrameWriter). The class listens for incoming data, processes it,
  * and records it when instructed. It also provides methods to start and stop the recording process.
+ * The two streams are paired by their arrival timestamps (see AmodeMocapSynchronizer), so every A-mode frame is
+ * recorded together with the nearest (or interpolated) pose, even if the two devices run at different rates.
  * Signals are emitted to coordinate the starting and stopping of writing operations in associated
  * classes, ensuring that all data is properly saved to disk without blocking the main application thread.
  */
@@ -30,7 +36,7 @@ class AmodeMocapRecorder : public QObject
 public:
     /**
      * @brief Constructor for the AmodeMocapRecorder class.
-     * Initializes the AmodeMocapRecorder instance, sets up separate threads for data and image writers,
+     * Initializes the AmodeMocapRecorder instance, sets up separate threads for data and frame writers,
      * and connects appropriate signals and slots to handle recording operations.
      * @param parent Pointer to the parent QObject. Defaults to nullptr if not provided.
      */
@@ -44,24 +50,43 @@ public:
 
     /**
      * @brief Sets the file path where recorded data will be saved.
-     * This method sets the directory path that will be used by both DataWriter and ImageWriter to store CSV and image files.
+     * This method sets the directory path that will be used by both DataWriter and AmodeFrameWriter to store the rigid body data and the A-mode container files.
      * @param filePath A QString that specifies the path where the files should be saved.
      */
     void setFilePath(const QString &filePath);
 
+    /**
+     * @brief Sets the format of the file for the rigid body data, binary pose log (default) or CSV.
+     * @param format The format, it is applied when the next recording starts.
+     */
+    void setPoseLogFormat(DataWriter::Format format);
+
+    /**
+     * @brief Sets whether the pose is interpolated to the A-mode timestamp, or simply the nearest pose is used.
+     * @param interpolate true to interpolate (slerp/lerp) between the two poses around the A-mode frame.
+     */
+    void setPoseInterpolation(bool interpolate);
+
 signals:
     /**
      * @brief Signal to initiate data writing.
-     * Emitted when recording starts to notify the DataWriter and ImageWriter to begin writing data to files.
+     * Emitted when recording starts to notify the DataWriter and AmodeFrameWriter to begin writing data to files.
      */
     void startWriter();
 
     /**
      * @brief Signal to stop data writing.
-     * Emitted when recording stops to notify the DataWriter and ImageWriter to stop writing data to files.
+     * Emitted when recording stops to notify the DataWriter and AmodeFrameWriter to stop writing data to files.
      */
     void stopWriter();
 
+    /**
+     * @brief Signal that the recording couldn't start (the A-mode container file can't be prepared).
+     * Emitted instead of startWriter(), nothing is recorded.
+     * @param reason What went wrong, for the user.
+     */
+    void recordingFailed(const QString &reason);
+
 public slots:
     /**
      * @brief Slot to handle incoming Rigid Body data.
@@ -87,49 +112,61 @@ public slots:
 
     /**
      * @brief Stops recording data.
-     * Stops the ongoing recording process by emitting the appropriate signal to stop the DataWriter and ImageWriter.
+     * Stops the ongoing recording process by emitting the appropriate signal to stop the DataWriter and AmodeFrameWriter.
      */
     void stopRecording();
 
 private:
     /**
-     * @brief Attempts to process the latest pair of Rigid Body and Ultrasound data.
-     * This function checks if both the Rigid Body and Ultrasound data are available. If both are available, it proceeds to process them together.
+     * @brief Processes all the A-mode frames which already have their pose decided by the synchronizer.
+     * @param flushAll If true, all the pending frames are released with the nearest pose available (used when stopping).
      */
-    void tryProcessDataPair();
+    void processSynchronizedFrames(bool flushAll = false);
 
     /**
      * @brief Processes a pair of Rigid Body and Ultrasound data.
-     * Processes the provided Rigid Body transformation data and ultrasound data, reshapes the ultrasound data into an image,
-     * and saves both data types using the DataWriter and ImageWriter.
-     * @param tmanager An instance of QualisysTransformationManager containing Rigid Body data.
-     * @param usdata A vector of 16-bit unsigned integers representing ultrasound data.
+     * Processes the provided Rigid Body transformation data and ultrasound data, and saves both data types using the
+     * DataWriter and AmodeFrameWriter.
+     * @param frame The A-mode frame, its pose, and the timestamps of both, coming from the synchronizer.
+     */
+    void processDataPair(const AmodeMocapSynchronizer::SyncedFrame &frame);
+
+    /**
+     * @brief Current time in microseconds since epoch, from a monotonic clock.
+     * QDateTime::currentMSecsSinceEpoch() only has millisecond resolution and can jump, which is not good enough to pair
+     * 200Hz A-mode frames with the mocap, so we use QElapsedTimer anchored to the epoch when the recorder is created.
      */
-    void processDataPair(const QualisysTransformationManager &tmanager, const std::vector<uint16_t> &usdata);
+    qint64 currentTimestamp() const;
 
     /**
      * @brief Proceeds to initiate recording.
-     * Sets the recording state to active, prepares CSV headers, and emits the signal to start data writing.
+     * Sets the recording state to active, prepares the header (schema) of the rigid body data, and emits the signal to start data writing.
      */
     void proceedToStartRecording();
 
     QualisysTransformationManager m_latestTManager; //!< Stores the most recent Rigid Body data received from the Qualisys system.
     std::vector<uint16_t> m_latestUSData;           //!< Stores the most recent Ultrasound data received from the ultrasound sensor.
-    QString m_filePath;                             //!< Path where the recorded CSV and image files will be stored.
+    QString m_filePath;                             //!< Path where the recorded rigid body data and A-mode container files will be stored.
+
+    AmodeMocapSynchronizer m_synchronizer;              //!< Pairs every A-mode frame with the nearest (or interpolated) pose based on the arrival timestamps.
+    AmodeMocapSynchronizer::SyncedFrame m_syncedFrame;  //!< Reused storage for the frame that comes out of the synchronizer.
+    QElapsedTimer m_clock;                              //!< Monotonic clock for timestamping the incoming data.
+    qint64 m_clockEpochMicros;                          //!< Epoch time (microseconds) when m_clock was started.
 
-    bool m_hasLatestTManager;       //!< Flag indicating whether the latest Rigid Body data has been received.
-    bool m_hasLatestUSData;         //!< Flag indicating whether the latest Ultrasound data has been received.
     bool m_isRecording;             //!< Indicates whether recording is currently active.
     bool m_pendingRecordingRequest; //!< Indicates whether there is a pending request to start recording (occurs if the request is made before data is available).
+    bool m_rowsMismatched;          //!< A frame was written without its row in this recording, so row i is not frame i anymore.
 
     QThread *m_dataWriterThread;    //!< Thread where the DataWriter will run to handle file writing without blocking the main thread.
-    DataWriter *m_dataWriter;       //!< Instance of DataWriter used to handle CSV file operations.
+    DataWriter *m_dataWriter;       //!< Instance of DataWriter used to write the rigid body data (pose log or CSV).
 
-    QThread *m_imageWriterThread;   //!< Thread where the ImageWriter will run to handle image writing without blocking the main thread.
-    ImageWriter *m_imageWriter;     //!< Instance of ImageWriter used to handle image file operations.
+    QThread *m_frameWriterThread;       //!< Thread where the AmodeFrameWriter will run to handle frame writing without blocking the main thread.
+    AmodeFrameWriter *m_frameWriter;    //!< Instance of AmodeFrameWriter used to write the A-mode frames into one container file.
 
     QMutex m_dataMutex;             //!< Mutex used to protect shared data between threads to ensure thread safety.
-    QStringList m_csvHeader;        //!< Stores the header information for the CSV file used during recording.
+    QStringList m_csvHeader;        //!< Stores the header (the schema) of the rigid body data file used during recording.
+    std::unordered_map<std::string, int> m_schemaColumn;    //!< For each rigid body in the schema, the column where its values start.
+    std::vector<double> m_dataRow;                          //!< Reused storage for the row of the rigid body data file.
 };
 
 #endif // AMODEMOCAPRECORDER_H
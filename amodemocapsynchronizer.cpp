@@ -0,0 +1,180 @@
+#include "amodemocapsynchronizer.h"
+
+#include <unordered_map>
+#include <string>
+
+AmodeMocapSynchronizer::AmodeMocapSynchronizer(std::size_t poseCapacity, std::size_t amodeCapacity, int64_t maxWait_us)
+    : poses_(poseCapacity),
+    amodes_(amodeCapacity),
+    maxWait_us_(maxWait_us),
+    latestTimestamp_(0),
+    interpolate_(false)
+{
+}
+
+void AmodeMocapSynchronizer::addPose(int64_t timestamp, const QualisysTransformationManager &tmanager)
+{
+    poses_.push(timestamp, tmanager);
+    if (timestamp > latestTimestamp_) latestTimestamp_ = timestamp;
+}
+
+void AmodeMocapSynchronizer::addAmode(int64_t timestamp, const std::vector<uint16_t> &usdata)
+{
+    // popSynced() never leaves the A-mode ring full, as long as it is called after every addAmode(), so this push
+    // will not overwrite a frame that is still waiting.
+    amodes_.push(timestamp, usdata);
+    if (timestamp > latestTimestamp_) latestTimestamp_ = timestamp;
+}
+
+bool AmodeMocapSynchronizer::popSynced(SyncedFrame &out)
+{
+    // nothing is waiting, or we don't have any pose yet (in that case, keep the frames until a pose comes)
+    if (amodes_.empty() || poses_.empty())
+        return false;
+
+    // the oldest A-mode frame can be decided if there is already a pose which is newer than the frame, because
+    // then the two poses that bracket the frame are known and nothing closer will come later.
+    int64_t t_amode = amodes_.timestamp(0);
+    bool hasNewerPose = poses_.timestamp(poses_.size()-1) >= t_amode;
+
+    // if there is no newer pose yet, only release the frame if it waits for too long, or if the buffer is full
+    bool waitedTooLong = (latestTimestamp_ - t_amode) > maxWait_us_;
+
+    if (!hasNewerPose && !waitedTooLong && !amodes_.full())
+        return false;
+
+    releaseOldest(out);
+    return true;
+}
+
+bool AmodeMocapSynchronizer::popRemaining(SyncedFrame &out)
+{
+    if (amodes_.empty() || poses_.empty())
+        return false;
+
+    releaseOldest(out);
+    return true;
+}
+
+void AmodeMocapSynchronizer::releaseOldest(SyncedFrame &out)
+{
+    int64_t t_amode = amodes_.timestamp(0);
+
+    // find the first pose which is not older than the A-mode frame. The pose buffer is small, and the frame we are
+    // looking for is almost always near the end, so let's just search from the back.
+    std::size_t n = poses_.size();
+    std::size_t idx_after = n;
+    for (std::size_t i = n; i-- > 0; )
+    {
+        if (poses_.timestamp(i) < t_amode) break;
+        idx_after = i;
+    }
+
+    out.interpolated = false;
+    if (idx_after == n)
+    {
+        // all the poses are older than the frame, the nearest one is the newest pose
+        out.timestamp_mocap = poses_.timestamp(n-1);
+        out.tmanager        = poses_.value(n-1);
+    }
+    else if (idx_after == 0)
+    {
+        // all the poses are newer than the frame (the frame is older than our pose history)
+        out.timestamp_mocap = poses_.timestamp(0);
+        out.tmanager        = poses_.value(0);
+    }
+    else
+    {
+        // the frame is bracketed by two poses
+        std::size_t idx_before = idx_after - 1;
+        int64_t t0 = poses_.timestamp(idx_before);
+        int64_t t1 = poses_.timestamp(idx_after);
+        bool nearestIsFirst = (t_amode - t0) <= (t1 - t_amode);
+
+        out.timestamp_mocap = nearestIsFirst ? t0 : t1;
+
+        if (interpolate_ && t1 > t0)
+        {
+            double alpha = static_cast<double>(t_amode - t0) / static_cast<double>(t1 - t0);
+            out.tmanager     = interpolatePose(poses_.value(idx_before), poses_.value(idx_after), alpha);
+            out.interpolated = true;
+        }
+        else
+        {
+            out.tmanager = nearestIsFirst ? poses_.value(idx_before) : poses_.value(idx_after);
+        }
+    }
+
+    out.timestamp_amode = t_amode;
+    amodes_.pop(out.usdata);
+}
+
+QualisysTransformationManager AmodeMocapSynchronizer::interpolatePose(const QualisysTransformationManager &tm0,
+                                                                      const QualisysTransformationManager &tm1,
+                                                                      double alpha)
+{
+    // rigid bodies of the second pose, so we can look them up by name
+    std::vector<std::string> ids1 = tm1.getAllIds();
+    std::vector<Eigen::Isometry3d> transforms1 = tm1.getAllTransformations();
+    std::unordered_map<std::string, const Eigen::Isometry3d*> lookup1;
+    for (std::size_t i = 0; i < ids1.size(); i++)
+        lookup1[ids1[i]] = &transforms1[i];
+
+    std::vector<std::string> ids0 = tm0.getAllIds();
+    std::vector<Eigen::Isometry3d> transforms0 = tm0.getAllTransformations();
+
+    QualisysTransformationManager result;
+    for (std::size_t i = 0; i < ids0.size(); i++)
+    {
+        auto it = lookup1.find(ids0[i]);
+
+        // the rigid body is missing in the second pose, we can't interpolate
+        if (it == lookup1.end())
+        {
+            result.addTransformation(ids0[i], transforms0[i]);
+            continue;
+        }
+
+        const Eigen::Isometry3d &T0 = transforms0[i];
+        const Eigen::Isometry3d &T1 = *(it->second);
+
+        // slerp for the rotation, lerp for the translation
+        Eigen::Quaterniond q0(T0.rotation());
+        Eigen::Quaterniond q1(T1.rotation());
+        Eigen::Quaterniond q = q0.slerp(alpha, q1);
+        Eigen::Vector3d t = (1.0 - alpha) * T0.translation() + alpha * T1.translation();
+
+        Eigen::Isometry3d T = Eigen::Isometry3d::Identity();
+        T.linear() = q.normalized().toRotationMatrix();
+        T.translation() = t;
+        result.addTransformation(ids0[i], T);
+
+        lookup1.erase(it);
+    }
+
+    // rigid bodies that only exist in the second pose
+    for (const auto &entry : lookup1)
+    {
+        // it was not visible in the first pose, but we still want it to be there so every row has the same columns
+        result.addTransformation(entry.first, *(entry.second));
+    }
+
+    return result;
+}
+
+void AmodeMocapSynchronizer::clear()
+{
+    poses_.clear();
+    amodes_.clear();
+    latestTimestamp_ = 0;
+}
+
+void AmodeMocapSynchronizer::setInterpolation(bool interpolate)
+{
+    interpolate_ = interpolate;
+}
+
+std::size_t AmodeMocapSynchronizer::pendingCount() const
+{
+    return amodes_.size();
+}
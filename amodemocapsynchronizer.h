@@ -0,0 +1,162 @@
+#ifndef AMODEMOCAPSYNCHRONIZER_H
+#define AMODEMOCAPSYNCHRONIZER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <Eigen/Geometry>
+
+#include "qualisystransformationmanager.h"
+
+/**
+ * @class AmodeMocapSynchronizer
+ * @brief Pairs every A-mode frame with the temporally nearest (or interpolated) motion capture pose.
+ *
+ * For the context. The A-mode machine and the motion capture system run at their own rate, and they are not
+ * synchronized by hardware. Previously, AmodeMocapRecorder only wrote a row when it had seen one new pose AND one
+ * new A-mode frame, which silently dropped whichever stream was faster (usually A-mode, since mocap is slower).
+ *
+ * Here, each stream is stored in its own timestamped ring buffer. An A-mode frame stays pending until a pose that
+ * is newer than the frame arrives, so that we can pick the pose which is closest in time (or interpolate between
+ * the two poses that bracket the frame). If no newer pose arrives within a certain time (mocap lost the markers,
+ * or the mocap simply stopped), the frame is released anyway with the nearest pose we have. The point is, every
+ * A-mode frame that goes in, comes out, and both source timestamps are kept so that we can check the pairing later.
+ *
+ * This class is not thread-safe, the owner should protect it (AmodeMocapRecorder uses its own mutex).
+ */
+class AmodeMocapSynchronizer
+{
+public:
+
+    /**
+     * @brief One A-mode frame and the pose that was paired with it.
+     */
+    struct SyncedFrame
+    {
+        int64_t timestamp_amode = 0;                //!< Arrival time of the A-mode frame (microseconds)
+        int64_t timestamp_mocap = 0;                //!< Arrival time of the pose sample used for this frame (the nearest one, if interpolated)
+        bool interpolated = false;                  //!< True if the pose was interpolated between two pose samples
+        std::vector<uint16_t> usdata;               //!< The A-mode frame
+        QualisysTransformationManager tmanager;     //!< The pose paired with the A-mode frame
+    };
+
+    /**
+     * @brief Constructor.
+     * @param poseCapacity Number of pose samples kept in the pose ring buffer.
+     * @param amodeCapacity Number of A-mode frames that are allowed to wait for a pose. If it is full, the oldest
+     * frame is released with the nearest pose instead of being dropped.
+     * @param maxWait_us How long (microseconds) an A-mode frame waits for a newer pose before it is released with the
+     * nearest pose available.
+     */
+    AmodeMocapSynchronizer(std::size_t poseCapacity = 64, std::size_t amodeCapacity = 256, int64_t maxWait_us = 50000);
+
+    /**
+     * @brief Adds a new pose sample to the pose ring buffer. Timestamps are expected to be monotonic.
+     */
+    void addPose(int64_t timestamp, const QualisysTransformationManager &tmanager);
+
+    /**
+     * @brief Adds a new A-mode frame to the pending ring buffer. Timestamps are expected to be monotonic.
+     */
+    void addAmode(int64_t timestamp, const std::vector<uint16_t> &usdata);
+
+    /**
+     * @brief Gets the next A-mode frame whose pose can be decided. Call it repeatedly until it returns false.
+     * @param out The paired frame. The vector inside is reused, so pass the same object around to avoid allocation.
+     * @return true if a frame was released.
+     */
+    bool popSynced(SyncedFrame &out);
+
+    /**
+     * @brief Releases the oldest pending A-mode frame with whatever pose is available (used when we stop recording).
+     * @return false if there is nothing pending or there is no pose at all.
+     */
+    bool popRemaining(SyncedFrame &out);
+
+    /**
+     * @brief Removes all the pending A-mode frames and all the poses.
+     */
+    void clear();
+
+    /**
+     * @brief If enabled, the pose is interpolated (slerp for rotation, lerp for translation) to the A-mode timestamp
+     * instead of using the nearest pose sample.
+     */
+    void setInterpolation(bool interpolate);
+
+    /**
+     * @brief Number of A-mode frames that are still waiting for a pose.
+     */
+    std::size_t pendingCount() const;
+
+private:
+
+    /**
+     * @brief Simple fixed-capacity ring buffer of timestamped samples. The slots are allocated once and reused.
+     */
+    template <typename T>
+    class TimestampedRing
+    {
+    public:
+        explicit TimestampedRing(std::size_t capacity) : timestamps_(capacity), values_(capacity), head_(0), count_(0) {}
+
+        std::size_t capacity() const { return values_.size(); }
+        std::size_t size() const { return count_; }
+        bool empty() const { return count_ == 0; }
+        bool full() const { return count_ == values_.size(); }
+
+        // i=0 is the oldest sample, i=size()-1 is the newest sample
+        int64_t timestamp(std::size_t i) const { return timestamps_[(head_ + i) % values_.size()]; }
+        const T &value(std::size_t i) const { return values_[(head_ + i) % values_.size()]; }
+
+        // when the buffer is full, the oldest sample is overwritten
+        void push(int64_t timestamp, const T &value)
+        {
+            std::size_t idx = (head_ + count_) % values_.size();
+            if (full())
+                head_ = (head_ + 1) % values_.size();
+            else
+                count_++;
+
+            timestamps_[idx] = timestamp;
+            values_[idx]     = value;
+        }
+
+        // swap instead of copy, so the storage of the slot goes back and forth without allocation
+        void pop(T &out)
+        {
+            std::swap(out, values_[head_]);
+            head_ = (head_ + 1) % values_.size();
+            count_--;
+        }
+
+        void clear() { head_ = 0; count_ = 0; }
+
+    private:
+        std::vector<int64_t> timestamps_;
+        std::vector<T> values_;
+        std::size_t head_;
+        std::size_t count_;
+    };
+
+    /**
+     * @brief Decides the pose for the oldest pending A-mode frame and releases it.
+     */
+    void releaseOldest(SyncedFrame &out);
+
+    /**
+     * @brief Interpolates every rigid body that exists in both pose samples. Rigid bodies that only exist in one of
+     * them are taken from the nearest sample.
+     */
+    static QualisysTransformationManager interpolatePose(const QualisysTransformationManager &tm0,
+                                                         const QualisysTransformationManager &tm1,
+                                                         double alpha);
+
+    TimestampedRing<QualisysTransformationManager> poses_;  //!< Ring buffer for the pose samples
+    TimestampedRing<std::vector<uint16_t>> amodes_;         //!< Ring buffer for the A-mode frames which wait for a pose
+    int64_t maxWait_us_;                                    //!< Maximum time for an A-mode frame to wait for a newer pose
+    int64_t latestTimestamp_;                               //!< The newest timestamp seen on either stream
+    bool interpolate_;                                      //!< Interpolate the pose instead of using the nearest one
+};
+
+#endif // AMODEMOCAPSYNCHRONIZER_H
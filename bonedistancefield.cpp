@@ -0,0 +1,284 @@
+#include "bonedistancefield.h"
+#include <omp.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+// The size of a cell of the field (mm), it is rounded to a whole number of voxels, and never smaller than a voxel.
+// The navigation is about millimeters, a finer field would only cost memory.
+static constexpr double FIELD_SPACING_MM = 1.0;
+// The unit of the stored distance (mm), 16 bits of it is up to 655mm
+static constexpr double DISTANCE_RESOLUTION_MM = 0.01;
+// The squared distance of a cell that has no bone in sight yet
+static constexpr double FAR_AWAY = std::numeric_limits<double>::max() / 4;
+
+namespace {
+
+/**
+ * @brief 1D squared distance transform (Felzenszwalb and Huttenlocher), d[q] = min over p of w2*(q-p)^2 + f[p]. It is
+ * the lower envelope of the parabolas of the sites (the cells that are not FAR_AWAY), v and z are its workspace.
+ */
+void distanceTransform1D(const double* f, int n, double w2, double* d, int* v, double* z)
+{
+    int k = -1;
+    for (int q = 0; q < n; ++q) {
+        if (f[q] >= FAR_AWAY) continue;
+        // the parabola of q hides the ones that it is lower than from where they start
+        double s = -std::numeric_limits<double>::infinity();
+        while (k >= 0) {
+            s = ((f[q] + w2 * q * q) - (f[v[k]] + w2 * static_cast<double>(v[k]) * v[k])) / (2.0 * w2 * (q - v[k]));
+            if (s > z[k]) break;
+            k--;
+        }
+        k++;
+        v[k] = q;
+        z[k] = (k == 0) ? -std::numeric_limits<double>::infinity() : s;
+    }
+
+    if (k < 0) {
+        std::fill(d, d + n, FAR_AWAY);
+        return;
+    }
+
+    int j = 0;
+    for (int q = 0; q < n; ++q) {
+        while (j < k && z[j + 1] < q) j++;
+        const double dq = q - v[j];
+        d[q] = w2 * dq * dq + f[v[j]];
+    }
+}
+
+}
+
+BoneDistanceField::BoneDistanceField()
+{
+}
+
+bool BoneDistanceField::build(const BrickedVolume& volume, int threshold, const std::function<bool()>& cancelled)
+{
+    *this = BoneDistanceField();
+    threshold_ = threshold;
+    if (volume.empty()) return true;
+
+    // the grid of the field, a whole number of voxels per cell
+    const std::array<int, 3>& volumeDim = volume.getDim();
+    std::array<int, 3> factor;
+    for (int i = 0; i < 3; ++i) {
+        factor[i]   = std::clamp(static_cast<int>(std::lround(FIELD_SPACING_MM / volume.getSpacing()[i])), 1, BrickedVolume::BRICK_SIZE);
+        dim_[i]     = (volumeDim[i] + factor[i] - 1) / factor[i];
+        spacing_[i] = volume.getSpacing()[i] * factor[i];
+        origin_[i]  = volume.getOrigin()[i] + volume.getSpacing()[i] * (factor[i] - 1) / 2.0;
+    }
+    const std::size_t nCells = static_cast<std::size_t>(dim_[0]) * dim_[1] * dim_[2];
+    std::vector<double> squared(nCells, FAR_AWAY);
+    std::atomic<bool> stopped{false};
+    std::atomic<bool> anyBone{false};
+
+    // 1) the bone cells (distance 0), the cells whose bricks are all under the threshold are not even looked at
+    constexpr int BRICK_SIZE = BrickedVolume::BRICK_SIZE;
+    #pragma omp parallel for schedule(dynamic)
+    for (int cz = 0; cz < dim_[2]; ++cz) {
+        if (stopped) continue;
+        if (cancelled && cancelled()) {
+            stopped = true;
+            continue;
+        }
+        for (int cy = 0; cy < dim_[1]; ++cy) {
+            for (int cx = 0; cx < dim_[0]; ++cx) {
+                const int begin[3] = { cx * factor[0], cy * factor[1], cz * factor[2] };
+                const int end[3]   = { std::min(volumeDim[0], begin[0] + factor[0]),
+                                       std::min(volumeDim[1], begin[1] + factor[1]),
+                                       std::min(volumeDim[2], begin[2] + factor[2]) };
+
+                int brightest = 0;
+                for (int bz = begin[2] / BRICK_SIZE; bz <= (end[2] - 1) / BRICK_SIZE; ++bz)
+                    for (int by = begin[1] / BRICK_SIZE; by <= (end[1] - 1) / BRICK_SIZE; ++by)
+                        for (int bx = begin[0] / BRICK_SIZE; bx <= (end[0] - 1) / BRICK_SIZE; ++bx)
+                            brightest = std::max<int>(brightest, volume.brickMaximum(volume.brickIndex(bx, by, bz)));
+                if (brightest <= threshold) continue;
+
+                bool bone = false;
+                for (int z = begin[2]; z < end[2] && !bone; ++z)
+                    for (int y = begin[1]; y < end[1] && !bone; ++y)
+                        for (int x = begin[0]; x < end[0] && !bone; ++x)
+                            bone = volume.at(x, y, z) > threshold;
+                if (bone) {
+                    squared[cellIndex(cx, cy, cz)] = 0.0;
+                    anyBone = true;
+                }
+            }
+        }
+    }
+    if (stopped) return false;
+    if (!anyBone) return true;
+
+    // 2) the squared distance, one axis after another, every line of an axis is independent
+    const std::size_t stride[3] = { 1, static_cast<std::size_t>(dim_[0]), static_cast<std::size_t>(dim_[0]) * dim_[1] };
+    for (int axis = 0; axis < 3 && !stopped; ++axis) {
+        const int n = dim_[axis];
+        const int other1 = (axis == 0) ? 1 : 0;
+        const int other2 = (axis == 2) ? 1 : 2;
+        const int nLines = dim_[other1] * dim_[other2];
+        const double w2 = spacing_[axis] * spacing_[axis];
+
+        #pragma omp parallel
+        {
+            std::vector<double> f(n), d(n), z(n + 1);
+            std::vector<int> v(n);
+
+            #pragma omp for schedule(static)
+            for (int line = 0; line < nLines; ++line) {
+                if (stopped) continue;
+                if ((line % 4096) == 0 && cancelled && cancelled()) {
+                    stopped = true;
+                    continue;
+                }
+                const std::size_t start = (line % dim_[other1]) * stride[other1] + (line / dim_[other1]) * stride[other2];
+                for (int q = 0; q < n; ++q) f[q] = squared[start + q * stride[axis]];
+                distanceTransform1D(f.data(), n, w2, d.data(), v.data(), z.data());
+                for (int q = 0; q < n; ++q) squared[start + q * stride[axis]] = d[q];
+            }
+        }
+    }
+    if (stopped) return false;
+
+    // 3) the distance, stored in 16 bits
+    const int nCellsInt = static_cast<int>(std::min<std::size_t>(nCells, std::numeric_limits<int>::max()));
+    distance_.resize(nCells);
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c < nCellsInt; ++c) {
+        squared[c] = std::sqrt(squared[c]);
+        distance_[c] = static_cast<std::uint16_t>(std::min(65535.0, std::round(squared[c] / DISTANCE_RESOLUTION_MM)));
+    }
+
+    // 4) the normal, the gradient of the distance with the Sobel operator (central difference along the axis, 1 2 1
+    //    smoothing across it), the cells outside the grid are the ones at its border
+    normal_.resize(nCells * 3);
+    #pragma omp parallel for schedule(static)
+    for (int cz = 0; cz < dim_[2]; ++cz) {
+        if (stopped) continue;
+        for (int cy = 0; cy < dim_[1]; ++cy) {
+            for (int cx = 0; cx < dim_[0]; ++cx) {
+                auto at = [&](int x, int y, int z) {
+                    x = std::clamp(x, 0, dim_[0] - 1);
+                    y = std::clamp(y, 0, dim_[1] - 1);
+                    z = std::clamp(z, 0, dim_[2] - 1);
+                    return squared[cellIndex(x, y, z)];
+                };
+                Eigen::Vector3d gradient = Eigen::Vector3d::Zero();
+                for (int a = -1; a <= 1; ++a) {
+                    for (int b = -1; b <= 1; ++b) {
+                        const double w = (2 - std::abs(a)) * (2 - std::abs(b));
+                        gradient[0] += w * (at(cx + 1, cy + a, cz + b) - at(cx - 1, cy + a, cz + b));
+                        gradient[1] += w * (at(cx + a, cy + 1, cz + b) - at(cx + a, cy - 1, cz + b));
+                        gradient[2] += w * (at(cx + a, cy + b, cz + 1) - at(cx + a, cy + b, cz - 1));
+                    }
+                }
+                for (int i = 0; i < 3; ++i) gradient[i] /= spacing_[i];
+
+                const double norm = gradient.norm();
+                std::int8_t* n = normal_.data() + 3 * cellIndex(cx, cy, cz);
+                for (int i = 0; i < 3; ++i)
+                    n[i] = (norm > 0.0) ? static_cast<std::int8_t>(std::lround(127.0 * gradient[i] / norm)) : 0;
+            }
+        }
+    }
+
+    hasBone_ = true;
+    return true;
+}
+
+bool BoneDistanceField::empty() const
+{
+    return !hasBone_;
+}
+
+int BoneDistanceField::getThreshold() const
+{
+    return threshold_;
+}
+
+std::size_t BoneDistanceField::cellIndex(int x, int y, int z) const
+{
+    return (static_cast<std::size_t>(z) * dim_[1] + y) * dim_[0] + x;
+}
+
+Eigen::Vector3d BoneDistanceField::toCell(const Eigen::Vector3d& point, double& outside) const
+{
+    Eigen::Vector3d cell, away;
+    for (int i = 0; i < 3; ++i) {
+        const double p = (point[i] - origin_[i]) / spacing_[i];
+        cell[i] = std::clamp(p, 0.0, static_cast<double>(dim_[i] - 1));
+        away[i] = (p - cell[i]) * spacing_[i];
+    }
+    outside = away.norm();
+    return cell;
+}
+
+double BoneDistanceField::distance(const Eigen::Vector3d& point) const
+{
+    if (empty()) return std::numeric_limits<double>::infinity();
+
+    // outside of the grid, the distance from the border of the grid on (a bit more than the truth, it is far anyway)
+    double outside = 0.0;
+    const Eigen::Vector3d p = toCell(point, outside);
+
+    // trilinear, the 8 cells around
+    int c0[3], c1[3];
+    double w[3];
+    for (int i = 0; i < 3; ++i) {
+        c0[i] = std::min(static_cast<int>(p[i]), dim_[i] - 1);
+        c1[i] = std::min(c0[i] + 1, dim_[i] - 1);
+        w[i]  = p[i] - c0[i];
+    }
+    double value = 0.0;
+    for (int corner = 0; corner < 8; ++corner) {
+        const int x = (corner & 1) ? c1[0] : c0[0];
+        const int y = (corner & 2) ? c1[1] : c0[1];
+        const int z = (corner & 4) ? c1[2] : c0[2];
+        const double weight = ((corner & 1) ? w[0] : 1 - w[0]) * ((corner & 2) ? w[1] : 1 - w[1]) * ((corner & 4) ? w[2] : 1 - w[2]);
+        value += weight * distance_[cellIndex(x, y, z)];
+    }
+    return value * DISTANCE_RESOLUTION_MM + outside;
+}
+
+Eigen::Vector3d BoneDistanceField::normal(const Eigen::Vector3d& point) const
+{
+    if (empty()) return Eigen::Vector3d::Zero();
+
+    double outside = 0.0;
+    const Eigen::Vector3d p = toCell(point, outside);
+
+    int c0[3], c1[3];
+    double w[3];
+    for (int i = 0; i < 3; ++i) {
+        c0[i] = std::min(static_cast<int>(p[i]), dim_[i] - 1);
+        c1[i] = std::min(c0[i] + 1, dim_[i] - 1);
+        w[i]  = p[i] - c0[i];
+    }
+    Eigen::Vector3d value = Eigen::Vector3d::Zero();
+    for (int corner = 0; corner < 8; ++corner) {
+        const int x = (corner & 1) ? c1[0] : c0[0];
+        const int y = (corner & 2) ? c1[1] : c0[1];
+        const int z = (corner & 4) ? c1[2] : c0[2];
+        const double weight = ((corner & 1) ? w[0] : 1 - w[0]) * ((corner & 2) ? w[1] : 1 - w[1]) * ((corner & 4) ? w[2] : 1 - w[2]);
+        const std::int8_t* n = normal_.data() + 3 * cellIndex(x, y, z);
+        value += weight * Eigen::Vector3d(n[0], n[1], n[2]);
+    }
+    const double norm = value.norm();
+    return (norm > 0.0) ? Eigen::Vector3d(value / norm) : Eigen::Vector3d::Zero();
+}
+
+bool BoneDistanceField::beamToBone(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, double& distance, double& angle) const
+{
+    const Eigen::Vector3d away = normal(origin);
+    const double length = direction.norm();
+    if (empty() || away.isZero() || length <= 0.0) return false;
+
+    // the nearest bone is against the normal
+    distance = this->distance(origin);
+    const double cosine = std::clamp(-away.dot(direction) / length, -1.0, 1.0);
+    angle = std::acos(cosine) * 180.0 / EIGEN_PI;
+    return true;
+}
@@ -0,0 +1,101 @@
+#ifndef BONEDISTANCEFIELD_H
+#define BONEDISTANCEFIELD_H
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+#include <Eigen/Dense>
+
+#include "brickedvolume.h"
+
+/**
+ * @class BoneDistanceField
+ * @brief The distance to the bone and the direction away from it, everywhere around the bone, so the navigation can
+ * ask "where is the bone from here" in constant time.
+ *
+ * For the context. To tell the user where to point a transducer, we need the distance from its tip to the bone and the
+ * angle between its beam and the bone. Searching the volume for the closest bone voxel at every mocap frame for every
+ * transducer is way too slow, so it is computed once for the whole volume (and a threshold, the bone is the voxels
+ * over it), in the background, and then a query is just a trilinear lookup of 8 values.
+ *
+ * The field has its own grid of about FIELD_SPACING_MM (a whole number of voxels per cell, never finer than the
+ * volume), a cell is bone if one of its voxels is. It is an exact Euclidean distance transform (Felzenszwalb and
+ * Huttenlocher, the squared distance is separable, so it is three passes of 1D transforms along x, y and z, every line
+ * on its own, in parallel), with the spacing of the cells taken into account. The normal is the gradient of the
+ * distance (Sobel, so it is smoothed over the neighbours), it points away from the nearest bone.
+ *
+ * Compact storage: the distance is a 16 bit fixed point (DISTANCE_RESOLUTION_MM), the normal three 8 bit components.
+ * That is 5 bytes per cell, a whole leg at 1mm is a few tens of MB. The field can't be changed after build(), so it
+ * can be shared with (and read by) any thread.
+ *
+ * The positions are in the coordinates of the volume (Reference, mm), like BrickedVolume.
+ *
+ */
+
+class BoneDistanceField
+{
+public:
+
+    /**
+     * @brief Constructor function, an empty field
+     */
+    BoneDistanceField();
+
+    /**
+     * @brief Computes the field of the bone (the voxels > threshold) of a volume. It stops early (returns false) if
+     * cancelled() returns true.
+     */
+    bool build(const BrickedVolume& volume, int threshold, const std::function<bool()>& cancelled = nullptr);
+
+    /**
+     * @brief There is no bone (or the field is not built)
+     */
+    bool empty() const;
+
+    /**
+     * @brief GET the threshold the field was built for
+     */
+    int getThreshold() const;
+
+    /**
+     * @brief The distance (mm) from a point to the nearest bone, 0 inside the bone
+     */
+    double distance(const Eigen::Vector3d& point) const;
+
+    /**
+     * @brief The direction away from the nearest bone at a point (unit), zero deep inside the bone
+     */
+    Eigen::Vector3d normal(const Eigen::Vector3d& point) const;
+
+    /**
+     * @brief For a beam from origin along direction: the distance to the nearest bone (mm) and the angle (degrees)
+     * between the beam and the direction to it. 0 degrees means the beam goes straight to the bone, perpendicular to
+     * its surface. Returns false if it can't be told (no bone, or the origin is deep inside the bone).
+     */
+    bool beamToBone(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, double& distance, double& angle) const;
+
+private:
+
+    /**
+     * @brief The position of a point in the grid of the cells, clamped to the grid. outside is how far (mm) the point
+     * is from the grid.
+     */
+    Eigen::Vector3d toCell(const Eigen::Vector3d& point, double& outside) const;
+
+    /**
+     * @brief The index of cell (x, y, z)
+     */
+    std::size_t cellIndex(int x, int y, int z) const;
+
+    std::array<int, 3> dim_ = {0, 0, 0};            //!< Size of the grid (cells)
+    std::array<double, 3> origin_ = {0, 0, 0};      //!< Position of the center of the first cell (mm)
+    std::array<double, 3> spacing_ = {1, 1, 1};     //!< Size of a cell (mm)
+    int threshold_ = 0;                             //!< The bone is over this intensity
+    bool hasBone_ = false;                          //!< There is at least one bone cell
+    std::vector<std::uint16_t> distance_;           //!< Per cell, the distance to the bone (DISTANCE_RESOLUTION_MM units)
+    std::vector<std::int8_t> normal_;               //!< Per cell, x y z of the normal (times 127)
+};
+
+#endif // BONEDISTANCEFIELD_H
@@ -0,0 +1,294 @@
+#include "bonekdtree.h"
+#include <omp.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+// Below this many queries a batch is done in the calling thread, waking the threads up costs more than the queries
+static constexpr int PARALLEL_QUERIES = 256;
+// The traversal stack, the tree is balanced, so it is never deeper than this (2^48 points)
+static constexpr int MAX_STACK = 64;
+
+BoneKdTree::BoneKdTree()
+{
+}
+
+bool BoneKdTree::build(const BrickedVolume& volume, int threshold, const std::function<bool()>& cancelled)
+{
+    *this = BoneKdTree();
+    threshold_ = threshold;
+    if (volume.empty()) return true;
+
+    const std::array<int, 3>& dim = volume.getDim();
+    const std::array<int, 3>& brickDim = volume.getBrickDim();
+    const std::array<double, 3>& origin = volume.getOrigin();
+    const std::array<double, 3>& spacing = volume.getSpacing();
+    std::atomic<bool> stopped{false};
+
+    // 1) the surface voxels: over the threshold, and one of the 6 neighbours is not (or it is at the border). Only
+    //    the bricks that have something over the threshold are looked at, every thread collects its own points.
+    constexpr int BRICK_SIZE = BrickedVolume::BRICK_SIZE;
+    std::vector<std::vector<Eigen::Vector3f>> threadPoints(omp_get_max_threads());
+    #pragma omp parallel num_threads(static_cast<int>(threadPoints.size()))
+    {
+        std::vector<Eigen::Vector3f>& points = threadPoints[omp_get_thread_num()];
+        auto isBone = [&](int x, int y, int z) {
+            if (x < 0 || y < 0 || z < 0 || x >= dim[0] || y >= dim[1] || z >= dim[2]) return false;
+            return volume.at(x, y, z) > threshold;
+        };
+
+        #pragma omp for schedule(dynamic)
+        for (int bz = 0; bz < brickDim[2]; ++bz) {
+            if (stopped) continue;
+            if (cancelled && cancelled()) {
+                stopped = true;
+                continue;
+            }
+            for (int by = 0; by < brickDim[1]; ++by) {
+                for (int bx = 0; bx < brickDim[0]; ++bx) {
+                    if (volume.brickMaximum(volume.brickIndex(bx, by, bz)) <= threshold) continue;
+                    for (int z = bz * BRICK_SIZE; z < std::min(dim[2], (bz + 1) * BRICK_SIZE); ++z) {
+                        for (int y = by * BRICK_SIZE; y < std::min(dim[1], (by + 1) * BRICK_SIZE); ++y) {
+                            for (int x = bx * BRICK_SIZE; x < std::min(dim[0], (bx + 1) * BRICK_SIZE); ++x) {
+                                if (volume.at(x, y, z) <= threshold) continue;
+                                if (isBone(x - 1, y, z) && isBone(x + 1, y, z) && isBone(x, y - 1, z) &&
+                                    isBone(x, y + 1, z) && isBone(x, y, z - 1) && isBone(x, y, z + 1)) continue;
+                                points.emplace_back(static_cast<float>(origin[0] + spacing[0] * x),
+                                                    static_cast<float>(origin[1] + spacing[1] * y),
+                                                    static_cast<float>(origin[2] + spacing[2] * z));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (stopped) return false;
+
+    std::size_t total = 0;
+    for (const auto& points : threadPoints) total += points.size();
+    if (total == 0) return true;
+    points_.reserve(total);
+    for (auto& points : threadPoints) {
+        points_.insert(points_.end(), points.begin(), points.end());
+        std::vector<Eigen::Vector3f>().swap(points);
+    }
+    hitRadius_ = static_cast<float>(0.5 * std::sqrt(3.0) * std::max({ spacing[0], spacing[1], spacing[2] }));
+
+    // 2) the tree, level by level. A node splits its range at the middle (the median along the longest side of its
+    //    box), so the ranges of the nodes don't have to be stored, they follow from the size.
+    const std::size_t n = points_.size();
+    while (((n + (std::size_t(1) << depth_) - 1) >> depth_) > static_cast<std::size_t>(LEAF_SIZE)) depth_++;
+    nodes_.resize((std::size_t(2) << depth_) - 1);
+    std::vector<std::size_t> rangeBegin(nodes_.size()), rangeEnd(nodes_.size());
+    rangeBegin[0] = 0;
+    rangeEnd[0]   = n;
+
+    for (int level = 0; level <= depth_; ++level) {
+        if (cancelled && cancelled()) return false;
+
+        const int first = (1 << level) - 1;
+        const int count = 1 << level;
+        #pragma omp parallel for schedule(dynamic)
+        for (int k = 0; k < count; ++k) {
+            const int node = first + k;
+            const std::size_t begin = rangeBegin[node];
+            const std::size_t end   = rangeEnd[node];
+
+            Eigen::Vector3f lower = points_[begin], upper = points_[begin];
+            for (std::size_t i = begin + 1; i < end; ++i) {
+                lower = lower.cwiseMin(points_[i]);
+                upper = upper.cwiseMax(points_[i]);
+            }
+            for (int a = 0; a < 3; ++a) {
+                nodes_[node].lower[a] = lower[a];
+                nodes_[node].upper[a] = upper[a];
+            }
+            if (level == depth_) continue;
+
+            int axis = 0;
+            (upper - lower).maxCoeff(&axis);
+            const std::size_t mid = begin + (end - begin) / 2;
+            std::nth_element(points_.begin() + begin, points_.begin() + mid, points_.begin() + end,
+                             [axis](const Eigen::Vector3f& a, const Eigen::Vector3f& b) { return a[axis] < b[axis]; });
+            rangeBegin[2 * node + 1] = begin;
+            rangeEnd[2 * node + 1]   = mid;
+            rangeBegin[2 * node + 2] = mid;
+            rangeEnd[2 * node + 2]   = end;
+        }
+    }
+    return true;
+}
+
+bool BoneKdTree::empty() const
+{
+    return points_.empty();
+}
+
+std::size_t BoneKdTree::size() const
+{
+    return points_.size();
+}
+
+int BoneKdTree::getThreshold() const
+{
+    return threshold_;
+}
+
+float BoneKdTree::boxDistanceSquared(const Node& node, const Eigen::Vector3f& point) const
+{
+    float distance = 0.0f;
+    for (int a = 0; a < 3; ++a) {
+        const float d = std::max({ node.lower[a] - point[a], 0.0f, point[a] - node.upper[a] });
+        distance += d * d;
+    }
+    return distance;
+}
+
+bool BoneKdTree::rayBox(const Node& node, const Eigen::Vector3f& origin, const Eigen::Vector3f& inverse, float tFar, float& tNear) const
+{
+    // slab test, the box is grown by the radius of the points
+    tNear = 0.0f;
+    for (int a = 0; a < 3; ++a) {
+        float t0 = (node.lower[a] - hitRadius_ - origin[a]) * inverse[a];
+        float t1 = (node.upper[a] + hitRadius_ - origin[a]) * inverse[a];
+        if (t0 > t1) std::swap(t0, t1);
+        tNear = std::max(tNear, t0);
+        tFar  = std::min(tFar, t1);
+        if (tNear > tFar) return false;
+    }
+    return true;
+}
+
+bool BoneKdTree::nearest(const Eigen::Vector3d& query, double& distance, Eigen::Vector3d& point) const
+{
+    if (empty()) return false;
+
+    const Eigen::Vector3f q = query.cast<float>();
+    float best = std::numeric_limits<float>::max();
+    std::size_t bestIndex = 0;
+
+    // depth first, the nearer child first, a node is skipped if its box is farther than the best point so far
+    struct Entry { int node; std::size_t begin, end; float boxDistance; };
+    Entry stack[MAX_STACK];
+    int top = 0;
+    stack[top++] = { 0, 0, points_.size(), boxDistanceSquared(nodes_[0], q) };
+    const int firstLeaf = (1 << depth_) - 1;
+
+    while (top > 0) {
+        const Entry entry = stack[--top];
+        if (entry.boxDistance >= best) continue;
+
+        if (entry.node >= firstLeaf) {
+            for (std::size_t i = entry.begin; i < entry.end; ++i) {
+                const float d = (points_[i] - q).squaredNorm();
+                if (d < best) {
+                    best = d;
+                    bestIndex = i;
+                }
+            }
+            continue;
+        }
+
+        const std::size_t mid = entry.begin + (entry.end - entry.begin) / 2;
+        const int left = 2 * entry.node + 1, right = 2 * entry.node + 2;
+        const float dLeft = boxDistanceSquared(nodes_[left], q), dRight = boxDistanceSquared(nodes_[right], q);
+        if (dLeft < dRight) {
+            stack[top++] = { right, mid, entry.end, dRight };
+            stack[top++] = { left, entry.begin, mid, dLeft };
+        } else {
+            stack[top++] = { left, entry.begin, mid, dLeft };
+            stack[top++] = { right, mid, entry.end, dRight };
+        }
+    }
+
+    distance = std::sqrt(static_cast<double>(best));
+    point = points_[bestIndex].cast<double>();
+    return true;
+}
+
+void BoneKdTree::nearest(const std::vector<Eigen::Vector3d>& queries, std::vector<double>& distances, std::vector<Eigen::Vector3d>& points) const
+{
+    const int n = static_cast<int>(queries.size());
+    distances.assign(n, std::numeric_limits<double>::infinity());
+    points.assign(n, Eigen::Vector3d::Zero());
+    if (empty()) return;
+
+    #pragma omp parallel for schedule(static) if(n >= PARALLEL_QUERIES)
+    for (int i = 0; i < n; ++i) nearest(queries[i], distances[i], points[i]);
+}
+
+bool BoneKdTree::castRay(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, double maxDistance, double& distance) const
+{
+    const double length = direction.norm();
+    if (empty() || length <= 0.0) return false;
+
+    const Eigen::Vector3f o = origin.cast<float>();
+    const Eigen::Vector3f d = (direction / length).cast<float>();
+    Eigen::Vector3f inverse;
+    for (int a = 0; a < 3; ++a)
+        inverse[a] = (std::abs(d[a]) > 1e-12f) ? 1.0f / d[a] : std::copysign(std::numeric_limits<float>::max(), d[a]);
+    const float radius2 = hitRadius_ * hitRadius_;
+    float best = static_cast<float>(maxDistance);
+
+    // front to back, the nearer child first, a node is skipped if the ray enters it after the best hit so far
+    struct Entry { int node; std::size_t begin, end; float tNear; };
+    Entry stack[MAX_STACK];
+    int top = 0;
+    float tNear = 0.0f;
+    if (!rayBox(nodes_[0], o, inverse, best, tNear)) return false;
+    stack[top++] = { 0, 0, points_.size(), tNear };
+    const int firstLeaf = (1 << depth_) - 1;
+
+    while (top > 0) {
+        const Entry entry = stack[--top];
+        if (entry.tNear >= best) continue;
+
+        if (entry.node >= firstLeaf) {
+            for (std::size_t i = entry.begin; i < entry.end; ++i) {
+                // where the ray enters the sphere of the point (0 if it starts inside), a sphere it leaves before
+                // its origin is behind it
+                const Eigen::Vector3f w = points_[i] - o;
+                const float t = w.dot(d);
+                const float miss2 = w.squaredNorm() - t * t;
+                if (miss2 > radius2) continue;
+                const float halfChord = std::sqrt(radius2 - miss2);
+                if (t + halfChord < 0.0f) continue;
+                const float hit = std::max(0.0f, t - halfChord);
+                if (hit < best) best = hit;
+            }
+            continue;
+        }
+
+        const std::size_t mid = entry.begin + (entry.end - entry.begin) / 2;
+        const int left = 2 * entry.node + 1, right = 2 * entry.node + 2;
+        float tLeft = 0.0f, tRight = 0.0f;
+        const bool hitLeft = rayBox(nodes_[left], o, inverse, best, tLeft);
+        const bool hitRight = rayBox(nodes_[right], o, inverse, best, tRight);
+        if (hitLeft && hitRight && tLeft < tRight) {
+            stack[top++] = { right, mid, entry.end, tRight };
+            stack[top++] = { left, entry.begin, mid, tLeft };
+        } else {
+            if (hitLeft) stack[top++] = { left, entry.begin, mid, tLeft };
+            if (hitRight) stack[top++] = { right, mid, entry.end, tRight };
+        }
+    }
+
+    if (best >= maxDistance) return false;
+    distance = best;
+    return true;
+}
+
+void BoneKdTree::castRays(const std::vector<Eigen::Vector3d>& origins, const std::vector<Eigen::Vector3d>& directions, double maxDistance, std::vector<std::optional<double>>& distances) const
+{
+    const int n = static_cast<int>(std::min(origins.size(), directions.size()));
+    distances.assign(n, std::nullopt);
+    if (empty()) return;
+
+    #pragma omp parallel for schedule(static) if(n >= PARALLEL_QUERIES)
+    for (int i = 0; i < n; ++i) {
+        double distance = 0.0;
+        if (castRay(origins[i], directions[i], maxDistance, distance)) distances[i] = distance;
+    }
+}
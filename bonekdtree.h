@@ -0,0 +1,113 @@
+#ifndef BONEKDTREE_H
+#define BONEKDTREE_H
+
+#include <array>
+#include <vector>
+#include <optional>
+#include <functional>
+
+#include <Eigen/Dense>
+
+#include "brickedvolume.h"
+
+/**
+ * @class BoneKdTree
+ * @brief The surface points of the bone in a KD-tree, for the nearest surface point and the first surface point along
+ * a ray, many queries at once.
+ *
+ * For the context. The distance field (BoneDistanceField) answers "how far is the bone" on a 1mm grid. Some things
+ * need the exact surface point: how far the bone point that the user picked in an A-mode signal is from the surface of
+ * the volume (that is what a registration of the A-mode bone points to the volume minimizes), or where exactly a beam
+ * enters the surface. So the surface voxels (over the threshold, with a neighbour that is not) are put in a tree, once
+ * per threshold, in the background (Volume3DController).
+ *
+ * The tree is static and has no pointers: it is a complete binary tree in one array (the children of node k are 2k+1
+ * and 2k+2), every node halves the points of its parent at the median of its longest side, so the points of a node are
+ * a contiguous range of the reordered points and a node only stores its bounding box (24 bytes). The tree is built
+ * level by level, the nodes of a level in parallel. A leaf has at most LEAF_SIZE points.
+ *
+ * For the rays a surface point is a small sphere (as big as a voxel), so the surface has no holes between the points.
+ * The batched queries are spread over the threads when there are enough of them to be worth it.
+ *
+ * The positions are in the coordinates of the volume (Reference, mm), like BrickedVolume.
+ *
+ */
+
+class BoneKdTree
+{
+public:
+
+    static constexpr int LEAF_SIZE = 8;             //!< Most points in a leaf
+
+    /**
+     * @brief Constructor function, an empty tree
+     */
+    BoneKdTree();
+
+    /**
+     * @brief Builds the tree of the surface of the bone (the voxels > threshold) of a volume. It stops early (returns
+     * false) if cancelled() returns true.
+     */
+    bool build(const BrickedVolume& volume, int threshold, const std::function<bool()>& cancelled = nullptr);
+
+    /**
+     * @brief There are no surface points (or the tree is not built)
+     */
+    bool empty() const;
+
+    /**
+     * @brief GET the number of surface points, and the threshold the tree was built for
+     */
+    std::size_t size() const;
+    int getThreshold() const;
+
+    /**
+     * @brief The nearest surface point of a query point and the distance to it (mm). Returns false if the tree is empty.
+     */
+    bool nearest(const Eigen::Vector3d& query, double& distance, Eigen::Vector3d& point) const;
+
+    /**
+     * @brief nearest() of many query points at once, infinity if the tree is empty
+     */
+    void nearest(const std::vector<Eigen::Vector3d>& queries, std::vector<double>& distances, std::vector<Eigen::Vector3d>& points) const;
+
+    /**
+     * @brief The distance (mm) along a ray to where it enters the surface, at most maxDistance. Returns false if it
+     * doesn't hit the surface.
+     */
+    bool castRay(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, double maxDistance, double& distance) const;
+
+    /**
+     * @brief castRay() of many rays at once (for example all beams of a holder), empty if a ray doesn't hit
+     */
+    void castRays(const std::vector<Eigen::Vector3d>& origins, const std::vector<Eigen::Vector3d>& directions, double maxDistance, std::vector<std::optional<double>>& distances) const;
+
+private:
+
+    /**
+     * @struct Node
+     * @brief The bounding box of the points of a node
+     */
+    struct Node {
+        float lower[3];
+        float upper[3];
+    };
+
+    /**
+     * @brief The squared distance from a point to the box of a node, 0 inside
+     */
+    float boxDistanceSquared(const Node& node, const Eigen::Vector3f& point) const;
+
+    /**
+     * @brief Where a ray enters the box of a node grown by hitRadius_ (in tNear), false if it misses it before tFar
+     */
+    bool rayBox(const Node& node, const Eigen::Vector3f& origin, const Eigen::Vector3f& inverse, float tFar, float& tNear) const;
+
+    int threshold_ = 0;                     //!< The bone is over this intensity
+    int depth_ = 0;                         //!< The depth of the leaves, the root is 0
+    float hitRadius_ = 0.5f;                //!< The radius of a surface point for the rays (mm)
+    std::vector<Eigen::Vector3f> points_;   //!< The surface points, ordered by the tree
+    std::vector<Node> nodes_;               //!< The nodes, level after level
+};
+
+#endif // BONEKDTREE_H
@@ -0,0 +1,409 @@
+#include "brickedvolume.h"
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Samples per voxel along a ray (of the smallest spacing) inside the bricks that can reach the threshold
+static constexpr double RAY_SAMPLES_PER_VOXEL = 2.0;
+// How far (in voxels) a ray goes past the border of a brick that it skips, so it is surely in the next one
+static constexpr double RAY_SKIP_EPSILON = 1e-3;
+
+BrickedVolume::BrickedVolume()
+{
+}
+
+BrickedVolume::BrickedVolume(const unsigned char* voxels, const std::array<int, 3>& dim, const std::array<double, 3>& origin, const std::array<double, 3>& spacing)
+    : BrickedVolume(dim, origin, spacing, [voxels, dim](int z, int) -> const unsigned char* {
+          // the slab is already there, in the dense volume
+          return voxels == nullptr ? nullptr : voxels + static_cast<std::size_t>(z) * dim[0] * dim[1];
+      })
+{
+}
+
+BrickedVolume::BrickedVolume(const std::array<int, 3>& dim, const std::array<double, 3>& origin, const std::array<double, 3>& spacing, const SlabSource& source)
+    : dim_(dim), origin_(origin), spacing_(spacing)
+{
+    if (dim[0] <= 0 || dim[1] <= 0 || dim[2] <= 0) {
+        dim_ = {0, 0, 0};
+        return;
+    }
+
+    for (int i = 0; i < 3; ++i) brickDim_[i] = (dim_[i] + BRICK_SIZE - 1) / BRICK_SIZE;
+    const std::size_t nBricks = static_cast<std::size_t>(brickDim_[0]) * brickDim_[1] * brickDim_[2];
+    const std::size_t dimX = dim_[0];
+    const std::size_t sliceSize = dimX * dim_[1];
+    slots_.assign(nBricks, EMPTY_BRICK);
+    brickMinimum_.resize(nBricks);
+    brickMaximum_.resize(nBricks);
+
+    // The background (the minimum of the whole volume) is only known at the end, so a slab can't tell which bricks
+    // are empty. It stores every brick that is not uniform (it surely has something over the minimum), and the
+    // uniform ones are decided at the end, by their value.
+    std::uint32_t nStored = 0;
+    for (int bz = 0; bz < brickDim_[2]; ++bz) {
+        const int slices = std::min(dim_[2] - bz * BRICK_SIZE, BRICK_SIZE);
+        const unsigned char* slab = source(bz * BRICK_SIZE, slices);
+        if (slab == nullptr) {
+            *this = BrickedVolume();
+            return;
+        }
+
+        // 1) the minimum and the maximum of every brick of the slab, a row of bricks per iteration (the rows of a
+        //    brick are contiguous in the slab, the row of bricks reads 8 whole rows of it)
+        #pragma omp parallel for schedule(dynamic)
+        for (int by = 0; by < brickDim_[1]; ++by) {
+            const int yEnd = std::min(dim_[1], (by + 1) * BRICK_SIZE);
+            for (int bx = 0; bx < brickDim_[0]; ++bx) {
+                const int x0 = bx * BRICK_SIZE;
+                const int n  = std::min(dim_[0] - x0, BRICK_SIZE);
+                unsigned char low = 255, high = 0;
+                for (int z = 0; z < slices; ++z) {
+                    for (int y = by * BRICK_SIZE; y < yEnd; ++y) {
+                        const unsigned char* src = slab + z * sliceSize + y * dimX + x0;
+                        for (int x = 0; x < n; ++x) {
+                            low  = std::min(low, src[x]);
+                            high = std::max(high, src[x]);
+                        }
+                    }
+                }
+                const std::size_t brick = brickIndex(bx, by, bz);
+                brickMinimum_[brick] = low;
+                brickMaximum_[brick] = high;
+            }
+        }
+
+        // 2) a slot for every brick of the slab that is not uniform
+        for (int by = 0; by < brickDim_[1]; ++by) {
+            for (int bx = 0; bx < brickDim_[0]; ++bx) {
+                const std::size_t brick = brickIndex(bx, by, bz);
+                if (brickMaximum_[brick] > brickMinimum_[brick]) slots_[brick] = nStored++;
+            }
+        }
+        voxels_.resize(static_cast<std::size_t>(nStored) * BRICK_VOXELS);
+
+        // 3) copy their voxels, the same rows of bricks as in 1)
+        #pragma omp parallel for schedule(dynamic)
+        for (int by = 0; by < brickDim_[1]; ++by) {
+            const int yEnd = std::min(dim_[1], (by + 1) * BRICK_SIZE);
+            for (int bx = 0; bx < brickDim_[0]; ++bx) {
+                const std::uint32_t slot = slots_[brickIndex(bx, by, bz)];
+                if (slot == EMPTY_BRICK) continue;
+                const int x0 = bx * BRICK_SIZE;
+                const int n  = std::min(dim_[0] - x0, BRICK_SIZE);
+                unsigned char* dst = voxels_.data() + static_cast<std::size_t>(slot) * BRICK_VOXELS;
+                for (int z = 0; z < slices; ++z) {
+                    for (int y = by * BRICK_SIZE; y < yEnd; ++y) {
+                        std::memcpy(dst + (z * BRICK_SIZE + (y % BRICK_SIZE)) * BRICK_SIZE, slab + z * sliceSize + y * dimX + x0, n);
+                    }
+                }
+            }
+        }
+    }
+
+    // 4) the background is the minimum of the volume, a uniform brick that is brighter than it is stored too (rare)
+    minimum_ = *std::min_element(brickMinimum_.begin(), brickMinimum_.end());
+    maximum_ = *std::max_element(brickMaximum_.begin(), brickMaximum_.end());
+    const std::uint32_t nVarying = nStored;
+    for (std::size_t brick = 0; brick < nBricks; ++brick) {
+        if (slots_[brick] == EMPTY_BRICK && brickMinimum_[brick] > minimum_) slots_[brick] = nStored++;
+    }
+    voxels_.resize(static_cast<std::size_t>(nStored) * BRICK_VOXELS);
+    for (std::size_t brick = 0; brick < nBricks; ++brick) {
+        const std::uint32_t slot = slots_[brick];
+        if (slot != EMPTY_BRICK && slot >= nVarying)
+            std::memset(voxels_.data() + static_cast<std::size_t>(slot) * BRICK_VOXELS, brickMinimum_[brick], BRICK_VOXELS);
+    }
+    voxels_.shrink_to_fit();
+
+    // 5) the voxels of the bricks at the border of the volume that are outside of it are the background
+    for (int bz = 0; bz < brickDim_[2]; ++bz) {
+        for (int by = 0; by < brickDim_[1]; ++by) {
+            for (int bx = 0; bx < brickDim_[0]; ++bx) {
+                const std::uint32_t slot = slots_[brickIndex(bx, by, bz)];
+                const int nx = std::min(dim_[0] - bx * BRICK_SIZE, BRICK_SIZE);
+                const int ny = std::min(dim_[1] - by * BRICK_SIZE, BRICK_SIZE);
+                const int nz = std::min(dim_[2] - bz * BRICK_SIZE, BRICK_SIZE);
+                if (slot == EMPTY_BRICK || (nx == BRICK_SIZE && ny == BRICK_SIZE && nz == BRICK_SIZE)) continue;
+                unsigned char* dst = voxels_.data() + static_cast<std::size_t>(slot) * BRICK_VOXELS;
+                for (int z = 0; z < BRICK_SIZE; ++z)
+                    for (int y = 0; y < BRICK_SIZE; ++y)
+                        for (int x = 0; x < BRICK_SIZE; ++x)
+                            if (x >= nx || y >= ny || z >= nz) dst[(z * BRICK_SIZE + y) * BRICK_SIZE + x] = minimum_;
+            }
+        }
+    }
+
+    // 6) what a trilinear sample inside a brick can reach, the brick and its next neighbours
+    const int brickRows = brickDim_[1] * brickDim_[2];
+    reachMaximum_.resize(nBricks);
+    #pragma omp parallel for schedule(static)
+    for (int row = 0; row < brickRows; ++row) {
+        const int by = row % brickDim_[1];
+        const int bz = row / brickDim_[1];
+        for (int bx = 0; bx < brickDim_[0]; ++bx) {
+            unsigned char high = 0;
+            for (int z = bz; z <= std::min(bz + 1, brickDim_[2] - 1); ++z)
+                for (int y = by; y <= std::min(by + 1, brickDim_[1] - 1); ++y)
+                    for (int x = bx; x <= std::min(bx + 1, brickDim_[0] - 1); ++x)
+                        high = std::max(high, brickMaximum_[brickIndex(x, y, z)]);
+            reachMaximum_[brickIndex(bx, by, bz)] = high;
+        }
+    }
+}
+
+bool BrickedVolume::empty() const
+{
+    return slots_.empty();
+}
+
+const std::array<int, 3>& BrickedVolume::getDim() const
+{
+    return dim_;
+}
+
+const std::array<double, 3>& BrickedVolume::getOrigin() const
+{
+    return origin_;
+}
+
+const std::array<double, 3>& BrickedVolume::getSpacing() const
+{
+    return spacing_;
+}
+
+std::size_t BrickedVolume::getVoxelCount() const
+{
+    return static_cast<std::size_t>(dim_[0]) * dim_[1] * dim_[2];
+}
+
+const std::array<int, 3>& BrickedVolume::getBrickDim() const
+{
+    return brickDim_;
+}
+
+std::size_t BrickedVolume::getAllocatedBricks() const
+{
+    return voxels_.size() / BRICK_VOXELS;
+}
+
+std::size_t BrickedVolume::getMemoryBytes() const
+{
+    return voxels_.size() + slots_.size() * (sizeof(std::uint32_t) + 3);
+}
+
+unsigned char BrickedVolume::getMinimum() const
+{
+    return minimum_;
+}
+
+unsigned char BrickedVolume::getMaximum() const
+{
+    return maximum_;
+}
+
+std::size_t BrickedVolume::brickIndex(int bx, int by, int bz) const
+{
+    return (static_cast<std::size_t>(bz) * brickDim_[1] + by) * brickDim_[0] + bx;
+}
+
+const unsigned char* BrickedVolume::brickVoxels(std::size_t brick) const
+{
+    const std::uint32_t slot = slots_[brick];
+    if (slot == EMPTY_BRICK) return nullptr;
+    return voxels_.data() + static_cast<std::size_t>(slot) * BRICK_VOXELS;
+}
+
+unsigned char BrickedVolume::brickMinimum(std::size_t brick) const
+{
+    return brickMinimum_[brick];
+}
+
+unsigned char BrickedVolume::brickMaximum(std::size_t brick) const
+{
+    return brickMaximum_[brick];
+}
+
+void BrickedVolume::copySlice(int z, unsigned char* out) const
+{
+    const int bz = z / BRICK_SIZE;
+    const int inBrickZ = z % BRICK_SIZE;
+    for (int by = 0; by < brickDim_[1]; ++by) {
+        const int yEnd = std::min(dim_[1], (by + 1) * BRICK_SIZE);
+        for (int bx = 0; bx < brickDim_[0]; ++bx) {
+            const int x0 = bx * BRICK_SIZE;
+            const int n  = std::min(dim_[0] - x0, BRICK_SIZE);
+            const unsigned char* brick = brickVoxels(brickIndex(bx, by, bz));
+            for (int y = by * BRICK_SIZE; y < yEnd; ++y) {
+                unsigned char* dst = out + static_cast<std::size_t>(y) * dim_[0] + x0;
+                if (brick == nullptr) std::memset(dst, minimum_, n);
+                else std::memcpy(dst, brick + (inBrickZ * BRICK_SIZE + (y % BRICK_SIZE)) * BRICK_SIZE, n);
+            }
+        }
+    }
+}
+
+float BrickedVolume::sample(double x, double y, double z) const
+{
+    if (empty()) return 0.0f;
+
+    const int x0 = static_cast<int>(std::floor(x));
+    const int y0 = static_cast<int>(std::floor(y));
+    const int z0 = static_cast<int>(std::floor(z));
+    const float fx = static_cast<float>(x - x0);
+    const float fy = static_cast<float>(y - y0);
+    const float fz = static_cast<float>(z - z0);
+
+    // the corners outside of the volume are the background
+    auto value = [this](int ix, int iy, int iz) -> float {
+        if (ix < 0 || iy < 0 || iz < 0 || ix >= dim_[0] || iy >= dim_[1] || iz >= dim_[2]) return minimum_;
+        return at(ix, iy, iz);
+    };
+
+    const float c00 = value(x0, y0,     z0    ) + fx * (value(x0 + 1, y0,     z0    ) - value(x0, y0,     z0    ));
+    const float c10 = value(x0, y0 + 1, z0    ) + fx * (value(x0 + 1, y0 + 1, z0    ) - value(x0, y0 + 1, z0    ));
+    const float c01 = value(x0, y0,     z0 + 1) + fx * (value(x0 + 1, y0,     z0 + 1) - value(x0, y0,     z0 + 1));
+    const float c11 = value(x0, y0 + 1, z0 + 1) + fx * (value(x0 + 1, y0 + 1, z0 + 1) - value(x0, y0 + 1, z0 + 1));
+    const float c0  = c00 + fy * (c10 - c00);
+    const float c1  = c01 + fy * (c11 - c01);
+    return c0 + fz * (c1 - c0);
+}
+
+void BrickedVolume::sampleRow(const Eigen::Vector3d& start, const Eigen::Vector3d& step, int count, unsigned char* out) const
+{
+    if (count <= 0) return;
+    if (empty()) {
+        std::memset(out, 0, count);
+        return;
+    }
+
+    // The part of the line where a sample can touch a voxel (-1 < position < dim), outside of it is background
+    double tEnter = 0.0, tExit = count - 1;
+    for (int i = 0; i < 3; ++i) {
+        if (step[i] == 0.0) {
+            if (start[i] <= -1.0 || start[i] >= dim_[i]) tEnter = count;
+            continue;
+        }
+        double t0 = (-1.0 - start[i]) / step[i];
+        double t1 = (dim_[i] - start[i]) / step[i];
+        if (t0 > t1) std::swap(t0, t1);
+        tEnter = std::max(tEnter, t0);
+        tExit  = std::min(tExit, t1);
+    }
+    const int first = static_cast<int>(std::clamp(std::ceil(tEnter), 0.0, static_cast<double>(count)));
+    const int last  = static_cast<int>(std::clamp(std::floor(tExit), -1.0, static_cast<double>(count - 1)));
+    if (first > last) {
+        std::memset(out, minimum_, count);
+        return;
+    }
+    std::memset(out, minimum_, first);
+    std::memset(out + last + 1, minimum_, count - 1 - last);
+
+    for (int i = first; i <= last; ++i) {
+        const Eigen::Vector3d p = start + step * i;
+        const int x0 = static_cast<int>(std::floor(p[0]));
+        const int y0 = static_cast<int>(std::floor(p[1]));
+        const int z0 = static_cast<int>(std::floor(p[2]));
+
+        // the 8 corners in one brick, no bounds and no brick lookups per corner
+        if (x0 >= 0 && y0 >= 0 && z0 >= 0 && x0 + 1 < dim_[0] && y0 + 1 < dim_[1] && z0 + 1 < dim_[2] &&
+            (x0 % BRICK_SIZE) != BRICK_SIZE - 1 && (y0 % BRICK_SIZE) != BRICK_SIZE - 1 && (z0 % BRICK_SIZE) != BRICK_SIZE - 1) {
+            const std::size_t brick = brickIndex(x0 / BRICK_SIZE, y0 / BRICK_SIZE, z0 / BRICK_SIZE);
+            if (slots_[brick] == EMPTY_BRICK) {
+                out[i] = minimum_;
+                continue;
+            }
+            const unsigned char* v = voxels_.data() + static_cast<std::size_t>(slots_[brick]) * BRICK_VOXELS
+                                   + ((z0 % BRICK_SIZE) * BRICK_SIZE + (y0 % BRICK_SIZE)) * BRICK_SIZE + (x0 % BRICK_SIZE);
+            constexpr int DY = BRICK_SIZE, DZ = BRICK_SIZE * BRICK_SIZE;
+            const float fx = static_cast<float>(p[0] - x0);
+            const float fy = static_cast<float>(p[1] - y0);
+            const float fz = static_cast<float>(p[2] - z0);
+            const float c00 = v[0]       + fx * (v[1]           - v[0]);
+            const float c10 = v[DY]      + fx * (v[DY + 1]      - v[DY]);
+            const float c01 = v[DZ]      + fx * (v[DZ + 1]      - v[DZ]);
+            const float c11 = v[DZ + DY] + fx * (v[DZ + DY + 1] - v[DZ + DY]);
+            const float c0  = c00 + fy * (c10 - c00);
+            const float c1  = c01 + fy * (c11 - c01);
+            out[i] = static_cast<unsigned char>(c0 + fz * (c1 - c0) + 0.5f);
+            continue;
+        }
+
+        // across bricks or at the border of the volume
+        out[i] = static_cast<unsigned char>(sample(p[0], p[1], p[2]) + 0.5f);
+    }
+}
+
+bool BrickedVolume::castRay(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, double maxDistance, int threshold, double& distance) const
+{
+    const double length = direction.norm();
+    if (empty() || threshold > maximum_ || length <= 0.0 || maxDistance <= 0.0) return false;
+
+    // In voxel coordinates the ray is start + step * t, with t in mm along the ray
+    Eigen::Vector3d start, step;
+    for (int i = 0; i < 3; ++i) {
+        start[i] = (origin[i] - origin_[i]) / spacing_[i];
+        step[i]  = direction[i] / length / spacing_[i];
+    }
+
+    // The part of the ray that is inside the volume
+    double tEnter = 0.0, tExit = maxDistance;
+    for (int i = 0; i < 3; ++i) {
+        if (step[i] == 0.0) {
+            if (start[i] < 0.0 || start[i] > dim_[i] - 1) return false;
+            continue;
+        }
+        double t0 = -start[i] / step[i];
+        double t1 = (dim_[i] - 1 - start[i]) / step[i];
+        if (t0 > t1) std::swap(t0, t1);
+        tEnter = std::max(tEnter, t0);
+        tExit  = std::min(tExit, t1);
+    }
+    if (tEnter > tExit) return false;
+
+    const double minimumSpacing = std::min({spacing_[0], spacing_[1], spacing_[2]});
+    const double stepLength = minimumSpacing / RAY_SAMPLES_PER_VOXEL;
+    const double skipEpsilon = minimumSpacing * RAY_SKIP_EPSILON;
+
+    double t = tEnter;
+    bool hasPrevious = false;                   // the sample before is known and under the threshold
+    double tPrevious = 0.0;
+    float previous = 0.0f;
+    while (t <= tExit) {
+        const Eigen::Vector3d p = start + step * t;
+        int brick[3];
+        for (int i = 0; i < 3; ++i) brick[i] = std::clamp(static_cast<int>(std::floor(p[i])), 0, dim_[i] - 1) / BRICK_SIZE;
+
+        // nothing around this brick reaches the threshold, jump to where the ray leaves it
+        if (reachMaximum_[brickIndex(brick[0], brick[1], brick[2])] < threshold) {
+            double tLeave = tExit;
+            for (int i = 0; i < 3; ++i) {
+                if (step[i] > 0.0) tLeave = std::min(tLeave, ((brick[i] + 1) * BRICK_SIZE - start[i]) / step[i]);
+                if (step[i] < 0.0) tLeave = std::min(tLeave, (brick[i] * BRICK_SIZE - start[i]) / step[i]);
+            }
+            t = std::max(tLeave, t) + skipEpsilon;
+            hasPrevious = false;
+            continue;
+        }
+
+        const float value = sample(p[0], p[1], p[2]);
+        if (value >= threshold) {
+            // right after a jump there is no sample before, take one
+            if (!hasPrevious && t > tEnter) {
+                tPrevious = std::max(tEnter, t - stepLength);
+                const Eigen::Vector3d q = start + step * tPrevious;
+                previous = sample(q[0], q[1], q[2]);
+                hasPrevious = previous < threshold;
+            }
+            // the crossing is between the two samples, linearly
+            distance = hasPrevious ? tPrevious + (threshold - previous) / (value - previous) * (t - tPrevious) : t;
+            return true;
+        }
+
+        hasPrevious = true;
+        tPrevious = t;
+        previous = value;
+        t += stepLength;
+    }
+    return false;
+}
@@ -0,0 +1,168 @@
+#ifndef BRICKEDVOLUME_H
+#define BRICKEDVOLUME_H
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+#include <Eigen/Dense>
+
+/**
+ * @class BrickedVolume
+ * @brief A volume that only stores the parts that are not empty, in bricks of 8x8x8 voxels.
+ *
+ * For the context. A reconstructed volume is a box around the whole sweep, and most of it is the empty space around
+ * the leg (the voxels that no pixel hit are 0). Kept dense, a whole leg at 0.5mm spacing is hundreds of MB, and every
+ * threshold, surface or ray has to go through all of it. Here the volume is cut into bricks of 8x8x8 voxels (512 bytes,
+ * a brick fits in the L1 cache), and a brick is only stored if it has a voxel that is brighter than the background
+ * (the minimum of the volume). The other bricks are just "empty", they cost one entry in the brick table.
+ *
+ * Every brick (stored or not) also knows the minimum and the maximum of its voxels. With that, the users skip whole
+ * bricks that can't have what they are looking for (empty-space skipping):
+ *   - thresholding (Volume3DController) only goes through the bricks whose maximum is over the threshold,
+ *   - slicing (copySlice(), MarchingCubes) gives the empty bricks as one memset,
+ *   - ray queries (castRay()) jump over the bricks where the (interpolated) intensity can't reach the threshold,
+ *   - resampling (sampleRow()) fills the samples whose whole neighbourhood is background without reading a voxel.
+ *
+ * The position of the voxels is like in the .mha file: origin (Offset) + spacing (ElementSpacing) * index, no
+ * rotation. The volume can't be changed after it is built, so it can be read by any number of threads.
+ *
+ */
+
+class BrickedVolume
+{
+public:
+
+    static constexpr int BRICK_SIZE   = 8;                                      //!< Voxels along one side of a brick
+    static constexpr int BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;   //!< Voxels (bytes) of one brick
+
+    /**
+     * @brief Constructor function, an empty volume
+     */
+    BrickedVolume();
+
+    /**
+     * @brief Gives the voxels of the slices [z, z + slices) (x fastest, then y, then z), slices is at most BRICK_SIZE.
+     * The pointer only has to stay valid until the next call. nullptr if the voxels can't be read.
+     */
+    using SlabSource = std::function<const unsigned char*(int z, int slices)>;
+
+    /**
+     * @brief Constructor function, bricks a dense volume (x fastest, then y, then z) in parallel. The dense voxels are
+     * not needed anymore afterwards.
+     */
+    BrickedVolume(const unsigned char* voxels, const std::array<int, 3>& dim, const std::array<double, 3>& origin, const std::array<double, 3>& spacing);
+
+    /**
+     * @brief Constructor function, bricks a volume that comes one slab of BRICK_SIZE slices at a time (e.g. while it is
+     * inflated or reconstructed), so only one slab and the bricks are in memory, never the whole dense volume. If the
+     * source fails (nullptr), the volume is empty.
+     */
+    BrickedVolume(const std::array<int, 3>& dim, const std::array<double, 3>& origin, const std::array<double, 3>& spacing, const SlabSource& source);
+
+    /**
+     * @brief There are no voxels
+     */
+    bool empty() const;
+
+    /**
+     * @brief GET the size of the volume (voxels), the position of the first voxel and the size of a voxel (mm)
+     */
+    const std::array<int, 3>& getDim() const;
+    const std::array<double, 3>& getOrigin() const;
+    const std::array<double, 3>& getSpacing() const;
+
+    /**
+     * @brief GET the number of voxels, as if it were dense
+     */
+    std::size_t getVoxelCount() const;
+
+    /**
+     * @brief GET the size of the brick table (bricks along every axis)
+     */
+    const std::array<int, 3>& getBrickDim() const;
+
+    /**
+     * @brief GET the number of bricks that are stored, and the memory they take (bytes, the tables included)
+     */
+    std::size_t getAllocatedBricks() const;
+    std::size_t getMemoryBytes() const;
+
+    /**
+     * @brief GET the minimum and the maximum intensity of the volume. The minimum is also the background, the value of
+     * every voxel of an empty brick.
+     */
+    unsigned char getMinimum() const;
+    unsigned char getMaximum() const;
+
+    /**
+     * @brief The index of brick (bx, by, bz) in the brick table
+     */
+    std::size_t brickIndex(int bx, int by, int bz) const;
+
+    /**
+     * @brief GET the voxels of a brick (x fastest, BRICK_SIZE per row), nullptr if the brick is empty. The voxels of a
+     * brick at the border of the volume that are outside of it are the background.
+     */
+    const unsigned char* brickVoxels(std::size_t brick) const;
+
+    /**
+     * @brief GET the minimum and the maximum of the voxels of a brick
+     */
+    unsigned char brickMinimum(std::size_t brick) const;
+    unsigned char brickMaximum(std::size_t brick) const;
+
+    /**
+     * @brief One voxel, it must be inside the volume
+     */
+    unsigned char at(int x, int y, int z) const
+    {
+        const std::uint32_t slot = slots_[brickIndex(x / BRICK_SIZE, y / BRICK_SIZE, z / BRICK_SIZE)];
+        if (slot == EMPTY_BRICK) return minimum_;
+        return voxels_[static_cast<std::size_t>(slot) * BRICK_VOXELS + ((z % BRICK_SIZE) * BRICK_SIZE + (y % BRICK_SIZE)) * BRICK_SIZE + (x % BRICK_SIZE)];
+    }
+
+    /**
+     * @brief Copies the slice z of the volume to out (dimX * dimY voxels, x fastest)
+     */
+    void copySlice(int z, unsigned char* out) const;
+
+    /**
+     * @brief The intensity at a position in voxel coordinates, trilinear. Outside of the volume it is the background.
+     */
+    float sample(double x, double y, double z) const;
+
+    /**
+     * @brief count trilinear samples along a line in voxel coordinates, start + i * step, rounded to out. It is the
+     * same as sample() for every point, but the part outside of the volume is filled at once, and the corners are
+     * read straight from the brick when all 8 are in the same one (most of the time).
+     */
+    void sampleRow(const Eigen::Vector3d& start, const Eigen::Vector3d& step, int count, unsigned char* out) const;
+
+    /**
+     * @brief The first point along a ray (mm) where the intensity reaches threshold, at most maxDistance (mm) from
+     * the origin. The distance to that point is in distance. Returns false if the ray doesn't reach the threshold.
+     */
+    bool castRay(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, double maxDistance, int threshold, double& distance) const;
+
+private:
+
+    static constexpr std::uint32_t EMPTY_BRICK = 0xFFFFFFFFu; //!< The slot of a brick that is not stored
+
+    std::array<int, 3> dim_ = {0, 0, 0};            //!< Size of the volume (voxels)
+    std::array<double, 3> origin_ = {0, 0, 0};      //!< Position of the first voxel (mm)
+    std::array<double, 3> spacing_ = {1, 1, 1};     //!< Size of a voxel (mm)
+    std::array<int, 3> brickDim_ = {0, 0, 0};       //!< Size of the brick table
+    unsigned char minimum_ = 0;                     //!< The minimum of the volume, the value of the empty bricks
+    unsigned char maximum_ = 0;                     //!< The maximum of the volume
+    std::vector<std::uint32_t> slots_;              //!< Per brick, where its voxels are in voxels_ (in bricks), or EMPTY_BRICK
+    std::vector<unsigned char> brickMinimum_;       //!< Per brick, the minimum of its voxels
+    std::vector<unsigned char> brickMaximum_;       //!< Per brick, the maximum of its voxels
+    std::vector<unsigned char> reachMaximum_;       //!< Per brick, the maximum of it and its next neighbours (x+1, y+1, z+1),
+                                                    //!< all voxels that a trilinear sample inside the brick can touch
+    std::vector<unsigned char> voxels_;             //!< The voxels of the stored bricks, one brick after another
+};
+
+#endif // BRICKEDVOLUME_H
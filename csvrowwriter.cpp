@@ -0,0 +1,184 @@
+#include "csvrowwriter.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+
+// Longest text that one number can produce (a double in scientific notation with 17 digits is 24 chars)
+static constexpr std::size_t MAX_NUMBER_CHARS = 32;
+// More significant digits than this don't change a double anymore (and wouldn't fit MAX_NUMBER_CHARS)
+static constexpr int MAX_PRECISION = 17;
+
+CsvRowWriter::CsvRowWriter(const std::vector<std::string> &columns, Sink sink, std::size_t batchBytes)
+    : columns_(columns),
+    sink_(std::move(sink)),
+    used_(0),
+    rowStart_(0),
+    rowValues_(0),
+    pendingRows_(0),
+    batchBytes_(batchBytes),
+    precision_(0),
+    ok_(true)
+{
+    // a bit more than one batch, so a full batch plus the row that is being built fit without growing
+    buffer_.resize(batchBytes_ + 4096);
+}
+
+CsvRowWriter::~CsvRowWriter()
+{
+    flush();
+}
+
+bool CsvRowWriter::writeHeader()
+{
+    for (const std::string &column : columns_)
+        add(std::string_view(column));
+    return endRow();
+}
+
+void CsvRowWriter::setPrecision(int precision)
+{
+    precision_ = std::clamp(precision, 0, MAX_PRECISION);
+}
+
+void CsvRowWriter::reserve(std::size_t n)
+{
+    if (used_ + n <= buffer_.size())
+        return;
+
+    // give the finished rows to the sink, and move the unfinished row to the beginning of the buffer
+    writeFinishedRows();
+
+    // a single row which is longer than the buffer (very long strings), we have no choice but to grow
+    if (used_ + n > buffer_.size())
+        buffer_.resize(used_ + n);
+}
+
+void CsvRowWriter::separator()
+{
+    if (rowValues_ > 0)
+        buffer_[used_++] = ',';
+    rowValues_++;
+}
+
+CsvRowWriter &CsvRowWriter::add(double value)
+{
+    reserve(MAX_NUMBER_CHARS + 1);
+    separator();
+
+    char *first = buffer_.data() + used_;
+    char *last  = first + MAX_NUMBER_CHARS;
+    std::to_chars_result result;
+
+    // whole numbers (timestamps, counters) are written as integers, as long as the double can hold them exactly
+    if (std::isfinite(value) && std::fabs(value) < 9007199254740992.0 && value == std::floor(value))
+        result = std::to_chars(first, last, static_cast<int64_t>(value));
+    else if (precision_ > 0)
+        result = std::to_chars(first, last, value, std::chars_format::general, precision_);
+    else
+        result = std::to_chars(first, last, value);
+
+    // should never happen with the clamped precision, but then the shortest form always fits
+    if (result.ec != std::errc())
+        result = std::to_chars(first, last, value);
+
+    used_ = result.ptr - buffer_.data();
+    return *this;
+}
+
+CsvRowWriter &CsvRowWriter::add(int64_t value)
+{
+    reserve(MAX_NUMBER_CHARS + 1);
+    separator();
+
+    std::to_chars_result result = std::to_chars(buffer_.data() + used_, buffer_.data() + used_ + MAX_NUMBER_CHARS, value);
+    used_ = result.ptr - buffer_.data();
+    return *this;
+}
+
+CsvRowWriter &CsvRowWriter::add(int value)
+{
+    return add(static_cast<int64_t>(value));
+}
+
+CsvRowWriter &CsvRowWriter::add(std::string_view value)
+{
+    reserve(value.size() + 1);
+    separator();
+
+    std::memcpy(buffer_.data() + used_, value.data(), value.size());
+    used_ += value.size();
+    return *this;
+}
+
+CsvRowWriter &CsvRowWriter::add(const char *value)
+{
+    return add(std::string_view(value));
+}
+
+CsvRowWriter &CsvRowWriter::add(const double *values, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; i++)
+        add(values[i]);
+    return *this;
+}
+
+bool CsvRowWriter::endRow()
+{
+    // the row doesn't follow the schema, drop it
+    if (rowValues_ != columns_.size())
+    {
+        used_      = rowStart_;
+        rowValues_ = 0;
+        return false;
+    }
+
+    reserve(1);
+    buffer_[used_++] = '\n';
+    rowStart_  = used_;
+    rowValues_ = 0;
+    pendingRows_++;
+
+    // the batch is full, give it to the sink
+    if (used_ >= batchBytes_)
+        return flush();
+
+    return ok_;
+}
+
+bool CsvRowWriter::flush()
+{
+    writeFinishedRows();
+
+    bool ok = ok_;
+    ok_ = true;
+    return ok;
+}
+
+void CsvRowWriter::writeFinishedRows()
+{
+    if (rowStart_ == 0)
+        return;
+
+    if (!sink_ || !sink_(buffer_.data(), rowStart_))
+        ok_ = false;
+
+    // keep the unfinished row (if any), it goes to the beginning of the buffer
+    std::size_t unfinished = used_ - rowStart_;
+    if (unfinished > 0)
+        std::memmove(buffer_.data(), buffer_.data() + rowStart_, unfinished);
+    used_        = unfinished;
+    rowStart_    = 0;
+    pendingRows_ = 0;
+}
+
+std::size_t CsvRowWriter::pendingRows() const
+{
+    return pendingRows_;
+}
+
+std::size_t CsvRowWriter::columnCount() const
+{
+    return columns_.size();
+}
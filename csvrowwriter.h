@@ -0,0 +1,128 @@
+#ifndef CSVROWWRITER_H
+#define CSVROWWRITER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @class CsvRowWriter
+ * @brief Builds CSV rows with a fixed schema into a reusable buffer, and writes them in batches.
+ *
+ * For the context. Formatting every value with QString::number and joining them with QStringList::join (or with
+ * std::ostream <<) allocates strings for every single value, and it was the top cost of the writer thread. Here the
+ * numbers are formatted with std::to_chars directly into one char buffer that is allocated once, and the buffer is
+ * only handed to the sink (QFile::write, std::ofstream::write, ...) when it is full enough, or when flush() is called.
+ *
+ * The usage is like this:
+ *
+ *   CsvRowWriter csv({"name", "q1", "q2"}, [&](const char *data, std::size_t size){ return file.write(data, size) == size; });
+ *   csv.writeHeader();
+ *   csv.add("Probe_1").add(0.5).add(0.25).endRow();
+ *   ...
+ *   csv.flush();
+ *
+ * Doubles are written with the shortest representation that gives back exactly the same double when it is read again,
+ * and doubles which are whole numbers (e.g. timestamps) are written as integers (no 1.7e+12). If a row doesn't have the
+ * same number of values as the schema, it is dropped and endRow() returns false.
+ */
+class CsvRowWriter
+{
+public:
+
+    /**
+     * @brief The function that receives the formatted bytes. Returns false if it failed to write them.
+     */
+    using Sink = std::function<bool(const char *data, std::size_t size)>;
+
+    /**
+     * @brief Constructor function.
+     * @param columns The schema, the name of each column.
+     * @param sink Where the formatted rows go.
+     * @param batchBytes The rows are given to the sink when the buffer has at least this many bytes.
+     */
+    CsvRowWriter(const std::vector<std::string> &columns, Sink sink, std::size_t batchBytes = 64 * 1024);
+
+    /**
+     * @brief Destructor function, gives the remaining rows to the sink.
+     */
+    ~CsvRowWriter();
+
+    /**
+     * @brief Writes the header row (the column names).
+     */
+    bool writeHeader();
+
+    /**
+     * @brief Sets the number of significant digits for doubles. 0 (default) means the shortest exact representation,
+     * more than 17 is the same as 17.
+     */
+    void setPrecision(int precision);
+
+    /**
+     * @brief Adds a value to the current row.
+     */
+    CsvRowWriter &add(double value);
+    CsvRowWriter &add(int64_t value);
+    CsvRowWriter &add(int value);
+    CsvRowWriter &add(std::string_view value);
+    CsvRowWriter &add(const char *value);
+
+    /**
+     * @brief Adds all the values of an array to the current row.
+     */
+    CsvRowWriter &add(const double *values, std::size_t n);
+
+    /**
+     * @brief Finishes the current row. The buffer is given to the sink if it is full enough.
+     * @return false if the row doesn't match the schema (the row is dropped), or the sink failed.
+     */
+    bool endRow();
+
+    /**
+     * @brief Gives all the finished rows to the sink.
+     */
+    bool flush();
+
+    /**
+     * @brief GET the number of finished rows that are still in the buffer.
+     */
+    std::size_t pendingRows() const;
+
+    /**
+     * @brief GET the number of columns of the schema.
+     */
+    std::size_t columnCount() const;
+
+private:
+    /**
+     * @brief Makes sure that there is space for n more bytes in the buffer.
+     */
+    void reserve(std::size_t n);
+
+    /**
+     * @brief Gives the finished rows to the sink, the unfinished row stays in the buffer.
+     */
+    void writeFinishedRows();
+
+    /**
+     * @brief Puts the separator before a value, if it is not the first value of the row.
+     */
+    void separator();
+
+    std::vector<std::string> columns_;  //!< The schema
+    Sink sink_;                         //!< Where the formatted rows go
+    std::vector<char> buffer_;          //!< The reusable buffer
+    std::size_t used_;                  //!< Bytes used in the buffer
+    std::size_t rowStart_;              //!< Where the current (unfinished) row starts in the buffer
+    std::size_t rowValues_;             //!< Number of values in the current row
+    std::size_t pendingRows_;           //!< Number of finished rows in the buffer
+    std::size_t batchBytes_;            //!< Give the rows to the sink when the buffer has this many bytes
+    int precision_;                     //!< Significant digits for doubles, 0 means shortest exact representation
+    bool ok_;                           //!< False if the sink failed since the last flush
+};
+
+#endif // CSVROWWRITER_H
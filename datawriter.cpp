@@ -2,10 +2,20 @@
 #include <QDebug>
 #include <QMutexLocker>
 #include <QMetaObject>
+#include <algorithm>
+#include <chrono>
+
+// How long the writing thread sleeps at most when the queue is empty, before it checks again whether it has to stop
+static constexpr int IDLE_WAIT_MILLISECONDS = 100;
 
 DataWriter::DataWriter(QObject *parent)
     : QObject(parent),
-    m_isWriting(false) // Initialize m_isWriting to false since writing has not started yet
+    m_dataQueue(8192, OverflowPolicy::DropNewest),  // ~40 seconds of rows at 200Hz. The rows come from the GUI thread, so a full
+                                                    // queue drops the new row (and AmodeMocapRecorder its frame) instead of waiting.
+    m_isWriting(false), // Initialize m_isWriting to false since writing has not started yet
+    m_format(Format::Binary),
+    m_flushRows(256),
+    m_flushMilliseconds(1000)
 {
     // Constructor
     // This initializes the DataWriter instance. Initially, the writing flag is set to false,
@@ -20,6 +30,37 @@ DataWriter::~DataWriter()
     stopWriting();
 }
 
+void DataWriter::setFormat(Format format)
+{
+    QMutexLocker locker(&m_mutex);
+    m_format = format;
+}
+
+DataWriter::Format DataWriter::format()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_format;
+}
+
+void DataWriter::setFlushPolicy(int rows, int milliseconds)
+{
+    QMutexLocker locker(&m_mutex);
+    m_flushRows = std::max(1, rows);
+    m_flushMilliseconds = std::max(1, milliseconds);
+}
+
+void DataWriter::setQueuePolicy(OverflowPolicy policy, int capacity)
+{
+    QMutexLocker locker(&m_mutex);
+    m_dataQueue.setPolicy(policy);
+    m_dataQueue.setCapacity(static_cast<std::size_t>(std::max(2, capacity)));
+}
+
+SpscQueueStats DataWriter::queueStats() const
+{
+    return m_dataQueue.stats();
+}
+
 void DataWriter::setFileName(const QString &fileName)
 {
     // Set the output file name where the data will be written
@@ -30,26 +71,71 @@ void DataWriter::writeHeader(const QStringList &header)
 {
     // Lock the mutex to ensure thread safety during file access
     QMutexLocker locker(&m_mutex);
+
+    // The header is the fixed schema of the file, every row must follow it
+    std::vector<std::string> columns;
+    columns.reserve(header.size());
+    for (const QString &column : header)
+        columns.push_back(column.toStdString());
+
+    // Binary format, the header becomes the schema of the pose log
+    if (m_format == Format::Binary)
+    {
+        // the block size is the flush policy, so a full block is written as soon as it has m_flushRows rows
+        if (!m_poseLog.open(m_file.fileName().toStdString(), columns, static_cast<std::size_t>(m_flushRows)))
+            qWarning() << "Cannot open file for writing:" << m_file.fileName();
+        m_flushTimer.start();
+        return;
+    }
+
     if (!m_file.isOpen())
     {
-        // Attempt to open the file in write-only mode and as a text file
-        if (!m_file.open(QIODevice::WriteOnly | QIODevice::Text))
+        // Attempt to open the file in write-only mode. The rows are collected and formatted by m_csv, and written
+        // in batches, so we don't need the buffer of QFile.
+        if (!m_file.open(QIODevice::WriteOnly | QIODevice::Unbuffered))
         {
             qWarning() << "Cannot open file for writing:" << m_file.errorString();
             return; // If the file cannot be opened, print a warning and return
         }
-        // Set the QTextStream to write to the file
-        m_stream.setDevice(&m_file);
     }
-    m_stream << header.join(",") << "\n";   // Write the header to the file, separated by commas
-    m_stream.flush();                       // Ensure the header is written immediately to the file
+
+    // CSV format, the rows are formatted into the buffer of m_csv and given to the file in batches
+    m_csv.reset(new CsvRowWriter(columns, [this](const char *data, std::size_t size) {
+        return m_file.write(data, static_cast<qint64>(size)) == static_cast<qint64>(size);
+    }));
+    m_csv->writeHeader();   // Write the header to the file, separated by commas
+    m_csv->flush();         // Ensure the header is written immediately to the file
+    m_flushTimer.start();
+}
+
+std::size_t DataWriter::pendingRows() const
+{
+    if (m_poseLog.isOpen())
+        return m_poseLog.pendingRows();
+    if (m_csv)
+        return m_csv->pendingRows();
+    return 0;
+}
+
+void DataWriter::flushPendingRows()
+{
+    if (m_poseLog.isOpen())
+        m_poseLog.flush();
+    if (m_csv)
+        m_csv->flush();
+    m_flushTimer.restart();
+}
+
+bool DataWriter::enqueueData(const std::vector<double> &data)
+{
+    // Copy the row into a free slot of the queue. The slot keeps its memory, so after the first rows nothing is
+    // allocated anymore. The writing thread is only woken up if it is sleeping.
+    return m_dataQueue.push([&data](std::vector<double> &slot) { slot.assign(data.begin(), data.end()); });
 }
 
-void DataWriter::enqueueData(const QStringList &data)
+bool DataWriter::canEnqueueData() const
 {
-    QMutexLocker locker(&m_mutex);          // Lock the mutex to protect access to the data queue
-    m_dataQueue.enqueue(data);              // Add the data to the queue
-    m_condition.wakeOne();                  // Wake up any thread waiting for data to be added to the queue
+    return m_dataQueue.hasFreeSlot();
 }
 
 
@@ -57,10 +143,8 @@ void DataWriter::startWriting()
 {
     qDebug() << "DataWriter::startWriting() called and attempting to start writing";
 
-    QMutexLocker locker(&m_mutex);  // Lock the mutex to safely check and update m_isWriting
-    if (m_isWriting) return;        // If already writing, do nothing
-    m_isWriting = true;             // Set the flag to indicate that writing is active
-    locker.unlock();                // Unlock the mutex before continuing
+    if (m_isWriting.exchange(true)) return; // If already writing, do nothing, otherwise set the flag to indicate that writing is active
+    m_dataQueue.resetStats();
 
     qDebug() << "DataWriter::startWriting() m_isWriting set to true.";
 
@@ -73,56 +157,103 @@ void DataWriter::stopWriting()
 {
     qDebug() << "DataWriter::stopWriting() called and attempting to stop writing.";
 
-    QMutexLocker locker(&m_mutex);  // Lock the mutex to safely change m_isWriting
     m_isWriting = false;            // Set the flag to indicate that writing should stop
-    m_condition.wakeOne();          // Wake up the thread if it's currently waiting for more data to be enqueued
+    m_dataQueue.wakeConsumer();     // Wake up the thread if it's currently waiting for more data to be enqueued
 
-    qDebug() << "DataWriter::stopWriting() m_isWriting set to false, condition variable signaled.";
+    qDebug() << "DataWriter::stopWriting() m_isWriting set to false, writing thread woken up.";
 }
 
 void DataWriter::processQueue()
 {
     qDebug() << "DataWriter::processQueue() started.";
+
+    // The rows are swapped out of the queue into this vector, and its old memory goes back to the queue to be reused
+    std::vector<double> dataRow;
     while (true)
     {
-        // Lock the mutex to safely access m_isWriting and the data queue
-        QMutexLocker locker(&m_mutex);
-        if (!m_isWriting && m_dataQueue.isEmpty())
+        if (!m_dataQueue.pop(dataRow))
         {
-            // If writing has stopped and the queue is empty, exit the loop
-            qDebug() << "DataWriter::processQueue() exiting loop.";
-            break;
+            if (!m_isWriting && m_dataQueue.empty())
+            {
+                // If writing has stopped and the queue is empty, exit the loop
+                qDebug() << "DataWriter::processQueue() exiting loop.";
+                break;
+            }
+
+            // If the queue is empty but writing is still active, wait for new data to be enqueued.
+            // If there are rows in memory, don't wait longer than the flush interval, so those rows still reach the
+            // file within m_flushMilliseconds even when no new data comes.
+            qint64 timeout = IDLE_WAIT_MILLISECONDS;
+            if (pendingRows() > 0)
+            {
+                qint64 remaining = m_flushMilliseconds - m_flushTimer.elapsed();
+                if (remaining <= 0)
+                {
+                    flushPendingRows();
+                    continue;
+                }
+                timeout = std::min(timeout, remaining);
+            }
+            m_dataQueue.waitForData(std::chrono::milliseconds(timeout));
+            continue;
         }
 
-        if (m_dataQueue.isEmpty())
+        if (!m_poseLog.isOpen() && !m_csv)
         {
-            // If the queue is empty but writing is still active, wait for new data to be enqueued
-            m_condition.wait(&m_mutex);
+            // If the file is not open, print a warning
+            qWarning() << "DataWriter::processQueue() File is not open for writing.";
             continue;
         }
 
-        QStringList dataRow = m_dataQueue.dequeue();    // Get the next data row from the queue
-        locker.unlock();                                // Unlock the mutex before writing to the file
+        // The rows stay in memory until there are m_flushRows rows, or until the oldest row in memory is older than
+        // m_flushMilliseconds. The timer starts with the first row that goes into the memory.
+        if (pendingRows() == 0)
+            m_flushTimer.restart();
 
-        // Write the data row to the file
-        if (m_file.isOpen())
+        bool ok = true;
+        if (m_poseLog.isOpen())
         {
-            m_stream << dataRow.join(",") << "\n";  // Write the data as a comma-separated row
-            m_stream.flush();                       // Ensure the data is written to the file immediately
+            // Write the data row to the pose log
+            if (dataRow.size() == m_poseLog.columnCount())
+                ok = m_poseLog.append(dataRow.data());
+            else
+                ok = false;
         }
         else
         {
-            // If the file is not open, print a warning
-            qWarning() << "DataWriter::processQueue() File is not open for writing.";
+            // Write the data row to the CSV, formatted directly into the buffer of m_csv (no strings allocated)
+            ok = m_csv->add(dataRow.data(), dataRow.size()).endRow();
         }
+
+        if (!ok)
+            qWarning() << "DataWriter::processQueue() Failed to write the row (file error, or the row does not match the header).";
+
+        if (pendingRows() >= static_cast<std::size_t>(m_flushRows) || (pendingRows() > 0 && m_flushTimer.elapsed() >= m_flushMilliseconds))
+            flushPendingRows();
     }
 
-    // After the loop, close the file if it is still open
+    // After the loop, write what is still in memory and close the file if it is still open
+    if (m_poseLog.isOpen())
+    {
+        m_poseLog.close();
+    }
+    if (m_csv)
+    {
+        m_csv->flush();
+        m_csv.reset();
+    }
     if (m_file.isOpen())
     {
         m_file.close();
     }
 
+    // Tell how the queue behaved, so we know if the disk was too slow during the recording
+    SpscQueueStats stats = m_dataQueue.stats();
+    qDebug() << "DataWriter::processQueue() queue: pushed" << stats.pushed << "rows, high-water mark" << stats.highWater
+             << "of" << stats.capacity << ", blocked" << stats.blocked << "times";
+    if (stats.dropped > 0)
+        qWarning() << "DataWriter::processQueue()" << stats.dropped << "rows were dropped because the queue was full.";
+
     qDebug() << "DataWriter::processQueue() emitting finished signal.";
     emit finished(); // Emit the finished signal to indicate that the writing process is complete
 }
@@ -3,11 +3,16 @@
 
 #include <QObject>
 #include <QFile>
-#include <QTextStream>
 #include <QMutex>
-#include <QQueue>
-#include <QWaitCondition>
 #include <QStringList>
+#include <QElapsedTimer>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+#include "poselog.h"
+#include "csvrowwriter.h"
+#include "spscqueue.h"
 
 /**
  * @brief DataWriter class implementation.
@@ -16,6 +21,15 @@
  * It operates in a separate thread to ensure that file writing operations do not block the main application thread.
  * The class handles starting and stopping the writing process, manages a queue of data to be written,
  * and ensures that data is written safely using mutexes to prevent race conditions.
+ *
+ * The rows are numbers (timestamps and poses), and they can be written in two formats. Format::Binary (the default)
+ * writes a columnar binary pose log (see PoseLogWriter), Format::CSV writes the old CSV text file (see CsvRowWriter).
+ * In both formats, the rows are kept in memory and written in one go every N rows or every T milliseconds, whichever
+ * comes first.
+ *
+ * The rows go from the producer (the recorder) to the writing thread through a bounded lock-free queue (see
+ * SpscQueue), so a slow disk can't make the memory grow forever. What happens when the queue is full is decided by
+ * the overflow policy (setQueuePolicy()), and queueStats() tells how deep the queue got and how many rows were dropped.
  */
 
 class DataWriter : public QObject
@@ -34,6 +48,46 @@ public:
      */
     ~DataWriter();
 
+    /**
+     * @brief The output formats of the DataWriter.
+     */
+    enum class Format
+    {
+        Binary, //!< Columnar binary pose log (.poselog), convert it to CSV offline with the poselog2csv tool
+        CSV     //!< Plain CSV text
+    };
+
+    /**
+     * @brief Sets the output format. It has to be set before writeHeader() is called.
+     */
+    void setFormat(Format format);
+
+    /**
+     * @brief GET the output format.
+     */
+    Format format();
+
+    /**
+     * @brief Sets how often the rows that are kept in memory are written to the file.
+     * @param rows The rows are written when this many rows are collected.
+     * @param milliseconds The rows are written when the oldest row in memory is this old, even if there are fewer rows.
+     */
+    void setFlushPolicy(int rows, int milliseconds);
+
+    /**
+     * @brief Sets the size of the queue and what happens when it is full. It has to be set before startWriting() is called.
+     * @param policy DropNewest (default, the new row is dropped), Block (the producer sleeps a bit) or DropOldest. With
+     *        DropOldest, a row whose frame AmodeMocapRecorder already gave to AmodeFrameWriter can go, so the rows don't
+     *        match the frames anymore.
+     * @param capacity Number of rows the queue can hold.
+     */
+    void setQueuePolicy(OverflowPolicy policy, int capacity);
+
+    /**
+     * @brief GET the counters of the queue (depth, high-water mark, dropped rows, ...).
+     */
+    SpscQueueStats queueStats() const;
+
     /**
      * @brief Sets the file name where data will be saved.
      *
@@ -43,22 +97,31 @@ public:
     void setFileName(const QString &fileName);
 
     /**
-     * @brief Writes the CSV header to the file.
+     * @brief Writes the header (the schema) to the file.
      *
      * This function opens the file for writing if it is not already open, and then writes the provided header.
      * It uses a mutex lock to ensure that file operations are safe from race conditions.
-     * @param header A QStringList containing the column headers for the CSV file.
+     * @param header A QStringList containing the column names. Every row must have the same number of values.
      */
     void writeHeader(const QStringList &header);
 
     /**
      * @brief Adds a new data row to the queue for writing.
      *
-     * This function enqueues the provided data for writing to the file later.
-     * It uses a mutex lock to ensure that access to the data queue is safe from race conditions.
-     * @param data A QStringList containing the data to be written as a new row in the CSV file.
+     * This function enqueues the provided data for writing to the file later. The row is copied into a preallocated
+     * slot of the queue, it must be called from one thread only (the producer).
+     * @param data The values of the new row, one value for each column of the header.
+     * @return false if the queue was full and the row was dropped.
+     */
+    bool enqueueData(const std::vector<double> &data);
+
+    /**
+     * @brief Whether the next enqueueData() is sure to take the row (there is a free slot in the queue).
+     *
+     * Only the producer calls this, the slot stays free until its next enqueueData(). The recorder checks it before it
+     * gives the frame of the row to AmodeFrameWriter, so a frame is never written without its row.
      */
-    void enqueueData(const QStringList &data);
+    bool canEnqueueData() const;
 
 public slots:
     /**
@@ -93,12 +156,27 @@ private slots:
     void processQueue();
 
 private:
-    QFile m_file;                       //!< The CSV file to write to.
-    QTextStream m_stream;               //!< Stream to write text data to the file.
-    QMutex m_mutex;                     //!< Ensures thread safety when accessing the file.
-    QWaitCondition m_condition;         //!< Manage access to the queue.
-    QQueue<QStringList> m_dataQueue;    //!< Store data rows in a Queue.
-    bool m_isWriting;                   //!< Indicates if writing is in progress.
+    /**
+     * @brief GET the number of rows that are in memory and not written to the file yet.
+     */
+    std::size_t pendingRows() const;
+
+    /**
+     * @brief Writes the rows that are in memory to the file.
+     */
+    void flushPendingRows();
+
+    QFile m_file;                               //!< The CSV file to write to.
+    std::unique_ptr<CsvRowWriter> m_csv;        //!< Formats the rows of the CSV file and writes them in batches (CSV format).
+    PoseLogWriter m_poseLog;                    //!< The binary pose log writer (binary format).
+    QMutex m_mutex;                             //!< Ensures thread safety when accessing the file.
+    SpscQueue<std::vector<double>> m_dataQueue; //!< Bounded queue of data rows, from the producer to the writing thread.
+    std::atomic<bool> m_isWriting;              //!< Indicates if writing is in progress.
+
+    Format m_format;                            //!< The output format.
+    int m_flushRows;                            //!< Write the rows in memory to the file every this many rows.
+    int m_flushMilliseconds;                    //!< Write the rows in memory to the file at least every this many milliseconds.
+    QElapsedTimer m_flushTimer;                 //!< Time since the rows in memory were last written.
 };
 
 #endif // DATAWRITER_H
@@ -0,0 +1,120 @@
+#include "framebufferpool.h"
+
+#include <iostream>
+#include <cstring>
+#include <new>
+
+// Buffers are aligned to a cache line, so a frame never shares a line with the next one
+static constexpr std::size_t BUFFER_ALIGNMENT = 64;
+
+FrameBufferPool::FrameBufferPool()
+    : bufferBytes_(0),
+    stride_(0),
+    buffersPerSlab_(0),
+    maxSlabs_(0),
+    nextFresh_(0),
+    inUse_(0)
+{
+}
+
+bool FrameBufferPool::reset(std::size_t bufferBytes, std::size_t buffersPerSlab, std::size_t maxSlabs)
+{
+    clear();
+
+    if (bufferBytes == 0 || buffersPerSlab == 0 || maxSlabs == 0)
+    {
+        std::cerr << "FrameBufferPool::reset() Invalid geometry." << std::endl;
+        return false;
+    }
+
+    bufferBytes_    = bufferBytes;
+    stride_         = (bufferBytes + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+    buffersPerSlab_ = buffersPerSlab;
+    maxSlabs_       = maxSlabs;
+
+    // the free list never has more entries than the buffers we can ever allocate, so reserve that and it never grows
+    // later (it is only pointers)
+    slabs_.reserve(maxSlabs_);
+    free_.reserve(buffersPerSlab_ * maxSlabs_);
+
+    return addSlab();
+}
+
+void FrameBufferPool::clear()
+{
+    slabs_.clear();
+    free_.clear();
+    nextFresh_ = 0;
+    inUse_     = 0;
+}
+
+bool FrameBufferPool::addSlab()
+{
+    if (slabs_.size() >= maxSlabs_)
+        return false;
+
+    // one extra alignment unit, so the first buffer can start on a 64 byte boundary
+    std::unique_ptr<uint8_t[]> slab(new (std::nothrow) uint8_t[stride_ * buffersPerSlab_ + BUFFER_ALIGNMENT]);
+    if (!slab)
+    {
+        std::cerr << "FrameBufferPool::addSlab() Out of memory for " << buffersPerSlab_ << " buffers of " << bufferBytes_ << " bytes." << std::endl;
+        return false;
+    }
+
+    // touch every page now, so the page faults happen here and not when the frames come
+    std::memset(slab.get(), 0, stride_ * buffersPerSlab_ + BUFFER_ALIGNMENT);
+
+    slabs_.push_back(std::move(slab));
+    nextFresh_ = 0;
+    return true;
+}
+
+uint8_t *FrameBufferPool::acquire()
+{
+    if (slabs_.empty())
+        return nullptr;
+
+    // a buffer that was used before, its pages are warm
+    if (!free_.empty())
+    {
+        uint8_t *buffer = free_.back();
+        free_.pop_back();
+        inUse_++;
+        return buffer;
+    }
+
+    // the last slab is completely handed out, grow if we may
+    if (nextFresh_ == buffersPerSlab_ && !addSlab())
+        return nullptr;
+
+    uint8_t *base = slabs_.back().get();
+    base += (BUFFER_ALIGNMENT - reinterpret_cast<std::uintptr_t>(base) % BUFFER_ALIGNMENT) % BUFFER_ALIGNMENT;
+    uint8_t *buffer = base + nextFresh_ * stride_;
+    nextFresh_++;
+    inUse_++;
+    return buffer;
+}
+
+void FrameBufferPool::release(uint8_t *buffer)
+{
+    if (buffer == nullptr)
+        return;
+
+    free_.push_back(buffer);
+    inUse_--;
+}
+
+std::size_t FrameBufferPool::bufferBytes() const
+{
+    return bufferBytes_;
+}
+
+std::size_t FrameBufferPool::allocatedBuffers() const
+{
+    return slabs_.size() * buffersPerSlab_;
+}
+
+std::size_t FrameBufferPool::buffersInUse() const
+{
+    return inUse_;
+}
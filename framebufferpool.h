@@ -0,0 +1,100 @@
+#ifndef FRAMEBUFFERPOOL_H
+#define FRAMEBUFFERPOOL_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @class FrameBufferPool
+ * @brief Hands out fixed-size frame buffers that are carved from a few big preallocated slabs.
+ *
+ * For the context. Every A-mode frame (~210KB) and every B-mode frame (~750KB) used to be a fresh heap allocation
+ * (cv::Mat::clone(), copyTo() into an empty cv::Mat, a new std::vector, ...). At 50-200Hz that is a lot of
+ * allocations and page faults on the per-frame path, and after a long session the heap is badly fragmented. Here the
+ * size of a frame is known from the stream geometry, so all the buffers are allocated at once, touched once (so the
+ * pages are already mapped when the first frame comes), and then reused forever.
+ *
+ * The usage is like this:
+ *
+ *   FrameBufferPool pool;
+ *   pool.reset(rows*cols*sizeof(uint16_t), 64);     // 64 buffers, allocated here
+ *   uint8_t *buffer = pool.acquire();                // no allocation
+ *   ...
+ *   pool.release(buffer);                            // the buffer can be acquired again
+ *
+ * If maxSlabs is more than 1, the pool grows by one slab (buffersPerSlab buffers) when it runs out, up to maxSlabs
+ * slabs. That is still one allocation for many frames, for when we don't know how many frames we will need (e.g. the
+ * frames that are kept until the end of a recording). If it can't grow anymore, acquire() returns nullptr.
+ *
+ * The buffers are aligned to 64 bytes. The pool is not thread-safe; if two threads use it, they must be synchronized
+ * by something else (e.g. the buffers are passed around through an SpscQueue, and acquire/release happen on one side).
+ */
+class FrameBufferPool
+{
+public:
+
+    /**
+     * @brief Constructor function, the pool is empty until reset() is called.
+     */
+    FrameBufferPool();
+
+    /**
+     * @brief Frees all the slabs and allocates the first one with the new geometry. All the buffers that were handed
+     * out before become invalid.
+     * @param bufferBytes Size of one buffer (one frame).
+     * @param buffersPerSlab Number of buffers in one slab.
+     * @param maxSlabs Maximum number of slabs the pool can grow to, 1 means a fixed-size pool.
+     * @return false if the geometry is invalid.
+     */
+    bool reset(std::size_t bufferBytes, std::size_t buffersPerSlab, std::size_t maxSlabs = 1);
+
+    /**
+     * @brief Frees all the slabs.
+     */
+    void clear();
+
+    /**
+     * @brief Takes a buffer from the pool.
+     * @return Pointer to bufferBytes() bytes, or nullptr if the pool is exhausted.
+     */
+    uint8_t *acquire();
+
+    /**
+     * @brief Gives a buffer back to the pool. The pointer must come from acquire() of this pool.
+     */
+    void release(uint8_t *buffer);
+
+    /**
+     * @brief GET the size of one buffer in bytes.
+     */
+    std::size_t bufferBytes() const;
+
+    /**
+     * @brief GET the number of buffers that are allocated (in all the slabs so far).
+     */
+    std::size_t allocatedBuffers() const;
+
+    /**
+     * @brief GET the number of buffers that are handed out and not released yet.
+     */
+    std::size_t buffersInUse() const;
+
+private:
+    /**
+     * @brief Allocates one more slab and touches its pages.
+     */
+    bool addSlab();
+
+    std::size_t bufferBytes_;                           //!< Size of one buffer, as requested
+    std::size_t stride_;                                //!< Distance between two buffers, bufferBytes_ rounded up to 64
+    std::size_t buffersPerSlab_;                        //!< Number of buffers in one slab
+    std::size_t maxSlabs_;                              //!< Maximum number of slabs
+    std::vector<std::unique_ptr<uint8_t[]>> slabs_;     //!< The slabs (the memory)
+    std::vector<uint8_t*> free_;                        //!< Released buffers, ready to be acquired again
+    std::size_t nextFresh_;                             //!< Buffers in the last slab that were never handed out start here
+    std::size_t inUse_;                                 //!< Number of buffers handed out
+};
+
+#endif // FRAMEBUFFERPOOL_H
@@ -0,0 +1,173 @@
+#ifndef LATESTMAILBOX_H
+#define LATESTMAILBOX_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+
+/**
+ * @brief A snapshot of the counters of a LatestMailbox.
+ */
+struct LatestMailboxStats
+{
+    std::size_t posted      = 0;    //!< Number of items the producer put in the mailbox
+    std::size_t taken       = 0;    //!< Number of items the consumer took
+    std::size_t overwritten = 0;    //!< Number of items that were replaced by a newer one before the consumer took them
+};
+
+/**
+ * @class LatestMailbox
+ * @brief Lock-free single slot for one producer thread and one consumer thread, the newest item always wins.
+ *
+ * For the context. A queue (SpscQueue) is right when every item has to arrive, like the writers. For a visualization
+ * it is the opposite: if the consumer is slower than the producer, it should skip what it missed and show the newest
+ * item, never work through old ones. Here the producer just overwrites, and the consumer always gets the latest item.
+ *
+ * It is a triple buffer. The producer has one slot (to fill), the consumer has one slot (to read), and the third one
+ * is in the middle. post() fills the slot of the producer and swaps it with the middle one, take() swaps the slot of
+ * the consumer with the middle one if there is something new there. The index of the middle slot and the "new" flag
+ * are one atomic, so a swap is one exchange, nobody ever waits for the other thread, and nobody ever touches the slot
+ * of the other thread. The slots are reused forever, the memory of the items too (e.g. a QVector of the same size).
+ *
+ * The consumer can sleep in waitForData() when there is nothing new. Like in SpscQueue, the producer only touches the
+ * mutex to wake it up when the consumer is really sleeping.
+ *
+ * The usage is like this:
+ *
+ *   LatestMailbox<Frame> mailbox;
+ *
+ *   // producer thread
+ *   mailbox.post([&](Frame &slot){ slot.signal = signal; slot.pose = pose; });
+ *
+ *   // consumer thread
+ *   while (running) {
+ *       if (!mailbox.take()) { mailbox.waitForData(std::chrono::milliseconds(100)); continue; }
+ *       ... use mailbox.latest() ...
+ *   }
+ */
+template <typename T>
+class LatestMailbox
+{
+public:
+
+    LatestMailbox() = default;
+    LatestMailbox(const LatestMailbox&) = delete;
+    LatestMailbox &operator=(const LatestMailbox&) = delete;
+
+    /**
+     * @brief Puts a new item in the mailbox, replacing the one that is there if the consumer didn't take it yet.
+     * Only the producer thread calls this.
+     * @param fill Function that receives the slot (T&) and copies the new item into it.
+     */
+    template <typename Fill>
+    void post(Fill &&fill)
+    {
+        fill(slots_[back_]);
+
+        // publish our slot, and get the previous middle one to fill next time
+        unsigned previous = middle_.exchange(back_ | FRESH, std::memory_order_acq_rel);
+        back_ = previous & INDEX;
+        posted_.fetch_add(1, std::memory_order_relaxed);
+        if (previous & FRESH)
+            overwritten_.fetch_add(1, std::memory_order_relaxed);
+
+        // only bother the mutex if the consumer is sleeping
+        if (consumerWaiting_.load(std::memory_order_seq_cst))
+            wakeConsumer();
+    }
+
+    /**
+     * @brief Takes the newest item, it is latest() until the next take(). Only the consumer thread calls this.
+     * @return false if nothing new was posted since the last take() (latest() stays the previous item).
+     */
+    bool take()
+    {
+        if (!hasNew())
+            return false;
+
+        // only the producer sets the flag, so it is still there, and the exchange clears it
+        unsigned previous = middle_.exchange(front_, std::memory_order_acq_rel);
+        front_ = previous & INDEX;
+        taken_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * @brief GET the item of the last take(). Only the consumer thread calls this.
+     */
+    const T &latest() const
+    {
+        return slots_[front_];
+    }
+
+    /**
+     * @brief GET whether something was posted since the last take().
+     */
+    bool hasNew() const
+    {
+        return (middle_.load(std::memory_order_seq_cst) & FRESH) != 0;
+    }
+
+    /**
+     * @brief Sleeps until the producer posts something, wakeConsumer() is called, or the timeout passes.
+     * Only the consumer thread calls this.
+     * @return true if there is something new.
+     */
+    bool waitForData(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(waitMutex_);
+        consumerWaiting_.store(true, std::memory_order_seq_cst);
+
+        // check again after the flag is set, the producer may have posted just before
+        if (!hasNew())
+        {
+            waitCondition_.wait_for(lock, timeout);
+        }
+
+        consumerWaiting_.store(false, std::memory_order_relaxed);
+        return hasNew();
+    }
+
+    /**
+     * @brief Wakes up the consumer if it is sleeping in waitForData() (e.g. to tell it to stop).
+     */
+    void wakeConsumer()
+    {
+        std::lock_guard<std::mutex> lock(waitMutex_);
+        waitCondition_.notify_one();
+    }
+
+    /**
+     * @brief GET a snapshot of the counters.
+     */
+    LatestMailboxStats stats() const
+    {
+        LatestMailboxStats s;
+        s.posted      = posted_.load(std::memory_order_relaxed);
+        s.taken       = taken_.load(std::memory_order_relaxed);
+        s.overwritten = overwritten_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+
+    static constexpr unsigned INDEX = 3;                //!< The bits of middle_ that are the index of the slot
+    static constexpr unsigned FRESH = 4;                //!< The bit of middle_ that says the producer put something new there
+
+    T slots_[3];                                        //!< The three slots, allocated once
+    unsigned back_ = 0;                                 //!< The slot of the producer, only the producer touches it
+    unsigned front_ = 1;                                //!< The slot of the consumer, only the consumer touches it
+    alignas(64) std::atomic<unsigned> middle_{2};       //!< The slot in the middle (and FRESH), on its own cache line
+
+    std::atomic<std::size_t> posted_{0};                //!< Counters for the stats
+    std::atomic<std::size_t> taken_{0};
+    std::atomic<std::size_t> overwritten_{0};
+
+    std::atomic<bool> consumerWaiting_{false};          //!< True while the consumer sleeps in waitForData()
+    std::mutex waitMutex_;                              //!< Only used to sleep and wake up the consumer
+    std::condition_variable waitCondition_;             //!< Only used to sleep and wake up the consumer
+};
+
+#endif // LATESTMAILBOX_H
@@ -0,0 +1,186 @@
+#include "livevolumereconstructor.h"
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
+
+#include <iostream>
+
+// Number of images that can wait for the reconstruction thread (~24MB for the 840x900 B-mode images), a frame takes
+// a few milliseconds, so this is only full if the machine is really busy
+static constexpr std::size_t LIVEQUEUE_CAPACITY = 32;
+// How long the reconstruction thread sleeps at most when the queue is empty
+static constexpr int LIVERECONSTRUCTOR_IDLE_MILLISECONDS = 50;
+// How often the volume of the sweep so far is sent to be shown (at most, it waits until the previous one is shown)
+static constexpr int LIVE_SNAPSHOT_MILLISECONDS = 1000;
+
+
+LiveVolumeReconstructor::LiveVolumeReconstructor(QObject *parent, const VolumeReconstructor::Config& config)
+    : QObject{parent},
+    reconstructor_(config),
+    snapshotReconstructor_(config),
+    frameQueue_(LIVEQUEUE_CAPACITY, OverflowPolicy::DropNewest)
+{
+}
+
+LiveVolumeReconstructor::~LiveVolumeReconstructor()
+{
+    // the thread might still send a volume in finish(), it is deleted by the receiver anyway
+    running_ = false;
+    if (thread_) {
+        frameQueue_.wakeConsumer();
+        thread_->wait();
+        delete thread_;
+        thread_ = nullptr;
+    }
+}
+
+void LiveVolumeReconstructor::setTransformationID(std::string bmodeprobe_transformationID, std::string bmoderef_transformationID)
+{
+    bmodeprobe_transformationID_ = bmodeprobe_transformationID;
+    bmoderef_transformationID_ = bmoderef_transformationID;
+}
+
+void LiveVolumeReconstructor::onImageReceived(const cv::Mat &image) {
+    // the same soft-synchronization as MHAWriter, so the live volume is made of the same pairs as the recording
+    if (latestTransform_probe) {
+        storeDataPair(image, *latestTransform_probe, *latestTransform_ref);
+        resetData();
+    } else {
+        latestImage = image;
+    }
+}
+
+void LiveVolumeReconstructor::onRigidBodyReceived(const QualisysTransformationManager &tmanager) {
+    if (latestImage) {
+        storeDataPair(*latestImage, tmanager.getTransformationById(bmodeprobe_transformationID_), tmanager.getTransformationById(bmoderef_transformationID_));
+        resetData();
+    } else {
+        latestTransform_probe = tmanager.getTransformationById(bmodeprobe_transformationID_);
+        latestTransform_ref = tmanager.getTransformationById(bmoderef_transformationID_);
+    }
+}
+
+void LiveVolumeReconstructor::resetData() {
+    latestImage.reset();
+    latestTransform_probe.reset();
+    latestTransform_ref.reset();
+}
+
+void LiveVolumeReconstructor::storeDataPair(const cv::Mat& image, const Eigen::Isometry3d& transform_probe, const Eigen::Isometry3d& transform_ref)
+{
+    if (finished_) return;
+    if (!thread_ && !startThread(image)) return;
+
+    // the reconstruction needs 8 bit images of the same size as the first one
+    if (image.cols != imageWidth_ || image.rows != imageHeight_ || image.type() != CV_8UC1) {
+        skippedImages_++;
+        return;
+    }
+
+    // ProbeToReference here, the calibration (ImageToProbe) is added in the thread. The marker was not seen -> NaN,
+    // the thread skips it.
+    const Eigen::Matrix4d probeToReference = (transform_ref.inverse() * transform_probe).matrix();
+    bool queued = frameQueue_.push([&](LiveFrame &slot) {
+        image.copyTo(slot.image);
+        slot.imageToReference = probeToReference;
+    });
+    if (!queued) skippedImages_++;
+}
+
+bool LiveVolumeReconstructor::startThread(const cv::Mat& image)
+{
+    if (image.empty() || image.type() != CV_8UC1)
+        return false;
+
+    imageWidth_  = image.cols;
+    imageHeight_ = image.rows;
+
+    // one buffer for every slot of the queue, plus one for the image that the thread is compounding
+    std::size_t imageBytes = image.total() * image.elemSize();
+    if (!imagePool_.reset(imageBytes, frameQueue_.capacity() + 1)) {
+        std::cerr << "LiveVolumeReconstructor::startThread() Failed to allocate the image buffers." << std::endl;
+        return false;
+    }
+    frameQueue_.initializeSlots([&](LiveFrame &slot) {
+        slot.image = cv::Mat(imageHeight_, imageWidth_, CV_8UC1, imagePool_.acquire());
+    });
+    currentFrame_.image = cv::Mat(imageHeight_, imageWidth_, CV_8UC1, imagePool_.acquire());
+
+    running_ = true;
+    snapshotTimer_.start();
+    thread_  = QThread::create([this]() { reconstructFrames(); });
+    thread_->start();
+    return true;
+}
+
+void LiveVolumeReconstructor::finish()
+{
+    finished_ = true;
+    resetData();
+    if (!thread_) return;
+
+    // the thread compounds what is still in the queue and sends the last volume, then it exits
+    running_ = false;
+    frameQueue_.wakeConsumer();
+    thread_->wait();
+    delete thread_;
+    thread_ = nullptr;
+
+    if (skippedImages_ > 0)
+        std::cerr << "LiveVolumeReconstructor::finish() " << skippedImages_ << " images were not compounded (different size, or too slow)." << std::endl;
+}
+
+void LiveVolumeReconstructor::snapshotShown()
+{
+    snapshotPending_ = false;
+}
+
+void LiveVolumeReconstructor::reconstructFrames()
+{
+    const Eigen::Matrix4d imageToProbe = reconstructor_.getConfig().imageToProbe;
+
+    while (true) {
+        if (frameQueue_.pop(currentFrame_)) {
+            const cv::Mat &image = currentFrame_.image;
+            if (reconstructor_.addFrame(image.data, image.cols, image.rows, currentFrame_.imageToReference * imageToProbe))
+                framesSinceSnapshot_++;
+        } else {
+            // nothing to compound, and no more images will come, the last volume and we are done
+            if (!running_ && frameQueue_.empty())
+                break;
+            frameQueue_.waitForData(std::chrono::milliseconds(LIVERECONSTRUCTOR_IDLE_MILLISECONDS));
+        }
+
+        // every now and then the volume so far, if the previous one is already on the screen
+        if (framesSinceSnapshot_ > 0 && !snapshotPending_ && snapshotTimer_.elapsed() >= LIVE_SNAPSHOT_MILLISECONDS)
+            sendSnapshot(false);
+    }
+
+    // no more images, the last volume is made right here
+    if (framesSinceSnapshot_ > 0)
+        sendSnapshot(true);
+    snapshotFuture_.waitForFinished();
+}
+
+void LiveVolumeReconstructor::sendSnapshot(bool wait)
+{
+    // the previous worker is done (the volume was shown), the copy is ours again
+    snapshotFuture_.waitForFinished();
+    reconstructor_.copyLiveVolume(snapshotReconstructor_);
+    framesSinceSnapshot_ = 0;
+    snapshotTimer_.restart();
+
+    snapshotPending_ = true;
+    if (wait) makeSnapshot();
+    else snapshotFuture_ = QtConcurrent::run([this]() { makeSnapshot(); });
+}
+
+void LiveVolumeReconstructor::makeSnapshot()
+{
+    MHAReader::MHAHeader header;
+    BrickedVolume volume;
+    if (!snapshotReconstructor_.snapshot(header, volume)) {
+        snapshotPending_ = false;
+        return;
+    }
+    emit volumeUpdated(new MHAReader(header, std::move(volume)));
+}
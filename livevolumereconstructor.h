@@ -0,0 +1,158 @@
+#ifndef LIVEVOLUMERECONSTRUCTOR_H
+#define LIVEVOLUMERECONSTRUCTOR_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QFuture>
+
+#include <string>
+#include <optional>
+#include <atomic>
+
+#include <Eigen/Geometry>
+#include <opencv2/opencv.hpp>
+
+#include "qualisystransformationmanager.h"
+#include "framebufferpool.h"
+#include "spscqueue.h"
+#include "volumereconstructor.h"
+
+class QThread;
+
+
+/**
+ * @class LiveVolumeReconstructor
+ * @brief Reconstructs the volume while the user is still sweeping, so the gaps in the coverage are seen immediately.
+ *
+ * For the context. Normally the user records the sweep (MHAWriter), stops, reconstructs and loads the volume, and only
+ * then sees that a part of the bone was not covered. This class gets the same pairs of image and transformation as
+ * MHAWriter (the same two slots and the same soft-synchronization), and every pair is compounded into the sparse
+ * volume of a VolumeReconstructor (VolumeReconstructor::addFrame()) in a background thread.
+ *
+ * The images go to the thread through an SpscQueue with preallocated buffers (FrameBufferPool), like in MHAWriter. If
+ * the thread can't keep up, the newest images are skipped, it is only a preview. Every LIVE_SNAPSHOT_MILLISECONDS the
+ * thread copies the bricks that changed to a second VolumeReconstructor (VolumeReconstructor::copyLiveVolume()), and a
+ * worker makes a bricked volume of it (VolumeReconstructor::snapshot()) and sends it with volumeUpdated(). So the thread
+ * keeps taking images from the queue while the volume is made. That only happens if the previous one was
+ * already shown (snapshotShown()), so the GUI never gets behind.
+ *
+ */
+
+class LiveVolumeReconstructor : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    /**
+     * @brief Constructor function, requires the calibration and the parameters of the reconstruction
+     */
+    explicit LiveVolumeReconstructor(QObject *parent, const VolumeReconstructor::Config& config);
+
+    /**
+     * @brief Destructor function, stops the reconstruction thread
+     */
+    ~LiveVolumeReconstructor();
+
+    /**
+     * @brief SET the transformation ID for bmode probe and bmode reference (marker on the phantom)
+     */
+    void setTransformationID(std::string bmodeprobe_transformationID, std::string bmoderef_transformationID);
+
+    /**
+     * @brief Stops taking images, the thread compounds what is still in the queue and sends the last volume
+     */
+    void finish();
+
+public slots:
+
+    /**
+     * @brief slot function, will be called when an image is received, needs to be connected to signal from BmodeConnection::imageProcessed
+     */
+    void onImageReceived(const cv::Mat &image);
+
+    /**
+     * @brief slot function, will be called when transformations in a timestamp are received, needs to be connected to signal from QualisysConnection::dataReceived class
+     */
+    void onRigidBodyReceived(const QualisysTransformationManager &tmanager);
+
+    /**
+     * @brief The last volume of volumeUpdated() is shown, the next one may come
+     */
+    void snapshotShown();
+
+signals:
+
+    /**
+     * @brief A new volume of the sweep so far. The receiver owns it (and deletes it).
+     */
+    void volumeUpdated(MHAReader *volume);
+
+private:
+
+    /**
+     * @brief One image with its ImageToReference, a slot of the queue (the cv::Mat is a header over a buffer of imagePool_)
+     */
+    struct LiveFrame {
+        cv::Mat image;
+        Eigen::Matrix4d imageToReference;
+    };
+
+    /**
+     * @brief handles pair of data (soft-synchronization), puts it in the queue
+     */
+    void storeDataPair(const cv::Mat& image, const Eigen::Isometry3d& transform_probe, const Eigen::Isometry3d& transform_ref);
+
+    /**
+     * @brief reset the pair of data (soft-synchronization)
+     */
+    void resetData();
+
+    /**
+     * @brief prepares the queue and starts the reconstruction thread (on the first image)
+     */
+    bool startThread(const cv::Mat& image);
+
+    /**
+     * @brief the loop of the reconstruction thread
+     */
+    void reconstructFrames();
+
+    /**
+     * @brief copies the sweep so far for makeSnapshot() and starts it in a worker, or waits for it if wait (in the
+     * reconstruction thread)
+     */
+    void sendSnapshot(bool wait);
+
+    /**
+     * @brief makes a bricked volume of the copy of the sweep and sends it (in the worker)
+     */
+    void makeSnapshot();
+
+    VolumeReconstructor reconstructor_;                         //!< The sparse volume, only touched by the reconstruction thread.
+    VolumeReconstructor snapshotReconstructor_;                 //!< The copy of the sparse volume that makeSnapshot() looks at.
+    QFuture<void> snapshotFuture_;                              //!< The worker of makeSnapshot(), only one at a time.
+
+    // soft-synchronization, like MHAWriter
+    std::optional<cv::Mat> latestImage;                         //!< The latest image comes from streaming.
+    std::optional<Eigen::Isometry3d> latestTransform_probe;     //!< The latest probe transformation.
+    std::optional<Eigen::Isometry3d> latestTransform_ref;       //!< The latest of reference transformation.
+    std::string bmodeprobe_transformationID_ = "B_N_PRB";       //!< Default indentifier for B-mode probe rigid body transformation from the Mocap system
+    std::string bmoderef_transformationID_   = "B_N_REF";       //!< Default indentifier for Reference rigid body transformation from the Mocap system
+
+    // the images on their way to the reconstruction thread
+    SpscQueue<LiveFrame>           frameQueue_;                 //!< From the receiving thread to the reconstruction thread.
+    FrameBufferPool                imagePool_;                  //!< The memory of the images in the queue.
+    LiveFrame                      currentFrame_;               //!< The image the reconstruction thread is compounding.
+    QThread*                       thread_ = nullptr;           //!< The reconstruction thread, started with the first image.
+    std::atomic<bool>              running_{false};             //!< Tells the reconstruction thread to keep waiting for images.
+    std::atomic<bool>              snapshotPending_{false};     //!< A volume was sent and is not shown yet.
+    bool                           finished_ = false;           //!< finish() was called, the images are ignored.
+    int                            imageWidth_ = 0;             //!< Geometry of the images (from the first image), every image must have it.
+    int                            imageHeight_ = 0;
+    std::size_t                    skippedImages_ = 0;          //!< Images that were not compounded (different geometry, or the queue was full).
+    QElapsedTimer                  snapshotTimer_;              //!< Time since the last volume was sent.
+    std::size_t                    framesSinceSnapshot_ = 0;    //!< Frames compounded since the last volume was sent.
+};
+
+#endif // LIVEVOLUMERECONSTRUCTOR_H
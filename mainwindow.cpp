@@ -3,12 +3,13 @@
 
 #include <opencv2/imgproc.hpp>
 #include <QMessageBox>
-#include <QProcess>
+#include <QtConcurrent/QtConcurrent>
 
 #include <regex>
 #include "qualisystransformationmanager.h"
 #include "amodedatamanipulator.h"
 #include "ultrasoundconfig.h"
+#include "csvrowwriter.h"
 
 #include <Qt3DExtras/Qt3DWindow>
 #include <QtWidgets/QHBoxLayout>
@@ -40,6 +41,8 @@ MainWindow::MainWindow(QWidget *parent)
     amodePlot->yAxis->setRange(-500, 7500);
     amodePlot->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
     ui->gridLayout_amodeSignals->addWidget(amodePlot);
+    // The slice of the volume along the holder is only there when there is a volume and a 3D signal
+    ui->label_amodeReslice->hide();
 
     // Initalize scatter object (for display too, looks good rather than empty)
     scatter = new Q3DScatter();
@@ -93,6 +96,10 @@ MainWindow::MainWindow(QWidget *parent)
     // Connect the button's clicked signal to the slot that opens the second window
     connect(ui->pushButton_recordWindow, &QPushButton::clicked, this, &MainWindow::openMeasurementWindow);
 
+    // Show the reconstructed volume when the background reconstruction is done
+    connect(&volumeReconstructionWatcher, &QFutureWatcher<MHAReader*>::finished, this, &MainWindow::volumeReconstructionFinished);
+    connect(&mhaWritingWatcher, &QFutureWatcher<int>::finished, this, &MainWindow::mhaWritingFinished);
+
 
     // Show the main window first
     this->show();
@@ -113,6 +120,11 @@ MainWindow::MainWindow(QWidget *parent)
 
 MainWindow::~MainWindow()
 {
+    // a reconstruction that is still running reads the recording, wait for it (and for the recording to be written)
+    volumeReconstructionWatcher.waitForFinished();
+    mhaWritingWatcher.waitForFinished();
+    // the live reconstruction has its own thread, stop it
+    delete myLiveVolumeReconstructor;
     delete ui;
 }
 
@@ -648,11 +660,32 @@ void MainWindow::on_pushButton_mhaRecord_clicked()
         // instantiate new mhawriter, with the file name from textfield
         myMHAWriter = new MHAWriter(nullptr, filepath, "SequenceRecording");
         myMHAWriter->setTransformationID("B_N_PRB", "B_N_REF");
+        // compress the images in the file (zlib, like Plus does), the sequence files get a lot smaller
+        myMHAWriter->setCompression(true);
         // start record (for the moment, inside this function is just a bool indicating that we are recording)
         myMHAWriter->startRecord();
         // connect the bmode and qualisys signal data to the mhawriter data receiving slot
         connect(myBmodeConnection, &BmodeConnection::imageProcessed, myMHAWriter, &MHAWriter::onImageReceived);
         connect(myMocapConnection, &MocapConnection::dataReceived, myMHAWriter, &MHAWriter::onRigidBodyReceived);
+
+        // reconstruct while recording, if the user wants to see the volume grow
+        if(ui->checkBox_liveReconstruct->isChecked())
+        {
+            VolumeReconstructor::Config reconstructionConfig;
+            if (VolumeReconstructor::loadConfig(ui->lineEdit_volumeConfig->text().toStdString(), reconstructionConfig))
+            {
+                myLiveVolumeReconstructor = new LiveVolumeReconstructor(nullptr, reconstructionConfig);
+                isLiveVolumeFirstSnapshot = true;
+                myLiveVolumeReconstructor->setTransformationID("B_N_PRB", "B_N_REF");
+                connect(myBmodeConnection, &BmodeConnection::imageProcessed, myLiveVolumeReconstructor, &LiveVolumeReconstructor::onImageReceived);
+                connect(myMocapConnection, &MocapConnection::dataReceived, myLiveVolumeReconstructor, &LiveVolumeReconstructor::onRigidBodyReceived);
+                connect(myLiveVolumeReconstructor, &LiveVolumeReconstructor::volumeUpdated, this, &MainWindow::liveVolumeUpdated);
+            }
+            else
+            {
+                QMessageBox::warning(this, "Invalid Configuration", "Live reconstruction needs the configuration file (with the ImageToProbe calibration) in the Volume Reconstruction form. Recording without it.");
+            }
+        }
     }
     else
     {
@@ -664,32 +697,58 @@ void MainWindow::on_pushButton_mhaRecord_clicked()
         disconnect(myBmodeConnection, &BmodeConnection::imageProcessed, myMHAWriter, &MHAWriter::onImageReceived);
         disconnect(myMocapConnection, &MocapConnection::dataReceived, myMHAWriter, &MHAWriter::onRigidBodyReceived);
 
-        // tell the mhawriter object to stop recording and start writing it to the file
-        int recordstatus = myMHAWriter->stopRecord();
-        if(recordstatus==1)
+        // the live reconstruction compounds what it still has and sends the last volume
+        if(myLiveVolumeReconstructor!=nullptr)
         {
-            QMessageBox::information(this, "Writing Successful", "Writing Image Sequence (.mha) file successfull.");
-            // if successful, let's write the full path to lineEdit_volumeRecording, make user's life easier
-            ui->lineEdit_volumeRecording->setText(QString::fromStdString(myMHAWriter->getFullfilename()));
+            disconnect(myBmodeConnection, &BmodeConnection::imageProcessed, myLiveVolumeReconstructor, &LiveVolumeReconstructor::onImageReceived);
+            disconnect(myMocapConnection, &MocapConnection::dataReceived, myLiveVolumeReconstructor, &LiveVolumeReconstructor::onRigidBodyReceived);
+            myLiveVolumeReconstructor->finish();
+            delete myLiveVolumeReconstructor;
+            myLiveVolumeReconstructor = nullptr;
         }
-        else if(recordstatus==-1)
-            QMessageBox::critical(this, "Writing Error", "Error occurred writing Image Sequence (.mha) file: Error in writing header.");
-        else if(recordstatus==-2)
-            QMessageBox::critical(this, "Writing Error", "Error occurred writing Image Sequence (.mha) file: Error in writing transformations.");
-        else if(recordstatus==-3)
-            QMessageBox::critical(this, "Writing Error", "Error occurred writing Image Sequence (.mha) file: Error in writing binary images.");
-
-
-        // delete the object
-        delete myMHAWriter;
 
-        // if the user specified autoReconstruct, execute the code for volume reconstruct
-        if(ui->checkBox_autoReconstruct->isChecked()) on_pushButton_volumeReconstruct_clicked();
+        // Tell the mhawriter object to stop recording and start writing it to the file. Compressing and writing a sweep
+        // of a few GB takes a while, so it is done in the background, mhaWritingFinished() tells the user. The button
+        // waits until then, the writer can't record the next sweep before.
+        ui->pushButton_mhaRecord->setEnabled(false);
+        ui->pushButton_mhaRecord->setText("Writing...");
+        // the images and poses that were posted before the disconnect still come to the slots, the writer ignores them
+        // from now on, before stopRecord() runs in the other thread
+        MHAWriter *writer = myMHAWriter;
+        writer->stopReceiving();
+        mhaWritingWatcher.setFuture(QtConcurrent::run([writer]() { return writer->stopRecord(); }));
     }
 
     isMHArecord = !isMHArecord;
 }
 
+void MainWindow::mhaWritingFinished()
+{
+    ui->pushButton_mhaRecord->setEnabled(true);
+    ui->pushButton_mhaRecord->setText("Record");
+
+    int recordstatus = mhaWritingWatcher.result();
+    if(recordstatus==1)
+    {
+        QMessageBox::information(this, "Writing Successful", "Writing Image Sequence (.mha) file successfull.");
+        // if successful, let's write the full path to lineEdit_volumeRecording, make user's life easier
+        ui->lineEdit_volumeRecording->setText(QString::fromStdString(myMHAWriter->getFullfilename()));
+    }
+    else if(recordstatus==-1)
+        QMessageBox::critical(this, "Writing Error", "Error occurred writing Image Sequence (.mha) file: Error in writing header.");
+    else if(recordstatus==-2)
+        QMessageBox::critical(this, "Writing Error", "Error occurred writing Image Sequence (.mha) file: Error in writing transformations.");
+    else if(recordstatus==-3)
+        QMessageBox::critical(this, "Writing Error", "Error occurred writing Image Sequence (.mha) file: Error in writing binary images.");
+
+    // delete the object
+    delete myMHAWriter;
+    myMHAWriter = nullptr;
+
+    // if the user specified autoReconstruct, execute the code for volume reconstruct
+    if(ui->checkBox_autoReconstruct->isChecked()) on_pushButton_volumeReconstruct_clicked();
+}
+
 void MainWindow::on_checkBox_autoReconstruct_stateChanged(int arg1)
 {
     if(arg1)
@@ -741,36 +800,12 @@ void MainWindow::on_pushButton_volumeLoad_clicked()
     // Set the file path in the QLineEdit
     ui->lineEdit_volumeSource->setText(filePath);
 
-    // Delete everything in the scatterplot
-    for (QScatter3DSeries *series : scatter->seriesList()) {
-        scatter->removeSeries(series);
-    }
-
-    // delete the related object, somehow there is bug if i dont do this.
-    if (myMHAReader!=nullptr) delete myMHAReader;
-    if (myVolume3DController!=nullptr) delete myVolume3DController;
-
     // Instantiate MHAReader object to read the mha file (special for volume)
-    myMHAReader = new MHAReader(filePath.toStdString());
+    MHAReader *volume = new MHAReader(filePath.toStdString());
     // Read the volume image
-    myMHAReader->readVolumeImage();
-    // Instantiate Volume3DController, pass the scatter object and mhareader object so that the class can
-    // manipulate the scatter and decode the data according to the mha
-    myVolume3DController = new Volume3DController(nullptr, scatter, myMHAReader);
-
-    // set initial threshold for slider
-    std::array<int, 2> pixelintensityrange = myVolume3DController->getPixelIntensityRange();
-    int init_range     = pixelintensityrange[1] - pixelintensityrange[0];
-    int init_threshold = pixelintensityrange[0] + (init_range/2);
-    ui->horizontalSlider_volumeThreshold->setMinimum(pixelintensityrange[0]+init_range*0.1);
-    ui->horizontalSlider_volumeThreshold->setMaximum(pixelintensityrange[1]-init_range*0.1);
-    ui->horizontalSlider_volumeThreshold->setSliderPosition(init_threshold);
-    // set the label for slider
-    ui->label_volumePixelValMin->setText(QString::number(pixelintensityrange[0]+init_range*0.1));
-    ui->label_volumePixelValMax->setText(QString::number(pixelintensityrange[1]-init_range*0.1));
-
-    // Connect the slider signal to updateVolume, if the user slide the threshold, the volume also change accordingly
-    connect(ui->horizontalSlider_volumeThreshold, &QSlider::valueChanged, myVolume3DController, &Volume3DController::updateVolume);
+    volume->readVolumeImage();
+    // Show it in the scatter, instead of the previous one
+    showVolume(volume);
 }
 
 
@@ -822,6 +857,13 @@ void MainWindow::on_pushButton_volumeReconstruct_clicked()
         return;
     }
 
+    // only one reconstruction at a time, it uses all cores anyway
+    if (volumeReconstructionWatcher.isRunning())
+    {
+        QMessageBox::information(this, "Volume Reconstruction", "The previous volume is still being reconstructed, please wait until it is shown.");
+        return;
+    }
+
     // Create postfix for file naming based on time
     // Format the date and time as a string (e.g., "2024-04-22_16-18-42")
     auto now = std::chrono::system_clock::now();
@@ -835,63 +877,128 @@ void MainWindow::on_pushButton_volumeReconstruct_clicked()
     // Set the output form
     ui->lineEdit_volumeSource->setText(output_volume_file);
 
-    // ATTENTION: You need to change this absolute value
-    QString file_exe    = "C:/Users/DennisChristie/PlusApp-2.9.0.20240320-Win64/bin/VolumeReconstructor.exe";
-    QString file_config = "--config-file=" + ui->lineEdit_volumeConfig->text();
-    QString file_source = "--source-seq-file=" + ui->lineEdit_volumeRecording->text();
-    QString file_output = "--output-volume-file=" + output_volume_file;
-    QString param1      = "--image-to-reference-transform=ImageToReference";
-    QString param2      = "--disable-compression";
+    // The calibration and the parameters of the reconstruction, from the same configuration file fCal produced
+    VolumeReconstructor::Config reconstructionConfig;
+    if (!VolumeReconstructor::loadConfig(ui->lineEdit_volumeConfig->text().toStdString(), reconstructionConfig))
+    {
+        QMessageBox::warning(this, "Invalid Configuration", "The configuration file has no ImageToProbe calibration (or it can't be read).");
+        return;
+    }
 
-    // QString command     = file_exe+file_config+file_source+file_output+param1+param2;
-    // qDebug() << command;
+    // The reconstruction runs here in the background, in memory. The volume goes directly to Volume3DController when it
+    // is ready (see volumeReconstructionFinished()), the file is only written so that it can be loaded again later.
+    std::string sequence_file = ui->lineEdit_volumeRecording->text().toStdString();
+    std::string volume_file   = output_volume_file.toStdString();
+    ui->pushButton_volumeReconstruct->setEnabled(false);
+    volumeReconstructionWatcher.setFuture(QtConcurrent::run([reconstructionConfig, sequence_file, volume_file]() -> MHAReader* {
+        try {
+            MHAReader sequence(sequence_file);
+            if (!sequence.readVolumeImage()) return nullptr;
+
+            VolumeReconstructor reconstructor(reconstructionConfig);
+            MHAReader::MHAHeader header;
+            BrickedVolume volume;
+            if (!reconstructor.reconstruct(sequence, header, volume)) return nullptr;
+
+            VolumeReconstructor::writeVolume(volume_file, header, volume);
+            return new MHAReader(header, std::move(volume));
+        } catch (const std::exception& e) {
+            qDebug() << "Volume reconstruction failed:" << e.what();
+            return nullptr;
+        }
+    }));
+}
 
-    process = new QProcess(this);
-    QString executablePath = file_exe;
-    QStringList arguments;
-    arguments << file_config << file_source << file_output << param2;
+void MainWindow::volumeReconstructionFinished()
+{
+    // the button is still disabled if the auto-reconstruction is on
+    ui->pushButton_volumeReconstruct->setEnabled(!ui->checkBox_autoReconstruct->isChecked());
 
-    process->start(executablePath, arguments);
-    qDebug() << process->state();
-    if (process->state() == QProcess::NotRunning) {
-        qDebug() << "The process failed to start.";
+    MHAReader *reconstructedVolume = volumeReconstructionWatcher.result();
+    if (reconstructedVolume == nullptr)
+    {
+        QMessageBox::critical(this, "Volume Reconstruction", "The volume could not be reconstructed, check the recording and the configuration file.");
+        return;
     }
 
-    connect(process, &QProcess::finished, this, &MainWindow::volumeReconstructorCmdFinished);
-    connect(process, &QProcess::readyReadStandardOutput, this, &MainWindow::volumeReconstructorCmdStandardOutput);
-    connect(process, &QProcess::readyReadStandardError, this, &MainWindow::volumeReconstructorCmdStandardError);
+    // The reconstructed volume is already in memory, no need to read the file
+    showVolume(reconstructedVolume);
 }
 
-void MainWindow::volumeReconstructorCmdStandardOutput() {
-    QByteArray standardOutput = process->readAllStandardOutput();
-    qDebug() << "Standard Output:" << QString(standardOutput);
+void MainWindow::liveVolumeUpdated(MHAReader *volume)
+{
+    // the volume of the sweep so far. The first one of the sweep replaces whatever was shown (a volume of before has
+    // another range, the slider gets the range of this one), the next ones only replace the volume of the controller,
+    // the other series of the scatter, the surface and the threshold the user picked stay.
+    if (myVolume3DController == nullptr || isLiveVolumeFirstSnapshot)
+    {
+        showVolume(volume);
+        isLiveVolumeFirstSnapshot = false;
+    }
+    else
+    {
+        // the controllers look at the voxels of the old reader, it goes only after they let go of it
+        if (myVolumeAmodeController!=nullptr) myVolumeAmodeController->setBoneVolume(nullptr);
+        if (myVolumeAmodeController!=nullptr) myVolumeAmodeController->setDistanceField(nullptr);
+        if (myVolumeAmodeController!=nullptr) myVolumeAmodeController->setSurfaceTree(nullptr);
+        MHAReader *previous = myMHAReader;
+        myMHAReader = volume;
+        myVolume3DController->setVolume(myMHAReader);
+        delete previous;
+        if (myVolumeAmodeController!=nullptr) myVolumeAmodeController->setBoneVolume(&myMHAReader->getBrickedVolume());
+    }
+    // the next one may come (the live reconstruction might already be gone if the recording just stopped)
+    if (myLiveVolumeReconstructor != nullptr) myLiveVolumeReconstructor->snapshotShown();
+}
+
+void MainWindow::boneDistanceFieldChanged(std::shared_ptr<const BoneDistanceField> field)
+{
+    // the navigation of the 3D signal uses the field of the current threshold
+    if (myVolumeAmodeController!=nullptr) myVolumeAmodeController->setDistanceField(field);
 }
 
-void MainWindow::volumeReconstructorCmdStandardError() {
-    QByteArray standardError = process->readAllStandardError();
-    qDebug() << "Standard Error:" << QString(standardError);
+void MainWindow::boneSurfaceTreeChanged(std::shared_ptr<const BoneKdTree> tree)
+{
+    // the expected peaks of the 3D signal are compared to the surface of the current threshold
+    if (myVolumeAmodeController!=nullptr) myVolumeAmodeController->setSurfaceTree(tree);
 }
 
-void MainWindow::volumeReconstructorCmdFinished()
+void MainWindow::displayReslice(const QImage &image)
 {
-    qDebug() << "Process exited with code:" << process->exitCode();
+    // no volume (anymore), no slice
+    if (image.isNull())
+    {
+        ui->label_amodeReslice->clear();
+        ui->label_amodeReslice->hide();
+        return;
+    }
+
+    ui->label_amodeReslice->show();
+    ui->label_amodeReslice->setPixmap(QPixmap::fromImage(image).scaled(ui->label_amodeReslice->size(), Qt::KeepAspectRatio, Qt::SmoothTransformation));
+}
 
+void MainWindow::showVolume(MHAReader *volume)
+{
     // Delete everything in the scatterplot
     for (QScatter3DSeries *series : scatter->seriesList()) {
         scatter->removeSeries(series);
     }
 
     // delete the related object, somehow there is bug if i dont do this.
-    if (myMHAReader!=nullptr) delete myMHAReader;
+    // the controllers first, they look at the voxels of the reader
+    if (myVolumeAmodeController!=nullptr) myVolumeAmodeController->setBoneVolume(nullptr);
+    if (myVolumeAmodeController!=nullptr) myVolumeAmodeController->setDistanceField(nullptr);
+    if (myVolumeAmodeController!=nullptr) myVolumeAmodeController->setSurfaceTree(nullptr);
     if (myVolume3DController!=nullptr) delete myVolume3DController;
+    if (myMHAReader!=nullptr) delete myMHAReader;
 
-    // Instantiate MHAReader object to read the mha file (special for volume)
-    myMHAReader = new MHAReader(ui->lineEdit_volumeSource->text().toStdString());
-    // Read the volume image
-    myMHAReader->readVolumeImage();
+    myMHAReader = volume;
     // Instantiate Volume3DController, pass the scatter object and mhareader object so that the class can
     // manipulate the scatter and decode the data according to the mha
     myVolume3DController = new Volume3DController(nullptr, scatter, myMHAReader);
+    // the distance field and the surface tree of the bone come later (and again with every threshold), for the navigation
+    connect(myVolume3DController, &Volume3DController::distanceFieldChanged, this, &MainWindow::boneDistanceFieldChanged);
+    connect(myVolume3DController, &Volume3DController::surfaceTreeChanged, this, &MainWindow::boneSurfaceTreeChanged);
 
     // set initial threshold for slider
     std::array<int, 2> pixelintensityrange = myVolume3DController->getPixelIntensityRange();
@@ -906,6 +1013,10 @@ void MainWindow::volumeReconstructorCmdFinished()
 
     // Connect the slider signal to updateVolume, if the user slide the threshold, the volume also change accordingly
     connect(ui->horizontalSlider_volumeThreshold, &QSlider::valueChanged, myVolume3DController, &Volume3DController::updateVolume);
+    // Show the surface instead of the points if the user wants it
+    myVolume3DController->setSurfaceVisible(ui->checkBox_volumeShowSurface->isChecked());
+    // The beams of the 3D signal go through the new volume
+    if (myVolumeAmodeController!=nullptr) myVolumeAmodeController->setBoneVolume(&myMHAReader->getBrickedVolume());
 }
 
 
@@ -1238,10 +1349,8 @@ void MainWindow::on_comboBox_amodeNumber_textActivated(const QString &arg1)
 
     // ...then reinitialize again. It's working. I don't care it is ugly. Bye.
     myVolumeAmodeController = new VolumeAmodeController(nullptr, scatter, amode_group);
-    connect(myMocapConnection, &MocapConnection::dataReceived, myVolumeAmodeController, &VolumeAmodeController::onRigidBodyReceived);
-    connect(myAmodeConnection, &AmodeConnection::dataReceived, myVolumeAmodeController, &VolumeAmodeController::onAmodeSignalReceived);
-    // don't forget to set which holder should be visualized
-    myVolumeAmodeController->setActiveHolder(arg1.toStdString());
+    // don't forget to set which holder should be visualized (and everything else, like when it was created)
+    connectVolumeAmodeController(arg1.toStdString());
 }
 
 
@@ -1513,10 +1622,12 @@ void MainWindow::on_pushButton_amodeSnapshot_clicked()
             return;
         }
 
-        // Use QTextStream to write to the file
-        QTextStream out(&file);
+        // Use CsvRowWriter to format the rows and write them to the file in one go
+        CsvRowWriter out({"name", "q1", "q2", "q3", "q4", "t1", "t2", "t3"}, [&file](const char* data, std::size_t size) {
+            return file.write(data, static_cast<qint64>(size)) == static_cast<qint64>(size);
+        });
         // Write the CSV header
-        out << "name,q1,q2,q3,q4,t1,t2,t3\n";
+        out.writeHeader();
 
         // Iterate through all global transformation that is necessary for snapshot
         for (const auto& pair_entry : global_Ts)
@@ -1529,10 +1640,11 @@ void MainWindow::on_pushButton_amodeSnapshot_clicked()
             Eigen::Quaterniond global_Q(global_T_matrix.rotation());
             Eigen::Vector3d global_t = global_T_matrix.translation();
 
-            // Stream to QTextStream out
-            out << global_T_id << ","                                                                       // Name
-                << global_Q.x() << "," << global_Q.y() << "," << global_Q.z() << "," << global_Q.w() << "," // Quaternion components
-                << global_t.x() << "," << global_t.y() << "," << global_t.z() << "\n";
+            // Add the row to the CSV
+            out.add(global_T_id.toStdString())                                                  // Name
+               .add(global_Q.x()).add(global_Q.y()).add(global_Q.z()).add(global_Q.w())        // Quaternion components
+               .add(global_t.x()).add(global_t.y()).add(global_t.z())                          // Translation components
+               .endRow();
         }
 
         // // First row in the csv reserved for global coordinate
@@ -1555,10 +1667,11 @@ void MainWindow::on_pushButton_amodeSnapshot_clicked()
             std::vector<double> tmp = amode_group.at(i).local_t;
             Eigen::Vector3d local_t(tmp[0], tmp[1], tmp[2]);
 
-            // Convert name to QString and write data to the file in CSV format
-            out << "Probe_"+QString::number(amode_group.at(i).number) << ","                            // Name
-                << local_Q.x() << "," << local_Q.y() << "," << local_Q.z() << "," << local_Q.w() << "," // Quaternion components
-                << local_t.x() << "," << local_t.y() << "," << local_t.z() << "\n";                     // Translation components
+            // Convert name to string and add the row to the CSV
+            out.add("Probe_" + std::to_string(amode_group.at(i).number))                     // Name
+               .add(local_Q.x()).add(local_Q.y()).add(local_Q.z()).add(local_Q.w())         // Quaternion components
+               .add(local_t.x()).add(local_t.y()).add(local_t.z())                          // Translation components
+               .endRow();
 
             // // Convert name to QString and write data to the file in CSV format
             // out << "Probe_"+QString::number(amode_group.at(i).number) << ","                                                        // Name
@@ -1566,7 +1679,9 @@ void MainWindow::on_pushButton_amodeSnapshot_clicked()
             //     << local_ts.at(i).x() << "," << local_ts.at(i).y() << "," << local_ts.at(i).z() << "\n";                            // Translation components
         }
 
-        // Close the file
+        // Write the rows to the file and close the file
+        if (!out.flush())
+            qWarning() << "MainWindow::on_pushButton_amodeSnapshot_clicked() Error: Failed to write to" << rigidbodyFilepath_filename;
         file.close();
 
     }
@@ -1856,6 +1971,80 @@ void MainWindow::on_comboBox_volume3DSignalMode_currentIndexChanged(int index)
 }
 
 
+void MainWindow::on_spinBox_volume3DSignalBudget_valueChanged(int value)
+{
+    // the visualizer picks the detail and the rate of the 3d signal for this budget
+    if (myVolumeAmodeController==nullptr) return;
+    myVolumeAmodeController->setFrameBudget(value);
+}
+
+
+void MainWindow::on_checkBox_volumeShowSurface_clicked(bool checked)
+{
+    // the bone as a surface mesh (marching cubes) or as points, the controller does the rest
+    if (myVolume3DController==nullptr) return;
+    myVolume3DController->setSurfaceVisible(checked);
+}
+
+void MainWindow::on_pushButton_volumeBoneWindows_clicked()
+{
+    // the depths of the bone come from the beams of the 3D signal through the volume
+    if (myVolumeAmodeController==nullptr || myVolume3DController==nullptr)
+    {
+        QMessageBox::warning(this, "Can't set windows", "To set the windows from the volume, please load (or reconstruct) the volume and show the 3D signal first.");
+        return;
+    }
+
+    // put the window of every transducer whose beam hits the bone there, the same width as a clicked window
+    const std::vector<std::optional<double>>& bonedepths = myVolumeAmodeController->getBoneDepths();
+    int nWindows = 0;
+    for(std::size_t i = 0; i < amodePlots.size() && i < bonedepths.size(); ++i)
+    {
+        if (!bonedepths.at(i).has_value()) continue;
+
+        const double depth = bonedepths.at(i).value();
+        std::array<std::optional<double>, 3> window = {depth - 3, depth, depth + 3};
+        amodePlots.at(i)->setInitialLines(window);
+        // the expected peak in the 3D signal as well, like the user clicked it
+        myVolumeAmodeController->onExpectedPeakSelected(amodePlots.at(i)->objectName().toStdString(), static_cast<int>(i), depth);
+        nWindows++;
+    }
+
+    if (nWindows == 0)
+        QMessageBox::information(this, "No bone", "None of the beams hits the bone (over the threshold) in the volume.");
+}
+
+void MainWindow::connectVolumeAmodeController(const std::string &holder)
+{
+    // the settings of the 3d signal, and which holder should be visualized
+    myVolumeAmodeController->setSignalDisplayMode(ui->comboBox_volume3DSignalMode->currentIndex());
+    myVolumeAmodeController->setFrameBudget(ui->spinBox_volume3DSignalBudget->value());
+    myVolumeAmodeController->setActiveHolder(holder);
+
+    // the beams are followed through the volume (if there is one already), the bone is over the threshold of the slider
+    myVolumeAmodeController->setBoneThreshold(ui->horizontalSlider_volumeThreshold->value());
+    connect(ui->horizontalSlider_volumeThreshold, &QSlider::valueChanged, myVolumeAmodeController, &VolumeAmodeController::setBoneThreshold);
+    if (myMHAReader!=nullptr) myVolumeAmodeController->setBoneVolume(&myMHAReader->getBrickedVolume());
+    // how far the bone is and how the beams are aimed, from the distance field and the surface tree of the bone
+    if (myVolume3DController!=nullptr) myVolumeAmodeController->setDistanceField(myVolume3DController->getDistanceField());
+    if (myVolume3DController!=nullptr) myVolumeAmodeController->setSurfaceTree(myVolume3DController->getSurfaceTree());
+    connect(myVolumeAmodeController, &VolumeAmodeController::boneGuidanceUpdated, ui->label_volumeBoneGuidance, &QLabel::setText);
+    // the volume along the holder, next to the signals
+    connect(myVolumeAmodeController, &VolumeAmodeController::resliceUpdated, this, &MainWindow::displayReslice);
+    // the detail and the rate the 3d signal is shown with
+    connect(myVolumeAmodeController, &VolumeAmodeController::renderSettingsUpdated, ui->label_volume3DSignalRender, &QLabel::setText);
+
+    // connect necessary signal (data received from mocap connection and amode connection) to VolumeAmodeController slots
+    connect(myMocapConnection, &MocapConnection::dataReceived, myVolumeAmodeController, &VolumeAmodeController::onRigidBodyReceived);
+    connect(myAmodeConnection, &AmodeConnection::dataReceived, myVolumeAmodeController, &VolumeAmodeController::onAmodeSignalReceived);
+
+    // i also need to connect signal from each individual amode 2d plots (that is emitted when the user click the plot) to VolumeAmodeController slots
+    for(std::size_t i = 0; i < amodePlots.size(); ++i)
+    {
+        connect(amodePlots.at(i), &QCustomPlotIntervalWindow::xLineSelected, myVolumeAmodeController, &VolumeAmodeController::onExpectedPeakSelected);
+    }
+}
+
 void MainWindow::on_checkBox_volumeShow3DSignal_clicked(bool checked)
 {
     // if the checkbox is now true, let's initialize the amode 3d visualization
@@ -1875,8 +2064,9 @@ void MainWindow::on_checkBox_volumeShow3DSignal_clicked(bool checked)
             return;
         }
 
-        // enable changing the state of combo box for variation display mode for amode 3d signal
+        // enable changing the state of combo box for variation display mode for amode 3d signal (and its frame budget)
         ui->comboBox_volume3DSignalMode->setEnabled(true);
+        ui->spinBox_volume3DSignalBudget->setEnabled(true);
 
         // get the a-mode groups
         std::vector<AmodeConfig::Data> amode_group = myAmodeConfig->getDataByGroupName(ui->comboBox_amodeNumber->currentText().toStdString());
@@ -1887,8 +2077,7 @@ void MainWindow::on_checkBox_volumeShow3DSignal_clicked(bool checked)
         // for note: i declare intentionally the argument for amode_group as value not the reference (a pointer to amode_group)
         // because amode_group here declared locally, so the reference will be gone outside of this scope.
         myVolumeAmodeController = new VolumeAmodeController(nullptr, scatter, amode_group);
-        myVolumeAmodeController->setSignalDisplayMode(ui->comboBox_volume3DSignalMode->currentIndex());
-        myVolumeAmodeController->setActiveHolder(ui->comboBox_amodeNumber->currentText().toStdString());
+        connectVolumeAmodeController(ui->comboBox_amodeNumber->currentText().toStdString());
 
         qDebug() << "MainWindow::on_checkBox_volumeShow3DSignal_clicked() myVolumeAmodeController object created successfuly";
 
@@ -1897,16 +2086,6 @@ void MainWindow::on_checkBox_volumeShow3DSignal_clicked(bool checked)
             qDebug() << "myVolumeAmodeController has been deleted successfully.";
         });
 
-        // connect necessary signal (data received from mocap connection and amode connection) to VolumeAmodeController slots
-        connect(myMocapConnection, &MocapConnection::dataReceived, myVolumeAmodeController, &VolumeAmodeController::onRigidBodyReceived);
-        connect(myAmodeConnection, &AmodeConnection::dataReceived, myVolumeAmodeController, &VolumeAmodeController::onAmodeSignalReceived);
-
-        // i also need to connect signal from each individual amode 2d plots (that is emitted when the user click the plot) to VolumeAmodeController slots
-        for(std::size_t i = 0; i < amodePlots.size(); ++i)
-        {
-            connect(amodePlots.at(i), &QCustomPlotIntervalWindow::xLineSelected, myVolumeAmodeController, &VolumeAmodeController::onExpectedPeakSelected);
-        }
-
     }
 
     // if the checkbox is now false, let's disconnect the signal to the class and delete the class
@@ -1921,6 +2100,7 @@ void MainWindow::on_checkBox_volumeShow3DSignal_clicked(bool checked)
         {
             // enable changing the state of combo box for variation display mode for amode 3d signal
             ui->comboBox_volume3DSignalMode->setEnabled(false);
+            ui->spinBox_volume3DSignalBudget->setEnabled(false);
             return;
         }
 
@@ -1939,6 +2119,10 @@ void MainWindow::on_checkBox_volumeShow3DSignal_clicked(bool checked)
 
         myVolumeAmodeController->deleteLater();
         myVolumeAmodeController = nullptr;
+        // no holder, no guidance, no slice and no signal
+        ui->label_volumeBoneGuidance->clear();
+        ui->label_volume3DSignalRender->clear();
+        displayReslice(QImage());
 
         // Enter the event loop and wait for deletion. This is the part where we prevent the deletion before stopping the thread.
         loop.exec();
@@ -5,6 +5,7 @@
 #include <QLabel>
 #include <QComboBox>
 #include <QPushButton>
+#include <QFutureWatcher>
 
 #include "amodeconnection.h"
 #include "amodeconfig.h"
@@ -17,6 +18,8 @@
 #include "mhawriter.h"
 #include "mhareader.h"
 #include "volume3dcontroller.h"
+#include "volumereconstructor.h"
+#include "livevolumereconstructor.h"
 #include "volumeamodecontroller.h"
 #include "amodetimedrecorder.h"
 
@@ -39,13 +42,16 @@ public:
 public slots:
     void displayImage(const cv::Mat &image);
     void displayUSsignal(const std::vector<uint16_t> &usdata_uint16_);
+    void displayReslice(const QImage &image);
     void disconnectUSsignal();
     void updateQualisysText(const QualisysTransformationManager &tmanager);
 
-    // functions for cmd calling
-    void volumeReconstructorCmdFinished();
-    void volumeReconstructorCmdStandardOutput();
-    void volumeReconstructorCmdStandardError();
+    // functions for the volume reconstruction
+    void volumeReconstructionFinished();
+    void mhaWritingFinished();
+    void liveVolumeUpdated(MHAReader *volume);
+    void boneDistanceFieldChanged(std::shared_ptr<const BoneDistanceField> field);
+    void boneSurfaceTreeChanged(std::shared_ptr<const BoneKdTree> tree);
 
     // functions for intermediate recording
     void startIntermediateRecording();
@@ -71,12 +77,16 @@ private slots:
     void on_pushButton_volumeBrowseConfig_clicked();
     void on_pushButton_volumeBrowseRecording_clicked();
     void on_checkBox_volumeShow3DSignal_clicked(bool checked);
+    void on_checkBox_volumeShowSurface_clicked(bool checked);
+    void on_pushButton_volumeBoneWindows_clicked();
 
     void on_pushButton_mhaPath_clicked();
     void on_pushButton_volumeBrowseOutput_clicked();
     void on_checkBox_autoReconstruct_stateChanged(int arg1);
     void on_comboBox_volume3DSignalMode_currentIndexChanged(int index);
 
+    void on_spinBox_volume3DSignalBudget_valueChanged(int value);
+
     void openMeasurementWindow();
 
 private:
@@ -92,6 +102,12 @@ private:
     void slotConnect_Amode();
     void slotDisconnect_Amode();
 
+    // wires a new myVolumeAmodeController (settings, bone, labels, data), it is created in more than one place
+    void connectVolumeAmodeController(const std::string &holder);
+
+    // shows a volume in the scatter (it takes the reader), instead of the previous one, the slider gets its range
+    void showVolume(MHAReader *volume);
+
 
     Ui::MainWindow *ui;
 
@@ -101,6 +117,7 @@ private:
     MocapConnection *myMocapConnection              = nullptr;
     Bmode3DVisualizer *myBmode3Dvisualizer          = nullptr;
     MHAWriter *myMHAWriter                          = nullptr;
+    LiveVolumeReconstructor *myLiveVolumeReconstructor = nullptr;
     MHAReader *myMHAReader                          = nullptr;
     Volume3DController *myVolume3DController        = nullptr;
     VolumeAmodeController *myVolumeAmodeController  = nullptr;
@@ -110,7 +127,8 @@ private:
 
     // for volume 3d plot
     Q3DScatter *scatter;                        //!< For handling amode 3d plots and 3d volume visualization
-    QProcess* process;                          //!< For invoking command prompt
+    QFutureWatcher<MHAReader*> volumeReconstructionWatcher; //!< Watches the volume reconstruction, running in the background
+    QFutureWatcher<int> mhaWritingWatcher;      //!< Watches MHAWriter::stopRecord() (compressing and writing the file), running in the background
 
     // for amode 2d plots
     QCustomPlotIntervalWindow *amodePlot;
@@ -130,6 +148,7 @@ private:
     bool isBmode2dFirstStream        = true;    //!< Flag to inform whether it is the first data from B-mode 2d image stream comes (for image scaling (in the gui) purpose)
     bool isBmode2d3dFirstStream      = true;    //!< Flag to inform whether it is the first time to stream B-mode 2d image and qualisys or not (first one need initialization)
     bool isAutoReconstructFirstClick = true;    //!< Flag to inform whether it is the first time auto reconstruct checkbox being clicked (for information about auto reconstruct)
+    bool isLiveVolumeFirstSnapshot   = true;    //!< Flag to inform whether the next live volume is the first one of the sweep (it sets the range of the threshold slider)
 
     int bmode2dvisheight = 1;                   //!< Stores the height of the layout where we draw B-mode 2d image (there is a bug that the height keep increasing)
 
@@ -0,0 +1,634 @@
+#include "marchingcubes.h"
+
+#include <omp.h>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <charconv>
+#include <algorithm>
+#include <unordered_map>
+
+namespace {
+
+// The corners of a cube (x, y, z offsets), and the edges between them (like Paul Bourke's numbering)
+const int cornerOffset[8][3] = {
+    {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0}, {0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1}
+};
+const int edgeCorners[12][2] = {
+    {0, 1}, {1, 2}, {2, 3}, {3, 0}, {4, 5}, {5, 6}, {6, 7}, {7, 4}, {0, 4}, {1, 5}, {2, 6}, {3, 7}
+};
+// The corner with the lowest voxel index of every edge, and the axis of the edge (0 x, 1 y, 2 z). Together with the
+// voxel index of that corner, it names the edge in the whole grid, that is how the cubes share the vertices.
+const int edgeOwner[12] = { 0, 1, 3, 0, 4, 5, 7, 4, 0, 1, 2, 3 };
+const int edgeAxis[12]  = { 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2 };
+
+// Which edges cross the iso-level for every combination of corners (bit i set: corner i is >= iso-level)
+const int edgeTable[256] = {
+    0x000, 0x109, 0x203, 0x30a, 0x406, 0x50f, 0x605, 0x70c,
+    0x80c, 0x905, 0xa0f, 0xb06, 0xc0a, 0xd03, 0xe09, 0xf00,
+    0x190, 0x099, 0x393, 0x29a, 0x596, 0x49f, 0x795, 0x69c,
+    0x99c, 0x895, 0xb9f, 0xa96, 0xd9a, 0xc93, 0xf99, 0xe90,
+    0x230, 0x339, 0x033, 0x13a, 0x636, 0x73f, 0x435, 0x53c,
+    0xa3c, 0xb35, 0x83f, 0x936, 0xe3a, 0xf33, 0xc39, 0xd30,
+    0x3a0, 0x2a9, 0x1a3, 0x0aa, 0x7a6, 0x6af, 0x5a5, 0x4ac,
+    0xbac, 0xaa5, 0x9af, 0x8a6, 0xfaa, 0xea3, 0xda9, 0xca0,
+    0x460, 0x569, 0x663, 0x76a, 0x066, 0x16f, 0x265, 0x36c,
+    0xc6c, 0xd65, 0xe6f, 0xf66, 0x86a, 0x963, 0xa69, 0xb60,
+    0x5f0, 0x4f9, 0x7f3, 0x6fa, 0x1f6, 0x0ff, 0x3f5, 0x2fc,
+    0xdfc, 0xcf5, 0xfff, 0xef6, 0x9fa, 0x8f3, 0xbf9, 0xaf0,
+    0x650, 0x759, 0x453, 0x55a, 0x256, 0x35f, 0x055, 0x15c,
+    0xe5c, 0xf55, 0xc5f, 0xd56, 0xa5a, 0xb53, 0x859, 0x950,
+    0x7c0, 0x6c9, 0x5c3, 0x4ca, 0x3c6, 0x2cf, 0x1c5, 0x0cc,
+    0xfcc, 0xec5, 0xdcf, 0xcc6, 0xbca, 0xac3, 0x9c9, 0x8c0,
+    0x8c0, 0x9c9, 0xac3, 0xbca, 0xcc6, 0xdcf, 0xec5, 0xfcc,
+    0x0cc, 0x1c5, 0x2cf, 0x3c6, 0x4ca, 0x5c3, 0x6c9, 0x7c0,
+    0x950, 0x859, 0xb53, 0xa5a, 0xd56, 0xc5f, 0xf55, 0xe5c,
+    0x15c, 0x055, 0x35f, 0x256, 0x55a, 0x453, 0x759, 0x650,
+    0xaf0, 0xbf9, 0x8f3, 0x9fa, 0xef6, 0xfff, 0xcf5, 0xdfc,
+    0x2fc, 0x3f5, 0x0ff, 0x1f6, 0x6fa, 0x7f3, 0x4f9, 0x5f0,
+    0xb60, 0xa69, 0x963, 0x86a, 0xf66, 0xe6f, 0xd65, 0xc6c,
+    0x36c, 0x265, 0x16f, 0x066, 0x76a, 0x663, 0x569, 0x460,
+    0xca0, 0xda9, 0xea3, 0xfaa, 0x8a6, 0x9af, 0xaa5, 0xbac,
+    0x4ac, 0x5a5, 0x6af, 0x7a6, 0x0aa, 0x1a3, 0x2a9, 0x3a0,
+    0xd30, 0xc39, 0xf33, 0xe3a, 0x936, 0x83f, 0xb35, 0xa3c,
+    0x53c, 0x435, 0x73f, 0x636, 0x13a, 0x033, 0x339, 0x230,
+    0xe90, 0xf99, 0xc93, 0xd9a, 0xa96, 0xb9f, 0x895, 0x99c,
+    0x69c, 0x795, 0x49f, 0x596, 0x29a, 0x393, 0x099, 0x190,
+    0xf00, 0xe09, 0xd03, 0xc0a, 0xb06, 0xa0f, 0x905, 0x80c,
+    0x70c, 0x605, 0x50f, 0x406, 0x30a, 0x203, 0x109, 0x000
+};
+
+// The triangles of every combination, three edges per triangle, -1 terminated. Generated: on every face of the cube
+// the crossings are paired so that the corners over the iso-level are cut off (also on the ambiguous faces, so the
+// neighbouring cube always does the same), the loops are fanned (never with a diagonal on a face of the cube, that
+// one would be shared with the neighbour), and oriented with the normal out of the bone.
+const int triangleTable[256][16] = {
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  8,  1,  8,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {10,  2,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  0,  3, 10,  2,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 9, 10,  2,  9,  2,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  3,  8,  2,  8,  9,  2,  9, 10, -1, -1, -1, -1, -1, -1, -1},
+    {11,  3,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2, 11,  0, 11,  8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0, 11,  3,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  2, 11,  1, 11,  8,  1,  8,  9, -1, -1, -1, -1, -1, -1, -1},
+    {10, 11,  3, 10,  3,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  1, 10,  0, 10, 11,  0, 11,  8, -1, -1, -1, -1, -1, -1, -1},
+    { 9, 10, 11,  9, 11,  3,  9,  3,  0, -1, -1, -1, -1, -1, -1, -1},
+    {10, 11,  8, 10,  8,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  7,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  7,  0,  7,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0,  8,  7,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  7,  1,  7,  4,  1,  4,  9, -1, -1, -1, -1, -1, -1, -1},
+    {10,  2,  1,  8,  7,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 7,  4,  0,  7,  0,  3, 10,  2,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 9, 10,  2,  9,  2,  0,  8,  7,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  3,  7,  2,  7,  4,  2,  4,  9,  2,  9, 10, -1, -1, -1, -1},
+    {11,  3,  2,  8,  7,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2, 11,  0, 11,  7,  0,  7,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0, 11,  3,  2,  8,  7,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  2, 11,  1, 11,  7,  1,  7,  4,  1,  4,  9, -1, -1, -1, -1},
+    {10, 11,  3, 10,  3,  1,  8,  7,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  1, 10,  0, 10, 11,  0, 11,  7,  0,  7,  4, -1, -1, -1, -1},
+    { 9, 10, 11,  9, 11,  3,  9,  3,  0,  8,  7,  4, -1, -1, -1, -1},
+    { 9, 10, 11,  9, 11,  7,  9,  7,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  5,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  8,  4,  5,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  5,  1,  4,  1,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  8,  1,  8,  4,  1,  4,  5, -1, -1, -1, -1, -1, -1, -1},
+    {10,  2,  1,  4,  5,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  0,  3, 10,  2,  1,  4,  5,  9, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  5, 10,  4, 10,  2,  4,  2,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  3,  8,  2,  8,  4,  2,  4,  5,  2,  5, 10, -1, -1, -1, -1},
+    {11,  3,  2,  4,  5,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2, 11,  0, 11,  8,  4,  5,  9, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  5,  1,  4,  1,  0, 11,  3,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  2, 11,  1, 11,  8,  1,  8,  4,  1,  4,  5, -1, -1, -1, -1},
+    {10, 11,  3, 10,  3,  1,  4,  5,  9, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  1, 10,  0, 10, 11,  0, 11,  8,  4,  5,  9, -1, -1, -1, -1},
+    { 4,  5, 10,  4, 10, 11,  4, 11,  3,  4,  3,  0, -1, -1, -1, -1},
+    { 4,  5, 10,  4, 10, 11,  4, 11,  8, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  8,  7,  9,  7,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  7,  0,  7,  5,  0,  5,  9, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  7,  5,  8,  5,  1,  8,  1,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  7,  1,  7,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {10,  2,  1,  9,  8,  7,  9,  7,  5, -1, -1, -1, -1, -1, -1, -1},
+    { 7,  5,  9,  7,  9,  0,  7,  0,  3, 10,  2,  1, -1, -1, -1, -1},
+    { 8,  7,  5,  8,  5, 10,  8, 10,  2,  8,  2,  0, -1, -1, -1, -1},
+    { 2,  3,  7,  2,  7,  5,  2,  5, 10, -1, -1, -1, -1, -1, -1, -1},
+    {11,  3,  2,  9,  8,  7,  9,  7,  5, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2, 11,  0, 11,  7,  0,  7,  5,  0,  5,  9, -1, -1, -1, -1},
+    { 8,  7,  5,  8,  5,  1,  8,  1,  0, 11,  3,  2, -1, -1, -1, -1},
+    { 1,  2, 11,  1, 11,  7,  1,  7,  5, -1, -1, -1, -1, -1, -1, -1},
+    {10, 11,  3, 10,  3,  1,  9,  8,  7,  9,  7,  5, -1, -1, -1, -1},
+    { 0,  1, 10,  0, 10, 11,  0, 11,  7,  0,  7,  5,  0,  5,  9, -1},
+    { 5, 10, 11,  5, 11,  3,  5,  3,  0,  5,  0,  8,  5,  8,  7, -1},
+    {10, 11,  7, 10,  7,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  6, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  8,  5,  6, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0,  5,  6, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  8,  1,  8,  9,  5,  6, 10, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  6,  2,  5,  2,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  0,  3,  5,  6,  2,  5,  2,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  5,  6,  9,  6,  2,  9,  2,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  3,  8,  2,  8,  9,  2,  9,  5,  2,  5,  6, -1, -1, -1, -1},
+    {11,  3,  2,  5,  6, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2, 11,  0, 11,  8,  5,  6, 10, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0, 11,  3,  2,  5,  6, 10, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  2, 11,  1, 11,  8,  1,  8,  9,  5,  6, 10, -1, -1, -1, -1},
+    { 5,  6, 11,  5, 11,  3,  5,  3,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  1,  5,  0,  5,  6,  0,  6, 11,  0, 11,  8, -1, -1, -1, -1},
+    { 9,  5,  6,  9,  6, 11,  9, 11,  3,  9,  3,  0, -1, -1, -1, -1},
+    { 5,  6, 11,  5, 11,  8,  5,  8,  9, -1, -1, -1, -1, -1, -1, -1},
+    { 7,  4,  8,  5,  6, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  7,  0,  7,  4,  5,  6, 10, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0,  7,  4,  8,  5,  6, 10, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  7,  1,  7,  4,  1,  4,  9,  5,  6, 10, -1, -1, -1, -1},
+    { 5,  6,  2,  5,  2,  1,  7,  4,  8, -1, -1, -1, -1, -1, -1, -1},
+    { 7,  4,  0,  7,  0,  3,  5,  6,  2,  5,  2,  1, -1, -1, -1, -1},
+    { 9,  5,  6,  9,  6,  2,  9,  2,  0,  7,  4,  8, -1, -1, -1, -1},
+    { 2,  3,  7,  2,  7,  4,  2,  4,  9,  2,  9,  5,  2,  5,  6, -1},
+    {11,  3,  2,  7,  4,  8,  5,  6, 10, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2, 11,  0, 11,  7,  0,  7,  4,  5,  6, 10, -1, -1, -1, -1},
+    { 9,  1,  0, 11,  3,  2,  7,  4,  8,  5,  6, 10, -1, -1, -1, -1},
+    { 1,  2, 11,  1, 11,  7,  1,  7,  4,  1,  4,  9,  5,  6, 10, -1},
+    { 5,  6, 11,  5, 11,  3,  5,  3,  1,  7,  4,  8, -1, -1, -1, -1},
+    { 0,  1,  5,  0,  5,  6,  0,  6, 11,  0, 11,  7,  0,  7,  4, -1},
+    { 9,  5,  6,  9,  6, 11,  9, 11,  3,  9,  3,  0,  7,  4,  8, -1},
+    { 9,  5,  6,  9,  6, 11,  9, 11,  7,  9,  7,  4, -1, -1, -1, -1},
+    { 4,  6, 10,  4, 10,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  8,  4,  6, 10,  4, 10,  9, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6, 10,  4, 10,  1,  4,  1,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  8,  1,  8,  4,  1,  4,  6,  1,  6, 10, -1, -1, -1, -1},
+    { 9,  4,  6,  9,  6,  2,  9,  2,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  0,  3,  9,  4,  6,  9,  6,  2,  9,  2,  1, -1, -1, -1, -1},
+    { 4,  6,  2,  4,  2,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  3,  8,  2,  8,  4,  2,  4,  6, -1, -1, -1, -1, -1, -1, -1},
+    {11,  3,  2,  4,  6, 10,  4, 10,  9, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2, 11,  0, 11,  8,  4,  6, 10,  4, 10,  9, -1, -1, -1, -1},
+    { 4,  6, 10,  4, 10,  1,  4,  1,  0, 11,  3,  2, -1, -1, -1, -1},
+    { 1,  2, 11,  1, 11,  8,  1,  8,  4,  1,  4,  6,  1,  6, 10, -1},
+    { 9,  4,  6,  9,  6, 11,  9, 11,  3,  9,  3,  1, -1, -1, -1, -1},
+    { 1,  9,  4,  1,  4,  6,  1,  6, 11,  1, 11,  8,  1,  8,  0, -1},
+    { 4,  6, 11,  4, 11,  3,  4,  3,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6, 11,  4, 11,  8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {10,  9,  8, 10,  8,  7, 10,  7,  6, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  7,  0,  7,  6,  0,  6, 10,  0, 10,  9, -1, -1, -1, -1},
+    { 8,  7,  6,  8,  6, 10,  8, 10,  1,  8,  1,  0, -1, -1, -1, -1},
+    { 1,  3,  7,  1,  7,  6,  1,  6, 10, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  8,  7,  9,  7,  6,  9,  6,  2,  9,  2,  1, -1, -1, -1, -1},
+    { 7,  6,  2,  7,  2,  1,  7,  1,  9,  7,  9,  0,  7,  0,  3, -1},
+    { 8,  7,  6,  8,  6,  2,  8,  2,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  3,  7,  2,  7,  6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {11,  3,  2, 10,  9,  8, 10,  8,  7, 10,  7,  6, -1, -1, -1, -1},
+    { 0,  2, 11,  0, 11,  7,  0,  7,  6,  0,  6, 10,  0, 10,  9, -1},
+    { 8,  7,  6,  8,  6, 10,  8, 10,  1,  8,  1,  0, 11,  3,  2, -1},
+    { 1,  2, 11,  1, 11,  7,  1,  7,  6,  1,  6, 10, -1, -1, -1, -1},
+    { 9,  8,  7,  9,  7,  6,  9,  6, 11,  9, 11,  3,  9,  3,  1, -1},
+    { 0,  1,  9, 11,  7,  6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 6, 11,  3,  6,  3,  0,  6,  0,  8,  6,  8,  7, -1, -1, -1, -1},
+    {11,  7,  6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 6,  7, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  8,  6,  7, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0,  6,  7, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  8,  1,  8,  9,  6,  7, 11, -1, -1, -1, -1, -1, -1, -1},
+    {10,  2,  1,  6,  7, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  0,  3, 10,  2,  1,  6,  7, 11, -1, -1, -1, -1, -1, -1, -1},
+    { 9, 10,  2,  9,  2,  0,  6,  7, 11, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  3,  8,  2,  8,  9,  2,  9, 10,  6,  7, 11, -1, -1, -1, -1},
+    { 6,  7,  3,  6,  3,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2,  6,  0,  6,  7,  0,  7,  8, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0,  6,  7,  3,  6,  3,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  2,  6,  1,  6,  7,  1,  7,  8,  1,  8,  9, -1, -1, -1, -1},
+    {10,  6,  7, 10,  7,  3, 10,  3,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  1, 10,  0, 10,  6,  0,  6,  7,  0,  7,  8, -1, -1, -1, -1},
+    { 9, 10,  6,  9,  6,  7,  9,  7,  3,  9,  3,  0, -1, -1, -1, -1},
+    { 6,  7,  8,  6,  8,  9,  6,  9, 10, -1, -1, -1, -1, -1, -1, -1},
+    { 8, 11,  6,  8,  6,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3, 11,  0, 11,  6,  0,  6,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0,  8, 11,  6,  8,  6,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3, 11,  1, 11,  6,  1,  6,  4,  1,  4,  9, -1, -1, -1, -1},
+    {10,  2,  1,  8, 11,  6,  8,  6,  4, -1, -1, -1, -1, -1, -1, -1},
+    {11,  6,  4, 11,  4,  0, 11,  0,  3, 10,  2,  1, -1, -1, -1, -1},
+    { 9, 10,  2,  9,  2,  0,  8, 11,  6,  8,  6,  4, -1, -1, -1, -1},
+    { 3, 11,  6,  3,  6,  4,  3,  4,  9,  3,  9, 10,  3, 10,  2, -1},
+    { 6,  4,  8,  6,  8,  3,  6,  3,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2,  6,  0,  6,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0,  6,  4,  8,  6,  8,  3,  6,  3,  2, -1, -1, -1, -1},
+    { 1,  2,  6,  1,  6,  4,  1,  4,  9, -1, -1, -1, -1, -1, -1, -1},
+    {10,  6,  4, 10,  4,  8, 10,  8,  3, 10,  3,  1, -1, -1, -1, -1},
+    { 0,  1, 10,  0, 10,  6,  0,  6,  4, -1, -1, -1, -1, -1, -1, -1},
+    {10,  6,  4, 10,  4,  8, 10,  8,  3, 10,  3,  0, 10,  0,  9, -1},
+    { 9, 10,  6,  9,  6,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  5,  9,  6,  7, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  8,  4,  5,  9,  6,  7, 11, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  5,  1,  4,  1,  0,  6,  7, 11, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  8,  1,  8,  4,  1,  4,  5,  6,  7, 11, -1, -1, -1, -1},
+    {10,  2,  1,  4,  5,  9,  6,  7, 11, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  0,  3, 10,  2,  1,  4,  5,  9,  6,  7, 11, -1, -1, -1, -1},
+    { 4,  5, 10,  4, 10,  2,  4,  2,  0,  6,  7, 11, -1, -1, -1, -1},
+    { 2,  3,  8,  2,  8,  4,  2,  4,  5,  2,  5, 10,  6,  7, 11, -1},
+    { 6,  7,  3,  6,  3,  2,  4,  5,  9, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2,  6,  0,  6,  7,  0,  7,  8,  4,  5,  9, -1, -1, -1, -1},
+    { 4,  5,  1,  4,  1,  0,  6,  7,  3,  6,  3,  2, -1, -1, -1, -1},
+    { 1,  2,  6,  1,  6,  7,  1,  7,  8,  1,  8,  4,  1,  4,  5, -1},
+    {10,  6,  7, 10,  7,  3, 10,  3,  1,  4,  5,  9, -1, -1, -1, -1},
+    { 0,  1, 10,  0, 10,  6,  0,  6,  7,  0,  7,  8,  4,  5,  9, -1},
+    {10,  6,  7, 10,  7,  3, 10,  3,  0, 10,  0,  4, 10,  4,  5, -1},
+    {10,  6,  7, 10,  7,  8, 10,  8,  4, 10,  4,  5, -1, -1, -1, -1},
+    { 9,  8, 11,  9, 11,  6,  9,  6,  5, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3, 11,  0, 11,  6,  0,  6,  5,  0,  5,  9, -1, -1, -1, -1},
+    { 8, 11,  6,  8,  6,  5,  8,  5,  1,  8,  1,  0, -1, -1, -1, -1},
+    { 1,  3, 11,  1, 11,  6,  1,  6,  5, -1, -1, -1, -1, -1, -1, -1},
+    {10,  2,  1,  9,  8, 11,  9, 11,  6,  9,  6,  5, -1, -1, -1, -1},
+    {11,  6,  5, 11,  5,  9, 11,  9,  0, 11,  0,  3, 10,  2,  1, -1},
+    { 8, 11,  6,  8,  6,  5,  8,  5, 10,  8, 10,  2,  8,  2,  0, -1},
+    { 3, 11,  6,  3,  6,  5,  3,  5, 10,  3, 10,  2, -1, -1, -1, -1},
+    { 6,  5,  9,  6,  9,  8,  6,  8,  3,  6,  3,  2, -1, -1, -1, -1},
+    { 0,  2,  6,  0,  6,  5,  0,  5,  9, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  3,  2,  8,  2,  6,  8,  6,  5,  8,  5,  1,  8,  1,  0, -1},
+    { 1,  2,  6,  1,  6,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 6,  5,  9,  6,  9,  8,  6,  8,  3,  6,  3,  1,  6,  1, 10, -1},
+    { 0,  1, 10,  0, 10,  6,  0,  6,  5,  0,  5,  9, -1, -1, -1, -1},
+    { 8,  3,  0, 10,  6,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {10,  6,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  7, 11,  5, 11, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  8,  5,  7, 11,  5, 11, 10, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0,  5,  7, 11,  5, 11, 10, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  8,  1,  8,  9,  5,  7, 11,  5, 11, 10, -1, -1, -1, -1},
+    { 5,  7, 11,  5, 11,  2,  5,  2,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  0,  3,  5,  7, 11,  5, 11,  2,  5,  2,  1, -1, -1, -1, -1},
+    { 9,  5,  7,  9,  7, 11,  9, 11,  2,  9,  2,  0, -1, -1, -1, -1},
+    { 2,  3,  8,  2,  8,  9,  2,  9,  5,  2,  5,  7,  2,  7, 11, -1},
+    {10,  5,  7, 10,  7,  3, 10,  3,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2, 10,  0, 10,  5,  0,  5,  7,  0,  7,  8, -1, -1, -1, -1},
+    { 9,  1,  0, 10,  5,  7, 10,  7,  3, 10,  3,  2, -1, -1, -1, -1},
+    { 2, 10,  5,  2,  5,  7,  2,  7,  8,  2,  8,  9,  2,  9,  1, -1},
+    { 5,  7,  3,  5,  3,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  1,  5,  0,  5,  7,  0,  7,  8, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  5,  7,  9,  7,  3,  9,  3,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  7,  8,  5,  8,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 8, 11, 10,  8, 10,  5,  8,  5,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3, 11,  0, 11, 10,  0, 10,  5,  0,  5,  4, -1, -1, -1, -1},
+    { 9,  1,  0,  8, 11, 10,  8, 10,  5,  8,  5,  4, -1, -1, -1, -1},
+    { 3, 11, 10,  3, 10,  5,  3,  5,  4,  3,  4,  9,  3,  9,  1, -1},
+    { 5,  4,  8,  5,  8, 11,  5, 11,  2,  5,  2,  1, -1, -1, -1, -1},
+    {11,  2,  1, 11,  1,  5, 11,  5,  4, 11,  4,  0, 11,  0,  3, -1},
+    { 5,  4,  8,  5,  8, 11,  5, 11,  2,  5,  2,  0,  5,  0,  9, -1},
+    { 2,  3, 11,  9,  5,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {10,  5,  4, 10,  4,  8, 10,  8,  3, 10,  3,  2, -1, -1, -1, -1},
+    { 0,  2, 10,  0, 10,  5,  0,  5,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  1,  0, 10,  5,  4, 10,  4,  8, 10,  8,  3, 10,  3,  2, -1},
+    { 2, 10,  5,  2,  5,  4,  2,  4,  9,  2,  9,  1, -1, -1, -1, -1},
+    { 5,  4,  8,  5,  8,  3,  5,  3,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  1,  5,  0,  5,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  4,  8,  5,  8,  3,  5,  3,  0,  5,  0,  9, -1, -1, -1, -1},
+    { 9,  5,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  7, 11,  4, 11, 10,  4, 10,  9, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3,  8,  4,  7, 11,  4, 11, 10,  4, 10,  9, -1, -1, -1, -1},
+    { 4,  7, 11,  4, 11, 10,  4, 10,  1,  4,  1,  0, -1, -1, -1, -1},
+    { 1,  3,  8,  1,  8,  4,  1,  4,  7,  1,  7, 11,  1, 11, 10, -1},
+    { 9,  4,  7,  9,  7, 11,  9, 11,  2,  9,  2,  1, -1, -1, -1, -1},
+    { 8,  0,  3,  9,  4,  7,  9,  7, 11,  9, 11,  2,  9,  2,  1, -1},
+    { 4,  7, 11,  4, 11,  2,  4,  2,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  3,  8,  2,  8,  4,  2,  4,  7,  2,  7, 11, -1, -1, -1, -1},
+    {10,  9,  4, 10,  4,  7, 10,  7,  3, 10,  3,  2, -1, -1, -1, -1},
+    { 2, 10,  9,  2,  9,  4,  2,  4,  7,  2,  7,  8,  2,  8,  0, -1},
+    { 4,  7,  3,  4,  3,  2,  4,  2, 10,  4, 10,  1,  4,  1,  0, -1},
+    { 1,  2, 10,  4,  7,  8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  4,  7,  9,  7,  3,  9,  3,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  9,  4,  1,  4,  7,  1,  7,  8,  1,  8,  0, -1, -1, -1, -1},
+    { 4,  7,  3,  4,  3,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  7,  8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  8, 11,  9, 11, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  3, 11,  0, 11, 10,  0, 10,  9, -1, -1, -1, -1, -1, -1, -1},
+    { 8, 11, 10,  8, 10,  1,  8,  1,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3, 11,  1, 11, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  8, 11,  9, 11,  2,  9,  2,  1, -1, -1, -1, -1, -1, -1, -1},
+    {11,  2,  1, 11,  1,  9, 11,  9,  0, 11,  0,  3, -1, -1, -1, -1},
+    { 8, 11,  2,  8,  2,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  3, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {10,  9,  8, 10,  8,  3, 10,  3,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2, 10,  0, 10,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  3,  2,  8,  2, 10,  8, 10,  1,  8,  1,  0, -1, -1, -1, -1},
+    { 1,  2, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 9,  8,  3,  9,  3,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  1,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 8,  3,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}
+};
+
+}
+
+MarchingCubes::MarchingCubes(const BrickedVolume& volume)
+    : volume_(volume),
+    dimX_(volume.getDim()[0]),
+    dimY_(volume.getDim()[1]),
+    dimZ_(volume.getDim()[2])
+{
+    for (int i = 0; i < 3; ++i) {
+        offset_[i]  = static_cast<float>(volume.getOrigin()[i]);
+        spacing_[i] = static_cast<float>(volume.getSpacing()[i]);
+    }
+}
+
+bool MarchingCubes::extract(int isolevel, Mesh& mesh, const std::function<bool()>& cancelled) const
+{
+    mesh = Mesh();
+    if (dimX_ < 2 || dimY_ < 2 || dimZ_ < 2) return true;
+
+    // What one thread made from its slab, the vertices still know their grid edge for the welding
+    struct Part {
+        std::vector<float>         vertices;
+        std::vector<std::uint64_t> edges;
+        std::vector<std::uint32_t> triangles;
+        int zBegin = 0;
+        int zEnd = 0;
+    };
+
+    const std::size_t sliceSize = static_cast<std::size_t>(dimX_) * dimY_;
+    const int cubesZ = dimZ_ - 1;
+
+    // the voxel index offset of every corner of a cube
+    std::size_t cornerIndex[8];
+    for (int c = 0; c < 8; ++c)
+        cornerIndex[c] = cornerOffset[c][2] * sliceSize + cornerOffset[c][1] * static_cast<std::size_t>(dimX_) + cornerOffset[c][0];
+
+    std::vector<Part> parts(omp_get_max_threads());
+    std::atomic<bool> stopped{false};
+    const std::array<int, 3>& brickDim = volume_.getBrickDim();
+    constexpr int BRICK_SIZE = BrickedVolume::BRICK_SIZE;
+
+    #pragma omp parallel num_threads(static_cast<int>(parts.size()))
+    {
+        const int thread = omp_get_thread_num();
+        const int nThreads = omp_get_num_threads();
+        Part& part = parts[thread];
+        part.zBegin = static_cast<int>(static_cast<long long>(cubesZ) * thread / nThreads);
+        part.zEnd   = static_cast<int>(static_cast<long long>(cubesZ) * (thread + 1) / nThreads);
+
+        // the vertex of every grid edge this thread already made
+        std::unordered_map<std::uint64_t, std::uint32_t> vertexOfEdge;
+
+        // the two slices of the layer of cubes (the lower one is the upper one of the layer before), and which 8x8
+        // cubes of the layer may have a surface
+        std::vector<unsigned char> lower(sliceSize), upper(sliceSize);
+        std::vector<unsigned char> active(static_cast<std::size_t>(brickDim[0]) * brickDim[1]);
+        if (part.zBegin < part.zEnd) volume_.copySlice(part.zBegin, lower.data());
+
+        for (int z = part.zBegin; z < part.zEnd && !stopped; ++z) {
+            if (cancelled && cancelled()) {
+                stopped = true;
+                break;
+            }
+            volume_.copySlice(z + 1, upper.data());
+            const unsigned char* slices[2] = { lower.data(), upper.data() };
+
+            // The cubes of an 8x8 block only touch their bricks and the next ones, if those are all under (or all
+            // over) the iso-level, no surface goes through the block. That is most of the volume.
+            const int bz0 = z / BRICK_SIZE, bz1 = std::min(z + 1, dimZ_ - 1) / BRICK_SIZE;
+            bool anyActive = false;
+            for (int by = 0; by < brickDim[1]; ++by) {
+                for (int bx = 0; bx < brickDim[0]; ++bx) {
+                    int low = 255, high = 0;
+                    for (int bz = bz0; bz <= bz1; ++bz)
+                        for (int ny = by; ny <= std::min(by + 1, brickDim[1] - 1); ++ny)
+                            for (int nx = bx; nx <= std::min(bx + 1, brickDim[0] - 1); ++nx) {
+                                const std::size_t brick = volume_.brickIndex(nx, ny, bz);
+                                low  = std::min<int>(low, volume_.brickMinimum(brick));
+                                high = std::max<int>(high, volume_.brickMaximum(brick));
+                            }
+                    const bool crosses = low < isolevel && high >= isolevel;
+                    active[static_cast<std::size_t>(by) * brickDim[0] + bx] = crosses;
+                    anyActive = anyActive || crosses;
+                }
+            }
+
+            for (int y = 0; y < dimY_ - 1 && anyActive; ++y) {
+                const unsigned char* activeRow = active.data() + static_cast<std::size_t>(y / BRICK_SIZE) * brickDim[0];
+                for (int x = 0; x < dimX_ - 1; ++x) {
+                    if (!activeRow[x / BRICK_SIZE]) {
+                        x += BRICK_SIZE - 1 - (x % BRICK_SIZE);
+                        continue;
+                    }
+                    const std::size_t base = z * sliceSize + static_cast<std::size_t>(y) * dimX_ + x;
+
+                    int values[8];
+                    int cube = 0;
+                    for (int c = 0; c < 8; ++c) {
+                        values[c] = slices[cornerOffset[c][2]][static_cast<std::size_t>(y + cornerOffset[c][1]) * dimX_ + x + cornerOffset[c][0]];
+                        if (values[c] >= isolevel) cube |= 1 << c;
+                    }
+                    if (edgeTable[cube] == 0) continue;
+
+                    for (int t = 0; triangleTable[cube][t] != -1; t += 3) {
+                        std::uint32_t triangle[3];
+                        for (int k = 0; k < 3; ++k) {
+                            const int e = triangleTable[cube][t + k];
+                            const std::uint64_t edge = (base + cornerIndex[edgeOwner[e]]) * 3 + edgeAxis[e];
+
+                            auto found = vertexOfEdge.find(edge);
+                            if (found != vertexOfEdge.end()) {
+                                triangle[k] = found->second;
+                                continue;
+                            }
+
+                            // where the iso-level is along the edge
+                            const int a = edgeCorners[e][0], b = edgeCorners[e][1];
+                            const float w = static_cast<float>(isolevel - values[a]) / static_cast<float>(values[b] - values[a]);
+                            const float px = x + cornerOffset[a][0] + w * (cornerOffset[b][0] - cornerOffset[a][0]);
+                            const float py = y + cornerOffset[a][1] + w * (cornerOffset[b][1] - cornerOffset[a][1]);
+                            const float pz = z + cornerOffset[a][2] + w * (cornerOffset[b][2] - cornerOffset[a][2]);
+
+                            // to the scatter, y and z swapped
+                            const std::uint32_t vertex = static_cast<std::uint32_t>(part.edges.size());
+                            part.vertices.push_back(offset_[0] + spacing_[0] * px);
+                            part.vertices.push_back(offset_[2] + spacing_[2] * pz);
+                            part.vertices.push_back(offset_[1] + spacing_[1] * py);
+                            part.edges.push_back(edge);
+                            vertexOfEdge.emplace(edge, vertex);
+                            triangle[k] = vertex;
+                        }
+
+                        // swapping y and z mirrors the mesh, so the winding is swapped as well to keep the normals out
+                        part.triangles.push_back(triangle[0]);
+                        part.triangles.push_back(triangle[2]);
+                        part.triangles.push_back(triangle[1]);
+                    }
+                }
+            }
+            lower.swap(upper);
+        }
+    }
+
+    if (stopped) return false;
+
+    // Put the parts together. Only the vertices on the plane between two slabs (x or y edges, on the first or the last
+    // slice of a slab) can be made twice, those are welded through a map.
+    std::size_t nVertices = 0, nTriangles = 0;
+    for (const Part& part : parts) {
+        nVertices  += part.edges.size();
+        nTriangles += part.triangles.size();
+    }
+    mesh.vertices.reserve(nVertices * 3);
+    mesh.triangles.reserve(nTriangles);
+
+    std::unordered_map<std::uint64_t, std::uint32_t> shared;
+    std::vector<std::uint32_t> remap;
+    for (const Part& part : parts) {
+        remap.resize(part.edges.size());
+        for (std::size_t i = 0; i < part.edges.size(); ++i) {
+            const std::uint64_t edge = part.edges[i];
+            const int axis = static_cast<int>(edge % 3);
+            const int z    = static_cast<int>((edge / 3) / sliceSize);
+            const std::uint32_t vertex = static_cast<std::uint32_t>(mesh.vertices.size() / 3);
+
+            if (axis != 2 && (z == part.zBegin || z == part.zEnd)) {
+                auto inserted = shared.emplace(edge, vertex);
+                if (!inserted.second) {
+                    remap[i] = inserted.first->second;
+                    continue;
+                }
+            }
+            remap[i] = vertex;
+            mesh.vertices.insert(mesh.vertices.end(), part.vertices.begin() + 3 * i, part.vertices.begin() + 3 * i + 3);
+        }
+        for (std::uint32_t v : part.triangles) mesh.triangles.push_back(remap[v]);
+    }
+
+    return true;
+}
+
+void MarchingCubes::decimate(Mesh& mesh, float cellSize)
+{
+    if (cellSize <= 0.0f || mesh.vertices.empty()) return;
+
+    const std::size_t nVertices = mesh.vertices.size() / 3;
+    float minimum[3] = { mesh.vertices[0], mesh.vertices[1], mesh.vertices[2] };
+    for (std::size_t v = 0; v < nVertices; ++v)
+        for (int k = 0; k < 3; ++k) minimum[k] = std::min(minimum[k], mesh.vertices[3 * v + k]);
+
+    // every vertex goes to its cell, the new vertex of a cell is the average of the vertices in it
+    std::unordered_map<std::uint64_t, std::uint32_t> vertexOfCell;
+    vertexOfCell.reserve(nVertices / 4);
+    std::vector<std::uint32_t> remap(nVertices);
+    std::vector<double> sum;
+    std::vector<std::uint32_t> count;
+    for (std::size_t v = 0; v < nVertices; ++v) {
+        std::uint64_t key = 0;
+        for (int k = 0; k < 3; ++k) {
+            const std::uint64_t cell = static_cast<std::uint64_t>((mesh.vertices[3 * v + k] - minimum[k]) / cellSize);
+            key = (key << 21) | (cell & 0x1FFFFF);
+        }
+        auto inserted = vertexOfCell.emplace(key, static_cast<std::uint32_t>(count.size()));
+        if (inserted.second) {
+            sum.insert(sum.end(), 3, 0.0);
+            count.push_back(0);
+        }
+        const std::uint32_t target = inserted.first->second;
+        for (int k = 0; k < 3; ++k) sum[3 * target + k] += mesh.vertices[3 * v + k];
+        count[target]++;
+        remap[v] = target;
+    }
+
+    mesh.vertices.resize(count.size() * 3);
+    for (std::size_t v = 0; v < count.size(); ++v)
+        for (int k = 0; k < 3; ++k) mesh.vertices[3 * v + k] = static_cast<float>(sum[3 * v + k] / count[v]);
+
+    // the triangles that collapsed (two corners in the same cell) are gone
+    std::size_t kept = 0;
+    for (std::size_t t = 0; t + 2 < mesh.triangles.size(); t += 3) {
+        const std::uint32_t a = remap[mesh.triangles[t]], b = remap[mesh.triangles[t + 1]], c = remap[mesh.triangles[t + 2]];
+        if (a == b || b == c || a == c) continue;
+        mesh.triangles[kept++] = a;
+        mesh.triangles[kept++] = b;
+        mesh.triangles[kept++] = c;
+    }
+    mesh.triangles.resize(kept);
+    mesh.normals.clear();
+}
+
+void MarchingCubes::computeNormals(Mesh& mesh)
+{
+    mesh.normals.assign(mesh.vertices.size(), 0.0f);
+
+    // the cross product of two sides is the normal of the triangle times twice its area
+    const float* p = mesh.vertices.data();
+    for (std::size_t t = 0; t + 2 < mesh.triangles.size(); t += 3) {
+        const std::uint32_t a = mesh.triangles[t], b = mesh.triangles[t + 1], c = mesh.triangles[t + 2];
+        const float u[3] = { p[3*b] - p[3*a], p[3*b+1] - p[3*a+1], p[3*b+2] - p[3*a+2] };
+        const float v[3] = { p[3*c] - p[3*a], p[3*c+1] - p[3*a+1], p[3*c+2] - p[3*a+2] };
+        const float n[3] = { u[1]*v[2] - u[2]*v[1], u[2]*v[0] - u[0]*v[2], u[0]*v[1] - u[1]*v[0] };
+        for (std::uint32_t vertex : { a, b, c })
+            for (int k = 0; k < 3; ++k) mesh.normals[3 * vertex + k] += n[k];
+    }
+
+    for (std::size_t v = 0; v < mesh.normals.size(); v += 3) {
+        const float length = std::sqrt(mesh.normals[v]*mesh.normals[v] + mesh.normals[v+1]*mesh.normals[v+1] + mesh.normals[v+2]*mesh.normals[v+2]);
+        if (length > 0.0f)
+            for (int k = 0; k < 3; ++k) mesh.normals[v + k] /= length;
+    }
+}
+
+bool MarchingCubes::writeObj(const Mesh& mesh, const std::string& filename, const float center[3])
+{
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) return false;
+
+    // formatted with to_chars into one buffer, written every megabyte (millions of lines, no streams per number)
+    std::string buffer;
+    buffer.reserve(1024 * 1024 + 256);
+    char number[64];
+    auto addFloat = [&](float value) {
+        auto result = std::to_chars(number, number + sizeof(number), static_cast<double>(value), std::chars_format::fixed, 4);
+        buffer.push_back(' ');
+        buffer.append(number, result.ptr);
+    };
+    auto flushIfFull = [&]() {
+        if (buffer.size() < 1024 * 1024) return;
+        file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+    };
+
+    const std::size_t nVertices = mesh.vertices.size() / 3;
+    for (std::size_t v = 0; v < nVertices; ++v) {
+        buffer.push_back('v');
+        for (int k = 0; k < 3; ++k) addFloat(mesh.vertices[3 * v + k] - center[k]);
+        buffer.push_back('\n');
+        flushIfFull();
+    }
+    for (std::size_t v = 0; v < mesh.normals.size() / 3; ++v) {
+        buffer.append("vn");
+        for (int k = 0; k < 3; ++k) addFloat(mesh.normals[3 * v + k]);
+        buffer.push_back('\n');
+        flushIfFull();
+    }
+
+    // Qt wants texture coordinates, all vertices have the same one (the texture is one color anyway)
+    buffer.append("vt 0 0\n");
+    const bool withNormals = !mesh.normals.empty();
+    for (std::size_t t = 0; t + 2 < mesh.triangles.size(); t += 3) {
+        buffer.push_back('f');
+        for (int k = 0; k < 3; ++k) {
+            // vertex/texture/normal, the vertex and its normal have the same index
+            auto result = std::to_chars(number, number + sizeof(number), mesh.triangles[t + k] + 1);
+            buffer.push_back(' ');
+            buffer.append(number, result.ptr);
+            buffer.append("/1");
+            if (withNormals) {
+                buffer.push_back('/');
+                buffer.append(number, result.ptr);
+            }
+        }
+        buffer.push_back('\n');
+        flushIfFull();
+    }
+
+    file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    file.close();
+    return static_cast<bool>(file);
+}
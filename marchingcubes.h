@@ -0,0 +1,80 @@
+#ifndef MARCHINGCUBES_H
+#define MARCHINGCUBES_H
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <cstdint>
+
+#include "brickedvolume.h"
+
+/**
+ * @class MarchingCubes
+ * @brief Extracts the bone surface (an iso-surface of the volume) as a triangle mesh.
+ *
+ * For the context. The reconstructed volume is shown as a point cloud of the voxels over a threshold (see
+ * Volume3DController), which means hundreds of thousands of points for a bone. The surface of the same bone at the
+ * same threshold is a mesh that is two orders of magnitude lighter, and it is a normal opaque mesh, so it doesn't have
+ * the rendering problem of QCustom3DVolumetric with the A-mode signal.
+ *
+ * The volume is split into slabs (along z) and every thread does the marching cubes of its own slab. A vertex is made
+ * once for every edge of the voxel grid that crosses the iso-level, and the triangles that meet at that edge share it
+ * (welding), also across the slabs. The triangle table was generated so that the ambiguous faces are always split the
+ * same way (the corners over the iso-level are cut off), so two neighbouring cubes always agree and the mesh has no
+ * holes. The mesh can be decimated afterwards (vertex clustering) and written as an .obj file.
+ *
+ * The volume is a BrickedVolume. Every thread takes the two slices of its layer of cubes out of the bricks, and skips
+ * the 8x8 cubes whose bricks are all under or all over the iso-level (no surface can go through them).
+ *
+ * The vertices are in the coordinates of the scatter (mm, offset and spacing of the volume, y and z swapped), the same
+ * as the points of Volume3DController. The normals point out of the bone (towards lower intensity).
+ */
+class MarchingCubes
+{
+public:
+
+    /**
+     * @struct Mesh
+     * @brief A triangle mesh, flat arrays.
+     */
+    struct Mesh {
+        std::vector<float>         vertices;    // x y z of every vertex
+        std::vector<float>         normals;     // x y z of the normal of every vertex (after computeNormals())
+        std::vector<std::uint32_t> triangles;   // three vertex indices per triangle
+    };
+
+    /**
+     * @brief Constructor function, the volume must live as long as this object.
+     */
+    MarchingCubes(const BrickedVolume& volume);
+
+    /**
+     * @brief Extracts the surface of the voxels that are >= isolevel. It stops early (returns false) if cancelled()
+     * returns true, it is asked once per slice.
+     */
+    bool extract(int isolevel, Mesh& mesh, const std::function<bool()>& cancelled = nullptr) const;
+
+    /**
+     * @brief Decimates the mesh by vertex clustering, all vertices within a cube of cellSize (mm) become one.
+     */
+    static void decimate(Mesh& mesh, float cellSize);
+
+    /**
+     * @brief Computes the normal of every vertex, the average of the triangles around it (weighted with their area).
+     */
+    static void computeNormals(Mesh& mesh);
+
+    /**
+     * @brief Writes the mesh as a Wavefront .obj file (with normals and one texture coordinate, as Qt wants it).
+     * The vertices are written relative to center.
+     */
+    static bool writeObj(const Mesh& mesh, const std::string& filename, const float center[3]);
+
+private:
+    const BrickedVolume& volume_;   //!< The voxels
+    int dimX_, dimY_, dimZ_;        //!< Size of the volume
+    float offset_[3];               //!< Offset of the volume (mm)
+    float spacing_[3];              //!< Spacing of the voxels (mm)
+};
+
+#endif // MARCHINGCUBES_H
@@ -113,6 +113,25 @@ void MeasurementWindow::on_amodeTimedRecordingStopped()
     ui->label_statusIntermRec->setStyleSheet("QLabel { color : rgb(100, 100, 100); background-color : rgb(200, 200, 200); }");
 }
 
+void MeasurementWindow::on_amodeMocapRecordingFailed(const QString &reason)
+{
+    if (!isMeasurementRecording) return;
+
+    // nothing is recorded, so the window goes back to the state before the record button, like after stopping
+    disconnect(myAmodeConnection, &AmodeConnection::dataReceived, myAmodeMocapRecorder, &AmodeMocapRecorder::onAmodeSignalReceived);
+    disconnect(myMocapConnection, &MocapConnection::dataReceived, myAmodeMocapRecorder, &AmodeMocapRecorder::onRigidBodyReceived);
+
+    ui->pushButton_recordButton->setText("Record");
+    ui->pushButton_recordButton->setIcon(QIcon::fromTheme(QIcon::ThemeIcon::MediaRecord));
+    ui->comboBox_poseLogFormat->setEnabled(true);
+    isMeasurementRecording = false;
+
+    QMessageBox::warning(this, "Recording failed", reason);
+
+    // the timed recording can go on, like after a normal recording
+    emit request_start_amodeTimedRecording();
+}
+
 
 void MeasurementWindow::on_pushButton_recordPath_clicked()
 {
@@ -160,10 +179,14 @@ void MeasurementWindow::on_pushButton_recordButton_clicked()
         // instantiate the AmodeMocapRecorder class
         myAmodeMocapRecorder = new AmodeMocapRecorder(nullptr);
         myAmodeMocapRecorder->setFilePath(ui->lineEdit_recordPath->text());
+        // the pose log is binary (default) or the old CSV, it has to be decided before the recording starts
+        myAmodeMocapRecorder->setPoseLogFormat(ui->comboBox_poseLogFormat->currentIndex() == 1 ? DataWriter::Format::CSV : DataWriter::Format::Binary);
 
         // connect signals to AmodeMocapRecorder slots
         connect(myAmodeConnection, &AmodeConnection::dataReceived, myAmodeMocapRecorder, &AmodeMocapRecorder::onAmodeSignalReceived);
         connect(myMocapConnection, &MocapConnection::dataReceived, myAmodeMocapRecorder, &AmodeMocapRecorder::onRigidBodyReceived);
+        // the recording may fail to start (now or when the data comes), queued so that it comes after this function
+        connect(myAmodeMocapRecorder, &AmodeMocapRecorder::recordingFailed, this, &MeasurementWindow::on_amodeMocapRecordingFailed, Qt::QueuedConnection);
 
         // start recording
         myAmodeMocapRecorder->startRecording();
@@ -180,6 +203,8 @@ void MeasurementWindow::on_pushButton_recordButton_clicked()
         // change the button text
         ui->pushButton_recordButton->setText("Stop");
         ui->pushButton_recordButton->setIcon(QIcon::fromTheme(QIcon::ThemeIcon::ProcessStop));
+        // the format can't change in the middle of a recording
+        ui->comboBox_poseLogFormat->setEnabled(false);
         // reset the flag
         isMeasurementRecording = true;
     }
@@ -198,6 +223,7 @@ void MeasurementWindow::on_pushButton_recordButton_clicked()
         // change the button text
         ui->pushButton_recordButton->setText("Record");
         ui->pushButton_recordButton->setIcon(QIcon::fromTheme(QIcon::ThemeIcon::MediaRecord));
+        ui->comboBox_poseLogFormat->setEnabled(true);
 
         // give information to user that it finished recording
         QMessageBox::information(this, "Finsihed recording", "Recording is finished. Check measurement folder.");
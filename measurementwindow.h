@@ -28,6 +28,7 @@ public slots:
     // void on_mocapDisconnected();
     void on_amodeTimedRecordingStarted();
     void on_amodeTimedRecordingStopped();
+    void on_amodeMocapRecordingFailed(const QString &reason);
 
 private slots:
     void on_pushButton_recordPath_clicked();
@@ -2,117 +2,208 @@
 #include <iostream>
 #include <sstream>
 #include <iterator>
-
+#include <stdexcept>
+#include <algorithm>
+#include <climits>
+#include <new>
+#include <utility>
+#include <cstdint>
+
+#include <QtConcurrent/QtConcurrent>
+#include <QFuture>
 #include <QtZlib/zlib.h>
 
+// Size of the pieces of the inflated volume whose checksum is computed in parallel
+static constexpr std::size_t CHECKSUM_SLICE_SIZE = 4 * 1024 * 1024;
+// Most voxels one inflate() call makes. Its checksum is combined with adler32_combine(), whose length is a z_off_t, a
+// 32 bit long on Windows, so a piece must stay far below 2GB
+static constexpr std::size_t INFLATE_OUTPUT_SIZE = 1024 * 1024 * 1024;
+// The best that deflate can do, one 258-byte match costs at least 2 bits
+static constexpr std::size_t MAXIMUM_COMPRESSION_RATIO = 1032;
+
+// Removes the whitespaces at both ends of a piece of the header
+static std::string_view trim(std::string_view text)
+{
+    const char* whitespaces = " \t\n\r\f\v";
+    std::size_t first = text.find_first_not_of(whitespaces);
+    if (first == std::string_view::npos) return std::string_view();
+    std::size_t last = text.find_last_not_of(whitespaces);
+    return text.substr(first, last - first + 1);
+}
+
 MHAReader::MHAReader(std::string filename) : filename_(filename)
 {
-    mhaFile_.open(filename_, std::ios::binary);
-    if (!mhaFile_.is_open()) {
+    header_.CompressedData = false;
+    header_.CompressedDataSize = 0;
+    mhaFile_.setFileName(QString::fromStdString(filename_));
+    if (!mhaFile_.open(QIODevice::ReadOnly)) {
         throw std::runtime_error("Unable to open file: " + filename_);
     }
 }
 
-bool MHAReader::readHeader(const std::string& text)
+MHAReader::MHAReader(const MHAReader::MHAHeader& header, BrickedVolume volume)
+    : header_(header), bricked_(std::move(volume))
 {
-    std::istringstream iss(text);
-    std::string line;
-
-    while (std::getline(iss, line))
-    {
-        // Find the delimiter
-        size_t equalSignPos = line.find('=');
-
-        // Get the first part of the string (key)
-        std::string key = line.substr(0, equalSignPos);
-        key.erase(key.find_last_not_of(" \t\n\r\f\v") + 1);
-
-        // Get the second part of the string (value)
-        std::string value = line.substr(equalSignPos + 1);
-        value.erase(0, value.find_first_not_of(" \t\n\r\f\v"));
-
-        if (key == "ObjectType")
-        {
-            header_.ObjectType = value;
-        }
-
-        else if (key == "NDims")
-        {
-            header_.NDims = std::stoi(value);
-        }
-
-        else if (key == "BinaryData")
-        {
-            header_.BinaryData = (value == "True");
-        }
-        else if (key == "BinaryDataByteOrderMSB")
-        {
-            header_.BinaryDataByteOrderMSB = (value == "True");
-        }
-
-        else if (key == "CompressedData")
-        {
-            header_.CompressedData = (value == "True");
-        }
-
-        else if (key == "TransformMatrix")
-        {
-            std::istringstream iss_value(value);
-            std::vector<int> vec((std::istream_iterator<int>(iss_value)), std::istream_iterator<int>());
-            header_.TransformMatrix = vec;
-        }
-
-        else if (key == "DimSize")
-        {
-            std::istringstream iss_value(value);
-            std::vector<int> vec((std::istream_iterator<int>(iss_value)), std::istream_iterator<int>());
-            header_.DimSize = vec;
-        }
-
-        else if (key == "Offset")
-        {
-            std::istringstream iss_value(value);
-            std::vector<double> vec((std::istream_iterator<double>(iss_value)), std::istream_iterator<double>());
-            header_.Offset = vec;
-        }
-
-        else if (key == "CenterOfRotation")
-        {
-            std::istringstream iss_value(value);
-            std::vector<int> vec((std::istream_iterator<int>(iss_value)), std::istream_iterator<int>());
-            header_.CenterOfRotation = vec;
-        }
+    // nothing to read, the bricks are simply ours now (there are no dense voxels, getMHAVolume() is empty)
+}
 
-        else if (key == "AnatomicalOrientation")
-        {
-            header_.AnatomicalOrientation = value;
-        }
+MHAReader::~MHAReader()
+{
+    // unmaps the file as well
+    mhaFile_.close();
+}
 
-        else if (key == "ElementSpacing")
-        {
-            std::istringstream iss_value(value);
-            std::vector<double> vec((std::istream_iterator<double>(iss_value)), std::istream_iterator<double>());
-            header_.ElementSpacing = vec;
-        }
+bool MHAReader::readHeader(std::string_view text)
+{
+    // the Seq_Frame lines are parsed after the rest, when DimSize tells how many frames there are
+    std::vector<std::pair<std::string_view, std::string_view>> frameFields;
 
-        else if (key == "ElementType")
+    // std::stoi and friends throw on a broken number, that is a broken header
+    try {
+        while (!text.empty())
         {
-            header_.ElementType = value;
+            // One line of the header, directly in the mapped file
+            std::size_t lineEnd = text.find('\n');
+            std::string_view line = text.substr(0, lineEnd);
+            text = (lineEnd == std::string_view::npos) ? std::string_view() : text.substr(lineEnd + 1);
+
+            // Find the delimiter
+            size_t equalSignPos = line.find('=');
+            if (equalSignPos == std::string_view::npos) continue;
+
+            // Get the first part of the string (key)
+            std::string_view key = trim(line.substr(0, equalSignPos));
+
+            // Get the second part of the string (value)
+            std::string value(trim(line.substr(equalSignPos + 1)));
+
+            if (key.substr(0, 9) == "Seq_Frame")
+            {
+                frameFields.emplace_back(key, trim(line.substr(equalSignPos + 1)));
+            }
+
+            else if (key == "ObjectType")
+            {
+                header_.ObjectType = value;
+            }
+
+            else if (key == "NDims")
+            {
+                header_.NDims = std::stoi(value);
+            }
+
+            else if (key == "BinaryData")
+            {
+                header_.BinaryData = (value == "True");
+            }
+            else if (key == "BinaryDataByteOrderMSB")
+            {
+                header_.BinaryDataByteOrderMSB = (value == "True");
+            }
+
+            else if (key == "CompressedData")
+            {
+                header_.CompressedData = (value == "True");
+            }
+
+            else if (key == "CompressedDataSize")
+            {
+                header_.CompressedDataSize = std::stoll(value);
+            }
+
+            else if (key == "TransformMatrix")
+            {
+                std::istringstream iss_value(value);
+                std::vector<int> vec((std::istream_iterator<int>(iss_value)), std::istream_iterator<int>());
+                header_.TransformMatrix = vec;
+            }
+
+            else if (key == "DimSize")
+            {
+                std::istringstream iss_value(value);
+                std::vector<int> vec((std::istream_iterator<int>(iss_value)), std::istream_iterator<int>());
+                header_.DimSize = vec;
+            }
+
+            else if (key == "Offset")
+            {
+                std::istringstream iss_value(value);
+                std::vector<double> vec((std::istream_iterator<double>(iss_value)), std::istream_iterator<double>());
+                header_.Offset = vec;
+            }
+
+            else if (key == "CenterOfRotation")
+            {
+                std::istringstream iss_value(value);
+                std::vector<int> vec((std::istream_iterator<int>(iss_value)), std::istream_iterator<int>());
+                header_.CenterOfRotation = vec;
+            }
+
+            else if (key == "AnatomicalOrientation")
+            {
+                header_.AnatomicalOrientation = value;
+            }
+
+            else if (key == "ElementSpacing")
+            {
+                std::istringstream iss_value(value);
+                std::vector<double> vec((std::istream_iterator<double>(iss_value)), std::istream_iterator<double>());
+                header_.ElementSpacing = vec;
+            }
+
+            else if (key == "ElementType")
+            {
+                header_.ElementType = value;
+            }
+
+            else if (key == "UltrasoundImageOrientation")
+            {
+                header_.UltrasoundImageOrientation = value;
+            }
+
+            else if (key == "UltrasoundImageType")
+            {
+                header_.UltrasoundImageType = value;
+            }
+
+            else if (key == "ElementDataFile")
+            {
+                header_.ElementDataFile = value;
+            }
         }
+    } catch (const std::exception& e) {
+        std::cerr << "Error parsing header: " << e.what() << std::endl;
+        return false;
+    }
 
-        else if (key == "UltrasoundImageOrientation")
-        {
-            header_.UltrasoundImageOrientation = value;
+    // every dimension of the volume must be there and not empty
+    if (header_.DimSize.size() < 3) {
+        std::cerr << "Error parsing header: DimSize needs 3 values." << std::endl;
+        return false;
+    }
+    for (int dim : header_.DimSize) {
+        if (dim <= 0) {
+            std::cerr << "Error parsing header: DimSize has a value that is not positive." << std::endl;
+            return false;
         }
+    }
 
-        else if (key == "UltrasoundImageType")
-        {
-            header_.UltrasoundImageType = value;
-        }
+    if (frameFields.empty()) return true;
 
-        else if (key == "ElementDataFile")
-        {
-            header_.ElementDataFile = value;
+    // A sequence has DimSize[2] frames, and every frame has its own lines, so a header with fewer lines than frames
+    // is broken. That way a (broken) number in the file never allocates more than the header text is worth.
+    const std::size_t frameCount = static_cast<std::size_t>(header_.DimSize[2]);
+    if (frameCount > frameFields.size()) {
+        std::cerr << "Error parsing header: DimSize says " << frameCount << " frames, but there are only "
+                  << frameFields.size() << " Seq_Frame lines." << std::endl;
+        return false;
+    }
+    frames_.assign(frameCount, SequenceFrame());
+    for (const auto& [key, value] : frameFields) {
+        if (!readFrameField(key, std::string(value))) {
+            std::cerr << "Error parsing header: " << key << " is beyond the " << frameCount << " frames of DimSize." << std::endl;
+            frames_.clear();
+            return false;
         }
     }
 
@@ -121,110 +212,353 @@ bool MHAReader::readHeader(const std::string& text)
 
 bool MHAReader::readVolumeImage()
 {
+    // Map the entire file, nothing is read or copied here, the OS brings the pages when we touch them
+    mappedSize_ = static_cast<std::size_t>(mhaFile_.size());
+    mapped_     = mhaFile_.map(0, mhaFile_.size());
+    if (!mapped_) {
+        std::cerr << "Error mapping file: " << filename_ << std::endl;
+        return false;
+    }
+    std::string_view fileContents(reinterpret_cast<const char*>(mapped_), mappedSize_);
 
-    // Read the entire file into a string
-    std::stringstream buffer;
-    buffer << mhaFile_.rdbuf();
-    const std::string fileContents = buffer.str();
-
-    // Find the start of the binary data
-    std::string separator = "ElementDataFile = LOCAL\n";
-    const size_t binaryStart = fileContents.find(separator);
-    // Separate the binary data (from binaryStart to the end)
-    const std::string binaryData = fileContents.substr(binaryStart+separator.size());
-    // Parse the normal text section (up to binaryStart)
-    const std::string normalText = fileContents.substr(0, binaryStart+separator.size());
+    // Find the start of the binary data, it starts right after the line "ElementDataFile = LOCAL"
+    const size_t separatorStart = fileContents.find("ElementDataFile");
+    const size_t separatorEnd   = (separatorStart == std::string_view::npos) ? std::string_view::npos : fileContents.find('\n', separatorStart);
+    if (separatorEnd == std::string_view::npos) {
+        std::cerr << "Error parsing normal text section: ElementDataFile not found." << std::endl;
+        return false;
+    }
+    const size_t binaryStart = separatorEnd + 1;
 
-    // Check if there is error in parsing the header values
-    if (!readHeader(normalText)) {
+    // Check if there is error in parsing the header values (up to binaryStart)
+    if (!readHeader(fileContents.substr(0, binaryStart))) {
         std::cerr << "Error parsing normal text section." << std::endl;
         return false;
     }
 
-    // Check if there is error in transfering all the binary string data to volumeimage_
-    try {
-        if(!header_.CompressedData)
-        {
-            volumeimage_.insert(volumeimage_.end(), binaryData.begin(), binaryData.end());
+    // The size of the volume according to the header (readHeader() checked that the dimensions are positive)
+    std::size_t expectedSize = 1;
+    for (int dim : header_.DimSize) {
+        if (expectedSize > SIZE_MAX / static_cast<std::size_t>(dim)) {
+            std::cerr << "Error reading volume: DimSize is too big." << std::endl;
+            return false;
         }
-        else
-        {
-            // I am still struggling with compressed data, please don't use compressed option
-            // std::vector<unsigned char> compressedvolumeimage(binaryData.begin(), binaryData.end());
-            // std::vector<unsigned char> volumeimage_ = zlib_decompress(compressedvolumeimage);
+        expectedSize *= static_cast<std::size_t>(dim);
+    }
+
+    if(!header_.CompressedData)
+    {
+        // The voxels are simply the rest of the file, make the view point there
+        if (mappedSize_ - binaryStart < expectedSize) {
+            std::cerr << "Error reading volume: the file has fewer voxels than DimSize says." << std::endl;
+            return false;
         }
+        volumeimage_.data = mapped_ + binaryStart;
+        volumeimage_.size = expectedSize;
     }
-    catch (std::exception const& e) {
-        std::cerr << "Exception: " << e.what() << std::endl;
-        return false;
+    else
+    {
+        // The compressed data is the rest of the file, or CompressedDataSize bytes of it if the header tells
+        std::size_t compressedSize = mappedSize_ - binaryStart;
+        if (header_.CompressedDataSize > 0)
+            compressedSize = std::min(compressedSize, static_cast<std::size_t>(header_.CompressedDataSize));
+
+        // deflate never gets better than ~1032:1, more voxels than that is a broken DimSize, don't allocate for it
+        if (expectedSize / MAXIMUM_COMPRESSION_RATIO > compressedSize) {
+            std::cerr << "Error reading volume: DimSize says more voxels than the compressed data can have." << std::endl;
+            return false;
+        }
+
+        // a volume goes slab by slab straight into the bricks, the dense voxels are never in memory. A B-mode
+        // sequence is read dense (VolumeReconstructor reads it frame by frame).
+        if (frames_.empty() && header_.Offset.size() >= 3 && header_.ElementSpacing.size() >= 3)
+            return inflateBricked(mapped_ + binaryStart, compressedSize);
+
+        if (!inflateVolume(mapped_ + binaryStart, compressedSize, expectedSize))
+            return false;
+        volumeimage_.data = inflated_.get();
+        volumeimage_.size = expectedSize;
     }
 
-    // Close the file
-    mhaFile_.close();
+    // a B-mode sequence has the transformations of its frames, it is not bricked (VolumeReconstructor reads it dense)
+    if (frames_.empty()) makeBricked();
 
     return true;
 }
 
 
+bool MHAReader::readFrameField(std::string_view key, const std::string& value)
+{
+    // Seq_Frame0012_ProbeToTrackerDeviceTransform, the number is the frame, the rest is the field
+    std::size_t underscore = key.find('_', 9);
+    if (underscore == std::string_view::npos) return true;
+    std::string_view number = key.substr(9, underscore - 9);
+    std::string_view field  = key.substr(underscore + 1);
+    if (number.empty() || number.find_first_not_of("0123456789") != std::string_view::npos) return true;
+
+    // frames_ already has DimSize[2] frames, a number beyond them is a broken file (a very long number too)
+    if (number.size() > 9) return false;
+    std::size_t frame = static_cast<std::size_t>(std::stoul(std::string(number)));
+    if (frame >= frames_.size()) return false;
+    SequenceFrame& sequenceframe = frames_[frame];
+
+    // MHAWriter writes ProbeToTrackerDevice, fCal writes ProbeToTracker, both are fine
+    const bool isProbe     = field.substr(0, 14) == "ProbeToTracker";
+    const bool isReference = field.substr(0, 18) == "ReferenceToTracker";
+    if (!isProbe && !isReference) return true;
+
+    const bool isStatus = field.size() >= 6 && field.substr(field.size() - 6) == "Status";
+    if (isStatus)
+    {
+        (isProbe ? sequenceframe.probeValid : sequenceframe.referenceValid) = (value == "OK");
+    }
+    else
+    {
+        std::array<double, 16>& matrix = isProbe ? sequenceframe.probeToTracker : sequenceframe.referenceToTracker;
+        std::istringstream iss_value(value);
+        for (double& element : matrix) iss_value >> element;
+    }
+    return true;
+}
+
 MHAReader::MHAHeader MHAReader::getMHAHeader()
 {
     return header_;
 }
 
-std::vector<unsigned char> MHAReader::getMHAVolume()
+MHAReader::VoxelSpan MHAReader::getMHAVolume() const
 {
     return volumeimage_;
 }
 
-std::vector<unsigned char> MHAReader::zlib_decompress(const std::vector<unsigned char>& Z) {
-    // Create an input stream from the compressed data
-    z_stream stream;
-    stream.zalloc = Z_NULL;
-    stream.zfree = Z_NULL;
-    stream.opaque = Z_NULL;
-    stream.avail_in = static_cast<uInt>(Z.size());
-    stream.next_in = const_cast<Bytef*>(Z.data());
-
-    // Initialize zlib for decompression (skip header checks)
-    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
-        std::cerr << "Error initializing zlib for decompression." << std::endl;
-        exit(EXIT_FAILURE);
-    }
-
-    std::vector<unsigned char> decompressedData;
-    unsigned char buffer[8192]; // Adjust buffer size as needed
-
-    while (true) {
-        stream.avail_out = sizeof(buffer);
-        stream.next_out = buffer;
-
-        int ret = inflate(&stream, Z_NO_FLUSH);
-        if (ret == Z_STREAM_END) {
-            // Decompression complete
-            decompressedData.insert(decompressedData.end(), buffer, buffer + stream.total_out);
-            break;
-        } else if (ret == Z_BUF_ERROR) {
-            std::cerr << "Error during zlib decompression." << std::endl;
-            exit(EXIT_FAILURE);
-        }  else if (ret == Z_MEM_ERROR) {
-            std::cerr << "Error during zlib decompression." << std::endl;
-            exit(EXIT_FAILURE);
-        } else if (ret == Z_STREAM_ERROR) {
-            std::cerr << "Error during zlib decompression." << std::endl;
-            exit(EXIT_FAILURE);
-        } else if (ret == Z_NEED_DICT) {
-            std::cerr << "Error during zlib decompression." << std::endl;
-            exit(EXIT_FAILURE);
-        } else {
-            std::cerr << "Error during zlib decompression." << std::endl;
-            exit(EXIT_FAILURE);
+const std::vector<MHAReader::SequenceFrame>& MHAReader::getSequenceFrames() const
+{
+    return frames_;
+}
+
+const BrickedVolume& MHAReader::getBrickedVolume() const
+{
+    return bricked_;
+}
+
+void MHAReader::makeBricked()
+{
+    if (header_.DimSize.size() < 3 || header_.Offset.size() < 3 || header_.ElementSpacing.size() < 3) return;
+
+    const std::array<int, 3> dim = {header_.DimSize[0], header_.DimSize[1], header_.DimSize[2]};
+    if (static_cast<std::size_t>(dim[0]) * dim[1] * dim[2] != volumeimage_.size) {
+        std::cerr << "MHAReader::makeBricked() DimSize doesn't match the voxels, the volume is not bricked." << std::endl;
+        return;
+    }
+    bricked_ = BrickedVolume(volumeimage_.data,
+                             dim,
+                             {header_.Offset[0], header_.Offset[1], header_.Offset[2]},
+                             {header_.ElementSpacing[0], header_.ElementSpacing[1], header_.ElementSpacing[2]});
+}
+
+namespace {
+
+// adler32 of any size, zlib only takes uInt at a time
+uLong adlerOfRange(const unsigned char* data, std::size_t size)
+{
+    uLong adler = adler32(0L, Z_NULL, 0);
+    while (size > 0) {
+        uInt piece = static_cast<uInt>(std::min<std::size_t>(size, UINT_MAX));
+        adler = adler32(adler, data, piece);
+        data += piece;
+        size -= piece;
+    }
+    return adler;
+}
+
+// adler32 of a big range, every slice on its own in parallel, then combined
+uLong adlerOfRangeParallel(const unsigned char* data, std::size_t size)
+{
+    if (size <= CHECKSUM_SLICE_SIZE) return adlerOfRange(data, size);
+
+    std::vector<QFuture<uLong>> slices;
+    for (std::size_t offset = 0; offset < size; offset += CHECKSUM_SLICE_SIZE) {
+        const std::size_t length = std::min(CHECKSUM_SLICE_SIZE, size - offset);
+        slices.push_back(QtConcurrent::run([data, offset, length]() { return adlerOfRange(data + offset, length); }));
+    }
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (std::size_t slice = 0; slice < slices.size(); ++slice) {
+        const std::size_t length = std::min(CHECKSUM_SLICE_SIZE, size - slice * CHECKSUM_SLICE_SIZE);
+        adler = adler32_combine(adler, slices[slice].result(), static_cast<z_off_t>(length));
+    }
+    return adler;
+}
+
+/**
+ * @class ZlibVoxelReader
+ * @brief Inflates the compressed voxels piece by piece (the whole volume at once, or a slab at a time), and verifies
+ * the checksum of every zlib stream.
+ *
+ * MetaIO (fCal's VolumeReconstructor) writes one zlib stream, but some writers concatenate several of them, so every
+ * stream is inflated one after another. A deflate stream can't be split without decoding it (nobody knows where a
+ * block starts), so the inflate stays in one thread. Our writers (MHAWriter, VolumeReconstructor::writeVolume()) write
+ * one stream too, Plus and Slicer only read one. The checksums are computed here and not inside inflate (raw inflate),
+ * so the voxels of every piece are checksummed in parallel.
+ */
+class ZlibVoxelReader
+{
+public:
+
+    ZlibVoxelReader(const unsigned char* input, std::size_t inputSize) : input_(input), inputSize_(inputSize) {}
+    ZlibVoxelReader(const ZlibVoxelReader&) = delete;
+    ZlibVoxelReader &operator=(const ZlibVoxelReader&) = delete;
+    ~ZlibVoxelReader() { if (inStream_) inflateEnd(&zs_); }
+
+    // inflates exactly size voxels into output
+    bool read(unsigned char* output, std::size_t size)
+    {
+        std::size_t outPos = 0;
+        while (outPos < size) {
+            if (!inStream_ && !beginStream()) return false;
+
+            zs_.next_in   = const_cast<Bytef*>(input_ + inPos_);
+            zs_.avail_in  = static_cast<uInt>(std::min<std::size_t>(inputSize_ - inPos_, UINT_MAX));
+            zs_.next_out  = output + outPos;
+            zs_.avail_out = static_cast<uInt>(std::min<std::size_t>(size - outPos, INFLATE_OUTPUT_SIZE));
+            const uInt availIn = zs_.avail_in, availOut = zs_.avail_out;
+
+            int ret = inflate(&zs_, Z_NO_FLUSH);
+
+            const std::size_t produced = availOut - zs_.avail_out;
+            adler_  = adler32_combine(adler_, adlerOfRangeParallel(output + outPos, produced), static_cast<z_off_t>(produced));
+            inPos_  += availIn - zs_.avail_in;
+            outPos  += produced;
+
+            if (ret == Z_STREAM_END) {
+                if (!endStream()) return false;
+                continue;
+            }
+            // no progress at all, the input ended before the end of the stream
+            if (ret == Z_OK && availIn == zs_.avail_in && produced == 0) ret = Z_BUF_ERROR;
+            if (ret != Z_OK) {
+                if (ret == Z_BUF_ERROR && inPos_ == inputSize_)
+                    std::cerr << "Error reading volume: the compressed data is truncated." << std::endl;
+                else
+                    std::cerr << "Error during zlib decompression (" << ret << (zs_.msg ? std::string(", ") + zs_.msg : std::string()) << ")." << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // all voxels are read, the stream must end right here (inflate still has to see the end of its last block)
+    bool finish()
+    {
+        if (!inStream_) return true;
+
+        unsigned char nothing = 0;
+        zs_.next_in   = const_cast<Bytef*>(input_ + inPos_);
+        zs_.avail_in  = static_cast<uInt>(std::min<std::size_t>(inputSize_ - inPos_, UINT_MAX));
+        zs_.next_out  = &nothing;
+        zs_.avail_out = 0;
+        const uInt availIn = zs_.avail_in;
+        const int ret = inflate(&zs_, Z_NO_FLUSH);
+        inPos_ += availIn - zs_.avail_in;
+        if (ret != Z_STREAM_END) {
+            std::cerr << "Error reading volume: the compressed data has more voxels than DimSize says." << std::endl;
+            return false;
+        }
+        return endStream();
+    }
+
+private:
+
+    // zlib header: deflate, checksum of the header is right, and no preset dictionary
+    bool beginStream()
+    {
+        if (inputSize_ - inPos_ < 2) {
+            std::cerr << "Error reading volume: the compressed data has fewer voxels than DimSize says." << std::endl;
+            return false;
+        }
+        const unsigned char cmf = input_[inPos_], flg = input_[inPos_ + 1];
+        if ((cmf & 0x0F) != Z_DEFLATED || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20)) {
+            std::cerr << "Error reading volume: the compressed data is not a zlib stream." << std::endl;
+            return false;
         }
+        inPos_ += 2;
 
-        decompressedData.insert(decompressedData.end(), buffer, buffer + stream.total_out);
+        // raw inflate, the header and the trailer are checked here
+        zs_ = z_stream();
+        if (inflateInit2(&zs_, -MAX_WBITS) != Z_OK) {
+            std::cerr << "Error initializing zlib for decompression." << std::endl;
+            return false;
+        }
+        inStream_ = true;
+        adler_ = adler32(0L, Z_NULL, 0);
+        return true;
+    }
+
+    // zlib trailer, adler32 of the voxels of this stream, big-endian
+    bool endStream()
+    {
+        inflateEnd(&zs_);
+        inStream_ = false;
+        if (inputSize_ - inPos_ < 4) {
+            std::cerr << "Error reading volume: the compressed data is truncated." << std::endl;
+            return false;
+        }
+        const uLong adler = (static_cast<uLong>(input_[inPos_]) << 24) | (static_cast<uLong>(input_[inPos_ + 1]) << 16) |
+                            (static_cast<uLong>(input_[inPos_ + 2]) << 8) | static_cast<uLong>(input_[inPos_ + 3]);
+        inPos_ += 4;
+        if (adler != adler_) {
+            std::cerr << "Error reading volume: the checksum of the decompressed voxels doesn't match." << std::endl;
+            return false;
+        }
+        return true;
     }
 
-    // Clean up
-    inflateEnd(&stream);
+    const unsigned char* input_;
+    std::size_t inputSize_;
+    std::size_t inPos_ = 0;
+    z_stream zs_ = {};
+    bool inStream_ = false;         // between the header and the trailer of a stream
+    uLong adler_ = 0;               // adler32 of the voxels of the stream so far
+};
 
-    return decompressedData;
+}
+
+bool MHAReader::inflateVolume(const unsigned char* input, std::size_t inputSize, std::size_t expectedSize)
+{
+    // The final buffer of the voxels, inflate writes directly into it. Not zero-initialized, inflate fills every byte.
+    inflated_.reset(new (std::nothrow) unsigned char[expectedSize > 0 ? expectedSize : 1]);
+    if (!inflated_) {
+        std::cerr << "Error reading volume: out of memory for " << expectedSize << " voxels." << std::endl;
+        return false;
+    }
+
+    ZlibVoxelReader reader(input, inputSize);
+    return reader.read(inflated_.get(), expectedSize) && reader.finish();
+}
+
+bool MHAReader::inflateBricked(const unsigned char* input, std::size_t inputSize)
+{
+    const std::array<int, 3> dim = {header_.DimSize[0], header_.DimSize[1], header_.DimSize[2]};
+    const std::size_t sliceSize = static_cast<std::size_t>(dim[0]) * dim[1];
+
+    // one slab of slices is inflated at a time, and goes straight into the bricks
+    std::vector<unsigned char> slab;
+    try {
+        slab.resize(sliceSize * BrickedVolume::BRICK_SIZE);
+    } catch (const std::bad_alloc&) {
+        std::cerr << "Error reading volume: out of memory for a slab of " << sliceSize * BrickedVolume::BRICK_SIZE << " voxels." << std::endl;
+        return false;
+    }
+
+    ZlibVoxelReader reader(input, inputSize);
+    bricked_ = BrickedVolume(dim,
+                             {header_.Offset[0], header_.Offset[1], header_.Offset[2]},
+                             {header_.ElementSpacing[0], header_.ElementSpacing[1], header_.ElementSpacing[2]},
+                             [&](int, int slices) -> const unsigned char* {
+                                 return reader.read(slab.data(), sliceSize * slices) ? slab.data() : nullptr;
+                             });
+    if (bricked_.empty() || !reader.finish()) {
+        bricked_ = BrickedVolume();
+        return false;
+    }
+    return true;
 }
@@ -2,8 +2,15 @@
 #define MHAREADER_H
 
 #include <string>
+#include <string_view>
 #include <vector>
-#include <fstream>
+#include <cstddef>
+#include <memory>
+#include <array>
+
+#include <QFile>
+
+#include "brickedvolume.h"
 
 /**
  * @class MHAReader
@@ -15,12 +22,26 @@
  * The formatting is a little bit different (you can always check yourself and compare both of them). Here
  * I called it a Volume Sequence Image.
  *
- * Another note. This class only working with the NON-COMPRESSED Volume Sequence Image. The different is just
- * how the voxel data is stored. The non-compressed one is just raw binary data of each of the voxel, while the
- * compressed one is... the compressed one. The volume reconstruction module from fCal has option on how the
- * data should be stored, however, by the time i write this class, i still don't know with what compressing
- * algorithm they compress the data. I can't find it anywhere in the documentation. How the fuck do i know to
- * decompress them.
+ * Another note. This class works with both NON-COMPRESSED and COMPRESSED Volume Sequence Image. The different is
+ * just how the voxel data is stored. The non-compressed one is just raw binary data of each of the voxel, while the
+ * compressed one is a zlib stream of that (that is what MetaIO does, it took me a while to find it out). A compressed
+ * volume is inflated one slab of slices at a time straight into the bricks (see below), a compressed B-mode sequence
+ * directly into one buffer owned by this class. The checksum is verified in parallel.
+ *
+ * The file is memory-mapped, the header is parsed directly from the mapped memory, and the voxels are NOT copied:
+ * getMHAVolume() returns a read-only view (VoxelSpan) into the mapped file (or into the inflated buffer). So loading a 500MB volume is instant, and
+ * it doesn't need any extra memory. The view is valid as long as this MHAReader object lives, so delete the users of
+ * the view (Volume3DController) before the reader.
+ *
+ * The same class also reads the (B-mode) Sequence Image files that MHAWriter records: the frames are the "volume"
+ * (DimSize = width height frames), and the transformations of every frame are in getSequenceFrames(). That is what
+ * VolumeReconstructor needs. A reconstructed volume lives in memory and never goes through a file, the second
+ * constructor wraps it so that Volume3DController can use it like a loaded one.
+ *
+ * A volume (not a B-mode sequence) is also bricked (see BrickedVolume, getBrickedVolume()), that is what
+ * Volume3DController and MarchingCubes use. If the voxels are not in the mapped file (compressed or reconstructed),
+ * there is never a dense copy of them, getMHAVolume() is empty and only the bricks that are not empty are in memory. A
+ * mapped file costs no memory, its view stays.
  *
  */
 
@@ -33,6 +54,26 @@ public:
      */
     MHAReader(std::string filename);
 
+    /**
+     * @brief Destructor function, unmaps the file
+     */
+    ~MHAReader();
+
+    /**
+     * @struct VoxelSpan
+     * @brief A read-only view of the voxels, it doesn't own the memory (it points into the mapped file, or into the
+     * inflated buffer if the volume is compressed).
+     */
+    struct VoxelSpan {
+        const unsigned char* data = nullptr;
+        std::size_t          size = 0;
+
+        const unsigned char* begin() const { return data; }
+        const unsigned char* end() const { return data + size; }
+        unsigned char operator[](std::size_t i) const { return data[i]; }
+        bool empty() const { return size == 0; }
+    };
+
     /**
      * @struct MHAHeader
      * @brief Represents the attribute list for the header of Sequence Image file
@@ -46,6 +87,7 @@ public:
         bool                BinaryData;
         bool                BinaryDataByteOrderMSB;
         bool                CompressedData;
+        long long           CompressedDataSize;
         std::vector<int>    TransformMatrix;
         std::vector<int>    DimSize;
         std::vector<double> Offset;
@@ -58,6 +100,22 @@ public:
         std::string         ElementDataFile;
     };
 
+    /**
+     * @struct SequenceFrame
+     * @brief The transformations of one frame of a (B-mode) Sequence Image file, row-major 4x4 matrices
+     */
+    struct SequenceFrame {
+        std::array<double, 16> probeToTracker{};
+        std::array<double, 16> referenceToTracker{};
+        bool probeValid = false;                // the TransformStatus is OK
+        bool referenceValid = false;
+    };
+
+    /**
+     * @brief Constructor function for a volume that is already in memory (reconstructed), it takes the bricks
+     */
+    MHAReader(const MHAReader::MHAHeader& header, BrickedVolume volume);
+
     /**
      * @brief Read the volume sequence image, it will read the header and the data.
      */
@@ -69,28 +127,61 @@ public:
     MHAReader::MHAHeader getMHAHeader();
 
     /**
-     * @brief GET the volume data of the volume sequence image.
+     * @brief GET the volume data of the volume sequence image, a view into the mapped file (no copy). It is only
+     * valid while this object lives.
+     */
+    MHAReader::VoxelSpan getMHAVolume() const;
+
+    /**
+     * @brief GET the transformations of every frame, only for a (B-mode) Sequence Image file (empty for a volume).
      */
-    std::vector<unsigned char> getMHAVolume();
+    const std::vector<MHAReader::SequenceFrame>& getSequenceFrames() const;
+
+    /**
+     * @brief GET the bricked volume, only for a volume (empty for a (B-mode) Sequence Image file).
+     */
+    const BrickedVolume& getBrickedVolume() const;
 
 private:
 
     /**
-     * @brief Read and parse the header part of the volume sequence image.
+     * @brief Read and parse the header part of the volume sequence image. Returns false if a number can't be parsed,
+     * DimSize is missing, or a Seq_Frame line is beyond the frames of DimSize.
+     */
+    bool readHeader(std::string_view text);
+
+    /**
+     * @brief Parses one Seq_FrameXXXX_... line of a (B-mode) Sequence Image file into frames_, which already has
+     * DimSize[2] frames. Returns false if the number of the frame is beyond them.
+     */
+    bool readFrameField(std::string_view key, const std::string& value);
+
+    /**
+     * @brief Inflates the compressed voxels (one or more zlib streams) into inflated_ and verifies their checksum.
+     */
+    bool inflateVolume(const unsigned char* input, std::size_t inputSize, std::size_t expectedSize);
+
+    /**
+     * @brief Inflates the compressed voxels slab by slab straight into bricked_, the dense voxels are never in memory.
      */
-    bool readHeader(const std::string &text);
+    bool inflateBricked(const unsigned char* input, std::size_t inputSize);
 
     /**
-     * @brief [Deprecated] My failed attempt to decompress the compressed volume sequence image.
+     * @brief Bricks the volume of the mapped file.
      */
-    std::vector<unsigned char> zlib_decompress(const std::vector<unsigned char>& Z);
+    void makeBricked();
 
 
 
-    std::vector<unsigned char> volumeimage_;    //!< Stores the raw binary data of the voxels.
+    MHAReader::VoxelSpan volumeimage_;          //!< The voxels, a view into the mapped file or into inflated_.
     std::string filename_;                      //!< Stores the full path and file name of the volume sequence image.
     MHAReader::MHAHeader header_;               //!< Stores the necessary information related to the volume sequence image.
-    std::ifstream mhaFile_;                     //!< Stores the stream object of the volume sequence image.
+    QFile mhaFile_;                             //!< The volume sequence image file, it stays open (and mapped) while this object lives.
+    const unsigned char* mapped_ = nullptr;     //!< The whole file, memory-mapped.
+    std::size_t mappedSize_ = 0;                //!< Size of the mapped file.
+    std::unique_ptr<unsigned char[]> inflated_; //!< The voxels of a compressed (B-mode) Sequence Image after inflating.
+    std::vector<MHAReader::SequenceFrame> frames_; //!< The transformations of every frame (Sequence Image files only).
+    BrickedVolume bricked_;                     //!< The volume in bricks (volumes only).
 };
 
 #endif // MHAREADER_H
@@ -3,9 +3,42 @@
 #include <QThread>
 #include <QMessageBox>
 
+#include <QtConcurrent/QtConcurrent>
+#include <QFuture>
+#include <QtZlib/zlib.h>
+
+#include <cstdio>
+#include <algorithm>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+// Number of images that can wait for the pixel writing thread (~24MB for the 840x900 B-mode images). If the disk
+// can't keep up for longer than that, the new images are dropped (with their transformations), the images come in on
+// the GUI thread and it shouldn't wait for the disk.
+static constexpr std::size_t PIXELQUEUE_CAPACITY = 32;
+// Buffer of the temporary pixel file, and the chunk size when it is appended to the .mha file
+static constexpr std::size_t PIXELFILE_BUFFER_SIZE = 8 * 1024 * 1024;
+// How long the pixel writing thread sleeps at most when the queue is empty
+static constexpr int PIXELWRITER_IDLE_MILLISECONDS = 100;
+// Size of the chunks that are compressed in parallel, and the size of the dictionary (the deflate window)
+static constexpr std::size_t COMPRESSION_CHUNK_SIZE = 1024 * 1024;
+static constexpr std::size_t COMPRESSION_DICTIONARY_SIZE = 32 * 1024;
+
 
 MHAWriter::MHAWriter(QObject *parent,  const std::string& filepath, const std::string& prefixname)
-    : QObject{parent}, isRecording(false)
+    : QObject{parent}, isRecording(false),
+    pixelFileBuffer_(PIXELFILE_BUFFER_SIZE),
+    pixelQueue_(PIXELQUEUE_CAPACITY, OverflowPolicy::DropNewest),
+    pixelThread_(nullptr),
+    pixelWriting_(false),
+    pixelWriteFailed_(false),
+    imageWidth_(0),
+    imageHeight_(0),
+    imageType_(-1),
+    droppedImages_(0)
 {
     // open a file to write the .mha
     fullfilename_ = filepath + prefixname + "_" + getCurrentDateTime() + ".mha";
@@ -14,10 +47,35 @@ MHAWriter::MHAWriter(QObject *parent,  const std::string& filepath, const std::s
         throw std::runtime_error("Unable to open file: " + fullfilename_);
     }
 
+    // the pixels go to a temporary file next to it during the recording
+    pixelfilename_ = fullfilename_ + ".pixels.tmp";
+    pixelFile_.rdbuf()->pubsetbuf(pixelFileBuffer_.data(), static_cast<std::streamsize>(pixelFileBuffer_.size()));
+    pixelFile_.open(pixelfilename_, std::ios::binary | std::ios::trunc);
+    if (!pixelFile_.is_open()) {
+        throw std::runtime_error("Unable to open file: " + pixelfilename_);
+    }
+
     // start the timestamp
     timestamp.start();
 }
 
+MHAWriter::~MHAWriter()
+{
+    // if the recording was not stopped properly, stop the thread anyway, the temporary file is useless alone
+    stopPixelWriter();
+    if (pixelFile_.is_open())
+        pixelFile_.close();
+    std::remove(pixelfilename_.c_str());
+    if (!compressedfilename_.empty())
+        std::remove(compressedfilename_.c_str());
+}
+
+void MHAWriter::setCompression(bool enabled, int level)
+{
+    compress_         = enabled;
+    compressionLevel_ = std::clamp(level, 1, 9);
+}
+
 void MHAWriter::setTransformationID(std::string bmodeprobe_transformationID, std::string bmoderef_transformationID)
 {
     bmodeprobe_transformationID_ = bmodeprobe_transformationID;
@@ -25,6 +83,8 @@ void MHAWriter::setTransformationID(std::string bmodeprobe_transformationID, std
 }
 
 void MHAWriter::onImageReceived(const cv::Mat &image) {
+    if (!isRecording) return;
+
     // if there is already data from mocap let's store
     // here i only check one of the data from mocap, they are coupled anyway, so..
     if (latestTransform_probe) {
@@ -36,6 +96,8 @@ void MHAWriter::onImageReceived(const cv::Mat &image) {
 }
 
 void MHAWriter::onRigidBodyReceived(const QualisysTransformationManager &tmanager) {
+    if (!isRecording) return;
+
     if (latestImage) {
         storeDataPair(*latestImage, tmanager.getTransformationById(bmodeprobe_transformationID_), tmanager.getTransformationById(bmoderef_transformationID_));
         resetData();
@@ -46,14 +108,33 @@ void MHAWriter::onRigidBodyReceived(const QualisysTransformationManager &tmanage
 }
 
 void MHAWriter::storeDataPair(const cv::Mat& image, const Eigen::Isometry3d& transform_probe, const Eigen::Isometry3d& transform_ref) {
-    // make a complete copy of cv::Mat using copyTo() function, it is super necessary so that i am not referencing the streaming image
-    cv::Mat imageCopy;
-    image.copyTo(imageCopy);
+    // stopRecord() may be writing the data already, and the pixel writer must not start again under it
+    if (!isRecording) return;
+
+    // the first image tells the geometry of the stream, the pool and the pixel writing thread are prepared for it
+    if (!pixelThread_ && !startPixelWriter(image))
+        return;
+
+    // all the images of a sequence file must have the same size, we can't put this one in the file
+    if (image.cols != imageWidth_ || image.rows != imageHeight_ || image.type() != imageType_) {
+        droppedImages_++;
+        return;
+    }
+
+    // make a complete copy of cv::Mat, it is super necessary so that i am not referencing the streaming image. The copy
+    // goes into the pool buffer of a free slot of the queue (the cv::Mat there is only a header over the buffer, so
+    // copyTo() writes into it and doesn't allocate), and the pixel writing thread takes it from there.
+    bool queued = pixelQueue_.push([&image](PixelItem &slot) { image.copyTo(slot.image); });
+    if (!queued) {
+        // the disk is too slow, skip the whole frame, so the transformations still match the images
+        droppedImages_++;
+        return;
+    }
+
     // make a copy of Eigen::Isometry3d, not like cv::Mat, assigning new object like this will not affect the original object
     Eigen::Isometry3d transformCopy_probe = transform_probe;
     Eigen::Isometry3d transformCopy_ref   = transform_ref;
 
-    allImages.push_back(imageCopy);
     allTransforms_probe.push_back(transformCopy_probe);
     allTransforms_ref.push_back(transformCopy_ref);
     allTimestamps.push_back(timestamp.elapsed()/1000.0);
@@ -70,14 +151,105 @@ void MHAWriter::startRecord()
     isRecording = true;
 }
 
+void MHAWriter::stopReceiving()
+{
+    isRecording = false;
+}
+
+bool MHAWriter::startPixelWriter(const cv::Mat& image)
+{
+    if (image.empty())
+        return false;
+
+    imageWidth_  = image.cols;
+    imageHeight_ = image.rows;
+    imageType_   = image.type();
+
+    // one buffer for every slot of the queue, plus one for the image that the thread is writing. After this, the
+    // buffers only move between the slots and currentPixels_, nothing is allocated per image.
+    std::size_t imageBytes = image.total() * image.elemSize();
+    if (!imagePool_.reset(imageBytes, pixelQueue_.capacity() + 1)) {
+        std::cerr << "MHAWriter::startPixelWriter() Failed to allocate the image buffers." << std::endl;
+        return false;
+    }
+    pixelQueue_.initializeSlots([&](PixelItem &slot) {
+        slot.image = cv::Mat(imageHeight_, imageWidth_, imageType_, imagePool_.acquire());
+    });
+    currentPixels_.image = cv::Mat(imageHeight_, imageWidth_, imageType_, imagePool_.acquire());
+
+    pixelWriting_ = true;
+    pixelThread_  = QThread::create([this]() { writePixels(); });
+    pixelThread_->start();
+    return true;
+}
+
+void MHAWriter::stopPixelWriter()
+{
+    if (!pixelThread_)
+        return;
+
+    // the thread writes what is still in the queue, then it exits
+    pixelWriting_ = false;
+    pixelQueue_.wakeConsumer();
+    pixelThread_->wait();
+    delete pixelThread_;
+    pixelThread_ = nullptr;
+}
+
+void MHAWriter::writePixels()
+{
+    while (true) {
+        if (!pixelQueue_.pop(currentPixels_)) {
+            // nothing to write, and no more images will come, we are done
+            if (!pixelWriting_ && pixelQueue_.empty())
+                break;
+
+            pixelQueue_.waitForData(std::chrono::milliseconds(PIXELWRITER_IDLE_MILLISECONDS));
+            continue;
+        }
+
+        // append the pixels of the image to the temporary file, the images are one after another, exactly like in the .mha
+        const cv::Mat &image = currentPixels_.image;
+        if (image.isContinuous()) {
+            pixelFile_.write(reinterpret_cast<const char*>(image.data), static_cast<std::streamsize>(image.total() * image.elemSize()));
+        } else {
+            for (int row = 0; row < image.rows; ++row)
+                pixelFile_.write(reinterpret_cast<const char*>(image.ptr(row)), static_cast<std::streamsize>(image.cols * image.elemSize()));
+        }
+
+        if (!pixelFile_)
+            pixelWriteFailed_ = true;
+    }
+
+    pixelFile_.flush();
+    if (!pixelFile_)
+        pixelWriteFailed_ = true;
+}
+
 int MHAWriter::stopRecord()
 {
     isRecording = false;
     resetData();
 
+    // wait until all the pixels are in the temporary file, and close it
+    stopPixelWriter();
+    pixelFile_.close();
+    if (droppedImages_ > 0)
+        std::cerr << "MHAWriter::stopRecord() " << droppedImages_ << " images were skipped (different size, or the disk was too slow)." << std::endl;
+
+    // compress the pixels now, we need the compressed size for the header
+    header_.CompressedDataSize = 0;
+    if (compress_) {
+        compressedfilename_ = fullfilename_ + ".zdata.tmp";
+        if (!compressFile(pixelfilename_, compressedfilename_, compressionLevel_, header_.CompressedDataSize)) {
+            std::cerr << "Error occurred writing Image Sequence (.mha) file: Error in compressing the images." << std::endl;
+            return -3;
+        }
+    }
+
     if (!mhaFile_.is_open()) {
         std::cerr << "Error opening MHA file for writing." << std::endl;
-        return false;
+        return -1;
     }
 
     // Header initalization
@@ -87,10 +259,10 @@ int MHAWriter::stopRecord()
     header_.NDims                      = 3;                                     // Number of dimensions for a 3D image (must be 3)
     header_.BinaryData                 = true;                                  // Data is in binary format (must be true)
     header_.BinaryDataByteOrderMSB     = false;                                 // Little-endian byte order (must be false)
-    header_.CompressedData             = false;                                 // Data is not compressed
+    header_.CompressedData             = compress_;                             // Data is zlib-compressed or not (see setCompression())
     header_.Kinds                      = {"domain", "domain", "list"};
     header_.TransformMatrix            = {1, 0, 0, 0, 1, 0, 0, 0, 1};           // Initialize with an identity matrix (not used by Plus Toolkit, typical value is identity matrix)
-    header_.DimSize                    = { allImages.at(1).cols, allImages.at(1).rows, static_cast<int>(allImages.size())}; // Assuming a 2D image with one slice
+    header_.DimSize                    = { imageWidth_, imageHeight_, static_cast<int>(allTimestamps.size())}; // Width and height from the first image, one slice per image
     header_.Offset                     = {0, 0, 0};                             // Origin of the image (not used by Plus Toolkit, typical value is 0 0 0)
     header_.CenterOfRotation           = {0, 0, 0};                             // Center of rotation (not used by Plus Toolkit, typical value is 0 0 0)
     header_.AnatomicalOrientation      = "RAI";                                 // Anatomical orientation (not used by Plus Toolkit, typical value is RAI)
@@ -104,8 +276,13 @@ int MHAWriter::stopRecord()
     if(!writeTransformations()) return -2;
     if(!writeImages()) return -3;
 
-    // close the file to save
-    mhaFile_.close();
+    // close the file to save (writeImages() already did it, the pixels are appended through another handle)
+    if (mhaFile_.is_open()) mhaFile_.close();
+
+    // the pixels are in the .mha file now, the temporary files and the buffers are not needed anymore
+    std::remove(pixelfilename_.c_str());
+    if (compress_) std::remove(compressedfilename_.c_str());
+    imagePool_.clear();
 
     return 1;
 }
@@ -118,6 +295,8 @@ bool MHAWriter::writeHeader()
     mhaFile_ << "BinaryData = "                 << (header_.BinaryData ? "True" : "False") << std::endl;
     mhaFile_ << "BinaryDataByteOrderMSB = "     << (header_.BinaryDataByteOrderMSB ? "True" : "False") << std::endl;
     mhaFile_ << "CompressedData = "             << (header_.CompressedData ? "True" : "False") << std::endl;
+    if (header_.CompressedData)
+        mhaFile_ << "CompressedDataSize = "     << header_.CompressedDataSize << std::endl;
     mhaFile_ << "Kinds = "                      << header_.Kinds.at(0) << " " << header_.Kinds.at(1) << " " << header_.Kinds.at(2) << std::endl;
     mhaFile_ << "TransformMatrix = "            << header_.TransformMatrix.at(0) << " " << header_.TransformMatrix.at(1) << " " << header_.TransformMatrix.at(2) << " "
                                                 << header_.TransformMatrix.at(3) << " " << header_.TransformMatrix.at(4) << " " << header_.TransformMatrix.at(5) << " "
@@ -215,37 +394,17 @@ bool MHAWriter::writeTransformations()
 // Function to write raw image data
 bool MHAWriter::writeImages()
 {
-    // // For debugging only, to see the resulting images in a window
-    // cv::namedWindow("Image Sequence", cv::WINDOW_NORMAL);
-    // // for (const auto& image : allImages) {
-    // //     cv::imshow("Image Sequence", image);
-    // //     cv::waitKey(500);  // Display each image for 1 second
-    // // }
-    // for (size_t i = 0; i < allImages.size(); ++i) {
-    //     const auto& image = allImages[i];
-    //     cv::imshow("Image Sequence", image);
-    //     cv::waitKey(10);  // Display each image for 1 second
-    // }
-
-    // for (size_t i = 0; i < allImages.size(); ++i) {
-    //     const auto& myimage = allImages[i];
-    //     mhaFile_.write(reinterpret_cast<const char*>(myimage.data), myimage.total() * myimage.elemSize());
-    //     std::cout << myimage.total() << "*"<< myimage.elemSize() << std::endl;
-    //     mhaFile_.flush();
-    // }
-
-    for (size_t i = 0; i < allImages.size(); ++i) {
-        mhaFile_.write(reinterpret_cast<const char*>(allImages[i].data), allImages[i].total() * allImages[i].elemSize());
-        mhaFile_.flush();
+    // the pixels were written to the temporary file during the recording, and the sizes of all the images are the same
+    if (pixelWriteFailed_)
+    {
+        std::cerr << "Error occurred writing Image Sequence (.mha) file: Error in writing the temporary pixel file." << std::endl;
+        return false;
     }
 
-    // mhaFile_.flush();
-    // std::vector<uchar> rawData(allImages[0].data, allImages[0].data + allImages[0].total() * allImages[0].elemSize());
-    // mhaFile_.write(reinterpret_cast<const char*>(rawData.data()), rawData.size());
-    // mhaFile_.flush();
-
-    // Check if any write operation failed
-    if (!mhaFile_)
+    // the header and the transformations are done, close the stream and append the pixels (or the compressed pixels) behind them
+    mhaFile_.flush();
+    mhaFile_.close();
+    if (!mhaFile_ || !appendFile(fullfilename_, compress_ ? compressedfilename_ : pixelfilename_))
     {
         // Handle the error
         std::cerr << "Error occurred writing Image Sequence (.mha) file: Error in writing binary images." << std::endl;
@@ -256,6 +415,173 @@ bool MHAWriter::writeImages()
     return true;
 }
 
+namespace {
+
+/**
+ * @brief One compressed chunk, with what we need to stitch it into the zlib stream.
+ */
+struct CompressedChunk
+{
+    std::vector<unsigned char> data;    // raw deflate data, ends on a byte boundary
+    uLong adler = 1;                    // adler32 of the uncompressed chunk
+    std::size_t length = 0;             // length of the uncompressed chunk
+    bool ok = false;
+};
+
+CompressedChunk deflateChunk(const unsigned char* input, std::size_t size, const unsigned char* dictionary, std::size_t dictionarySize, int level, bool last)
+{
+    CompressedChunk chunk;
+    z_stream zs = {};
+
+    // raw deflate (negative window bits), the zlib header and trailer are written once for the whole stream
+    if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return chunk;
+    // the end of the previous chunk is the window, so the matches can reach back into it like in a single stream
+    if (dictionarySize > 0)
+        deflateSetDictionary(&zs, dictionary, static_cast<uInt>(dictionarySize));
+
+    // deflateBound() is for Z_FINISH, the sync flush adds an empty stored block (5 bytes) on top
+    chunk.data.resize(deflateBound(&zs, static_cast<uLong>(size)) + 16);
+    zs.next_in   = const_cast<Bytef*>(input);
+    zs.avail_in  = static_cast<uInt>(size);
+    zs.next_out  = chunk.data.data();
+    zs.avail_out = static_cast<uInt>(chunk.data.size());
+
+    // the last chunk closes the stream, the others end on a byte boundary so the next chunk can follow directly
+    int ret  = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    chunk.ok = last ? (ret == Z_STREAM_END) : (ret == Z_OK && zs.avail_in == 0);
+    chunk.data.resize(chunk.data.size() - zs.avail_out);
+    deflateEnd(&zs);
+
+    chunk.adler  = adler32(adler32(0L, Z_NULL, 0), input, static_cast<uInt>(size));
+    chunk.length = size;
+    return chunk;
+}
+
+}
+
+bool MHAWriter::compressFile(const std::string& src, const std::string& dst, int level, long long& compressedSize)
+{
+    std::ifstream in(src, std::ios::binary | std::ios::ate);
+    std::ofstream out(dst, std::ios::binary | std::ios::trunc);
+    if (!in.is_open() || !out.is_open())
+        return false;
+
+    const long long totalSize = static_cast<long long>(in.tellg());
+    in.seekg(0);
+
+    // zlib header (deflate, 32K window), the second byte only tells the level and makes the checksum of the header right
+    const unsigned char flg = level <= 1 ? 0x01 : (level <= 5 ? 0x5E : (level == 6 ? 0x9C : 0xDA));
+    const unsigned char zlibHeader[2] = { 0x78, flg };
+    out.write(reinterpret_cast<const char*>(zlibHeader), 2);
+    compressedSize = 2;
+
+    // the chunks are read and compressed in batches, so the memory stays bounded for any file size
+    const std::size_t batchSize = static_cast<std::size_t>(std::max(2, QThread::idealThreadCount()) * 2);
+    std::vector<std::vector<unsigned char>> inputs(batchSize);
+    std::vector<unsigned char> previousTail;    // the last 32KB of the previous batch, dictionary of the first chunk
+    uLong adler = adler32(0L, Z_NULL, 0);
+    long long remaining = totalSize;
+
+    do {
+        // read a batch
+        std::size_t n = 0;
+        for (; n < batchSize && (remaining > 0 || (n == 0 && totalSize == 0)); ++n) {
+            std::size_t size = static_cast<std::size_t>(std::min<long long>(remaining, COMPRESSION_CHUNK_SIZE));
+            inputs[n].resize(size);
+            in.read(reinterpret_cast<char*>(inputs[n].data()), static_cast<std::streamsize>(size));
+            if (!in) return false;
+            remaining -= static_cast<long long>(size);
+        }
+
+        // compress the chunks of the batch in parallel
+        std::vector<QFuture<CompressedChunk>> futures;
+        futures.reserve(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            const std::vector<unsigned char>& dictionarySource = (i == 0) ? previousTail : inputs[i - 1];
+            std::size_t dictionarySize = std::min(dictionarySource.size(), COMPRESSION_DICTIONARY_SIZE);
+            const unsigned char* dictionary = dictionarySource.data() + dictionarySource.size() - dictionarySize;
+            const std::vector<unsigned char>* input = &inputs[i];
+            bool last = (remaining == 0 && i == n - 1);
+            futures.push_back(QtConcurrent::run([=]() {
+                return deflateChunk(input->data(), input->size(), dictionary, dictionarySize, level, last);
+            }));
+        }
+
+        // stitch them in order
+        for (std::size_t i = 0; i < n; ++i) {
+            CompressedChunk chunk = futures[i].result();
+            if (!chunk.ok) return false;
+            out.write(reinterpret_cast<const char*>(chunk.data.data()), static_cast<std::streamsize>(chunk.data.size()));
+            compressedSize += static_cast<long long>(chunk.data.size());
+            adler = adler32_combine(adler, chunk.adler, static_cast<z_off_t>(chunk.length));
+        }
+
+        // keep the end of this batch for the first chunk of the next one
+        const std::vector<unsigned char>& lastInput = inputs[n - 1];
+        std::size_t tailSize = std::min(lastInput.size(), COMPRESSION_DICTIONARY_SIZE);
+        previousTail.assign(lastInput.end() - static_cast<std::ptrdiff_t>(tailSize), lastInput.end());
+    } while (remaining > 0);
+
+    // zlib trailer, adler32 of the whole uncompressed data, big-endian
+    const unsigned char trailer[4] = { static_cast<unsigned char>(adler >> 24), static_cast<unsigned char>(adler >> 16),
+                                       static_cast<unsigned char>(adler >> 8),  static_cast<unsigned char>(adler) };
+    out.write(reinterpret_cast<const char*>(trailer), 4);
+    compressedSize += 4;
+
+    out.close();
+    return static_cast<bool>(out);
+}
+
+bool MHAWriter::appendFile(const std::string& dst, const std::string& src)
+{
+#ifdef __linux__
+    // let the kernel copy the data, without going through our memory (and without copying at all on some filesystems)
+    int in = ::open(src.c_str(), O_RDONLY);
+    if (in < 0) return false;
+    int out = ::open(dst.c_str(), O_WRONLY);    // not O_APPEND, copy_file_range refuses it, we give the offset instead
+    if (out < 0) { ::close(in); return false; }
+
+    struct stat st;
+    off_t outOffset = ::lseek(out, 0, SEEK_END);
+    bool ok = (::fstat(in, &st) == 0 && outOffset >= 0);
+    off_t remaining = ok ? st.st_size : 0;
+    bool copiedSomething = false;
+    while (ok && remaining > 0)
+    {
+        ssize_t copied = ::copy_file_range(in, nullptr, out, &outOffset, static_cast<size_t>(remaining), 0);
+        if (copied <= 0) ok = false;
+        else { remaining -= copied; copiedSomething = true; }
+    }
+
+    ::close(in);
+    ::close(out);
+    if (ok) return true;
+    // it failed in the middle, the .mha is broken
+    if (copiedSomething) return false;
+    // copy_file_range is not supported here (old kernel, different filesystems, ...), do the plain copy below
+#endif
+
+    // big sequential reads and writes
+    std::FILE* in_file = std::fopen(src.c_str(), "rb");
+    if (!in_file) return false;
+    std::FILE* out_file = std::fopen(dst.c_str(), "ab");
+    if (!out_file) { std::fclose(in_file); return false; }
+
+    std::vector<char> buffer(PIXELFILE_BUFFER_SIZE);
+    bool success = true;
+    while (true)
+    {
+        std::size_t n = std::fread(buffer.data(), 1, buffer.size(), in_file);
+        if (n > 0 && std::fwrite(buffer.data(), 1, n, out_file) != n) { success = false; break; }
+        if (n < buffer.size()) { success = !std::ferror(in_file); break; }
+    }
+
+    std::fclose(in_file);
+    if (std::fclose(out_file) != 0) success = false;
+    return success;
+}
+
 // Function to get the current date and time as a formatted string
 std::string MHAWriter::getCurrentDateTime()
 {
@@ -9,12 +9,17 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <atomic>
 
 #include <Eigen/Geometry>
 #include <opencv2/opencv.hpp>
 
 #include "qualisysconnection.h"
 #include "qualisystransformationmanager.h"
+#include "framebufferpool.h"
+#include "spscqueue.h"
+
+class QThread;
 
 
 /**
@@ -30,6 +35,18 @@
  * signal from BmodeConnection::imageProcessed and QualisysConnection::dataReceived. This class will do
  * the soft-synchronization by making sure there will be pair of data.
  *
+ * The images are not kept in memory until the end of the recording. Every image is copied into a buffer of a small
+ * pool and handed to a writing thread (through an SpscQueue), which appends the pixels to a temporary file
+ * (<file>.mha.pixels.tmp) while we are still recording. Only the transformations and timestamps, which are small, stay
+ * in memory. When the recording stops, the header (with the correct DimSize) and the transformations are written to
+ * the .mha file, and then the temporary pixel file is appended to it with big sequential copies (copy_file_range on
+ * Linux). So the memory stays the same no matter how long the sweep is.
+ *
+ * With setCompression(true), the pixels are zlib-compressed at stop (CompressedData = True, with CompressedDataSize,
+ * like MetaIO/Plus expect). The pixels are cut into chunks that are compressed in parallel on the Qt thread pool, each
+ * chunk as a raw deflate block sequence that ends on a byte boundary (Z_SYNC_FLUSH), with the last 32KB of the previous
+ * chunk as dictionary, so the chunks can simply be put one after another into one valid zlib stream (same idea as pigz).
+ *
  */
 
 class MHAWriter : public QObject
@@ -51,6 +68,7 @@ public:
         bool             BinaryData;
         bool             BinaryDataByteOrderMSB;
         bool             CompressedData;
+        long long        CompressedDataSize;
         std::vector<std::string> Kinds;
         std::vector<int> TransformMatrix;
         std::vector<int> DimSize;
@@ -70,13 +88,28 @@ public:
      */
     explicit MHAWriter(QObject *parent = nullptr, const std::string& filepath="D:\\", const std::string& prefixname="output");
 
+    /**
+     * @brief Destructor function, stops the writing thread and removes the temporary pixel file
+     */
+    ~MHAWriter();
+
     /**
      * @brief Start recording the data (image, transformations, and timestamps), stored in local
      */
     void startRecord();
 
     /**
-     * @brief Stop recording the data (image, transformations, and timestamps) and start writing the file
+     * @brief Stop taking data, call it in the thread of the writer before stopRecord() goes to another thread. The
+     * images and transformations that are still queued for the slots (posted before the disconnect) are ignored, so
+     * nothing touches the recorded data (or restarts the pixel writer) while stopRecord() writes it.
+     */
+    void stopReceiving();
+
+    /**
+     * @brief Stop recording the data (image, transformations, and timestamps) and start writing the file. It takes a
+     * while (compressing and appending all the pixels), it can run on another thread after stopReceiving().
+     * Returns 1 if successful, -1 for the header (or the file could not be opened), -2 for the transformations and
+     * -3 for the images.
      */
     int stopRecord();
 
@@ -85,6 +118,12 @@ public:
      */
     void setTransformationID(std::string bmodeprobe_transformationID, std::string bmoderef_transformationID);
 
+    /**
+     * @brief SET whether the pixels are zlib-compressed in the Sequence Image file (default false)
+     * @param level zlib compression level, 1 is the fastest, 9 is the smallest
+     */
+    void setCompression(bool enabled, int level = 1);
+
     /**
      * @brief GET the full path of the Sequence Image file
      */
@@ -115,10 +154,35 @@ private:
     bool writeTransformations();
 
     /**
-     * @brief writes binary image (not compressed), for sequence image (.mha) file
+     * @brief writes binary image (not compressed), for sequence image (.mha) file, by appending the temporary pixel file
      */
     bool writeImages();
 
+    /**
+     * @brief prepares the pixel queue and starts the thread that writes the pixels to the temporary file (on the first image)
+     */
+    bool startPixelWriter(const cv::Mat& image);
+
+    /**
+     * @brief tells the pixel writing thread to write what is left in the queue, and waits until it is finished
+     */
+    void stopPixelWriter();
+
+    /**
+     * @brief the loop of the pixel writing thread
+     */
+    void writePixels();
+
+    /**
+     * @brief compresses the file src into the file dst as one zlib stream, in parallel chunks
+     */
+    static bool compressFile(const std::string& src, const std::string& dst, int level, long long& compressedSize);
+
+    /**
+     * @brief appends the content of the file src at the end of the file dst
+     */
+    static bool appendFile(const std::string& dst, const std::string& src);
+
     /**
      * @brief generates current time, for file naming purposes
      */
@@ -141,17 +205,42 @@ private:
     std::ofstream mhaFile_;             //!< Stream object to write the sequence image.
 
     // variables for storing data
-    bool isRecording;                                           //!< An indicator that whether we are recording or not.
+    std::atomic<bool> isRecording;                              //!< An indicator that whether we are recording or not, the slots ignore the data when it is false.
     std::optional<cv::Mat> latestImage;                         //!< The latest image comes from streaming. Using std::optional so it is optional that this variable is empty or not.
     std::optional<Eigen::Isometry3d> latestTransform_probe;     //!< The latest probe transformation. Similar to latestImage.
     std::optional<Eigen::Isometry3d> latestTransform_ref;       //!< The latest of reference transformation. Similar to latestTransform_probe.
 
-    std::vector<cv::Mat>           allImages;                   //!< Stores all the images had been streamed.
     std::vector<Eigen::Isometry3d> allTransforms_probe;         //!< Stores all probe transformation had been streamed.
     std::vector<Eigen::Isometry3d> allTransforms_ref;           //!< Stores all reference transformation had been stream. (Reference transformation is the marker from Calibration Phantom, somehow it is used by the volume reconstructor module from fCal)
     std::vector<double>            allTimestamps;               //!< Stores all the timestamps of the data streamed.
     QElapsedTimer timestamp;                                    //!< Stores the timestamp has been elapsed.
 
+    // variables for streaming the pixels to the temporary file
+    /**
+     * @brief One slot of the pixel queue, a cv::Mat header over a buffer of imagePool_.
+     */
+    struct PixelItem {
+        cv::Mat image;
+    };
+    std::string                    pixelfilename_;              //!< The temporary file where the pixels go during the recording.
+    std::vector<char>              pixelFileBuffer_;            //!< Big buffer for pixelFile_ (declared first, it must outlive pixelFile_).
+    std::ofstream                  pixelFile_;                  //!< Stream object to write the temporary pixel file.
+    SpscQueue<PixelItem>           pixelQueue_;                 //!< The images waiting to be written, from the receiving thread to the pixel writing thread.
+    FrameBufferPool                imagePool_;                  //!< The memory of the images in the queue, one buffer per slot (+1 for the image being written).
+    PixelItem                      currentPixels_;              //!< The image the pixel writing thread is writing.
+    QThread*                       pixelThread_;                //!< The pixel writing thread, started with the first image.
+    std::atomic<bool>              pixelWriting_;               //!< Tells the pixel writing thread to keep waiting for images.
+    std::atomic<bool>              pixelWriteFailed_;           //!< Set by the pixel writing thread if a write failed.
+    int                            imageWidth_;                 //!< Width of the images (from the first image), every image must have it.
+    int                            imageHeight_;                //!< Height of the images (from the first image), every image must have it.
+    int                            imageType_;                  //!< OpenCV type of the images (from the first image), every image must have it.
+    std::size_t                    droppedImages_;              //!< Number of images skipped (different geometry, or the queue was full for too long).
+
+    // variables for the compression
+    bool                           compress_ = false;           //!< Whether the pixels are zlib-compressed in the .mha file.
+    int                            compressionLevel_ = 1;       //!< zlib compression level.
+    std::string                    compressedfilename_;         //!< The temporary file where the compressed pixels go at stop.
+
     // variables that is used to grab the necessary rigid bodies
     std::string bmodeprobe_transformationID_ = "B_N_PRB";       //!< Default indentifier for B-mode probe rigid body transformation from the Mocap system
     std::string bmoderef_transformationID_   = "B_N_REF";       //!< Default indentifier for Reference rigid body transformation from the Mocap system
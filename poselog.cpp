@@ -0,0 +1,235 @@
+#include "poselog.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <limits>
+#include <algorithm>
+
+static const char POSELOG_MAGIC[8] = {'P','O','S','E','L','O','G','1'};
+static const char POSELOG_BLOCKMAGIC[4] = {'P','B','L','K'};
+
+// ============================================================================
+// PoseLogWriter
+// ============================================================================
+
+PoseLogWriter::PoseLogWriter()
+    : filebuffer_(1024 * 1024),
+    ncolumns_(0),
+    blockRows_(0),
+    rows_(0)
+{
+}
+
+PoseLogWriter::~PoseLogWriter()
+{
+    close();
+}
+
+bool PoseLogWriter::open(const std::string &filename, const std::vector<std::string> &columns, std::size_t blockRows)
+{
+    if (file_.is_open())
+        close();
+
+    if (columns.empty() || blockRows == 0)
+    {
+        std::cerr << "PoseLogWriter::open() The schema is empty." << std::endl;
+        return false;
+    }
+
+    // bigger buffer for the stream, it has to be set before the file is opened
+    file_.rdbuf()->pubsetbuf(filebuffer_.data(), static_cast<std::streamsize>(filebuffer_.size()));
+    file_.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file_.is_open())
+    {
+        std::cerr << "PoseLogWriter::open() Could not open file: " << filename << std::endl;
+        return false;
+    }
+
+    ncolumns_  = columns.size();
+    blockRows_ = blockRows;
+    rows_      = 0;
+    block_.assign(ncolumns_ * blockRows_, 0.0);
+
+    // the schema
+    uint32_t version  = FORMAT_VERSION;
+    uint32_t ncolumns = static_cast<uint32_t>(ncolumns_);
+    file_.write(POSELOG_MAGIC, sizeof(POSELOG_MAGIC));
+    file_.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    file_.write(reinterpret_cast<const char*>(&ncolumns), sizeof(ncolumns));
+    for (const std::string &column : columns)
+    {
+        uint16_t length = static_cast<uint16_t>(std::min<std::size_t>(column.size(), std::numeric_limits<uint16_t>::max()));
+        file_.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        file_.write(column.data(), length);
+    }
+    file_.flush();
+
+    return file_.good();
+}
+
+bool PoseLogWriter::append(const double *row)
+{
+    if (!file_.is_open())
+        return false;
+
+    // scatter the row into the columns of the block
+    for (std::size_t c = 0; c < ncolumns_; c++)
+        block_[c * blockRows_ + rows_] = row[c];
+    rows_++;
+
+    if (rows_ == blockRows_)
+        return flush();
+
+    return true;
+}
+
+bool PoseLogWriter::flush()
+{
+    if (!file_.is_open())
+        return false;
+
+    if (rows_ > 0)
+    {
+        // the block header, then every column one after another
+        uint32_t nrows = static_cast<uint32_t>(rows_);
+        file_.write(POSELOG_BLOCKMAGIC, sizeof(POSELOG_BLOCKMAGIC));
+        file_.write(reinterpret_cast<const char*>(&nrows), sizeof(nrows));
+        for (std::size_t c = 0; c < ncolumns_; c++)
+            file_.write(reinterpret_cast<const char*>(&block_[c * blockRows_]), static_cast<std::streamsize>(rows_ * sizeof(double)));
+        rows_ = 0;
+    }
+
+    file_.flush();
+    if (!file_.good())
+    {
+        std::cerr << "PoseLogWriter::flush() Failed to write the block." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void PoseLogWriter::close()
+{
+    if (!file_.is_open())
+        return;
+
+    flush();
+    file_.close();
+}
+
+bool PoseLogWriter::isOpen() const
+{
+    return file_.is_open();
+}
+
+std::size_t PoseLogWriter::pendingRows() const
+{
+    return rows_;
+}
+
+std::size_t PoseLogWriter::columnCount() const
+{
+    return ncolumns_;
+}
+
+// ============================================================================
+// PoseLogReader
+// ============================================================================
+
+PoseLogReader::PoseLogReader(const std::string &filename)
+{
+    file_.open(filename, std::ios::in | std::ios::binary);
+    if (!file_.is_open())
+        throw std::runtime_error("PoseLogReader::PoseLogReader() Could not open file: " + filename);
+
+    char magic[8];
+    uint32_t version = 0, ncolumns = 0;
+    file_.read(magic, sizeof(magic));
+    file_.read(reinterpret_cast<char*>(&version), sizeof(version));
+    file_.read(reinterpret_cast<char*>(&ncolumns), sizeof(ncolumns));
+    if (!file_.good() || std::memcmp(magic, POSELOG_MAGIC, sizeof(magic)) != 0 || version != PoseLogWriter::FORMAT_VERSION)
+        throw std::runtime_error("PoseLogReader::PoseLogReader() Not a valid pose log: " + filename);
+
+    columns_.resize(ncolumns);
+    for (uint32_t c = 0; c < ncolumns; c++)
+    {
+        uint16_t length = 0;
+        file_.read(reinterpret_cast<char*>(&length), sizeof(length));
+        columns_[c].resize(length);
+        file_.read(&columns_[c][0], length);
+    }
+
+    if (!file_.good())
+        throw std::runtime_error("PoseLogReader::PoseLogReader() The schema is incomplete: " + filename);
+}
+
+const std::vector<std::string> &PoseLogReader::columns() const
+{
+    return columns_;
+}
+
+bool PoseLogReader::readBlock(std::size_t &nrows, std::vector<double> &values)
+{
+    char magic[4];
+    uint32_t n = 0;
+    file_.read(magic, sizeof(magic));
+    file_.read(reinterpret_cast<char*>(&n), sizeof(n));
+    if (!file_.good() || std::memcmp(magic, POSELOG_BLOCKMAGIC, sizeof(magic)) != 0)
+        return false;
+
+    values.resize(static_cast<std::size_t>(n) * columns_.size());
+    file_.read(reinterpret_cast<char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(double)));
+
+    // the last block is incomplete (the recording was not stopped properly), ignore it
+    if (!file_.good())
+        return false;
+
+    nrows = n;
+    return true;
+}
+
+bool PoseLogReader::exportToCsv(const std::string &poselogFilename, const std::string &csvFilename)
+{
+    try
+    {
+        PoseLogReader reader(poselogFilename);
+
+        std::ofstream csv(csvFilename, std::ios::out | std::ios::trunc);
+        if (!csv.is_open())
+        {
+            std::cerr << "PoseLogReader::exportToCsv() Could not open file: " << csvFilename << std::endl;
+            return false;
+        }
+
+        // the header
+        const std::vector<std::string> &columns = reader.columns();
+        for (std::size_t c = 0; c < columns.size(); c++)
+            csv << (c == 0 ? "" : ",") << columns[c];
+        csv << "\n";
+
+        // the rows, from every block. %.17g so the doubles survive the round trip to text
+        std::size_t nrows = 0;
+        std::vector<double> values;
+        char number[32];
+        while (reader.readBlock(nrows, values))
+        {
+            for (std::size_t r = 0; r < nrows; r++)
+            {
+                for (std::size_t c = 0; c < columns.size(); c++)
+                {
+                    std::snprintf(number, sizeof(number), "%.17g", values[c * nrows + r]);
+                    csv << (c == 0 ? "" : ",") << number;
+                }
+                csv << "\n";
+            }
+        }
+        return csv.good();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+}
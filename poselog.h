@@ -0,0 +1,139 @@
+#ifndef POSELOG_H
+#define POSELOG_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @class PoseLogWriter
+ * @brief Writes rows of doubles (timestamps and rigid body poses) into a binary, columnar pose log (.poselog).
+ *
+ * For the context. Writing the mocap data as CSV means converting dozens of numbers to strings for every row, and
+ * with many rigid bodies at 300Hz the writer thread can't keep up. Here the schema (the column names) is fixed when
+ * the file is opened, and the rows are collected in memory and written as blocks, column by column. So the disk only
+ * sees a few big writes of raw doubles. Use PoseLogReader (or the poselog2csv tool) to get the CSV back.
+ *
+ * The layout of the file (all values are little-endian):
+ *
+ *   "POSELOG1"                                  magic, 8 bytes
+ *   uint32 version, uint32 ncolumns
+ *   ncolumns x (uint16 length, char[length])    column names
+ *   block, block, block, ...                    until the end of the file
+ *
+ * and every block is:
+ *
+ *   uint32 "PBLK", uint32 nrows
+ *   ncolumns x (nrows x double)                 column 0 of all the rows, then column 1 of all the rows, and so on
+ *
+ * A block is only written completely or not at all (as far as we can), so if the program crashes, at most the last
+ * (incomplete) block is lost, the reader simply stops there.
+ *
+ * This class is not thread-safe, DataWriter uses it from its own thread.
+ */
+class PoseLogWriter
+{
+public:
+
+    static constexpr uint32_t FORMAT_VERSION = 1;   //!< Current version of the pose log format
+
+    /**
+     * @brief Constructor function
+     */
+    PoseLogWriter();
+
+    /**
+     * @brief Destructor function, writes the rows that are still in memory and closes the file.
+     */
+    ~PoseLogWriter();
+
+    /**
+     * @brief Opens the file and writes the schema.
+     * @param filename Path and name of the pose log file.
+     * @param columns Name of each column, every row that is appended must have exactly this number of values.
+     * @param blockRows Number of rows in memory before they are written as a block.
+     * @return true if the file is opened and the schema is written.
+     */
+    bool open(const std::string &filename, const std::vector<std::string> &columns, std::size_t blockRows = 256);
+
+    /**
+     * @brief Appends a row. If the block is full, it is written to the file.
+     * @param row Pointer to ncolumns doubles.
+     * @return false if the file is not open or the block could not be written.
+     */
+    bool append(const double *row);
+
+    /**
+     * @brief Writes the rows that are in memory (if any) as a block, and flushes the file.
+     */
+    bool flush();
+
+    /**
+     * @brief Flushes and closes the file.
+     */
+    void close();
+
+    /**
+     * @brief GET whether the file is open.
+     */
+    bool isOpen() const;
+
+    /**
+     * @brief GET the number of rows that are in memory and not written yet.
+     */
+    std::size_t pendingRows() const;
+
+    /**
+     * @brief GET the number of columns of the schema.
+     */
+    std::size_t columnCount() const;
+
+private:
+    std::vector<char> filebuffer_;      //!< Buffer for the file stream, bigger than the default (declared first, it must outlive file_)
+    std::ofstream file_;                //!< The pose log file
+    std::size_t ncolumns_;              //!< Number of columns of the schema
+    std::size_t blockRows_;             //!< Capacity of a block (rows)
+    std::size_t rows_;                  //!< Number of rows currently in the block
+    std::vector<double> block_;         //!< The block, column-major: column c of row r is at block_[c*blockRows_ + r]
+};
+
+/**
+ * @class PoseLogReader
+ * @brief Reads the binary, columnar pose log (.poselog) written by PoseLogWriter.
+ */
+class PoseLogReader
+{
+public:
+
+    /**
+     * @brief Constructor function. Opens the file and reads the schema, throws std::runtime_error if it is not a valid pose log.
+     */
+    PoseLogReader(const std::string &filename);
+
+    /**
+     * @brief GET the column names.
+     */
+    const std::vector<std::string> &columns() const;
+
+    /**
+     * @brief Reads the next block.
+     * @param nrows Number of rows in the block.
+     * @param values The block, column-major: column c of row r is at values[c*nrows + r].
+     * @return false if there are no more (complete) blocks.
+     */
+    bool readBlock(std::size_t &nrows, std::vector<double> &values);
+
+    /**
+     * @brief Converts a pose log file into a CSV file (same columns, first line is the header).
+     * @return false if one of the files can't be opened.
+     */
+    static bool exportToCsv(const std::string &poselogFilename, const std::string &csvFilename);
+
+private:
+    std::ifstream file_;                //!< The pose log file
+    std::vector<std::string> columns_;  //!< The column names
+};
+
+#endif // POSELOG_H
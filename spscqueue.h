@@ -0,0 +1,426 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cstddef>
+
+/**
+ * @brief What SpscQueue::push() does when the queue is full.
+ */
+enum class OverflowPolicy
+{
+    Block,      //!< The producer sleeps until the consumer frees a slot (up to the block timeout, then the item is dropped)
+    DropOldest, //!< The oldest item in the queue is thrown away to make space for the new one
+    DropNewest  //!< The new item is thrown away, the queue is left as it is
+};
+
+/**
+ * @brief A snapshot of the counters of an SpscQueue.
+ */
+struct SpscQueueStats
+{
+    std::size_t capacity  = 0;  //!< Number of slots
+    std::size_t depth     = 0;  //!< Number of items in the queue right now
+    std::size_t highWater = 0;  //!< Highest depth seen since the last resetStats()
+    std::size_t pushed    = 0;  //!< Number of items that went into the queue
+    std::size_t popped    = 0;  //!< Number of items that were taken by the consumer
+    std::size_t dropped   = 0;  //!< Number of items that were thrown away because the queue was full
+    std::size_t blocked   = 0;  //!< Number of times the producer had to wait for a free slot (Block policy)
+};
+
+/**
+ * @class SpscQueue
+ * @brief Bounded, lock-free queue for one producer thread and one consumer thread, with preallocated slots.
+ *
+ * For the context. The writers used to have an unbounded QQueue protected by a QMutex, with a wakeOne() for every
+ * item. If the disk stalls for a while (antivirus, another program copying files, ...), the queue just grows until
+ * we run out of memory, and every item is a new allocation. Here all the slots are allocated once, when the queue is
+ * created, and they are reused forever:
+ *
+ *   - push() gives the producer a reference to a free slot, and the producer copies its data INTO the slot. For
+ *     std::vector or cv::Mat of the same size, that is a plain copy, the memory of the slot is reused.
+ *   - pop() swaps the content of the slot with the item of the consumer, so the buffer the consumer just finished
+ *     with goes back into the ring, and it will be reused by a later push().
+ *
+ * When the queue is full, the OverflowPolicy decides what happens. The positions are the ones from the bounded queue
+ * of Dmitry Vyukov (every slot has a sequence number), so the producer can also take the oldest item out of the ring
+ * safely for DropOldest, even if the consumer is trying to take it at the same moment.
+ *
+ * The consumer can sleep in waitForData() when the queue is empty. The producer only touches the mutex to wake it up
+ * when the consumer is really sleeping, so in the normal case (the consumer is busy writing) push() never locks. The
+ * other way around too: with the Block policy a producer that finds the queue full sleeps (it doesn't spin), and pop()
+ * only wakes it up when it is really sleeping. A producer on the GUI thread should still rather drop (DropNewest,
+ * DropOldest), with Block the GUI stands still while the disk is slow.
+ *
+ * The usage is like this:
+ *
+ *   SpscQueue<std::vector<double>> queue(1024, OverflowPolicy::DropOldest);
+ *
+ *   // producer thread
+ *   queue.push([&](std::vector<double> &slot){ slot = row; });
+ *
+ *   // consumer thread
+ *   std::vector<double> row;
+ *   while (running) {
+ *       if (!queue.pop(row)) { queue.waitForData(std::chrono::milliseconds(100)); continue; }
+ *       ... write row ...
+ *   }
+ *
+ * setCapacity() and setPolicy() are not thread-safe, call them before the threads start to use the queue.
+ */
+template <typename T>
+class SpscQueue
+{
+public:
+
+    /**
+     * @brief Constructor function.
+     * @param capacity Number of slots, it is rounded up to a power of two.
+     * @param policy What push() does when the queue is full.
+     */
+    explicit SpscQueue(std::size_t capacity = 256, OverflowPolicy policy = OverflowPolicy::Block)
+        : policy_(policy),
+        blockTimeout_(std::chrono::milliseconds(1000))
+    {
+        setCapacity(capacity);
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue &operator=(const SpscQueue&) = delete;
+
+    /**
+     * @brief Reallocates the slots (the queue becomes empty), and resets the counters. Not thread-safe.
+     */
+    void setCapacity(std::size_t capacity)
+    {
+        std::size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+
+        cells_.reset(new Cell[n]);
+        mask_ = n - 1;
+        for (std::size_t i = 0; i < n; i++)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        enqueuePos_.store(0, std::memory_order_relaxed);
+        dequeuePos_.store(0, std::memory_order_relaxed);
+        resetStats();
+    }
+
+    /**
+     * @brief Calls init(T&) for every slot, e.g. to give every slot a buffer from a FrameBufferPool up front, so
+     * push() never has to allocate. Only while the queue is empty and not used by the threads. Not thread-safe.
+     */
+    template <typename Init>
+    void initializeSlots(Init &&init)
+    {
+        for (std::size_t i = 0; i <= mask_; i++)
+            init(cells_[i].value);
+    }
+
+    /**
+     * @brief Sets what push() does when the queue is full. Not thread-safe.
+     */
+    void setPolicy(OverflowPolicy policy)
+    {
+        policy_ = policy;
+    }
+
+    /**
+     * @brief GET what push() does when the queue is full.
+     */
+    OverflowPolicy policy() const
+    {
+        return policy_;
+    }
+
+    /**
+     * @brief Sets how long push() waits for a free slot with the Block policy, before it gives up and drops the item.
+     * So the producer can never hang forever if the consumer is gone. Not thread-safe.
+     */
+    void setBlockTimeout(std::chrono::milliseconds timeout)
+    {
+        blockTimeout_ = timeout;
+    }
+
+    /**
+     * @brief GET the number of slots.
+     */
+    std::size_t capacity() const
+    {
+        return mask_ + 1;
+    }
+
+    /**
+     * @brief Puts a new item in the queue. Only the producer thread calls this.
+     * @param fill Function that receives the slot (T&) and copies the new item into it.
+     * @return false if the item was dropped (queue full with DropNewest, or Block timed out). With DropOldest it
+     *         is always true, an older item was dropped instead.
+     */
+    template <typename Fill>
+    bool push(Fill &&fill)
+    {
+        Cell *cell = acquireForPush();
+        if (cell == nullptr && policy_ == OverflowPolicy::DropOldest)
+        {
+            // throw away the oldest items until there is a free slot. If the consumer is taking that slot at the same
+            // moment, we only have to wait until it is done, it is a swap.
+            while ((cell = acquireForPush()) == nullptr)
+            {
+                if (discardOldest())
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                else
+                    std::this_thread::yield();
+            }
+        }
+        else if (cell == nullptr && policy_ == OverflowPolicy::Block)
+        {
+            // sleep until the consumer frees a slot, but not forever
+            blocked_.fetch_add(1, std::memory_order_relaxed);
+            auto deadline = std::chrono::steady_clock::now() + blockTimeout_;
+            while ((cell = acquireForPush()) == nullptr)
+            {
+                if (std::chrono::steady_clock::now() >= deadline)
+                    break;
+                wakeConsumer();
+
+                std::unique_lock<std::mutex> lock(waitMutex_);
+                producerWaiting_.store(true, std::memory_order_seq_cst);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                // check again after the flag is set, the consumer may have popped just before
+                if (acquireForPush() == nullptr)
+                    spaceCondition_.wait_until(lock, deadline);
+                producerWaiting_.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        if (cell == nullptr)
+        {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        // the slot is ours, copy the item into it and publish it
+        std::size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        fill(cell->value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        enqueuePos_.store(pos + 1, std::memory_order_seq_cst);
+        pushed_.fetch_add(1, std::memory_order_relaxed);
+
+        // keep track of the deepest the queue has been
+        std::size_t depth = size();
+        std::size_t highWater = highWater_.load(std::memory_order_relaxed);
+        while (depth > highWater && !highWater_.compare_exchange_weak(highWater, depth, std::memory_order_relaxed))
+            ;
+
+        // only bother the mutex if the consumer is sleeping
+        if (consumerWaiting_.load(std::memory_order_seq_cst))
+            wakeConsumer();
+
+        return true;
+    }
+
+    /**
+     * @brief Takes the oldest item out of the queue. Only the consumer thread calls this.
+     * @param item Receives the item; its previous content goes back into the ring (swap), so it can be reused.
+     * @return false if the queue is empty.
+     */
+    bool pop(T &item)
+    {
+        std::size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell *cell = &cells_[pos & mask_];
+            std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1);
+
+            // nothing there yet, the queue is empty
+            if (diff < 0)
+                return false;
+
+            // the producer dropped this item (DropOldest) in the meantime, try the next one
+            if (diff > 0)
+            {
+                pos = dequeuePos_.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                using std::swap;
+                swap(item, cell->value);
+                cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+                popped_.fetch_add(1, std::memory_order_relaxed);
+
+                // only bother the mutex if the producer is sleeping on a full queue (Block)
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (producerWaiting_.load(std::memory_order_seq_cst))
+                    wakeProducer();
+                return true;
+            }
+        }
+    }
+
+    /**
+     * @brief Sleeps until the producer pushes something, wakeConsumer() is called, or the timeout passes.
+     * Only the consumer thread calls this.
+     * @return true if the queue is not empty.
+     */
+    bool waitForData(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(waitMutex_);
+        consumerWaiting_.store(true, std::memory_order_seq_cst);
+
+        // check again after the flag is set, the producer may have pushed just before
+        if (empty())
+        {
+            waitCondition_.wait_for(lock, timeout);
+        }
+
+        consumerWaiting_.store(false, std::memory_order_relaxed);
+        return !empty();
+    }
+
+    /**
+     * @brief Wakes up the consumer if it is sleeping in waitForData() (e.g. to tell it to stop).
+     */
+    void wakeConsumer()
+    {
+        std::lock_guard<std::mutex> lock(waitMutex_);
+        waitCondition_.notify_one();
+    }
+
+    /**
+     * @brief Wakes up the producer if it is sleeping in push() on a full queue (Block).
+     */
+    void wakeProducer()
+    {
+        std::lock_guard<std::mutex> lock(waitMutex_);
+        spaceCondition_.notify_one();
+    }
+
+    /**
+     * @brief GET the number of items in the queue right now (only a hint while the other thread is working).
+     */
+    std::size_t size() const
+    {
+        std::size_t enqueuePos = enqueuePos_.load(std::memory_order_seq_cst);
+        std::size_t dequeuePos = dequeuePos_.load(std::memory_order_seq_cst);
+        return enqueuePos > dequeuePos ? std::min(enqueuePos - dequeuePos, capacity()) : 0;
+    }
+
+    /**
+     * @brief GET whether the next push() finds a free slot. Only the producer thread calls this: only the producer
+     * fills slots, so a free slot stays free until its next push(), which can't drop the item then (any policy).
+     */
+    bool hasFreeSlot() const
+    {
+        std::size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        return cells_[pos & mask_].sequence.load(std::memory_order_acquire) == pos;
+    }
+
+    /**
+     * @brief GET whether the queue is empty right now.
+     */
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    /**
+     * @brief GET a snapshot of the counters.
+     */
+    SpscQueueStats stats() const
+    {
+        SpscQueueStats s;
+        s.capacity  = capacity();
+        s.depth     = size();
+        s.highWater = highWater_.load(std::memory_order_relaxed);
+        s.pushed    = pushed_.load(std::memory_order_relaxed);
+        s.popped    = popped_.load(std::memory_order_relaxed);
+        s.dropped   = dropped_.load(std::memory_order_relaxed);
+        s.blocked   = blocked_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    /**
+     * @brief Sets all the counters back to 0.
+     */
+    void resetStats()
+    {
+        highWater_.store(0, std::memory_order_relaxed);
+        pushed_.store(0, std::memory_order_relaxed);
+        popped_.store(0, std::memory_order_relaxed);
+        dropped_.store(0, std::memory_order_relaxed);
+        blocked_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+
+    /**
+     * @brief One slot of the ring. The sequence number tells whether the slot is free (== position), holds an item
+     * (== position+1), or is still being emptied for the previous round.
+     */
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    /**
+     * @brief Returns the free slot at the enqueue position, or nullptr if the queue is full.
+     */
+    Cell *acquireForPush()
+    {
+        std::size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        Cell *cell = &cells_[pos & mask_];
+        std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        return sequence == pos ? cell : nullptr;
+    }
+
+    /**
+     * @brief The producer takes the oldest item out of the ring and throws it away (DropOldest).
+     * @return false if the consumer was faster (nothing is dropped then).
+     */
+    bool discardOldest()
+    {
+        std::size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+        Cell *cell = &cells_[pos & mask_];
+        std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        if (sequence != pos + 1)
+            return false;
+        if (!dequeuePos_.compare_exchange_strong(pos, pos + 1, std::memory_order_relaxed))
+            return false;
+
+        // the item stays in the slot, it will simply be overwritten by the next push()
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::unique_ptr<Cell[]> cells_;                     //!< The slots, allocated once
+    std::size_t mask_ = 0;                              //!< capacity - 1, capacity is a power of two
+    OverflowPolicy policy_;                             //!< What push() does when the queue is full
+    std::chrono::milliseconds blockTimeout_;            //!< How long push() waits with the Block policy
+
+    alignas(64) std::atomic<std::size_t> enqueuePos_{0}; //!< Next position to push (producer), on its own cache line
+    alignas(64) std::atomic<std::size_t> dequeuePos_{0}; //!< Next position to pop (consumer, or producer with DropOldest)
+
+    alignas(64) std::atomic<std::size_t> highWater_{0};  //!< Counters for the stats
+    std::atomic<std::size_t> pushed_{0};
+    std::atomic<std::size_t> popped_{0};
+    std::atomic<std::size_t> dropped_{0};
+    std::atomic<std::size_t> blocked_{0};
+
+    std::atomic<bool> consumerWaiting_{false};          //!< True while the consumer sleeps in waitForData()
+    std::atomic<bool> producerWaiting_{false};          //!< True while the producer sleeps in push() (Block)
+    std::mutex waitMutex_;                              //!< Only used to sleep and wake up the threads
+    std::condition_variable waitCondition_;             //!< Only used to sleep and wake up the consumer
+    std::condition_variable spaceCondition_;            //!< Only used to sleep and wake up the producer
+};
+
+#endif // SPSCQUEUE_H
@@ -0,0 +1,33 @@
+#include <iostream>
+#include <string>
+
+#include "poselog.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: poselog2csv <input.poselog> [output.csv]" << std::endl;
+        return 1;
+    }
+
+    // if the output is not specified, use the same name as the input, with .csv extension
+    std::string input = argv[1];
+    std::string output;
+    if (argc >= 3)
+        output = argv[2];
+    else
+    {
+        std::size_t dot = input.find_last_of('.');
+        output = (dot == std::string::npos ? input : input.substr(0, dot)) + ".csv";
+    }
+
+    if (!PoseLogReader::exportToCsv(input, output))
+    {
+        std::cerr << "poselog2csv: failed to convert " << input << std::endl;
+        return 1;
+    }
+
+    std::cout << "poselog2csv: " << input << " -> " << output << std::endl;
+    return 0;
+}
@@ -0,0 +1,15 @@
+# Offline tool to convert the binary pose log (.poselog) recorded by AmodeMocapRecorder into a CSV file.
+# Usage: poselog2csv <input.poselog> [output.csv]
+
+TEMPLATE = app
+CONFIG += console c++17
+CONFIG -= app_bundle qt
+
+INCLUDEPATH += ../..
+
+SOURCES += \
+    main.cpp \
+    ../../poselog.cpp
+
+HEADERS += \
+    ../../poselog.h
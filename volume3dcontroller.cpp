@@ -1,5 +1,25 @@
 #include "volume3dcontroller.h"
 #include <omp.h>
+#include <algorithm>
+#include <limits>
+
+#include <QDebug>
+#include <QFile>
+#include <QImage>
+#include <QCoreApplication>
+#include <QtConcurrent/QtConcurrent>
+
+// How many points a thread of the worker fills between two checks whether its threshold is still the latest one
+static constexpr std::size_t POINTDELTA_CANCEL_CHECK = 64 * 1024;
+// Number of coarser levels of detail, the coarsest keeps one voxel of every 16x16x16 cube
+static constexpr int LOD_LEVELS = 4;
+// How many points the scatter gets: while the camera moves, when it rests, and never more than the hard cap (also
+// not when zoomed in). Q3DScatter draws every point every frame, this keeps it interactive without a discrete GPU.
+static constexpr std::size_t POINTBUDGET_INTERACTIVE = 150000;
+static constexpr std::size_t POINTBUDGET_IDLE        = 500000;
+static constexpr std::size_t POINTBUDGET_HARDCAP     = 1500000;
+// How long the camera must rest before the finer level comes back
+static constexpr int CAMERA_IDLE_MILLISECONDS = 300;
 
 Volume3DController::Volume3DController(QObject *parent, Q3DScatter *scatter, MHAReader *mhareader)
     : QObject{parent}, m_scatter(scatter), myMHAReader_(mhareader)
@@ -22,12 +42,11 @@ Volume3DController::Volume3DController(QObject *parent, Q3DScatter *scatter, MHA
 
     // get the initial data
     myMHAHeader_ = myMHAReader_->getMHAHeader();
-    myMHAVolume_ = myMHAReader_->getMHAVolume();
+    myVolume_    = &myMHAReader_->getBrickedVolume();
 
-    // Find the max and min elements in the vector
-    auto minmax = std::minmax_element(myMHAVolume_.begin(), myMHAVolume_.end());
-    pixelintensity_min_ = *minmax.first;
-    pixelintensity_max_ = *minmax.second;
+    // The max and min of the volume, the bricks already know them
+    pixelintensity_min_ = myVolume_->getMinimum();
+    pixelintensity_max_ = myVolume_->getMaximum();
 
     // delete all the series inside the scatter. This is new session of volume reconstruction,
     // i want everything that is reconstructed before, gone.
@@ -35,83 +54,95 @@ Volume3DController::Volume3DController(QObject *parent, Q3DScatter *scatter, MHA
         m_scatter->removeSeries(series);
     }
 
+    // the series first (only the border), so the user sees where the volume is while the voxels are being sorted
+    createSeries();
+
+    // sort the voxels by intensity once, in the background, then the threshold slider only adds or removes the
+    // difference. The thresholds that come before it is done are simply kept and the latest one is shown after.
+    connect(&m_indexWatcher, &QFutureWatcher<void>::finished, this, &Volume3DController::indexBuildFinished);
+    connect(&m_pointWatcher, &QFutureWatcher<PointDelta>::finished, this, &Volume3DController::pointDeltaFinished);
+    connect(&m_surfaceWatcher, &QFutureWatcher<SurfaceResult>::finished, this, &Volume3DController::surfaceFinished);
+    connect(&m_fieldWatcher, &QFutureWatcher<DistanceFieldResult>::finished, this, &Volume3DController::distanceFieldFinished);
+    connect(&m_treeWatcher, &QFutureWatcher<SurfaceTreeResult>::finished, this, &Volume3DController::surfaceTreeFinished);
+    m_indexWatcher.setFuture(QtConcurrent::run([this]() { buildIntensityIndex(); buildLodLevels(); }));
+
+    // coarse while the user orbits or zooms, finer again when the camera rests
+    m_cameraIdleTimer.setSingleShot(true);
+    m_cameraIdleTimer.setInterval(CAMERA_IDLE_MILLISECONDS);
+    connect(&m_cameraIdleTimer, &QTimer::timeout, this, &Volume3DController::cameraIdle);
+    Q3DCamera *camera = m_scatter->scene()->activeCamera();
+    connect(camera, &Q3DCamera::xRotationChanged, this, &Volume3DController::cameraMoved);
+    connect(camera, &Q3DCamera::yRotationChanged, this, &Volume3DController::cameraMoved);
+    connect(camera, &Q3DCamera::zoomLevelChanged, this, &Volume3DController::cameraMoved);
+    connect(camera, &Q3DCamera::targetChanged, this, &Volume3DController::cameraMoved);
+
     // initial pixel intensity
     int init_threshold = pixelintensity_min_ + ((pixelintensity_max_ - pixelintensity_min_)/3);
     // add data
     updateVolume(init_threshold);
 }
 
-void Volume3DController::findIndicesWithThreshold(const std::vector<unsigned char>& volume, int threshold, std::vector<int>& result) {
-    #pragma omp parallel for
-    for (int i = 0; i <  static_cast<int>(volume.size()); ++i)
-    {
-        if (volume[i] > threshold) {
-            #pragma omp critical
-            result.push_back(i);
-        }
-    }
-}
-
-void Volume3DController::findIndicesWithThreshold(const std::vector<unsigned char>& volume, std::vector<int> threshold, std::vector<int>& result) {
-    if (threshold.size() >2) return;
-
-    #pragma omp parallel for
-    for (int i = 0; i <  static_cast<int>(volume.size()); ++i)
-    {
-        if (volume[i] >= threshold[0] && volume[i] <= threshold[0]) {
-            #pragma omp critical
-            result.push_back(i);
-        }
-    }
-}
-
-void Volume3DController::getValuesWithIndices(const std::vector<unsigned char>& volume, const std::vector<int>& myindices, std::vector<unsigned char>& result) {
-    // #pragma omp parallel for
-    // for (int index : myindices) {
-    //     #pragma omp critical
-    //     result.push_back(volume[index]);
-    // }
-
-    // Resize the result vector to avoid concurrent modification of its size.
-    result.resize(myindices.size());
-
-    // Use a traditional for loop that OpenMP can parallelize.
-    #pragma omp parallel for
-    for (int i = 0; i < myindices.size(); ++i) {
-        int index = myindices[i];
-        // Assign the value to the corresponding position in the result vector.
-        result[i] = volume[index];
-    }
-}
-
-void Volume3DController::ind2sub(const std::vector<int>& indices, const std::vector<int>& dimsize, std::vector<std::vector<int>>& voxelcoordinate) {
-    #pragma omp parallel for
-    for (int i = 0; i < static_cast<int>(indices.size()); ++i)
-    {
-        // int x = indices[i] % dimsize[0];
-        // int y = (indices[i]/dimsize[0]) % dimsize[1];
-        // int z = indices[i] / (dimsize[0] * dimsize[1]);
-        #pragma omp critical
-        voxelcoordinate.push_back({(indices[i] % dimsize[0]), (indices[i] / dimsize[0]) % dimsize[1], (indices[i] / (dimsize[0] * dimsize[1]))});
-    }
+Volume3DController::~Volume3DController()
+{
+    // the workers look at our members (and at the voxels of the reader), tell them to stop and wait for them
+    stopping_ = true;
+    generation_++;
+    surfaceGeneration_++;
+    fieldGeneration_++;
+    treeGeneration_++;
+    m_indexWatcher.waitForFinished();
+    m_pointWatcher.waitForFinished();
+    m_surfaceWatcher.waitForFinished();
+    m_fieldWatcher.waitForFinished();
+    m_treeWatcher.waitForFinished();
+
+    // the surface is ours, the series are removed by MainWindow
+    if (m_surfaceItem != nullptr) m_scatter->removeCustomItem(m_surfaceItem);
 }
 
-Eigen::MatrixXd Volume3DController::vectorVector2EigenMatrix(const std::vector<std::vector<int>>& voxel_coordinate) {
-    // Assuming all inner vectors have the same size
-    int rows = voxel_coordinate.size();
-    int cols = voxel_coordinate[0].size();
-
-    // Create a temporary vector to hold all the data
-    std::vector<int> temp;
-    temp.reserve(rows * cols);
-    for (const auto& row : voxel_coordinate) {
-        temp.insert(temp.end(), row.begin(), row.end());
-    }
-
-    // Map the data to an Eigen matrix
-    Eigen::MatrixXd matrix = Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>(temp.data(), rows, cols).cast<double>();
-
-    return matrix;
+void Volume3DController::setVolume(MHAReader *mhareader)
+{
+    // the workers look at the voxels of the old reader, stop them like in the destructor
+    stopping_ = true;
+    generation_++;
+    surfaceGeneration_++;
+    fieldGeneration_++;
+    treeGeneration_++;
+    m_indexWatcher.waitForFinished();
+    m_pointWatcher.waitForFinished();
+    m_surfaceWatcher.waitForFinished();
+    m_fieldWatcher.waitForFinished();
+    m_treeWatcher.waitForFinished();
+
+    // their finished() is already posted, deliver it now while stopping_ is set, so the slots ignore the old results
+    QCoreApplication::sendPostedEvents(&m_indexWatcher, QEvent::FutureCallOut);
+    QCoreApplication::sendPostedEvents(&m_pointWatcher, QEvent::FutureCallOut);
+    QCoreApplication::sendPostedEvents(&m_surfaceWatcher, QEvent::FutureCallOut);
+    QCoreApplication::sendPostedEvents(&m_fieldWatcher, QEvent::FutureCallOut);
+    QCoreApplication::sendPostedEvents(&m_treeWatcher, QEvent::FutureCallOut);
+    stopping_ = false;
+
+    myMHAReader_ = mhareader;
+    myMHAHeader_ = myMHAReader_->getMHAHeader();
+    myVolume_    = &myMHAReader_->getBrickedVolume();
+    pixelintensity_min_ = myVolume_->getMinimum();
+    pixelintensity_max_ = myVolume_->getMaximum();
+    levels_.clear();
+    indexReady_   = false;
+    shownLevel_   = 0;
+    shownVoxels_  = 0;
+
+    // only our series gets the new border (and the axes), the other series of the scatter (the A-mode) stay. The
+    // surface stays too, until the one of the new volume is ready.
+    m_scatter->removeSeries(m_series);
+    delete m_series;
+    createSeries();
+    m_series->setVisible(!surfaceVisible_);
+    shownSurfaceThreshold_ = -1;
+
+    // the same as a new controller, with the threshold that the user has now
+    m_indexWatcher.setFuture(QtConcurrent::run([this]() { buildIntensityIndex(); buildLodLevels(); }));
+    updateVolume(requestedThreshold_);
 }
 
 Eigen::Affine3d Volume3DController::RightToLeftHandedTransformation(const Eigen::Affine3d& rightHandedTransform) {
@@ -192,19 +223,13 @@ void Volume3DController::initData()
     Eigen::MatrixXd voxelcoordinate_homogeneous(4, voxelcoordinate_.cols());
     voxelcoordinate_homogeneous << voxelcoordinate_, Eigen::MatrixXd::Ones(1, voxelcoordinate_.cols());
 
-    // Corner voxel (to know the borders)
-    std::vector<std::vector<int>> bordercoordinate;
-    bordercoordinate.push_back({0, 0, 0});
-    bordercoordinate.push_back({0, 0, myMHAHeader_.DimSize.at(2)});
-    bordercoordinate.push_back({0, myMHAHeader_.DimSize.at(1), 0});
-    bordercoordinate.push_back({0, myMHAHeader_.DimSize.at(1), myMHAHeader_.DimSize.at(2)});
-    bordercoordinate.push_back({myMHAHeader_.DimSize.at(0), 0, 0});
-    bordercoordinate.push_back({myMHAHeader_.DimSize.at(0), 0, myMHAHeader_.DimSize.at(2)});
-    bordercoordinate.push_back({myMHAHeader_.DimSize.at(0), myMHAHeader_.DimSize.at(1), 0});
-    bordercoordinate.push_back({myMHAHeader_.DimSize.at(0), myMHAHeader_.DimSize.at(1), myMHAHeader_.DimSize.at(2)});
-    Eigen::MatrixXd bordercoordinate_ = vectorVector2EigenMatrix(bordercoordinate).transpose();
-    Eigen::MatrixXd bordercoordinate_homogeneous(4, bordercoordinate_.cols());
-    bordercoordinate_homogeneous << bordercoordinate_, Eigen::MatrixXd::Ones(1, bordercoordinate_.cols());
+    // Corner voxel (to know the borders), homogeneous, one corner per column
+    const double dimX = myMHAHeader_.DimSize.at(0), dimY = myMHAHeader_.DimSize.at(1), dimZ = myMHAHeader_.DimSize.at(2);
+    Eigen::MatrixXd bordercoordinate_homogeneous(4, 8);
+    bordercoordinate_homogeneous << 0,    0,    0,    0,    dimX, dimX, dimX, dimX,
+                                    0,    0,    dimY, dimY, 0,    0,    dimY, dimY,
+                                    0,    dimZ, 0,    dimZ, 0,    dimZ, 0,    dimZ,
+                                    1,    1,    1,    1,    1,    1,    1,    1;
     Eigen::MatrixXd bordercubecoordinate_homogeneous = findBoundingCubeBottomAligned(bordercoordinate_homogeneous);
 
     // Get the transformation value from MHAReader
@@ -268,43 +293,172 @@ void Volume3DController::initData()
 }
 */
 
-void Volume3DController::updateVolume(int value)
+void Volume3DController::buildIntensityIndex()
 {
-    // delete all the series inside the scatter
-    for (QScatter3DSeries *series : m_scatter->seriesList()) {
-        if (series->name() == "tissue_layers") {
-            m_scatter->removeSeries(series);
+    // This is a counting sort of the voxels by their intensity (there are only 256 of them, it is MET_UCHAR), brightest
+    // first, storing the linear index of the voxel. Then all voxels over any threshold are simply the first
+    // countAbove[threshold] indices. The voxels with the minimum intensity (the empty space, most of the volume) are
+    // never shown (the threshold is never below the minimum), so they are not stored, and the bricks that only have
+    // those are not even looked at.
+    levels_.assign(1, LodLevel());
+    std::vector<std::uint32_t>& sortedVoxels = levels_[0].voxels;
+    std::array<std::size_t, 256>& countAbove = levels_[0].countAbove;
+    if (myVolume_->empty()) return;
+    if (myVolume_->getVoxelCount() > std::numeric_limits<std::uint32_t>::max()) {
+        qWarning() << "Volume3DController::buildIntensityIndex() The volume is too big to be indexed:" << myVolume_->getVoxelCount() << "voxels.";
+        return;
+    }
+
+    const int dimX = myVolume_->getDim()[0];
+    const int dimY = myVolume_->getDim()[1];
+    const int dimZ = myVolume_->getDim()[2];
+    const std::size_t sliceSize = static_cast<std::size_t>(dimX) * dimY;
+    const std::array<int, 3>& brickDim = myVolume_->getBrickDim();
+    constexpr int BRICK_SIZE = BrickedVolume::BRICK_SIZE;
+    const int minimum = pixelintensity_min_;
+
+    // the position of every column, row and slice in the scatter, the same transformation as the border in
+    // createSeries() (offset and spacing, y and z are swapped later when the position is made)
+    coordinateX_.resize(dimX);
+    coordinateY_.resize(dimY);
+    coordinateZ_.resize(dimZ);
+    for (int x = 0; x < dimX; ++x) coordinateX_[x] = static_cast<float>(myMHAHeader_.Offset[0] + myMHAHeader_.ElementSpacing[0] * x);
+    for (int y = 0; y < dimY; ++y) coordinateY_[y] = static_cast<float>(myMHAHeader_.Offset[1] + myMHAHeader_.ElementSpacing[1] * y);
+    for (int z = 0; z < dimZ; ++z) coordinateZ_[z] = static_cast<float>(myMHAHeader_.Offset[2] + myMHAHeader_.ElementSpacing[2] * z);
+
+    // every thread counts (and later places) its own layers of bricks, so nobody waits for anybody
+    const int maxThreads = omp_get_max_threads();
+    std::vector<std::array<std::size_t, 256>> counts(maxThreads);
+    for (auto& count : counts) count.fill(0);
+
+    #pragma omp parallel num_threads(maxThreads)
+    {
+        const int thread = omp_get_thread_num();
+        const int nThreads = omp_get_num_threads();
+        std::array<std::size_t, 256>& count = counts[thread];
+
+        // 1) histogram of the bricks of this thread that have something over the minimum
+        #pragma omp for schedule(static)
+        for (int bz = 0; bz < brickDim[2]; ++bz) {
+            if (stopping_) continue;
+            for (int by = 0; by < brickDim[1]; ++by) {
+                for (int bx = 0; bx < brickDim[0]; ++bx) {
+                    const std::size_t brick = myVolume_->brickIndex(bx, by, bz);
+                    if (myVolume_->brickMaximum(brick) <= minimum) continue;
+                    // the voxels of the brick outside of the volume are the minimum, they are not counted anyway
+                    const unsigned char* voxels = myVolume_->brickVoxels(brick);
+                    for (int k = 0; k < BrickedVolume::BRICK_VOXELS; ++k) count[voxels[k]]++;
+                }
+            }
+        }
+
+        // 2) where every (thread, intensity) starts in the sorted array, brightest intensity first, and within one
+        //    intensity the threads in order, so the result is the same however many threads there are
+        #pragma omp single
+        {
+            std::size_t start = 0;
+            for (int v = 255; v > minimum; --v) {
+                for (int t = 0; t < nThreads; ++t) {
+                    std::size_t n = counts[t][v];
+                    counts[t][v] = start;
+                    start += n;
+                }
+                countAbove[v - 1] = start;
+            }
+            for (int v = minimum - 1; v >= 0; --v) countAbove[v] = start;
+            sortedVoxels.resize(start);
+        }
+
+        // 3) place the indices, the same bricks as in 1) (static schedule, same loop)
+        #pragma omp for schedule(static)
+        for (int bz = 0; bz < brickDim[2]; ++bz) {
+            if (stopping_) continue;
+            for (int by = 0; by < brickDim[1]; ++by) {
+                for (int bx = 0; bx < brickDim[0]; ++bx) {
+                    const std::size_t brick = myVolume_->brickIndex(bx, by, bz);
+                    if (myVolume_->brickMaximum(brick) <= minimum) continue;
+                    const unsigned char* voxels = myVolume_->brickVoxels(brick);
+                    const int zEnd = std::min(dimZ, (bz + 1) * BRICK_SIZE);
+                    const int yEnd = std::min(dimY, (by + 1) * BRICK_SIZE);
+                    const int xEnd = std::min(dimX, (bx + 1) * BRICK_SIZE);
+                    for (int z = bz * BRICK_SIZE; z < zEnd; ++z) {
+                        for (int y = by * BRICK_SIZE; y < yEnd; ++y) {
+                            const unsigned char* row = voxels + ((z % BRICK_SIZE) * BRICK_SIZE + (y % BRICK_SIZE)) * BRICK_SIZE;
+                            const std::uint32_t base = static_cast<std::uint32_t>(z * sliceSize + static_cast<std::size_t>(y) * dimX);
+                            for (int x = bx * BRICK_SIZE; x < xEnd; ++x) {
+                                const int v = row[x % BRICK_SIZE];
+                                if (v <= minimum) continue;
+                                sortedVoxels[count[v]++] = base + static_cast<std::uint32_t>(x);
+                            }
+                        }
+                    }
+                }
+            }
         }
     }
+}
 
-    // Get the data
-    std::vector<int> indices;
-    findIndicesWithThreshold(myMHAVolume_, value, indices);
-    std::vector<unsigned char> volumevalues_overthresh;
-    getValuesWithIndices(myMHAVolume_, indices, volumevalues_overthresh);
+void Volume3DController::buildLodLevels()
+{
+    // Level l keeps the brightest voxel of every cube of 2^l voxels per side, so a thin bone stays where it is, just
+    // with less points. Going through level 0 (brightest first), the first voxel that lands in a cube is its brightest
+    // one, and the levels come out sorted by intensity as well. If a cube of level l already has a brighter voxel, so
+    // has the bigger cube of level l+1 around it, so we can stop there.
+    if (levels_.empty() || coordinateX_.empty()) return;
+    const std::uint32_t dimX = static_cast<std::uint32_t>(coordinateX_.size());
+    const std::uint32_t dimY = static_cast<std::uint32_t>(coordinateY_.size());
+    const std::uint32_t dimZ = static_cast<std::uint32_t>(coordinateZ_.size());
+    const std::uint32_t sliceSize = dimX * dimY;
+
+    std::vector<std::vector<bool>> taken(LOD_LEVELS + 1);
+    std::vector<std::array<std::uint32_t, 3>> cells(LOD_LEVELS + 1);
+    std::vector<std::array<std::size_t, 256>> counts(LOD_LEVELS + 1);
+    levels_.resize(LOD_LEVELS + 1);
+    for (int l = 1; l <= LOD_LEVELS; ++l) {
+        const std::uint32_t size = 1u << l;
+        cells[l] = { (dimX + size - 1) >> l, (dimY + size - 1) >> l, (dimZ + size - 1) >> l };
+        taken[l].assign(static_cast<std::size_t>(cells[l][0]) * cells[l][1] * cells[l][2], false);
+        counts[l].fill(0);
+        levels_[l].voxels.reserve(levels_[0].voxels.size() >> (2 * l));
+    }
 
-    // Convert indices to subscripts
-    std::vector<std::vector<int>> voxelcoordinate;
-    ind2sub(indices, myMHAHeader_.DimSize, voxelcoordinate);
+    const std::vector<std::uint32_t>& voxels = levels_[0].voxels;
+    for (std::size_t k = 0; k < voxels.size(); ++k) {
+        if ((k % POINTDELTA_CANCEL_CHECK) == 0 && stopping_) return;
+
+        const std::uint32_t index = voxels[k];
+        const std::uint32_t z     = index / sliceSize;
+        const std::uint32_t rest  = index - z * sliceSize;
+        const std::uint32_t y     = rest / dimX;
+        const std::uint32_t x     = rest - y * dimX;
+        for (int l = 1; l <= LOD_LEVELS; ++l) {
+            const std::size_t cell = (static_cast<std::size_t>(z >> l) * cells[l][1] + (y >> l)) * cells[l][0] + (x >> l);
+            if (taken[l][cell]) break;
+            taken[l][cell] = true;
+            levels_[l].voxels.push_back(index);
+            counts[l][myVolume_->at(x, y, z)]++;
+        }
+    }
 
-    // Convert std::vector to Eigen::MatrixXd, more efficient to perform calculation
-    Eigen::MatrixXd voxelcoordinate_ = vectorVector2EigenMatrix(voxelcoordinate).transpose();
-    Eigen::MatrixXd voxelcoordinate_homogeneous(4, voxelcoordinate_.cols());
-    voxelcoordinate_homogeneous << voxelcoordinate_, Eigen::MatrixXd::Ones(1, voxelcoordinate_.cols());
+    // countAbove of every level, like level 0
+    for (int l = 1; l <= LOD_LEVELS; ++l) {
+        std::size_t above = 0;
+        for (int v = 255; v >= 0; --v) {
+            levels_[l].countAbove[v] = above;
+            above += counts[l][v];
+        }
+    }
+}
 
-    // Corner voxel (to know the borders)
-    std::vector<std::vector<int>> bordercoordinate;
-    bordercoordinate.push_back({0, 0, 0});
-    bordercoordinate.push_back({0, 0, myMHAHeader_.DimSize.at(2)});
-    bordercoordinate.push_back({0, myMHAHeader_.DimSize.at(1), 0});
-    bordercoordinate.push_back({0, myMHAHeader_.DimSize.at(1), myMHAHeader_.DimSize.at(2)});
-    bordercoordinate.push_back({myMHAHeader_.DimSize.at(0), 0, 0});
-    bordercoordinate.push_back({myMHAHeader_.DimSize.at(0), 0, myMHAHeader_.DimSize.at(2)});
-    bordercoordinate.push_back({myMHAHeader_.DimSize.at(0), myMHAHeader_.DimSize.at(1), 0});
-    bordercoordinate.push_back({myMHAHeader_.DimSize.at(0), myMHAHeader_.DimSize.at(1), myMHAHeader_.DimSize.at(2)});
-    Eigen::MatrixXd bordercoordinate_ = vectorVector2EigenMatrix(bordercoordinate).transpose();
-    Eigen::MatrixXd bordercoordinate_homogeneous(4, bordercoordinate_.cols());
-    bordercoordinate_homogeneous << bordercoordinate_, Eigen::MatrixXd::Ones(1, bordercoordinate_.cols());
+void Volume3DController::createSeries()
+{
+    // Corner voxel (to know the borders), homogeneous, one corner per column
+    const double dimX = myMHAHeader_.DimSize.at(0), dimY = myMHAHeader_.DimSize.at(1), dimZ = myMHAHeader_.DimSize.at(2);
+    Eigen::MatrixXd bordercoordinate_homogeneous(4, 8);
+    bordercoordinate_homogeneous << 0,    0,    0,    0,    dimX, dimX, dimX, dimX,
+                                    0,    0,    dimY, dimY, 0,    0,    dimY, dimY,
+                                    0,    dimZ, 0,    dimZ, 0,    dimZ, 0,    dimZ,
+                                    1,    1,    1,    1,    1,    1,    1,    1;
     Eigen::MatrixXd bordercubecoordinate_homogeneous = findBoundingCubeBottomAligned(bordercoordinate_homogeneous);
 
     // Get the transformation value from MHAReader
@@ -317,46 +471,18 @@ void Volume3DController::updateVolume(int value)
     init_A.translate(init_t);
     init_A.linear() = init_R * init_s.asDiagonal();
 
-    // // Convert the transformation from right-hand (Qualisys) to left-hand (Qt3DScatter plot)
-    // Eigen::Affine3d init_A_lh   = RightToLeftHandedTransformation(init_A);
-
-    // // The point cloud also needs to be negated first (in the z component)
-    // voxelcoordinate_homogeneous.row(2) *= -1;
-    // // Transform the z-negated point cloud with transformed transformation
-    // voxelcoordinate_homogeneous = init_A.matrix() * voxelcoordinate_homogeneous;
-    // voxelcoordinate_ = voxelcoordinate_homogeneous.topRows(3);
-
-    // // The point cloud also needs to be negated first (in the z component)
-    // bordercubecoordinate_homogeneous.row(2) *= -1;
-    // // Transform the z-negated point cloud with transformed transformation
-    // bordercubecoordinate_homogeneous = init_A.matrix() * bordercubecoordinate_homogeneous;
-    // bordercoordinate_ = bordercubecoordinate_homogeneous.topRows(3);
-
-    voxelcoordinate_homogeneous = init_A.matrix() * voxelcoordinate_homogeneous;
-    // voxelcoordinate_homogeneous.row(2) *= -1;
-    voxelcoordinate_homogeneous.row(1).swap(voxelcoordinate_homogeneous.row(2));
-    voxelcoordinate_ = voxelcoordinate_homogeneous.topRows(3);
-
-    // Transform the z-negated point cloud with transformed transformation
+    // Transform the border cube, and swap y and z for the scatter (the voxels get the same in buildIntensityIndex())
     bordercubecoordinate_homogeneous = init_A.matrix() * bordercubecoordinate_homogeneous;
     // bordercubecoordinate_homogeneous.row(2) *= -1;
     bordercubecoordinate_homogeneous.row(1).swap(bordercubecoordinate_homogeneous.row(2));
-    bordercoordinate_ = bordercubecoordinate_homogeneous.topRows(3);
-
-    // // Apply the transformation
-    // voxelcoordinate_homogeneous = init_A.matrix() * voxelcoordinate_homogeneous;
-    // voxelcoordinate_ = voxelcoordinate_homogeneous.topRows(3);
+    Eigen::MatrixXd bordercoordinate_ = bordercubecoordinate_homogeneous.topRows(3);
 
-    // Create a new QScatterDataArray
+    // The first items of the series are the corners of the border, the voxels come after them
     QScatterDataArray* dataArray = new QScatterDataArray;
-    // Resize the array to hold all points
-    dataArray->resize(voxelcoordinate_.cols());
-    // Copy the points from the Eigen matrix to the QScatterDataArray
-    for (int i = 0; i < voxelcoordinate_.cols(); ++i) {
-        (*dataArray)[i].setPosition( QVector3D(voxelcoordinate_(0, i),voxelcoordinate_(1, i),voxelcoordinate_(2, i)));
-    }
-    for (int i = 0; i < bordercoordinate_.cols(); ++i) {
-        (*dataArray)[i].setPosition( QVector3D(bordercoordinate_(0, i),bordercoordinate_(1, i),bordercoordinate_(2, i)));
+    dataArray->resize(BORDER_POINTS);
+    for (int i = 0; i < BORDER_POINTS; ++i) {
+        borderPositions_[i] = QVector3D(bordercoordinate_(0, i),bordercoordinate_(1, i),bordercoordinate_(2, i));
+        (*dataArray)[i].setPosition(borderPositions_[i]);
     }
 
     Eigen::Vector3d minCoords = bordercoordinate_.block<3, 8>(0, 0).rowwise().minCoeff();
@@ -368,21 +494,350 @@ void Volume3DController::updateVolume(int value)
     gradient.setColorAt(0.0, QColor(50,50,50));                    // Low values of Z
     gradient.setColorAt(maxWhite_inScatter, QColor(220,220,220));  // High values of Z
 
-    // Create a new scatter series
-    QScatter3DSeries *series = new QScatter3DSeries();
-    series->setName("tissue_layers");
-    series->setItemSize(0.03f);
-    series->setMesh(QAbstract3DSeries::MeshPoint);
-    series->setBaseGradient(gradient);
-    series->setColorStyle(Q3DTheme::ColorStyleRangeGradient);
-    series->dataProxy()->resetArray(dataArray);
+    // Create a new scatter series, it lives as long as this volume, updateVolume() only changes its items
+    m_series = new QScatter3DSeries();
+    m_series->setName("tissue_layers");
+    m_series->setItemSize(0.03f);
+    m_series->setMesh(QAbstract3DSeries::MeshPoint);
+    m_series->setBaseGradient(gradient);
+    m_series->setColorStyle(Q3DTheme::ColorStyleRangeGradient);
+    m_series->dataProxy()->resetArray(dataArray);
 
     // add the volume to the series
-    m_scatter->addSeries(series);
+    m_scatter->addSeries(m_series);
     m_scatter->axisX()->setRange(minCoords(0)-extensionvolume_mm, maxCoords(0)+extensionvolume_mm);
     m_scatter->axisY()->setRange(minCoords(1), maxCoords(1)+(extensionvolume_mm*2));
     m_scatter->axisZ()->setRange(minCoords(2)-extensionvolume_mm, maxCoords(2)+extensionvolume_mm);
+}
+
+void Volume3DController::updateVolume(int value)
+{
+    requestedThreshold_ = value;
+    requestPointUpdate();
+    if (surfaceVisible_) requestSurfaceUpdate();
+    requestDistanceFieldUpdate();
+    requestSurfaceTreeUpdate();
+}
+
+void Volume3DController::requestPointUpdate()
+{
+    // Only the latest request matters. A newer generation tells the running worker to give up, and when it is done
+    // (pointDeltaFinished()) the next one starts with whatever is the latest request by then.
+    generation_++;
+
+    if (!indexReady_ || m_pointWatcher.isRunning()) return;
+    startPointDelta();
+}
+
+std::size_t Volume3DController::pointBudget() const
+{
+    if (cameraMoving_) return POINTBUDGET_INTERACTIVE;
 
+    // zoomed in (into the holder, usually), most of the volume is outside the view, so the same budget on the screen
+    // allows a finer level. zoomLevel is in percent, the area on the screen grows with its square.
+    const double zoom = std::max(100.0f, m_scatter->scene()->activeCamera()->zoomLevel()) / 100.0;
+    return static_cast<std::size_t>(std::min<double>(POINTBUDGET_IDLE * zoom * zoom, POINTBUDGET_HARDCAP));
+}
+
+void Volume3DController::startPointDelta()
+{
+    if (stopping_) return;
+
+    // The finest level whose voxels over the threshold fit in the budget. If even the coarsest doesn't fit, it is cut
+    // to the budget, as the voxels are sorted by intensity, the brightest ones stay.
+    const int threshold = std::clamp(requestedThreshold_, 0, 255);
+    const std::size_t budget = pointBudget();
+    int level = 0;
+    while (level + 1 < static_cast<int>(levels_.size()) && levels_[level].countAbove[threshold] > budget) level++;
+    const std::size_t count = std::min(levels_[level].countAbove[threshold], budget);
+
+    // Another level, the whole series is replaced at once by the worker
+    if (level != shownLevel_) {
+        const int generation = generation_;
+        m_pointWatcher.setFuture(QtConcurrent::run([this, generation, level, count]() {
+            return computePointDelta(generation, level, 0, count, true);
+        }));
+        return;
+    }
+
+    // The same level. The voxels over the threshold are the first ones in the sorted indices, so changing the threshold
+    // only appends the voxels that came in, or cuts the voxels that went out at the end of the series.
+    // cutting is cheap, it is done here
+    if (count < shownVoxels_) {
+        m_series->dataProxy()->removeItems(BORDER_POINTS + static_cast<int>(count), static_cast<int>(shownVoxels_ - count));
+        shownVoxels_ = count;
+        return;
+    }
+    if (count == shownVoxels_) return;
+
+    // filling the new items can be millions of them, that is for the worker
+    const int generation = generation_;
+    const std::size_t from = shownVoxels_;
+    m_pointWatcher.setFuture(QtConcurrent::run([this, generation, level, from, count]() {
+        return computePointDelta(generation, level, from, count, false);
+    }));
+}
+
+Volume3DController::PointDelta Volume3DController::computePointDelta(int generation, int level, std::size_t from, std::size_t to, bool reset) const
+{
+    PointDelta delta;
+    delta.generation = generation;
+    delta.level      = level;
+    delta.from       = from;
+    delta.to         = to;
+    delta.reset      = reset;
+
+    // a new series starts with the border
+    const int offset = reset ? BORDER_POINTS : 0;
+    delta.added.resize(offset + static_cast<int>(to - from));
+    for (int i = 0; i < offset; ++i) delta.added[i].setPosition(borderPositions_[i]);
+
+    // One fused kernel from the sorted voxel indices straight to the items of the scatter: the index is split into
+    // column, row and slice, which pick their positions from the coordinate tables (y and z swapped for the scatter).
+    // The chunks are spread over the threads, between two chunks every thread looks whether it should give up.
+    QScatterDataItem* items = delta.added.data() + offset;
+    const std::vector<std::uint32_t>& sortedVoxels = levels_[level].voxels;
+    const std::uint32_t dimX = static_cast<std::uint32_t>(coordinateX_.size());
+    const std::uint32_t sliceSize = dimX * static_cast<std::uint32_t>(coordinateY_.size());
+    const int chunks = static_cast<int>((to - from + POINTDELTA_CANCEL_CHECK - 1) / POINTDELTA_CANCEL_CHECK);
+    std::atomic<bool> cancelled{false};
+
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c < chunks; ++c) {
+        // somebody wants another threshold already, this one is not needed anymore
+        if (cancelled || generation_ != generation) {
+            cancelled = true;
+            continue;
+        }
+        const std::size_t begin = from + static_cast<std::size_t>(c) * POINTDELTA_CANCEL_CHECK;
+        const std::size_t end   = std::min(to, begin + POINTDELTA_CANCEL_CHECK);
+        for (std::size_t k = begin; k < end; ++k) {
+            const std::uint32_t index = sortedVoxels[k];
+            const std::uint32_t z     = index / sliceSize;
+            const std::uint32_t rest  = index - z * sliceSize;
+            const std::uint32_t y     = rest / dimX;
+            const std::uint32_t x     = rest - y * dimX;
+            items[k - from].setPosition(QVector3D(coordinateX_[x], coordinateZ_[z], coordinateY_[y]));
+        }
+    }
+
+    delta.cancelled = cancelled;
+    return delta;
+}
+
+void Volume3DController::indexBuildFinished()
+{
+    if (stopping_) return;
+    indexReady_ = true;
+    startPointDelta();
+}
+
+void Volume3DController::pointDeltaFinished()
+{
+    if (stopping_) return;
+
+    // the new items go into the series at once (one change of the proxy), the scatter never shows half of them
+    PointDelta delta = m_pointWatcher.result();
+    if (!delta.cancelled && delta.reset) {
+        m_series->dataProxy()->resetArray(new QScatterDataArray(std::move(delta.added)));
+        shownLevel_   = delta.level;
+        shownVoxels_  = delta.to;
+    }
+    else if (!delta.cancelled && delta.level == shownLevel_ && delta.from == shownVoxels_) {
+        m_series->dataProxy()->addItems(delta.added);
+        shownVoxels_ = delta.to;
+    }
+
+    // the threshold (or the camera) changed while the worker was busy
+    if (delta.cancelled || delta.generation != generation_) startPointDelta();
+}
+
+void Volume3DController::cameraMoved()
+{
+    // only the start of the movement changes the level, the rest just keeps the timer from firing
+    m_cameraIdleTimer.start();
+    if (cameraMoving_) return;
+    cameraMoving_ = true;
+    requestPointUpdate();
+}
+
+void Volume3DController::cameraIdle()
+{
+    cameraMoving_ = false;
+    requestPointUpdate();
+}
+
+void Volume3DController::setSurfaceVisible(bool visible)
+{
+    // the points stay up to date in the background, so switching back is instant
+    surfaceVisible_ = visible;
+    m_series->setVisible(!visible);
+    if (m_surfaceItem != nullptr) m_surfaceItem->setVisible(visible);
+    if (visible && shownSurfaceThreshold_ != requestedThreshold_) requestSurfaceUpdate();
+}
+
+void Volume3DController::requestSurfaceUpdate()
+{
+    // like the points, only the latest threshold matters, the running worker gives up if it is an older one
+    surfaceGeneration_++;
+    if (stopping_ || m_surfaceWatcher.isRunning()) return;
+
+    const int generation = surfaceGeneration_;
+    const int threshold  = requestedThreshold_;
+    const QString meshFile = m_surfaceDir.filePath(QString("surface_%1.obj").arg(surfaceCount_++));
+    m_surfaceWatcher.setFuture(QtConcurrent::run([this, generation, threshold, meshFile]() {
+        // the points are the voxels > threshold, the surface is around the same voxels
+        SurfaceResult result = computeSurface(generation, threshold + 1, meshFile);
+        return result;
+    }));
+}
+
+Volume3DController::SurfaceResult Volume3DController::computeSurface(int generation, int isolevel, const QString& meshFile) const
+{
+    SurfaceResult result;
+    result.generation = generation;
+    result.meshFile   = meshFile;
+
+    MarchingCubes marchingcubes(*myVolume_);
+    MarchingCubes::Mesh mesh;
+    if (!marchingcubes.extract(isolevel, mesh, [this, generation]() { return stopping_ || surfaceGeneration_ != generation; })) {
+        result.cancelled = true;
+        return result;
+    }
+    if (mesh.triangles.empty()) return result;
+
+    MarchingCubes::decimate(mesh, surfaceDecimation_mm_);
+    MarchingCubes::computeNormals(mesh);
+
+    // the mesh file is written around the center of the mesh, the item is placed there
+    float minimum[3] = { mesh.vertices[0], mesh.vertices[1], mesh.vertices[2] };
+    float maximum[3] = { mesh.vertices[0], mesh.vertices[1], mesh.vertices[2] };
+    for (std::size_t v = 0; v < mesh.vertices.size(); v += 3) {
+        for (int k = 0; k < 3; ++k) {
+            minimum[k] = std::min(minimum[k], mesh.vertices[v + k]);
+            maximum[k] = std::max(maximum[k], mesh.vertices[v + k]);
+        }
+    }
+    const float center[3] = { (minimum[0] + maximum[0]) / 2, (minimum[1] + maximum[1]) / 2, (minimum[2] + maximum[2]) / 2 };
+    result.center = QVector3D(center[0], center[1], center[2]);
+
+    result.ok = MarchingCubes::writeObj(mesh, meshFile.toStdString(), center);
+    if (!result.ok) qWarning() << "Volume3DController::computeSurface() Can't write the surface to" << meshFile;
+    return result;
+}
+
+void Volume3DController::surfaceFinished()
+{
+    if (stopping_) return;
+
+    SurfaceResult result = m_surfaceWatcher.result();
+    if (!result.cancelled && result.generation == surfaceGeneration_) {
+        if (result.ok) {
+            // the first surface, a uniformly colored opaque mesh. The mesh is in mm, with the scaling relative to the
+            // axes (not absolute) a mesh unit is a data unit of the scatter, so it lies exactly on the points.
+            if (m_surfaceItem == nullptr) {
+                QImage color(2, 2, QImage::Format_RGB32);
+                color.fill(QColor(220, 215, 200));
+                m_surfaceItem = new QCustom3DItem();
+                m_surfaceItem->setTextureImage(color);
+                m_surfaceItem->setScalingAbsolute(false);
+                m_surfaceItem->setScaling(QVector3D(1.0f, 1.0f, 1.0f));
+                m_surfaceItem->setShadowCasting(false);
+                m_scatter->addCustomItem(m_surfaceItem);
+            }
+            m_surfaceItem->setMeshFile(result.meshFile);
+            m_surfaceItem->setPosition(result.center);
+            m_surfaceItem->setVisible(surfaceVisible_);
+
+            if (!shownSurfaceFile_.isEmpty()) QFile::remove(shownSurfaceFile_);
+            shownSurfaceFile_ = result.meshFile;
+        }
+        else if (m_surfaceItem != nullptr) {
+            // nothing over the threshold
+            m_surfaceItem->setVisible(false);
+        }
+        shownSurfaceThreshold_ = requestedThreshold_;
+    }
+    else if (result.ok) {
+        QFile::remove(result.meshFile);
+    }
+
+    // the threshold changed while the worker was busy
+    if (surfaceVisible_ && result.generation != surfaceGeneration_) requestSurfaceUpdate();
+}
+
+void Volume3DController::requestDistanceFieldUpdate()
+{
+    // the same as the surface, only the field of the latest threshold is handed out
+    fieldGeneration_++;
+    if (stopping_ || m_fieldWatcher.isRunning()) return;
+
+    const int generation = fieldGeneration_;
+    const int threshold  = requestedThreshold_;
+    m_fieldWatcher.setFuture(QtConcurrent::run([this, generation, threshold]() {
+        DistanceFieldResult result;
+        result.generation = generation;
+        auto field = std::make_shared<BoneDistanceField>();
+        if (field->build(*myVolume_, threshold, [this, generation]() { return stopping_ || fieldGeneration_ != generation; }))
+            result.field = field;
+        return result;
+    }));
+}
+
+void Volume3DController::distanceFieldFinished()
+{
+    if (stopping_) return;
+
+    DistanceFieldResult result = m_fieldWatcher.result();
+    if (result.field != nullptr && result.generation == fieldGeneration_) {
+        distanceField_ = result.field;
+        emit distanceFieldChanged(distanceField_);
+    }
+
+    // the threshold changed while the worker was busy
+    if (result.generation != fieldGeneration_) requestDistanceFieldUpdate();
+}
+
+std::shared_ptr<const BoneDistanceField> Volume3DController::getDistanceField() const
+{
+    return distanceField_;
+}
+
+void Volume3DController::requestSurfaceTreeUpdate()
+{
+    // the same as the distance field
+    treeGeneration_++;
+    if (stopping_ || m_treeWatcher.isRunning()) return;
+
+    const int generation = treeGeneration_;
+    const int threshold  = requestedThreshold_;
+    m_treeWatcher.setFuture(QtConcurrent::run([this, generation, threshold]() {
+        SurfaceTreeResult result;
+        result.generation = generation;
+        auto tree = std::make_shared<BoneKdTree>();
+        if (tree->build(*myVolume_, threshold, [this, generation]() { return stopping_ || treeGeneration_ != generation; }))
+            result.tree = tree;
+        return result;
+    }));
+}
+
+void Volume3DController::surfaceTreeFinished()
+{
+    if (stopping_) return;
+
+    SurfaceTreeResult result = m_treeWatcher.result();
+    if (result.tree != nullptr && result.generation == treeGeneration_) {
+        surfaceTree_ = result.tree;
+        emit surfaceTreeChanged(surfaceTree_);
+    }
+
+    // the threshold changed while the worker was busy
+    if (result.generation != treeGeneration_) requestSurfaceTreeUpdate();
+}
+
+std::shared_ptr<const BoneKdTree> Volume3DController::getSurfaceTree() const
+{
+    return surfaceTree_;
 }
 
 std::array<int, 2> Volume3DController::getPixelIntensityRange() {
@@ -1,12 +1,23 @@
 #ifndef VOLUME3DCONTROLLER_H
 #define VOLUME3DCONTROLLER_H
 
+#include <array>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <Eigen/Dense>
 
 #include <QObject>
+#include <QFutureWatcher>
+#include <QTimer>
+#include <QTemporaryDir>
 #include <QtDataVisualization>
 
 #include "mhareader.h"
+#include "marchingcubes.h"
+#include "bonedistancefield.h"
+#include "bonekdtree.h"
 
 /**
  * @class Volume3DController
@@ -21,6 +32,15 @@
  * Note: Why we don't use a volume renderer, you might ask, instead of 3dscatter? We tried it. However, there is a "bug"
  * in qt when rendering the volume simultaneously with another object (like the A-mode 3D signal). The render seems "confuse"
  * which one is on top of each other. The visualization become very confusing, so that is why we use 3Dscatter here.
+ * The bone can also be shown as a surface (see MarchingCubes), it is an ordinary opaque mesh (QCustom3DItem) in the
+ * same scatter, so it doesn't have that problem.
+ *
+ * The voxels come from the bricked volume of MHAReader (see BrickedVolume), the sorting by intensity and the surface
+ * only go through the bricks that have something brighter than the empty space.
+ *
+ * The distance field of the bone (see BoneDistanceField) and the tree of its surface points (see BoneKdTree) follow the
+ * threshold too, they are computed in the background and handed out with distanceFieldChanged() and
+ * surfaceTreeChanged(), for the navigation.
  *
  */
 
@@ -33,46 +53,191 @@ public:
      */
     explicit Volume3DController(QObject *parent = nullptr, Q3DScatter *scatter = nullptr, MHAReader *mhareader=nullptr);
 
+    /**
+     * @brief Destructor, waits for the workers (they look at the voxels of the reader)
+     */
+    ~Volume3DController();
+
     /**
      * @brief Returns pixel intensity range (min and max)
      */
     std::array<int, 2> getPixelIntensityRange();
 
+    /**
+     * @brief GET the latest distance field of the bone, nullptr until the first one is computed
+     */
+    std::shared_ptr<const BoneDistanceField> getDistanceField() const;
+
+    /**
+     * @brief GET the latest tree of the surface points of the bone, nullptr until the first one is built
+     */
+    std::shared_ptr<const BoneKdTree> getSurfaceTree() const;
+
+    /**
+     * @brief Shows another volume (e.g. the next one of the live reconstruction) in place of the current one. The
+     * threshold, the surface and the other series of the scatter stay, the old reader can be deleted afterwards.
+     */
+    void setVolume(MHAReader *mhareader);
+
 public slots:
     /**
      * @brief A slot where we could update the volume
-     * As now i am writing this class, this function will be called when user change the threshold
+     * As now i am writing this class, this function will be called when user change the threshold. The points are
+     * computed in the background, only for the latest threshold, and added to the scatter when they are ready.
      */
     void updateVolume(int value);
 
+    /**
+     * @brief Shows the bone as a surface mesh (marching cubes at the threshold) instead of the points, or back
+     */
+    void setSurfaceVisible(bool visible);
+
+private slots:
+    /**
+     * @brief The voxels are sorted and the levels are built, shows the latest requested threshold
+     */
+    void indexBuildFinished();
+
+    /**
+     * @brief The worker has the new points, puts them in the series and starts the next one if the threshold changed
+     */
+    void pointDeltaFinished();
+
+    /**
+     * @brief The user orbits or zooms, switches to the interactive point budget (a coarser level)
+     */
+    void cameraMoved();
+
+    /**
+     * @brief The camera rests for a while, switches back to the idle point budget (a finer level)
+     */
+    void cameraIdle();
+
+    /**
+     * @brief The worker has the surface mesh, shows it and starts the next one if the threshold changed
+     */
+    void surfaceFinished();
+
+    /**
+     * @brief The worker has the distance field, hands it out and starts the next one if the threshold changed
+     */
+    void distanceFieldFinished();
+
+    /**
+     * @brief The worker has the tree of the surface points, hands it out and starts the next one if the threshold changed
+     */
+    void surfaceTreeFinished();
+
 private:
 
     /**
-     * @brief Returns indices from a vector (volume) that is over the threshold
+     * @brief Sorts the voxels by intensity (counting sort) and stores their indices in level 0, once per volume.
+     * After this, the voxels over a threshold are simply the first countAbove[threshold] indices.
+     */
+    void buildIntensityIndex();
+
+    /**
+     * @brief Builds the coarser levels of detail from level 0, the brightest voxel of every 2x2x2, 4x4x4, ... cube
+     */
+    void buildLodLevels();
+
+    /**
+     * @brief Creates the series of the volume with the border corners, and sets the axes and the gradient
+     */
+    void createSeries();
+
+    /**
+     * @struct LodLevel
+     * @brief One level of detail, voxel indices sorted by intensity (brightest first)
+     */
+    struct LodLevel {
+        std::vector<std::uint32_t> voxels;      // linear indices of the voxels of this level, brightest first
+        std::array<std::size_t, 256> countAbove{}; // countAbove[t] is how many of them are brighter than t
+    };
+
+    /**
+     * @struct PointDelta
+     * @brief The points that a worker prepared to be added to the series (levels_[level].voxels[from, to), or the whole series)
+     */
+    struct PointDelta {
+        int generation = 0;                     // the generation of the request it was computed for
+        int level = 0;                          // the level of detail of the points
+        std::size_t from = 0;
+        std::size_t to = 0;
+        bool reset = false;                     // the whole series (border included) instead of points to append
+        bool cancelled = false;                 // a newer threshold came, the points are incomplete
+        QScatterDataArray added;
+    };
+
+    /**
+     * @brief Something changed (threshold or camera), shows it as soon as the worker is free
+     */
+    void requestPointUpdate();
+
+    /**
+     * @brief How many points the scatter may get now, depends on whether the camera moves and on the zoom
+     */
+    std::size_t pointBudget() const;
+
+    /**
+     * @brief Brings the series to the latest requested threshold and budget, cuts it directly or starts a worker
+     */
+    void startPointDelta();
+
+    /**
+     * @brief Runs in the worker, fills the items of levels_[level].voxels[from, to). Gives up if the generation changes.
+     */
+    PointDelta computePointDelta(int generation, int level, std::size_t from, std::size_t to, bool reset) const;
+
+    /**
+     * @struct SurfaceResult
+     * @brief The surface mesh that a worker extracted, already written as an .obj file for QCustom3DItem
+     */
+    struct SurfaceResult {
+        int generation = 0;                     // the generation of the request it was computed for
+        bool cancelled = false;                 // a newer threshold came, there is no mesh
+        bool ok = false;                        // the mesh file is written (false also if the surface is empty)
+        QString meshFile;
+        QVector3D center;                       // the mesh file is relative to this point (scatter coordinates)
+    };
+
+    /**
+     * @brief Starts a worker for the surface at the latest threshold, or remembers to do so when the running one is done
+     */
+    void requestSurfaceUpdate();
+
+    /**
+     * @brief Runs in the worker, marching cubes + decimation + normals, written to meshFile. Gives up if the generation changes.
      */
-    void findIndicesWithThreshold(const std::vector<unsigned char>& volume, int threshold, std::vector<int>& result);
+    SurfaceResult computeSurface(int generation, int isolevel, const QString& meshFile) const;
 
     /**
-     * @brief Returns indices from a vector (volume) that is within the threshold
+     * @struct DistanceFieldResult
+     * @brief The distance field that a worker computed
      */
-    void findIndicesWithThreshold(const std::vector<unsigned char>& volume, std::vector<int> threshold, std::vector<int>& result);
+    struct DistanceFieldResult {
+        int generation = 0;                     // the generation of the request it was computed for
+        std::shared_ptr<const BoneDistanceField> field; // nullptr if a newer threshold came
+    };
 
     /**
-     * @brief Returns values from a vector that is specified with indices
+     * @brief Starts a worker for the distance field at the latest threshold, or remembers to do so when the running one is done
      */
-    void getValuesWithIndices(const std::vector<unsigned char>& volume, const std::vector<int>& myindices, std::vector<unsigned char>& result);
+    void requestDistanceFieldUpdate();
 
     /**
-     * @brief Converts indices into a subscript.
-     * Imagine you have a long vector that it is actually a matrix. You have the indices but you want to know,
-     * the position (row and column) in the matrix. This function will does that for you.
+     * @struct SurfaceTreeResult
+     * @brief The tree of the surface points that a worker built
      */
-    void ind2sub(const std::vector<int>& indices, const std::vector<int>& dimsize, std::vector<std::vector<int>>& voxelcoordinate);
+    struct SurfaceTreeResult {
+        int generation = 0;                     // the generation of the request it was built for
+        std::shared_ptr<const BoneKdTree> tree; // nullptr if a newer threshold came
+    };
 
     /**
-     * @brief Convert std::vector of std::vector to an Eigen Matrix
+     * @brief Starts a worker for the tree of the surface points at the latest threshold, or remembers to do so when the running one is done
      */
-    Eigen::MatrixXd vectorVector2EigenMatrix(const std::vector<std::vector<int>>& voxel_coordinate);
+    void requestSurfaceTreeUpdate();
 
     /**
      * @brief Convert right-hand CS (from Qualisys) to left-handed CS (Qt3DScatter plot)
@@ -94,7 +259,7 @@ private:
     Q3DScatter *m_scatter;                      //!< An object of the Q3Dscatter, initialized outside of this class
     MHAReader *myMHAReader_;                    //!< A pointer to an MHAReader object, contains the header data and the volume of MHA file
     MHAReader::MHAHeader myMHAHeader_;          //!< A pointer to an MHAHeader object, stores the header data from the MHA file
-    std::vector<unsigned char> myMHAVolume_;    //!< A vector that stores the volume
+    const BrickedVolume* myVolume_ = nullptr;   //!< The volume in bricks, owned by MHAReader (the empty bricks are skipped)
 
     // variables for visualization only
     // QLinearGradient gradient;                   //!< A gradient to color the data points in Q3DScatter
@@ -106,7 +271,56 @@ private:
     // volume
     int extensionvolume_mm = 30;                //!< An dimension extension for volume viusalization
 
+    // the voxels sorted by intensity, see buildIntensityIndex()
+    static constexpr int BORDER_POINTS = 8;     //!< The corners of the border, they are the first items of the series
+    std::vector<LodLevel> levels_;              //!< Level 0 has all voxels over the minimum intensity, the next ones are coarser
+    int shownLevel_ = 0;                        //!< The level that is in the series now
+    std::size_t shownVoxels_ = 0;               //!< How many voxels of that level are in the series now
+    std::array<QVector3D, BORDER_POINTS> borderPositions_; //!< The corners of the border, the first items of the series
+    std::vector<float> coordinateX_;            //!< Position (in the scatter, mm) of every column of the volume
+    std::vector<float> coordinateY_;            //!< Position (in the scatter, mm) of every row of the volume
+    std::vector<float> coordinateZ_;            //!< Position (in the scatter, mm) of every slice of the volume
+    QScatter3DSeries *m_series = nullptr;       //!< The series of the volume, owned by the scatter
+
+    // the background work, the series itself is only touched in the GUI thread
+    QFutureWatcher<void> m_indexWatcher;        //!< Watches buildIntensityIndex(), running in the background
+    QFutureWatcher<PointDelta> m_pointWatcher;  //!< Watches computePointDelta(), running in the background
+    std::atomic<int> generation_{0};            //!< Increases with every requested threshold, the worker gives up when it changes
+    std::atomic<bool> stopping_{false};         //!< Set in the destructor, the workers stop as soon as they can
+    bool indexReady_ = false;                   //!< levels_ are ready
+    int requestedThreshold_ = 0;                //!< The latest threshold from the slider
+    QTimer m_cameraIdleTimer;                   //!< Fires when the camera rests, then the finer level comes back
+    bool cameraMoving_ = false;                 //!< The user orbits or zooms right now
+
+    // the surface of the bone, instead of the points
+    QFutureWatcher<SurfaceResult> m_surfaceWatcher; //!< Watches computeSurface(), running in the background
+    std::atomic<int> surfaceGeneration_{0};     //!< Increases with every requested surface, the worker gives up when it changes
+    bool surfaceVisible_ = false;               //!< The surface is shown instead of the points
+    QCustom3DItem *m_surfaceItem = nullptr;     //!< The surface in the scatter, owned by the scatter
+    QTemporaryDir m_surfaceDir;                 //!< Where the .obj files go (QCustom3DItem only loads meshes from files)
+    QString shownSurfaceFile_;                  //!< The .obj file of m_surfaceItem
+    int shownSurfaceThreshold_ = -1;            //!< The threshold of m_surfaceItem
+    int surfaceCount_ = 0;                      //!< For the names of the .obj files, every mesh needs a new name (Qt caches them by name)
+    float surfaceDecimation_mm_ = 1.0f;         //!< Cell size of the decimation of the surface, 0 to not decimate
+
+    // the distance field of the bone, for the navigation
+    QFutureWatcher<DistanceFieldResult> m_fieldWatcher; //!< Watches the BoneDistanceField::build(), running in the background
+    std::atomic<int> fieldGeneration_{0};       //!< Increases with every requested field, the worker gives up when it changes
+    std::shared_ptr<const BoneDistanceField> distanceField_; //!< The latest field, shared with whoever navigates with it
+    QFutureWatcher<SurfaceTreeResult> m_treeWatcher; //!< Watches the BoneKdTree::build(), running in the background
+    std::atomic<int> treeGeneration_{0};        //!< Increases with every requested tree, the worker gives up when it changes
+    std::shared_ptr<const BoneKdTree> surfaceTree_; //!< The latest tree, shared with whoever navigates with it
+
 signals:
+    /**
+     * @brief A new distance field of the bone (for the latest threshold) is ready
+     */
+    void distanceFieldChanged(std::shared_ptr<const BoneDistanceField> field);
+
+    /**
+     * @brief A new tree of the surface points of the bone (for the latest threshold) is ready
+     */
+    void surfaceTreeChanged(std::shared_ptr<const BoneKdTree> tree);
 };
 
 #endif // VOLUME3DCONTROLLER_H
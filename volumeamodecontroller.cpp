@@ -1,20 +1,35 @@
 #include <iostream>
+#include <limits>
+#include <cmath>
 
 #include "volumeamodecontroller.h"
+#include "ultrasoundconfig.h"
+
+#include <QPainter>
+
+// How often the summary of the guidance goes to the GUI, the mocap frames come much faster than anybody can read
+static constexpr int GUIDANCE_REPORT_MILLISECONDS = 100;
+// How often the volume is resliced along the holder, a slice is a lot of samples and the GUI shows ~30 Hz anyway
+static constexpr int RESLICE_REPORT_MILLISECONDS = 33;
 
 VolumeAmodeController::VolumeAmodeController(QObject *parent, Q3DScatter *scatter, std::vector<AmodeConfig::Data> amodegroupdata)
-    : QObject{parent}, scatter_(scatter), amodegroupdata_(amodegroupdata), m_isVisualizing(false)
+    : QObject{parent}, scatter_(scatter), amodegroupdata_(amodegroupdata), beamCaster_(amodegroupdata), reslicer_(amodegroupdata), m_isVisualizing(false)
 {
+    // no peak is picked yet
+    expectedpeaks_.assign(amodegroupdata_.size(), std::nullopt);
+
     // instantiate the visualizer and move it to a thread
     m_visualizer = new VolumeAmodeVisualizer(nullptr, scatter, amodegroupdata);
     m_visualizerThread = new QThread();
     m_visualizer->moveToThread(m_visualizerThread);
 
     // just in case it is not connected, just ignore this
+    // the frames don't go through signals, they go through the mailbox of the visualizer (postFrame())
     bool a = connect(m_visualizerThread, &QThread::started, m_visualizer, &VolumeAmodeVisualizer::processVisualization, Qt::QueuedConnection);
-    bool b = connect(this, &VolumeAmodeController::newDataPairReceived, m_visualizer, &VolumeAmodeVisualizer::setData, Qt::QueuedConnection);
     if(!a) qDebug() << "a is not connected";
-    if(!b) qDebug() << "b is not connected";
+
+    // what the visualizer does to hold the frame budget, for the GUI (queued, the visualizer is in its thread)
+    connect(m_visualizer, &VolumeAmodeVisualizer::renderSettingsChanged, this, &VolumeAmodeController::reportRenderSettings, Qt::QueuedConnection);
 
     // start the thread
     m_visualizerThread->start();
@@ -124,15 +139,8 @@ void VolumeAmodeController::onAmodeSignalReceived(const std::vector<uint16_t> &u
     amodesignalReady = true;
     // ...and only continue to visualize data if rigidbody data already arrive
     if (rigidbodyReady) {
-        // visualize3DSignal();
-
-        // // Emit signal to the worker thread
-        // qDebug() << "onAmodeSignalReceived| data pair ready";
-        // emit newDataPairReceived(amodesignal_, currentT_holder_camera);
-        // qDebug() << "onAmodeSignalReceived| signal emitted";
-
-        // Hoi, dennis in the future, please check this function name, use the correct name
-        m_visualizer->test(amodesignal_, currentT_holder_ref);
+        // the visualizer thread takes the newest pair whenever it is ready, this never waits for it
+        m_visualizer->postFrame(amodesignal_, currentT_holder_ref, expectedpeaks_);
     }
 }
 
@@ -157,24 +165,223 @@ void VolumeAmodeController::onRigidBodyReceived(const QualisysTransformationMana
         return;
     }
 
+    // where the beams hit the bone now, a few microseconds per beam, so it is done for every frame
+    if (beamCaster_.hasVolume()) beamCaster_.cast(currentT_holder_ref, bonedepths_);
+
+    // how far the bone is and how well the beams are aimed at it, lookups in the distance field and the surface tree
+    if (distanceField_ != nullptr || surfaceTree_ != nullptr) updateBoneGuidance();
+
+    // what the beams go through, the volume along the plane of the holder, not more often than the GUI shows it
+    if (reslicer_.hasVolume() && (!resliceTimer_.isValid() || resliceTimer_.elapsed() >= RESLICE_REPORT_MILLISECONDS)) {
+        resliceTimer_.start();
+        updateReslice();
+    }
+
     // set the flag to be true...
     rigidbodyReady = true;
     // ...and only continue to visualize data if the amode signal data already arrive
     if (amodesignalReady) {
-        // visualize3DSignal();
+        // the visualizer thread takes the newest pair whenever it is ready, this never waits for it
+        m_visualizer->postFrame(amodesignal_, currentT_holder_ref, expectedpeaks_);
+    }
+
+}
 
-        // // Emit signal to the worker thread
-        // qDebug() << "onRigidBodyReceived| data pair ready";
-        // emit newDataPairReceived(amodesignal_, currentT_holder_camera);
-        // qDebug() << "onRigidBodyReceived| signal emitted";
+void VolumeAmodeController::onExpectedPeakSelected(std::string plotname, int plotid, std::optional<double> xLineValue)
+{
+    // the depth of the bone picked by the user, compared to the surface of the volume in updateBoneGuidance(). The
+    // visualizer gets them with the next frame.
+    if (plotid >= 0 && plotid < static_cast<int>(expectedpeaks_.size())) expectedpeaks_[plotid] = xLineValue;
+}
+
+void VolumeAmodeController::setBoneVolume(const BrickedVolume* volume)
+{
+    beamCaster_.setVolume(volume);
+    reslicer_.setVolume(volume);
+    if (volume == nullptr) emit resliceUpdated(QImage());
+    // the slice of the new volume comes with the next mocap frame
+    resliceTimer_.invalidate();
+    // the depths of the previous volume mean nothing anymore
+    bonedepths_.assign(amodegroupdata_.size(), std::nullopt);
+}
+
+void VolumeAmodeController::setBoneThreshold(int threshold)
+{
+    beamCaster_.setThreshold(threshold);
+}
+
+const std::vector<std::optional<double>>& VolumeAmodeController::getBoneDepths() const
+{
+    return bonedepths_;
+}
+
+void VolumeAmodeController::setDistanceField(std::shared_ptr<const BoneDistanceField> field)
+{
+    distanceField_ = field;
+    boneguidance_.assign(amodegroupdata_.size(), std::nullopt);
+    if (distanceField_ == nullptr && surfaceTree_ == nullptr) emit boneGuidanceUpdated(QString());
+}
+
+const std::vector<std::optional<VolumeAmodeController::BoneGuidance>>& VolumeAmodeController::getBoneGuidance() const
+{
+    return boneguidance_;
+}
+
+void VolumeAmodeController::setSurfaceTree(std::shared_ptr<const BoneKdTree> tree)
+{
+    surfaceTree_ = tree;
+    peakresiduals_.assign(amodegroupdata_.size(), std::nullopt);
+    surfacedepths_.assign(amodegroupdata_.size(), std::nullopt);
+    if (distanceField_ == nullptr && surfaceTree_ == nullptr) emit boneGuidanceUpdated(QString());
+}
+
+const std::vector<std::optional<double>>& VolumeAmodeController::getPeakResiduals() const
+{
+    return peakresiduals_;
+}
 
-        // Hoi, dennis in the future, please check this function name, use the correct name
-        m_visualizer->test(amodesignal_, currentT_holder_ref);
+const std::vector<std::optional<double>>& VolumeAmodeController::getSurfaceDepths() const
+{
+    return surfacedepths_;
+}
+
+void VolumeAmodeController::setFrameBudget(int milliseconds)
+{
+    if (m_visualizer == nullptr) return;
+    m_visualizer->setFrameBudget(milliseconds);
+}
+
+VolumeAmodeVisualizer::RenderSettings VolumeAmodeController::getRenderSettings() const
+{
+    if (m_visualizer == nullptr) return VolumeAmodeVisualizer::RenderSettings();
+    return m_visualizer->getRenderSettings();
+}
+
+void VolumeAmodeController::reportRenderSettings()
+{
+    // e.g. "1/4 samples, 2 envelopes, 30 Hz (12.5 of 33 ms)"
+    const VolumeAmodeVisualizer::RenderSettings settings = getRenderSettings();
+    emit renderSettingsUpdated(QString("1/%1 samples, %2 envelope%3, %4 Hz (%5 of %6 ms)")
+                                   .arg(settings.downsampleRatio, 0, 'f', 0)
+                                   .arg(settings.signalDisplay)
+                                   .arg(settings.signalDisplay == 1 ? "" : "s")
+                                   .arg(settings.updateRate, 0, 'f', 0)
+                                   .arg(settings.frameMilliseconds, 0, 'f', 1)
+                                   .arg(settings.frameBudget));
+}
+
+void VolumeAmodeController::updateBoneGuidance()
+{
+    const std::vector<Eigen::Isometry3d>& T_ustip_holder = beamCaster_.getTransducersToHolder();
+    QStringList summary;
+
+    // how far the tips are from the bone and how well the beams are aimed, from the distance field
+    if (distanceField_ != nullptr) {
+        boneguidance_.assign(T_ustip_holder.size(), std::nullopt);
+
+        std::optional<std::size_t> worst;
+        double nearest = std::numeric_limits<double>::max();
+        double farthest = 0.0;
+        for (std::size_t i = 0; i < T_ustip_holder.size(); ++i) {
+            // the same beam as the beam caster, from the tip along the local z axis
+            const Eigen::Isometry3d T_ustip_ref = currentT_holder_ref * T_ustip_holder[i];
+            BoneGuidance guidance;
+            if (!distanceField_->beamToBone(T_ustip_ref.translation(), T_ustip_ref.linear().col(2), guidance.distance, guidance.angle)) continue;
+
+            boneguidance_[i] = guidance;
+            nearest  = std::min(nearest, guidance.distance);
+            farthest = std::max(farthest, guidance.distance);
+            if (!worst.has_value() || guidance.angle > boneguidance_[worst.value()]->angle) worst = i;
+        }
+
+        if (!worst.has_value()) summary << "Bone: -";
+        else summary << QString("Bone: %1-%2 mm, worst angle %3° (#%4)")
+                            .arg(nearest, 0, 'f', 1)
+                            .arg(farthest, 0, 'f', 1)
+                            .arg(boneguidance_[worst.value()]->angle, 0, 'f', 0)
+                            .arg(worst.value() + 1);
+    }
+
+    // how far the bone points picked in the signals (the expected peaks) are from the surface of the volume, all of
+    // them in one query. It is what a registration of the A-mode to the volume would minimize.
+    if (surfaceTree_ != nullptr) {
+        peakresiduals_.assign(T_ustip_holder.size(), std::nullopt);
+
+        std::vector<std::size_t> transducers;
+        std::vector<Eigen::Vector3d> peakpoints;
+        for (std::size_t i = 0; i < T_ustip_holder.size() && i < expectedpeaks_.size(); ++i) {
+            if (!expectedpeaks_[i].has_value()) continue;
+            const Eigen::Isometry3d T_ustip_ref = currentT_holder_ref * T_ustip_holder[i];
+            transducers.push_back(i);
+            peakpoints.push_back(T_ustip_ref.translation() + expectedpeaks_[i].value() * T_ustip_ref.linear().col(2));
+        }
+
+        std::vector<double> distances;
+        std::vector<Eigen::Vector3d> surfacepoints;
+        surfaceTree_->nearest(peakpoints, distances, surfacepoints);
+
+        double sumSquared = 0.0;
+        int nResiduals = 0;
+        for (std::size_t k = 0; k < transducers.size(); ++k) {
+            if (!std::isfinite(distances[k])) continue;
+            peakresiduals_[transducers[k]] = distances[k];
+            sumSquared += distances[k] * distances[k];
+            nResiduals++;
+        }
+        if (nResiduals > 0) summary << QString("Peaks off surface: %1 mm RMS").arg(std::sqrt(sumSquared / nResiduals), 0, 'f', 1);
+
+        // where every beam enters the surface, all beams in one query, as deep as the signal goes
+        std::vector<Eigen::Vector3d> tips, directions;
+        for (const Eigen::Isometry3d& T_ustip : T_ustip_holder) {
+            const Eigen::Isometry3d T_ustip_ref = currentT_holder_ref * T_ustip;
+            tips.push_back(T_ustip_ref.translation());
+            directions.push_back(T_ustip_ref.linear().col(2));
+        }
+        surfaceTree_->castRays(tips, directions, UltrasoundConfig::N_SAMPLE * UltrasoundConfig::DS, surfacedepths_);
+
+        int nHits = 0;
+        for (const std::optional<double>& depth : surfacedepths_) nHits += depth.has_value();
+        summary << QString("Beams on surface: %1/%2").arg(nHits).arg(surfacedepths_.size());
     }
 
+    // the user only needs to see it a few times per second
+    if (guidanceTimer_.isValid() && guidanceTimer_.elapsed() < GUIDANCE_REPORT_MILLISECONDS) return;
+    guidanceTimer_.start();
+    emit boneGuidanceUpdated(summary.join(", "));
 }
 
-void VolumeAmodeController::onExpectedPeakSelected(std::string plotname, int plotid, std::optional<double> xLineValue)
+void VolumeAmodeController::updateReslice()
 {
-    m_visualizer->setExpectedPeak(plotid, xLineValue);
+    if (!reslicer_.reslice(currentT_holder_ref)) return;
+
+    // the gray slice into the (reused) color image, then the beams on top of it
+    const int width = reslicer_.getWidth(), height = reslicer_.getHeight();
+    if (resliceImage_.width() != width || resliceImage_.height() != height)
+        resliceImage_ = QImage(width, height, QImage::Format_RGB32);
+    const unsigned char* gray = reslicer_.getImage().data();
+    for (int row = 0; row < height; ++row) {
+        QRgb* line = reinterpret_cast<QRgb*>(resliceImage_.scanLine(row));
+        for (int column = 0; column < width; ++column, ++gray) line[column] = qRgb(*gray, *gray, *gray);
+    }
+
+    QPainter painter(&resliceImage_);
+    painter.setRenderHint(QPainter::Antialiasing);
+    const std::vector<Eigen::Vector2d>& tips = reslicer_.getTipPixels();
+    const std::vector<Eigen::Vector2d>& beamEnds = reslicer_.getBeamEndPixels();
+    for (std::size_t i = 0; i < tips.size(); ++i) {
+        const QPointF tip(tips[i].x(), tips[i].y()), beamEnd(beamEnds[i].x(), beamEnds[i].y());
+        painter.setPen(QPen(QColor(255, 200, 0, 160), 1.0));
+        painter.drawLine(tip, beamEnd);
+        // where the beam hits the bone, if it does
+        if (i < bonedepths_.size() && bonedepths_[i].has_value()) {
+            const QPointF hit = tip + (beamEnd - tip) * (bonedepths_[i].value() / (UltrasoundConfig::N_SAMPLE * UltrasoundConfig::DS));
+            painter.setPen(QPen(Qt::red, 2.0));
+            painter.drawEllipse(hit, 2.0, 2.0);
+        }
+        painter.setPen(QPen(Qt::green, 2.0));
+        painter.drawEllipse(tip, 1.5, 1.5);
+    }
+    painter.end();
+
+    emit resliceUpdated(resliceImage_);
 }
@@ -1,13 +1,20 @@
 #ifndef VOLUMEAMODECONTROLLER_H
 #define VOLUMEAMODECONTROLLER_H
 
+#include <memory>
 #include <Eigen/Dense>
 
 #include <QObject>
+#include <QElapsedTimer>
+#include <QImage>
 #include <QtDataVisualization>
 
 #include "VolumeAmodeVisualizer.h"
 #include "qualisystransformationmanager.h"
+#include "amodebeamcaster.h"
+#include "bonedistancefield.h"
+#include "bonekdtree.h"
+#include "volumereslicer.h"
 
 /**
  * @class VolumeAmodeController
@@ -29,6 +36,24 @@
  * produces data queueing. My solution is to move the visualization to another thread. Please
  * check VolumeAmodeVisualizer.cpp for details
  *
+ * If there is a reconstructed volume (setBoneVolume()), the beam of every transducer is also followed through it for
+ * every mocap frame (AmodeBeamCaster), that is where the transducer should see the bone (getBoneDepths()). The user
+ * can put the interval windows there, instead of looking for the peak in every signal.
+ *
+ * With the distance field of the bone (setDistanceField()), every mocap frame also tells how far every transducer tip
+ * is from the bone and how well its beam is aimed at it (getBoneGuidance()), a few lookups per transducer. A short
+ * summary goes to the GUI with boneGuidanceUpdated(), not more often than the user can read it. With the tree of the
+ * surface points of the bone (setSurfaceTree()), the bone points that the user picked in the signals (the expected
+ * peaks) are compared to the surface of the volume too (getPeakResiduals()), and all beams are cast onto the surface
+ * in one query (getSurfaceDepths()).
+ *
+ * The volume is also cut along the plane of the transducers of the holder (VolumeReslicer), with the beams drawn on it
+ * (resliceUpdated()), so the user sees what every beam goes through next to the signals. That is a lot of samples, so
+ * it is done about 30 times per second (as often as the GUI shows it), not for every mocap frame.
+ *
+ * How detailed the 3D signal is and how often it is updated is decided by the visualizer, to hold a frame budget
+ * (setFrameBudget()); what it does right now is getRenderSettings(), and its summary goes to renderSettingsUpdated().
+ *
  */
 
 class VolumeAmodeController : public QObject
@@ -66,6 +91,63 @@ public:
      */
     void setActiveHolder(std::string T_id);
 
+    /**
+     * @brief SET the reconstructed volume that the beams are cast through (owned by MHAReader, nullptr to remove it)
+     */
+    void setBoneVolume(const BrickedVolume* volume);
+
+    /**
+     * @brief GET the depth (mm) of the bone along the beam of every transducer at the latest mocap frame, empty if the
+     * beam doesn't hit the bone (or there is no volume)
+     */
+    const std::vector<std::optional<double>>& getBoneDepths() const;
+
+    /**
+     * @struct BoneGuidance
+     * @brief Where the bone is for one transducer
+     */
+    struct BoneGuidance {
+        double distance;    // distance (mm) from the tip to the nearest bone
+        double angle;       // angle (degrees) between the beam and the direction to the nearest bone, 0 is straight at it
+    };
+
+    /**
+     * @brief SET the distance field of the bone (from Volume3DController, nullptr to remove it)
+     */
+    void setDistanceField(std::shared_ptr<const BoneDistanceField> field);
+
+    /**
+     * @brief GET the guidance of every transducer at the latest mocap frame, empty if it can't be told (or there is no field)
+     */
+    const std::vector<std::optional<BoneGuidance>>& getBoneGuidance() const;
+
+    /**
+     * @brief SET the tree of the surface points of the bone (from Volume3DController, nullptr to remove it)
+     */
+    void setSurfaceTree(std::shared_ptr<const BoneKdTree> tree);
+
+    /**
+     * @brief GET the distance (mm) from the expected peak of every transducer (as a point along its beam) to the
+     * surface of the bone at the latest mocap frame, empty if there is no peak (or no tree)
+     */
+    const std::vector<std::optional<double>>& getPeakResiduals() const;
+
+    /**
+     * @brief GET the depth (mm) where the beam of every transducer enters the surface of the bone at the latest mocap
+     * frame, empty if it doesn't (or there is no tree)
+     */
+    const std::vector<std::optional<double>>& getSurfaceDepths() const;
+
+    /**
+     * @brief SET the time (ms) one frame of the 3D signal may take, the visualizer picks the detail and the rate for it
+     */
+    void setFrameBudget(int milliseconds);
+
+    /**
+     * @brief GET the detail and the rate the visualizer shows the 3D signal with right now
+     */
+    VolumeAmodeVisualizer::RenderSettings getRenderSettings() const;
+
 public slots:
 
     /**
@@ -83,9 +165,30 @@ public slots:
      */
     void onExpectedPeakSelected(std::string plotname, int plotid, std::optional<double> xLineValue);
 
+    /**
+     * @brief SET the threshold of the bone in the volume, needs to be connected to the threshold slider (the same as Volume3DController)
+     */
+    void setBoneThreshold(int threshold);
+
 
 private:
 
+    /**
+     * @brief The slice of the volume along the holder with the beams on it, for the current holder pose
+     */
+    void updateReslice();
+
+    /**
+     * @brief The guidance and the peak residuals of every transducer for the current holder pose, and their summary for
+     * the GUI (throttled)
+     */
+    void updateBoneGuidance();
+
+    /**
+     * @brief The visualizer changed its settings, their summary for the GUI
+     */
+    void reportRenderSettings();
+
     // all variables related to visualization with QCustomPlot
     Q3DScatter *scatter_;                                       //!< 3d Scatter object. Initialized from mainwindow.
 
@@ -104,13 +207,45 @@ private:
     std::string transformation_id = "";                         //!< The name of the current holder being visualized (relates to its transformation).
     std::string transformation_ref = "B_N_REF";                 //!< The name of reference rigid body (the wire calibration thing). The reconstructed bone is in this CS.
 
+    // variable that handle the prediction of the bone depth from the volume
+    AmodeBeamCaster beamCaster_;                                //!< Casts the beams of the holder through the volume.
+    std::vector<std::optional<double>> bonedepths_;             //!< The depth of the bone along every beam, at the latest mocap frame.
+
+    // variable that handle the guidance with the distance field of the bone
+    std::shared_ptr<const BoneDistanceField> distanceField_;    //!< The distance field of the bone, shared with Volume3DController.
+    std::vector<std::optional<BoneGuidance>> boneguidance_;     //!< The guidance of every transducer, at the latest mocap frame.
+    std::shared_ptr<const BoneKdTree> surfaceTree_;             //!< The surface points of the bone, shared with Volume3DController.
+    std::vector<std::optional<double>> expectedpeaks_;          //!< The depth of the expected peak of every transducer (picked by the user).
+    std::vector<std::optional<double>> peakresiduals_;          //!< The distance of every expected peak to the surface, at the latest mocap frame.
+    std::vector<std::optional<double>> surfacedepths_;          //!< The depth where every beam enters the surface, at the latest mocap frame.
+    QElapsedTimer guidanceTimer_;                               //!< Since the last boneGuidanceUpdated().
+
+    // variable that handle the slice of the volume along the holder
+    VolumeReslicer reslicer_;                                   //!< Samples the volume on the plane of the transducers.
+    QImage resliceImage_;                                       //!< The slice with the beams, the same image for every frame.
+    QElapsedTimer resliceTimer_;                                //!< Since the last updateReslice().
+
     // variable that handle the threading
     VolumeAmodeVisualizer *m_visualizer;
     QThread *m_visualizerThread;
     bool m_isVisualizing;
 
 signals:
-    void newDataPairReceived(const QVector<int16_t>& data_amode, const Eigen::Isometry3d& data_rigidbody);
+    /**
+     * @brief A short summary of the guidance for the user (the range of the distances, the worst aimed beam and how far
+     * the expected peaks are from the surface)
+     */
+    void boneGuidanceUpdated(const QString& summary);
+
+    /**
+     * @brief A new slice of the volume along the holder (with the beams drawn on it), a null image if there is no volume
+     */
+    void resliceUpdated(const QImage& image);
+
+    /**
+     * @brief A short summary of the detail and the rate of the 3D signal (see getRenderSettings())
+     */
+    void renderSettingsUpdated(const QString& summary);
 };
 
 #endif // VOLUMEAMODECONTROLLER_H
@@ -1,67 +1,158 @@
 #include "VolumeAmodeVisualizer.h"
 #include <QThread>
+#include <algorithm>
 
 
 #include "amodedatamanipulator.h"
+#include "amodebeamcaster.h"
 #include "ultrasoundconfig.h"
 
+// The time one frame of the 3D signal may take by default (ms, computing the points and copying them to the GUI)
+static constexpr int RENDER_FRAME_BUDGET_MS = 33;
+
+// The levels of detail, from the finest to the coarsest, every one has about half of the points of the one before.
+// The envelopes are the most that are shown, the display mode may ask for less.
+struct RenderLevel {
+    double downsample_ratio;
+    int max_signaldisplay;
+};
+static constexpr RenderLevel RENDER_LEVELS[] = { {2.0, 4}, {4.0, 4}, {4.0, 2}, {4.0, 1}, {8.0, 1}, {16.0, 1} };
+static constexpr int RENDER_LEVEL_COUNT   = sizeof(RENDER_LEVELS) / sizeof(RENDER_LEVELS[0]);
+static constexpr int RENDER_LEVEL_DEFAULT = 1;     // the downsampling that used to be fixed
+
+// Frames in a row over the budget before the detail goes down, and far under it before it goes up again (slower,
+// so it doesn't flip back and forth). Far under is when the next finer level (twice the points) would still fit.
+static constexpr int RENDER_FRAMES_TO_COARSEN   = 3;
+static constexpr int RENDER_FRAMES_TO_REFINE    = 30;
+static constexpr double RENDER_REFINE_FRACTION  = 0.4;
+// How much a new measurement moves the averages, and how often the settings go to the GUI
+static constexpr double RENDER_SMOOTHING        = 0.2;
+static constexpr int RENDER_REPORT_MILLISECONDS = 500;
+
+// the number of envelopes of a level of detail, for a display mode (see setSignalDisplayMode())
+static int levelSignalDisplay(int level, int mode)
+{
+    const int requested = (mode == 2) ? 4 : (mode == 1) ? 2 : 1;
+    return std::min(requested, RENDER_LEVELS[level].max_signaldisplay);
+}
+
 VolumeAmodeVisualizer::VolumeAmodeVisualizer(QObject *parent, Q3DScatter *scatter, std::vector<AmodeConfig::Data> amodegroupdata)
-    : QObject(parent), stopVisualization(false), isVisualizing(false), hasNewData(false), scatter_(scatter), amodegroupdata_(amodegroupdata)
+    : QObject(parent), stopVisualization(false), scatter_(scatter), m_guiContext(new QObject()),
+      m_originSeries(nullptr), m_expectedPeakSeries(nullptr), frameBudget_(RENDER_FRAME_BUDGET_MS), signalDisplayMode_(0),
+      renderLevel_(RENDER_LEVEL_DEFAULT), amodegroupdata_(amodegroupdata)
 {
     // Calculate necessary constants, will be used later for signal visualization
     us_dvector_ = Eigen::VectorXd::LinSpaced(UltrasoundConfig::N_SAMPLE, 1, UltrasoundConfig::N_SAMPLE) * UltrasoundConfig::DS;             // [[mm]]
     us_tvector_ = Eigen::VectorXd::LinSpaced(UltrasoundConfig::N_SAMPLE, 1, UltrasoundConfig::N_SAMPLE) * UltrasoundConfig::DT * 1000000;   // [[mu s]]
 
-    // I added option to downsample, for visualization performance
-    if (isDownsample)
+    // initialize transformations
+    for(std::size_t i = 0; i < amodegroupdata_.size(); ++i)
     {
-        // downsample the us_dvector and get the length of the vector
-        Eigen::VectorXd us_dvector_downsampled = AmodeDataManipulator::downsampleVector(us_dvector_, round((double)UltrasoundConfig::N_SAMPLE / downsample_ratio));
-        downsample_nsample_ = us_dvector_downsampled.size();
-
-        // first resize the amode3dsignal matrix according to nsample_downsample_ (not nsample_)
-        amode3dsignal_.resize(Eigen::NoChange, downsample_nsample_);
-        // initialize the amode3dsignal
-        amode3dsignal_.row(0).setZero();     // x-coordinate
-        amode3dsignal_.row(1).setZero();     // y-coordinate
-        amode3dsignal_.row(2) = us_dvector_downsampled; // z-coordinate
-        amode3dsignal_.row(3).setOnes();     // 1 (homogeneous)
+        currentT_ustip_ref.push_back(Eigen::Isometry3d::Identity());
+        currentT_ustip_ref_Qt.push_back(Eigen::Isometry3d::Identity());
     }
-    else
+
+    // initialize mode, and the downsampling of the default level of detail
+    applyRenderSettings();
+
+    // the points of the series, two sets, they are only resized when the display mode or the level of detail changes
+    for (SeriesBuffer& buffer : buffers_)
     {
-        // first resize the amode3dsignal matrix according to nsample_ of amode signal
-        amode3dsignal_.resize(Eigen::NoChange, UltrasoundConfig::N_SAMPLE);
-        // initialize the amode3dsignal
-        amode3dsignal_.row(0).setZero();     // x-coordinate
-        amode3dsignal_.row(1).setZero();     // y-coordinate
-        amode3dsignal_.row(2) = us_dvector_; // z-coordinate
-        amode3dsignal_.row(3).setOnes();     // 1 (homogeneous)
+        buffer.signalpoints.assign(amodegroupdata_.size(), QScatterDataArray(amode3dsignal_.cols() * n_signaldisplay));
+        buffer.origin.resize(amodegroupdata_.size());
+        buffer.expectedpeak.reserve(amodegroupdata_.size());
     }
 
-    // initialize transformations
-    currentT_holder_ref = Eigen::Isometry3d::Identity();
-    for(std::size_t i = 0; i < amodegroupdata_.size(); ++i)
+    // the constructor is still in the GUI thread (the controller moves this object to its thread after), so the
+    // series are created right here, once
+    createSeries();
+}
+
+VolumeAmodeVisualizer::~VolumeAmodeVisualizer()
+{
+    // this is in the GUI thread, after the thread of the visualization is done. Deleting the context drops the
+    // uploads that are still queued (they would look at the buffers of this object).
+    delete m_guiContext;
+
+    // the series are ours, the controller may already have removed them from the scatter
+    const QList<QScatter3DSeries*> inScatter = scatter_->seriesList();
+    std::vector<QScatter3DSeries*> allSeries = m_signalSeries;
+    allSeries.push_back(m_originSeries);
+    allSeries.push_back(m_expectedPeakSeries);
+    for (QScatter3DSeries *series : allSeries)
     {
-        currentT_ustip_ref.push_back(Eigen::Isometry3d::Identity());
-        currentT_ustip_ref_Qt.push_back(Eigen::Isometry3d::Identity());
+        if (inScatter.contains(series)) scatter_->removeSeries(series);
+        delete series;
     }
+}
 
-    // initialize points
+void VolumeAmodeVisualizer::createSeries()
+{
+    // each signal has its own series, so that every signal has its own color
     for(std::size_t i = 0; i < amodegroupdata_.size(); ++i)
     {
-        all_amode3dsignal_.push_back(amode3dsignal_);
+        QScatter3DSeries *series = new QScatter3DSeries();
+        series->setName("amode3dsignal");
+        series->setItemSize(0.04f);
+        series->setMesh(QAbstract3DSeries::MeshPoint);
+        scatter_->addSeries(series);
+        m_signalSeries.push_back(series);
     }
 
-    // initialize array of boolean that will be used for visualizing xLine in 2D plot
-    expectedpeaks_.resize(amodegroupdata_.size());
-
-    // initialize mode
-    setSignalDisplayMode(0);
+    // the origins as a group, so the configuration of the visualization is the same for all of them
+    m_originSeries = new QScatter3DSeries();
+    m_originSeries->setName("amode3dorigin");
+    m_originSeries->setItemSize(0.2f);
+    m_originSeries->setMesh(QAbstract3DSeries::MeshPoint);
+    m_originSeries->setBaseColor(Qt::red);
+    scatter_->addSeries(m_originSeries);
+
+    m_expectedPeakSeries = new QScatter3DSeries();
+    m_expectedPeakSeries->setName("amode3dexpectedpeak");
+    m_expectedPeakSeries->setItemSize(0.2f);
+    m_expectedPeakSeries->setMesh(QAbstract3DSeries::MeshPoint);
+    m_expectedPeakSeries->setBaseColor(Qt::blue);
+    scatter_->addSeries(m_expectedPeakSeries);
 }
 
-VolumeAmodeVisualizer::~VolumeAmodeVisualizer()
+void VolumeAmodeVisualizer::uploadBuffer(int buffer, const QElapsedTimer &handover)
 {
+    // somebody removed our series (a new volume clears the whole scatter), put them back
+    if (!scatter_->seriesList().contains(m_originSeries))
+    {
+        for (QScatter3DSeries *series : m_signalSeries) scatter_->addSeries(series);
+        scatter_->addSeries(m_originSeries);
+        scatter_->addSeries(m_expectedPeakSeries);
+    }
+
+    // copy the items into the arrays of the series, they only get a new array if the number of points changed
+    auto replaceItems = [](QScatter3DSeries *series, const QScatterDataArray &items) {
+        QScatterDataProxy *proxy = series->dataProxy();
+        if (proxy->itemCount() == items.size()) proxy->setItems(0, items);
+        else proxy->resetArray(new QScatterDataArray(items));
+    };
+    const SeriesBuffer &points = buffers_[buffer];
+    for (std::size_t i = 0; i < m_signalSeries.size(); ++i) replaceItems(m_signalSeries[i], points.signalpoints[i]);
+    replaceItems(m_originSeries, points.origin);
+    replaceItems(m_expectedPeakSeries, points.expectedpeak);
+
+    // the visualization thread may fill the next set (and it counts how long the GUI needed for this one)
+    QMutexLocker locker(&uploadMutex);
+    uploadMilliseconds = handover.nsecsElapsed() / 1.0e6;
+    uploadPending = false;
+    uploadDone.wakeAll();
+}
 
+bool VolumeAmodeVisualizer::waitForUpload()
+{
+    QMutexLocker locker(&uploadMutex);
+    while (uploadPending)
+    {
+        // not forever, the GUI thread might be the one that is stopping us
+        if (stopVisualization) return false;
+        uploadDone.wait(&uploadMutex, 20);
+    }
+    return true;
 }
 
 Eigen::Isometry3d VolumeAmodeVisualizer::RightToLeftHandedTransformation(const Eigen::Isometry3d& rightHandedTransform) {
@@ -123,28 +214,35 @@ void VolumeAmodeVisualizer::setSignalDisplayMode(int mode)
      * Mode 4 is 4 envelope signal. The original, and the original that is rotated 90, 180, 270 degrees along directional axis.
      *        you can imagine how it will be, come on.
      *
+     * This is called from the GUI thread, the thread takes the mode at the start of the next frame (applyRenderSettings()).
+     * If the frame budget is small, it might show less envelopes than the mode.
      */
 
+    signalDisplayMode_ = mode;
+}
+
+void VolumeAmodeVisualizer::setSignalDisplay(int signaldisplay)
+{
     // delete all the rotation matrix inside this variable
     rotation_signaldisplay.clear();
 
     // initialize angle degrees
     std::vector<int> angle_degrees;
-    // angle_degrees will depend on user choice
-    if (mode==0)
+    // angle_degrees will depend on the number of envelopes
+    if (signaldisplay == 4)
     {
-        n_signaldisplay = 1;
-        angle_degrees.insert(angle_degrees.end(), {0});
+        n_signaldisplay = 4;
+        angle_degrees.insert(angle_degrees.end(), {0, 90, 180, 270});
     }
-    else if (mode==1)
+    else if (signaldisplay == 2)
     {
         n_signaldisplay = 2;
         angle_degrees.insert(angle_degrees.end(), {0, 180});
     }
-    else if (mode == 2)
+    else
     {
-        n_signaldisplay = 4;
-        angle_degrees.insert(angle_degrees.end(), {0, 90, 180, 270});
+        n_signaldisplay = 1;
+        angle_degrees.insert(angle_degrees.end(), {0});
     }
 
     for (size_t i = 0; i < angle_degrees.size(); ++i)
@@ -172,6 +270,48 @@ void VolumeAmodeVisualizer::setSignalDisplayMode(int mode)
     }
 }
 
+void VolumeAmodeVisualizer::setDownsampleRatio(double ratio)
+{
+    downsample_ratio = ratio;
+
+    // I added option to downsample, for visualization performance
+    if (isDownsample)
+    {
+        // downsample the us_dvector and get the length of the vector
+        Eigen::VectorXd us_dvector_downsampled = AmodeDataManipulator::downsampleVector(us_dvector_, round((double)UltrasoundConfig::N_SAMPLE / downsample_ratio));
+        downsample_nsample_ = us_dvector_downsampled.size();
+
+        // first resize the amode3dsignal matrix according to nsample_downsample_ (not nsample_)
+        amode3dsignal_.resize(Eigen::NoChange, downsample_nsample_);
+        // initialize the amode3dsignal
+        amode3dsignal_.row(0).setZero();     // x-coordinate
+        amode3dsignal_.row(1).setZero();     // y-coordinate
+        amode3dsignal_.row(2) = us_dvector_downsampled; // z-coordinate
+        amode3dsignal_.row(3).setOnes();     // 1 (homogeneous)
+    }
+    else
+    {
+        // first resize the amode3dsignal matrix according to nsample_ of amode signal
+        amode3dsignal_.resize(Eigen::NoChange, UltrasoundConfig::N_SAMPLE);
+        // initialize the amode3dsignal
+        amode3dsignal_.row(0).setZero();     // x-coordinate
+        amode3dsignal_.row(1).setZero();     // y-coordinate
+        amode3dsignal_.row(2) = us_dvector_; // z-coordinate
+        amode3dsignal_.row(3).setOnes();     // 1 (homogeneous)
+    }
+}
+
+void VolumeAmodeVisualizer::applyRenderSettings()
+{
+    // the level of detail decides the downsampling, and the most envelopes next to the display mode of the user
+    const double ratio      = RENDER_LEVELS[renderLevel_].downsample_ratio;
+    const int signaldisplay = levelSignalDisplay(renderLevel_, signalDisplayMode_);
+
+    // only rebuilt if they changed, the points of the series follow by themselves (visualize3DSignal())
+    if (ratio != downsample_ratio) setDownsampleRatio(ratio);
+    if (signaldisplay != n_signaldisplay) setSignalDisplay(signaldisplay);
+}
+
 void VolumeAmodeVisualizer::updateTransformations(Eigen::Isometry3d currentT_holder_ref)
 {
     // // Make base transformation
@@ -201,23 +341,8 @@ void VolumeAmodeVisualizer::updateTransformations(Eigen::Isometry3d currentT_hol
     // update the T_ustip_holder. Loop for each ustip inside the holder
     for(std::size_t i = 0; i < amodegroupdata_.size(); ++i)
     {
-        // get the local_R data from amodeconfig
-        Eigen::Vector3d local_R_euler(amodegroupdata_.at(i).local_R.at(0), amodegroupdata_.at(i).local_R.at(1), amodegroupdata_.at(i).local_R.at(2));
-        // convert it to radians
-        Eigen::Vector3d local_R_radians = local_R_euler * (M_PI / 180.0);
-        // convert it to rotation matrix
-        Eigen::Matrix3d local_R_matrix;
-        local_R_matrix = Eigen::AngleAxisd(local_R_radians.x(), Eigen::Vector3d::UnitX()) *
-                         Eigen::AngleAxisd(local_R_radians.y(), Eigen::Vector3d::UnitY()) *
-                         Eigen::AngleAxisd(local_R_radians.z(), Eigen::Vector3d::UnitZ());
-
-        // convert local_t from amode config data in with Eigen
-        Eigen::Vector3d local_t(amodegroupdata_.at(i).local_t.at(0), amodegroupdata_.at(i).local_t.at(1), amodegroupdata_.at(i).local_t.at(2));
-
-        // pack local_R and local_t into transformation matrix with Eigen
-        Eigen::Isometry3d currentT_ustip_holder = Eigen::Isometry3d::Identity();
-        currentT_ustip_holder.linear() = local_R_matrix;
-        currentT_ustip_holder.translation() = local_t;
+        // the transformation of the ustip relative to the holder, from local_R and local_t of amodeconfig
+        Eigen::Isometry3d currentT_ustip_holder = AmodeBeamCaster::transducerToHolder(amodegroupdata_.at(i));
 
         // // now, do the same thing also but for Qt matrix representation
         // Eigen::Isometry3d currentT_ustip_holder_Qt = Eigen::Isometry3d::Identity();
@@ -244,38 +369,28 @@ void VolumeAmodeVisualizer::updateTransformations(Eigen::Isometry3d currentT_hol
 
 void VolumeAmodeVisualizer::visualize3DSignal()
 {
-    // update all necessary transformations
-    updateTransformations(currentT_holder_ref);
+    // the newest frame from the controller, it stays the same until the next take() (that is us, after this function)
+    const AmodeFrame &frame = mailbox_.latest();
 
-    // Delete all the series inside the scatter. So everytime there is a new rigidbody data coming
-    // from qualisys, we should remove all the scatter data in our scatter series
-    // >> I need this QMetaObject::invokeMethod because scatter_ object is in the main thread, i can't access it directly
-    // >> because this class is meant to be run in another thread. This is the way to access it
-    QMetaObject::invokeMethod(scatter_, [this]() {
-        for (QScatter3DSeries *series : scatter_->seriesList()) {
-            if (series->name() == "amode3dsignal" || series->name() == "amode3dorigin" || series->name() == "amode3dexpectedpeak") {
-                scatter_->removeSeries(series);
-            }
-        }
-    });
+    // the level of detail of this frame, the time to compute it goes to the governor
+    QElapsedTimer computeTimer;
+    computeTimer.start();
+    applyRenderSettings();
 
-    // Create a QScatterDataArray to store the origins of the signals.
-    // I wrote this outside the loop (below), because i want the scatter for origin point to be one scatter object,
-    // so that i could set the configuration of the visualization as a group
-    QScatterDataArray *originArray = new QScatterDataArray;
-    originArray->resize(amodegroupdata_.size());
+    // update all necessary transformations
+    updateTransformations(frame.T_holder_ref);
 
-    // Create another QScatterDataArray to store the expected peaks
-    QScatterDataArray *expectedPeakArray = new QScatterDataArray;
-    expectedPeakArray->resize(amodegroupdata_.size());
+    // The series stay in the scatter, this frame goes into the back set of points. The other set might still be
+    // copied by the GUI thread, that's fine, it's not this one.
+    SeriesBuffer &points = buffers_[backbuffer_];
+    points.expectedpeak.resize(0);
 
-    // For the case of scatter for the signal data themshelves, i will make them separately,
-    // each signal has its own scatter object, so that i could make differentiation in color for each signal.
+    // Each signal has its own series, so that i could make differentiation in color for each signal.
     // So i will need a loop for how much signal i have
     for(std::size_t i = 0; i < amodegroupdata_.size(); ++i)
     {
         // select the row from the whole amode data
-        QVector<int16_t> amodesignal_rowsel = AmodeDataManipulator::getRow(amodesignal_, amodegroupdata_.at(i).number-1, UltrasoundConfig::N_SAMPLE);
+        QVector<int16_t> amodesignal_rowsel = AmodeDataManipulator::getRow(frame.amodesignal, amodegroupdata_.at(i).number-1, UltrasoundConfig::N_SAMPLE);
 
         // if we decided to downsample, we need to downsample the amodesignal_rowsel first
         // before we assign to amode3dsignal_ so that the dimension will match
@@ -302,70 +417,40 @@ void VolumeAmodeVisualizer::visualize3DSignal()
         // store it to our amode3dsignal_ while multiplied by a scale (the height of the amplitude in 3d visualization)
         amode3dsignal_.row(0) = amodesignal_rowsel_eigenVector * 0.0015; // x-coordinate
 
-        // // convert the points to accomodate RHR to LHR transformation
-        // Eigen::Matrix<double, 4, Eigen::Dynamic> amode3dsignal_LH;
-        // amode3dsignal_LH.resize(4, amode3dsignal_.cols());
-        // amode3dsignal_LH = amode3dsignal_;
-        // amode3dsignal_LH.row(2) *= -1;
-
         // Get the size of the data (that is the samples in the signal)
         int arraysize = amode3dsignal_.cols();
 
         // Since we provided several display mode for visualizing amode 3d signal, we need to provide
-        // a variable to place all of those display modes
-        Eigen::Matrix<double, 4, Eigen::Dynamic> current_amode3dsignal_display(4, arraysize * n_signaldisplay);
+        // a variable to place all of those display modes (it keeps its memory, unless the mode changes)
+        amode3dsignal_display_.resize(4, arraysize * n_signaldisplay);
 
         // Let's populate the all the rotated signal data to it
         for (std::size_t j = 0; j < rotation_signaldisplay.size(); ++j)
         {
             int start_column = j*arraysize;
-
-            // current_amode3dsignal_display.block(0, start_column, 4, arraysize) = currentT_ustip_ref_Qt.at(i).matrix() * rotation_signaldisplay.at(j) * amode3dsignal_;
-            // current_amode3dsignal_display.block(0, start_column, 4, arraysize) = currentT_ustip_ref_Qt.at(i).matrix() * amode3dsignal_LH;
-            // current_amode3dsignal_display.block(0, start_column, 4, arraysize) = currentT_ustip_ref.at(i).matrix() * amode3dsignal_LH;
-            current_amode3dsignal_display.block(0, start_column, 4, arraysize) = currentT_ustip_ref.at(i).matrix() * amode3dsignal_;
+            amode3dsignal_display_.block(0, start_column, 4, arraysize) = currentT_ustip_ref.at(i).matrix() * amode3dsignal_;
         }
-        current_amode3dsignal_display.row(1).swap(current_amode3dsignal_display.row(2));
-
-        // This is the QScatterDataArray object for the signal data, each loop will be new object
-        QScatterDataArray *dataArray = new QScatterDataArray;
-        // resize the dataArray (multiply of n_signaldisplay) for display purpose (double envelope)
-        dataArray->resize(arraysize * n_signaldisplay);
+        amode3dsignal_display_.row(1).swap(amode3dsignal_display_.row(2));
 
-        // Add the points to the our QScatterDataArray (dataArray)
-        // We need to copy copy the points from the Eigen matrix to the QScatterDataArray one by one
+        // Copy the points from the Eigen matrix to the (preallocated) QScatterDataArray of this signal.
         // There is no other way, this is bullshit from QtDataVisualization, i hate it so much
+        QScatterDataArray &dataArray = points.signalpoints[i];
+        dataArray.resize(arraysize * n_signaldisplay);
         for (int j = 0; j < arraysize * n_signaldisplay; ++j) {
-            (*dataArray)[j].setPosition( QVector3D(current_amode3dsignal_display(0, j),
-                                                  current_amode3dsignal_display(1, j),
-                                                  current_amode3dsignal_display(2, j)));
+            dataArray[j].setPosition( QVector3D(amode3dsignal_display_(0, j),
+                                                amode3dsignal_display_(1, j),
+                                                amode3dsignal_display_(2, j)));
         }
 
-        // Add the QScatterDataArray we have (dataArray) to our scatter series by creating a QScatter3DSeries
-        // >> I need this QMetaObject::invokeMethod because scatter_ object is in the main thread, i can't access it directly
-        // >> because this class is meant to be run in another thread. This is the way to access it
-        QMetaObject::invokeMethod(scatter_, [this, dataArray]() {
-            QScatter3DSeries *series = new QScatter3DSeries();
-            series->setName("amode3dsignal");
-            series->setItemSize(0.04f);
-            series->setMesh(QAbstract3DSeries::MeshPoint);
-            series->dataProxy()->resetArray(dataArray);
-
-            // add the current amode data (series) to our scatter object
-            scatter_->addSeries(series);
-        });
-
-
         // if the user selected the expected peaks in the 2d plot visualization,
         // it means that we need to visualize the expected peak in our 3d signal visualization.
-        qDebug() << "VolumeAmodeVisualizer::visualize3DSignal() expectedpeaks_ at " << i << " has value? " << expectedpeaks_.at(i).has_value();
-        if(expectedpeaks_.at(i).has_value())
+        if(i < frame.expectedpeaks.size() && frame.expectedpeaks.at(i).has_value())
         {
             // initialize the 3d point
             Eigen::Matrix<double, 4, 1> expected3dpeak;
             expected3dpeak(0) = 0.0;
             expected3dpeak(1) = 0.0;
-            expected3dpeak(2) = expectedpeaks_.at(i).value();
+            expected3dpeak(2) = frame.expectedpeaks.at(i).value();
             expected3dpeak(3) = 1.0;
 
             // transform the point
@@ -375,136 +460,181 @@ void VolumeAmodeVisualizer::visualize3DSignal()
             // swap between z and y
             current_expected3dpeak_display.row(1).swap(current_expected3dpeak_display.row(2));
 
-            // Add the points to the our QScatterDataArray (expectedPeakArray)
-            (*expectedPeakArray)[i].setPosition( QVector3D( current_expected3dpeak_display(0),
-                                                            current_expected3dpeak_display(1),
-                                                            current_expected3dpeak_display(2)));
-
+            // Add the point to the expected peaks (only the ones that are set)
+            points.expectedpeak.append(QScatterDataItem(QVector3D( current_expected3dpeak_display(0),
+                                                                   current_expected3dpeak_display(1),
+                                                                   current_expected3dpeak_display(2))));
         }
 
-        // Add the points to the our QScatterDataArray (originArray)
-        // Using this loop, i will add data to my originArray, that is the first data in the signal.
+        // Add the points to the our QScatterDataArray (origin)
+        // Using this loop, i will add data to my origin, that is the first data in the signal.
         // To be honest, it is not exactly the origin of the signal, but hey, who the fuck can see 0.01 mm differences in the visualization?
-        (*originArray)[i].setPosition( QVector3D(current_amode3dsignal_display(0, 0),
-                                                current_amode3dsignal_display(1, 0),
-                                                current_amode3dsignal_display(2, 0)));
+        points.origin[i].setPosition( QVector3D(amode3dsignal_display_(0, 0),
+                                                amode3dsignal_display_(1, 0),
+                                                amode3dsignal_display_(2, 0)));
     }
 
-    // Add the QScatterDataArray we have (expectedPeakArray, originArray) to our scatter series by creating a QScatter3DSeries
+    // Hand the points over to the GUI thread, but only when it is done with the previous ones, so the frames
+    // don't pile up there. Then the next frame goes into the other set.
     // >> I need this QMetaObject::invokeMethod because scatter_ object is in the main thread, i can't access it directly
     // >> because this class is meant to be run in another thread. This is the way to access it
-    QMetaObject::invokeMethod(scatter_, [this, originArray, expectedPeakArray]() {
-        QScatter3DSeries *originSeries = new QScatter3DSeries();
-        originSeries->setName("amode3dorigin");
-        originSeries->setItemSize(0.2f);
-        originSeries->setMesh(QAbstract3DSeries::MeshPoint);
-        originSeries->setBaseColor(Qt::red);
-        originSeries->dataProxy()->resetArray(originArray);
-        scatter_->addSeries(originSeries);
-
-        if (expectedPeakArray->isEmpty())
-            return;
-
-        QScatter3DSeries *expectedPeakSeries = new QScatter3DSeries();
-        expectedPeakSeries->setName("amode3dexpectedpeak");
-        expectedPeakSeries->setItemSize(0.2f);
-        expectedPeakSeries->setMesh(QAbstract3DSeries::MeshPoint);
-        expectedPeakSeries->setBaseColor(Qt::blue);
-        expectedPeakSeries->dataProxy()->resetArray(expectedPeakArray);
-
-        // add the current origin point data (series) to our scatter object
-        scatter_->addSeries(expectedPeakSeries);
-    });
-
+    const double computeMilliseconds = computeTimer.nsecsElapsed() / 1.0e6;
+    if (!waitForUpload()) return;
+    {
+        QMutexLocker locker(&uploadMutex);
+        uploadPending = true;
+    }
+    const int buffer = backbuffer_;
+    QElapsedTimer handover;
+    handover.start();
+    QMetaObject::invokeMethod(m_guiContext, [this, buffer, handover]() { uploadBuffer(buffer, handover); });
+    backbuffer_ = 1 - backbuffer_;
+
+    // does it still fit the budget?
+    governFrame(computeMilliseconds);
 }
 
-void VolumeAmodeVisualizer::setData(const QVector<int16_t>& data_amode, const Eigen::Isometry3d& data_rigidbody)
+void VolumeAmodeVisualizer::governFrame(double computeMilliseconds)
 {
-    qDebug() << "VolumeAmodeVisualizer::setData() setAmodeSignal called in thread:" << QThread::currentThread();
-    qDebug() << "VolumeAmodeVisualizer::setData() Expected worker thread:" << this->thread();
-    qDebug() << "VolumeAmodeVisualizer::setData() called, visualizing status: " << isVisualizing;
-
-    QMutexLocker locker(&mutex);
-
-    // If visualization is in progress, ignore the new data
-    if (isVisualizing) return;
-
-    qDebug() << "VolumeAmodeVisualizer::setData() visualization is idle, set the data";
+    // Smoothed, one slow frame (the GUI was busy with something else) shouldn't change anything. The upload is the
+    // one of the previous frame, the one we just handed over is still in the GUI.
+    auto smooth = [](double &average, double value) {
+        average = (average == 0.0) ? value : average + RENDER_SMOOTHING * (value - average);
+    };
+    smooth(computeAverage_, computeMilliseconds);
+    {
+        QMutexLocker locker(&uploadMutex);
+        smooth(uploadAverage_, uploadMilliseconds);
+    }
+    if (intervalTimer_.isValid()) smooth(intervalAverage_, intervalTimer_.nsecsElapsed() / 1.0e6);
+    intervalTimer_.start();
+
+    // Over the budget for a few frames, one level coarser. Far under it for a while, one level finer. Levels that
+    // look the same for the current display mode are skipped, they would cost the same.
+    const int mode = signalDisplayMode_;
+    auto sameLevel = [mode](int a, int b) {
+        return RENDER_LEVELS[a].downsample_ratio == RENDER_LEVELS[b].downsample_ratio &&
+               levelSignalDisplay(a, mode) == levelSignalDisplay(b, mode);
+    };
+    const double budget = frameBudget_;
+    const double cost   = computeAverage_ + uploadAverage_;
+    int level = renderLevel_;
+    if (cost > budget)
+    {
+        framesUnderBudget_ = 0;
+        if (++framesOverBudget_ >= RENDER_FRAMES_TO_COARSEN)
+        {
+            int next = level + 1;
+            while (next < RENDER_LEVEL_COUNT && sameLevel(next, level)) ++next;
+            if (next < RENDER_LEVEL_COUNT) level = next;
+        }
+    }
+    else if (cost < RENDER_REFINE_FRACTION * budget)
+    {
+        framesOverBudget_ = 0;
+        if (++framesUnderBudget_ >= RENDER_FRAMES_TO_REFINE)
+        {
+            int next = level - 1;
+            while (next >= 0 && sameLevel(next, level)) --next;
+            if (next >= 0) level = next;
+        }
+    }
+    else
+    {
+        framesOverBudget_  = 0;
+        framesUnderBudget_ = 0;
+    }
 
-    // set the data
-    amodesignal_ = data_amode;
-    currentT_holder_ref = data_rigidbody;
+    // a new level starts to count from scratch, the averages were measured with the old one
+    if (level != renderLevel_)
+    {
+        renderLevel_       = level;
+        framesOverBudget_  = 0;
+        framesUnderBudget_ = 0;
+        computeAverage_    = 0.0;
+        uploadAverage_     = 0.0;
+    }
 
-    // Set the flag to indicate new data has arrived
-    hasNewData = true;
-    // Wake up the thread if it was waiting
-    // condition.wakeOne();
+    // what we are doing, for the GUI
+    if (reportTimer_.isValid() && reportTimer_.elapsed() < RENDER_REPORT_MILLISECONDS) return;
+    reportTimer_.start();
+    {
+        QMutexLocker locker(&settingsMutex);
+        renderSettings_.frameBudget       = frameBudget_;
+        renderSettings_.downsampleRatio   = isDownsample ? downsample_ratio : 1.0;
+        renderSettings_.signalDisplay     = n_signaldisplay;
+        renderSettings_.frameMilliseconds = cost;
+        renderSettings_.updateRate        = (intervalAverage_ > 0.0) ? 1000.0 / intervalAverage_ : 0.0;
+    }
+    emit renderSettingsChanged();
 }
 
-void VolumeAmodeVisualizer::test(const QVector<int16_t>& data_amode, const Eigen::Isometry3d& data_rigidbody)
+void VolumeAmodeVisualizer::waitForFrameBudget(const QElapsedTimer &frameTimer)
 {
-    // qDebug() << "VolumeAmodeVisualizer::test() got paired data";
-
-    if(isVisualizing)
+    // There is no point to show frames faster than the budget, the next frame will be the newest one anyway. The
+    // wait is on uploadDone so stop() can end it, an upload wakes it too, so it just waits again.
+    QMutexLocker locker(&uploadMutex);
+    while (!stopVisualization)
     {
-        // qDebug() << "VolumeAmodeVisualizer::test() but it still visualizing, ignore";
-        return;
+        const qint64 remaining = frameBudget_ - frameTimer.elapsed();
+        if (remaining <= 0) break;
+        uploadDone.wait(&uploadMutex, static_cast<unsigned long>(remaining));
     }
+}
 
-    // QMutexLocker locker(&mutex);
+void VolumeAmodeVisualizer::setFrameBudget(int milliseconds)
+{
+    frameBudget_ = std::max(1, milliseconds);
+}
 
-    amodesignal_ = data_amode;
-    currentT_holder_ref = data_rigidbody;
-    hasNewData = true;      // Set the flag to indicate new data has arrived
+VolumeAmodeVisualizer::RenderSettings VolumeAmodeVisualizer::getRenderSettings() const
+{
+    QMutexLocker locker(&settingsMutex);
+    return renderSettings_;
 }
 
-void VolumeAmodeVisualizer::setExpectedPeak(int plotid, std::optional<double> xLineValue)
+void VolumeAmodeVisualizer::postFrame(const QVector<int16_t>& data_amode, const Eigen::Isometry3d& data_rigidbody, const std::vector<std::optional<double>>& expectedpeaks)
 {
-    expectedpeaks_.at(plotid) = xLineValue;
+    // Overwrite whatever the thread didn't take yet, it only needs the newest frame. The QVector is shared (no copy
+    // of the samples), the pose and the peaks are copied into the slot, which keeps its memory.
+    mailbox_.post([&](AmodeFrame &slot) {
+        slot.amodesignal  = data_amode;
+        slot.T_holder_ref = data_rigidbody;
+        slot.expectedpeaks.assign(expectedpeaks.begin(), expectedpeaks.end());
+    });
 }
 
 void VolumeAmodeVisualizer::processVisualization()
 {
-    while (true)
+    while (!stopVisualization)
     {
-        if (stopVisualization)
-            break;
-
-        // qDebug() << "VolumeAmodeVisualizer::processVisualization";
-
-        if (!hasNewData)
+        // Sleep until the controller posts a frame (or stop() wakes us). The timeout is only a safety net, posting
+        // wakes us up right away.
+        if (!mailbox_.take())
         {
-            QThread::msleep(10);
+            mailbox_.waitForData(std::chrono::milliseconds(100));
             continue;
         }
 
-        QMutexLocker locker(&mutex);
-
-        // Set flag to indicate visualization is in progress
-        // qDebug() << "VolumeAmodeVisualizer::processVisualization() start visualization";
-        isVisualizing = true;
-
-        // Perform visualization task
-        visualize3DSignal();        
-
-        // something weird is going on, if i reduce the sleep, it seems like the threading
-        // is unstable. There will be more queue if you reduce the sleep time. However,
-        // the more you put the sleep, the more stable, no queueing. Fucking weird!
-        // i need to implement better multi threading architecture, but i don't want to do it
-        // now. It is (somewhat) working to some extent, so be it.
-        QThread::msleep(200);
+        // Perform visualization task with the newest frame, the ones that came in the meantime were overwritten.
+        // It waits for the GUI to take the previous frame before it hands over this one.
+        QElapsedTimer frameTimer;
+        frameTimer.start();
+        visualize3DSignal();
 
-
-        // After visualization is done, reset the flag
-        // qDebug() << "VolumeAmodeVisualizer::processVisualization() finish visualization";
-        hasNewData = false;
-        isVisualizing = false;
+        // and not faster than the frame budget
+        waitForFrameBudget(frameTimer);
     }
 }
 
 void VolumeAmodeVisualizer::stop()
 {
-    QMutexLocker locker(&mutex);
     stopVisualization = true;
-    // condition.wakeOne(); // Wake up the thread to allow it to exit
+
+    // the thread might be waiting for the GUI (that is us, right now) to take the points, or for a frame, let it go
+    {
+        QMutexLocker uploadLocker(&uploadMutex);
+        uploadDone.wakeAll();
+    }
+    mailbox_.wakeConsumer();
 }
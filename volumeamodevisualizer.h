@@ -5,11 +5,16 @@
 #include <QVector>
 #include <QMutex>
 #include <QWaitCondition>
+#include <QElapsedTimer>
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <optional>
 
 #include <Eigen/Dense>
 
 #include "amodeconfig.h"
+#include "latestmailbox.h"
 
 /**
  * @class VolumeAmodeVisualizer
@@ -19,6 +24,22 @@
  * 3d amode signal using 3d scatter plot. It is a heavy task, such that i need to separate the visualization
  * to a different thread
  *
+ * The series (one per transducer, the origins and the expected peaks) are created once, when the holder is chosen,
+ * and stay in the scatter. For every frame, this thread fills one of two preallocated sets of points, and the GUI
+ * thread copies them into the series (QScatterDataProxy::setItems(), the arrays of the series keep their memory). The
+ * next frame goes into the other set, so the thread doesn't wait for the GUI while it computes. It only waits before
+ * handing a set over, if the GUI is still busy with the previous one, so the frames never queue up in the GUI.
+ *
+ * The frames come from the controller (GUI thread) through a LatestMailbox, postFrame() overwrites the frame that is
+ * not taken yet. The thread sleeps until there is a frame, and always visualizes the newest one, so it never works
+ * through old frames and the controller never waits for it.
+ *
+ * How many points there are depends on the machine. The thread measures every frame (computing the points, and until
+ * the GUI copied them into the series) and holds a frame budget (setFrameBudget()): over the budget for a few frames,
+ * it shows less detail (more downsampling, then fewer envelopes than the display mode asks for); far under it for a
+ * while, it shows more again. It also never starts the next frame before the budget of the previous one is over, so
+ * a fast machine doesn't burn the CPU for frames nobody can see. What it is doing right now is getRenderSettings().
+ *
  */
 class VolumeAmodeVisualizer : public QObject
 {
@@ -33,9 +54,32 @@ public:
      *
      * The signal that is visualized is an envelope. When i write this class, i want the signal to be symmetric above and below x-axis.
      * So, basically this function make the envelope symmetric (only for visualization).
+     * It is the most envelopes that are shown, with a small frame budget there might be less. Any thread.
      */
     void setSignalDisplayMode(int mode);
 
+    /**
+     * @struct RenderSettings
+     * @brief What the visualization is doing right now, chosen by the thread to hold the frame budget
+     */
+    struct RenderSettings {
+        int frameBudget = 0;            // the time one frame may take (ms)
+        double downsampleRatio = 1.0;   // one point for every this many samples of the signal
+        int signalDisplay = 1;          // the number of envelopes that are shown
+        double frameMilliseconds = 0.0; // the time one frame takes (ms, computing and copying to the GUI, smoothed)
+        double updateRate = 0.0;        // the frames per second that are shown
+    };
+
+    /**
+     * @brief SET the time one frame may take (ms), the detail and the rate of the visualization follow it. Any thread.
+     */
+    void setFrameBudget(int milliseconds);
+
+    /**
+     * @brief GET what the visualization is doing right now. Any thread.
+     */
+    RenderSettings getRenderSettings() const;
+
     /**
      * @brief Updates the transformation of a-mode local coordinate system to global from Mocap feed
      */
@@ -47,28 +91,23 @@ public:
     void stop();
 
     /**
-     * @brief SET the data that is from volumeamodecontroller to this class.
+     * @brief Hands a new pair of data (and the expected peaks of every transducer) to the thread. Only one thread
+     * (the one of the controller) calls this, it never waits; a frame the thread didn't take yet is replaced.
      */
-    void test(const QVector<int16_t>& data_amode, const Eigen::Isometry3d& data_rigidbody);
-
-    /**
-     * @brief SET the expected peak that later will be
-     */
-    void setExpectedPeak(int plotid, std::optional<double> xLineValue);
+    void postFrame(const QVector<int16_t>& data_amode, const Eigen::Isometry3d& data_rigidbody, const std::vector<std::optional<double>>& expectedpeaks);
 
 signals:
-
-public slots:
     /**
-     * @brief [Deprecated] SET the data that is from volumeamodecontroller to this class.
+     * @brief The settings of getRenderSettings() changed (not more often than the user can read them)
      */
-    void setData(const QVector<int16_t>& data_amode, const Eigen::Isometry3d& data_rigidbody);
+    void renderSettingsChanged();
 
+public slots:
     /**
      * @brief Controlling visualization in multithreading way.
      *
      * This function will runs idefinitely once this class is instantiated and the thread started.
-     * It will only perform visualization when there is new data coming, that is when setData function() called.
+     * It sleeps until there is a new frame (postFrame()), then it visualizes the newest one.
      */
     void processVisualization();
 
@@ -78,23 +117,102 @@ private:
      */
     void visualize3DSignal();
 
+    /**
+     * @brief Creates the series and adds them to the scatter. In the GUI thread, once.
+     */
+    void createSeries();
+
+    /**
+     * @brief Copies a set of points into the series (and adds the series again if somebody removed them from the
+     * scatter, like a new volume does). In the GUI thread. The timer was started when the set was handed over.
+     */
+    void uploadBuffer(int buffer, const QElapsedTimer &handover);
+
+    /**
+     * @brief Waits until the GUI is done with the previous set of points. Returns false if the visualization stops.
+     */
+    bool waitForUpload();
+
+    /**
+     * @brief Applies the level of detail and the requested display mode (at the start of a frame, and in the constructor)
+     */
+    void applyRenderSettings();
+
+    /**
+     * @brief Rebuilds amode3dsignal_ for a downsample ratio
+     */
+    void setDownsampleRatio(double ratio);
+
+    /**
+     * @brief Rebuilds the rotations of the envelopes for a number of envelopes (1, 2 or 4)
+     */
+    void setSignalDisplay(int signaldisplay);
+
+    /**
+     * @brief Measures the frame that was just handed over, and changes the level of detail if it doesn't fit the budget
+     */
+    void governFrame(double computeMilliseconds);
+
+    /**
+     * @brief Sleeps until the budget of the frame (started with frameTimer) is over, or the visualization stops
+     */
+    void waitForFrameBudget(const QElapsedTimer &frameTimer);
+
     /**
      * @brief Convert right-hand CS (from Qualisys) to left-handed CS (Qt3DScatter plot)
      */
     Eigen::Isometry3d RightToLeftHandedTransformation(const Eigen::Isometry3d& rightHandedTransform);
 
+    /**
+     * @struct AmodeFrame
+     * @brief A pair of data (and the expected peaks) from the controller, one slot of the mailbox
+     */
+    struct AmodeFrame {
+        QVector<int16_t> amodesignal;                           // the A-mode signal of all transducers
+        Eigen::Isometry3d T_holder_ref = Eigen::Isometry3d::Identity(); // the holder in the reference
+        std::vector<std::optional<double>> expectedpeaks;       // the expected peak of every transducer
+    };
+
     // all related to multithreading
-    QMutex mutex;
-    QWaitCondition condition;
-    bool stopVisualization;
-    bool isVisualizing;
-    bool hasNewData;
+    LatestMailbox<AmodeFrame> mailbox_;                         //!< The newest frame from the controller.
+    std::atomic<bool> stopVisualization;                        //!< Set by stop(), from the GUI thread.
 
     // all related to visualization
     Q3DScatter *scatter_;                                       //!< 3d Scatter object. Initialized from mainwindow.
-    QScatter3DSeries *series;
-    std::vector<QScatterDataArray> all_dataArray_;              //!< Stores multiple a-mode 3D signal data.
-    std::vector<QScatter3DSeries> all_series_;                  //!< Stores multiple series (which contains a-mode 3d signal data).
+    QObject *m_guiContext;                                      //!< Lives in the GUI thread, the uploads are queued to it (and dropped when it is deleted).
+    std::vector<QScatter3DSeries*> m_signalSeries;              //!< The series of the 3d signal of every transducer.
+    QScatter3DSeries *m_originSeries;                           //!< The series of the origins of the signals.
+    QScatter3DSeries *m_expectedPeakSeries;                     //!< The series of the expected peaks.
+
+    /**
+     * @struct SeriesBuffer
+     * @brief One set of points for all series, filled by this thread and copied into the series by the GUI thread
+     */
+    struct SeriesBuffer {
+        std::vector<QScatterDataArray> signalpoints;            // the points of every transducer
+        QScatterDataArray origin;                               // the origin of every transducer
+        QScatterDataArray expectedpeak;                         // the expected peaks that are set
+    };
+    std::array<SeriesBuffer, 2> buffers_;                       //!< The two sets of points, filled in turns.
+    int backbuffer_ = 0;                                        //!< The set that is filled next.
+    QMutex uploadMutex;                                         //!< Guards uploadPending.
+    QWaitCondition uploadDone;                                  //!< Signaled by the GUI thread when it copied a set.
+    bool uploadPending = false;                                 //!< The GUI thread hasn't copied the latest set yet.
+    double uploadMilliseconds = 0.0;                            //!< From handing over the latest set until the GUI copied it, guarded by uploadMutex.
+
+    // all related to the frame budget
+    std::atomic<int> frameBudget_;                              //!< The time one frame may take (ms).
+    std::atomic<int> signalDisplayMode_;                        //!< The display mode that the user asked for (setSignalDisplayMode()).
+    int renderLevel_;                                           //!< The level of detail, an index in RENDER_LEVELS (the .cpp).
+    double computeAverage_ = 0.0;                               //!< The time to compute the points of a frame (ms, smoothed).
+    double uploadAverage_ = 0.0;                                //!< The time until the GUI copied them (ms, smoothed).
+    double intervalAverage_ = 0.0;                              //!< The time between the frames (ms, smoothed).
+    int framesOverBudget_ = 0;                                  //!< Frames in a row over the budget.
+    int framesUnderBudget_ = 0;                                 //!< Frames in a row far under the budget.
+    QElapsedTimer intervalTimer_;                               //!< Since the start of the previous frame.
+    QElapsedTimer reportTimer_;                                 //!< Since the last renderSettingsChanged().
+    mutable QMutex settingsMutex;                               //!< Guards renderSettings_.
+    RenderSettings renderSettings_;                             //!< What getRenderSettings() gives.
 
     // all variables related to ultrasound specification
     Eigen::VectorXd us_dvector_;                                //!< vector of distances (ds), used for plotting the A-mode.
@@ -102,22 +220,19 @@ private:
 
     // all variables related to amode signal
     int downsample_nsample_;                                    //!< the number of sample after downsampling. used when we do downsample
-    double downsample_ratio = 4.0;                              //!< specifiy the ratio of the downsampling. the default is half less.
+    double downsample_ratio = 0.0;                              //!< specifiy the ratio of the downsampling. it follows the level of detail.
     bool isDownsample       = true;                             //!< a flag to signify the class that we are doing downsampling.
 
     std::vector<AmodeConfig::Data> amodegroupdata_;             //!< Stores the configuration of a-mode group. We need the local transformations.
-    std::vector<std::optional<double>> expectedpeaks_;           //!< Stores the information about expectedPeaks that comes from the user when they click the 2d plot.
-    QVector<int16_t> amodesignal_;
     Eigen::Matrix<double, 4, Eigen::Dynamic> amode3dsignal_;    //!< A-mode signal but in Eigen::Matrix. For transformation manupulation, easier with this class.
-    std::vector<Eigen::Matrix<double, 4, Eigen::Dynamic>> all_amode3dsignal_;   //!< all amode3dsignal_ in a holder
+    Eigen::Matrix<double, 4, Eigen::Dynamic> amode3dsignal_display_; //!< amode3dsignal_ of one transducer in the scatter (all display modes), reused.
 
     // all variables related to transformations
-    Eigen::Isometry3d currentT_holder_ref;                      //!< current transformation of holder in camera coordinate system
     std::vector<Eigen::Isometry3d> currentT_ustip_ref;          //!< current transformation of ultrasound tip in camera coordinate system
     std::vector<Eigen::Isometry3d> currentT_ustip_ref_Qt;       //!< similar to currentT_ustip_camera, but with Qt format, the T is transposed compared to common homogeneous T format
 
     // variable that handle the display of 3d signal
-    int n_signaldisplay = 1;                                    //!< controls the visualization of the 3d signal. See setSignalDisplayMode() description for detail.
+    int n_signaldisplay = 0;                                    //!< controls the visualization of the 3d signal. See setSignalDisplayMode() description for detail.
     std::vector<Eigen::Matrix4d> rotation_signaldisplay;        //!< controls the visualization of the 3d signal.
 
 };
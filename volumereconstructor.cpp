@@ -0,0 +1,645 @@
+#include "volumereconstructor.h"
+#include <omp.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <cstring>
+#include <new>
+
+#include <QFile>
+#include <QTextStream>
+#include <QtZlib/zlib.h>
+#include "rapidxml.hpp"
+
+// A voxel of the accumulator is the number of pixels it got (upper 24 bits) and the sum of them (lower 40 bits), so
+// adding one pixel is one atomic add of (1 << 40) + pixel. 40 bits of sum is more than 4 billion pixels of 255.
+static constexpr int ACCUMULATOR_COUNT_SHIFT = 40;
+static constexpr std::uint64_t ACCUMULATOR_COUNT_ONE = std::uint64_t(1) << ACCUMULATOR_COUNT_SHIFT;
+static constexpr std::uint64_t ACCUMULATOR_SUM_MASK  = ACCUMULATOR_COUNT_ONE - 1;
+// The biggest volume we reconstruct, the accumulator needs 8 bytes per voxel (~2GB here)
+static constexpr std::size_t MAXIMUM_VOXELS = 256 * 1024 * 1024;
+// Hole filling, how many passes (every pass closes gaps of ~2 voxels) and how many of the 26 neighbours must be known
+static constexpr int HOLEFILL_PASSES = 2;
+static constexpr int HOLEFILL_MINIMUM_NEIGHBOURS = 8;
+// Live reconstruction, a frame that reaches further than this from the Reference (in voxels), or whose box would need
+// more bricks than this, has a broken transformation and is skipped
+static constexpr double LIVE_MAXIMUM_VOXEL = 1000000;
+static constexpr std::size_t LIVE_MAXIMUM_FRAME_BRICKS = 64 * 1024;
+// writeVolume(), how much output deflate gets at a time (the compressed volume grows by this much)
+static constexpr std::size_t VOLUME_DEFLATE_CHUNK_SIZE = 4 * 1024 * 1024;
+
+// Reads the numbers of an attribute of the configuration file into values, if there are enough of them
+template <typename T, std::size_t N>
+static void readAttribute(rapidxml::xml_node<>* node, const char* name, std::array<T, N>& values)
+{
+    rapidxml::xml_attribute<>* attribute = node->first_attribute(name);
+    if (!attribute) return;
+
+    std::array<T, N> parsed;
+    std::istringstream iss(attribute->value());
+    for (T& value : parsed) iss >> value;
+    if (!iss.fail()) values = parsed;
+}
+
+bool VolumeReconstructor::loadConfig(const std::string& filename, VolumeReconstructor::Config& config)
+{
+    QFile file(QString::fromStdString(filename));
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        std::cerr << "VolumeReconstructor::loadConfig() Failed to open " << filename << std::endl;
+        return false;
+    }
+    std::string content = QTextStream(&file).readAll().toStdString();
+    file.close();
+
+    // rapidxml parses in place, it needs its own null-terminated buffer
+    std::vector<char> buffer(content.begin(), content.end());
+    buffer.push_back('\0');
+
+    rapidxml::xml_document<> doc;
+    try {
+        doc.parse<0>(&buffer[0]);
+    } catch (const rapidxml::parse_error& e) {
+        std::cerr << "VolumeReconstructor::loadConfig() XML Parse error: " << e.what() << std::endl;
+        return false;
+    }
+
+    rapidxml::xml_node<>* root_node = doc.first_node("PlusConfiguration");
+    if (!root_node) {
+        std::cerr << "VolumeReconstructor::loadConfig() " << filename << " is not a Plus configuration file" << std::endl;
+        return false;
+    }
+
+    // the calibration, without it the volume is meaningless
+    bool foundCalibration = false;
+    rapidxml::xml_node<>* coord_def_node = root_node->first_node("CoordinateDefinitions");
+    for (rapidxml::xml_node<>* transform_node = coord_def_node ? coord_def_node->first_node("Transform") : nullptr;
+         transform_node && !foundCalibration;
+         transform_node = transform_node->next_sibling("Transform")) {
+
+        rapidxml::xml_attribute<>* from_attr = transform_node->first_attribute("From");
+        rapidxml::xml_attribute<>* to_attr = transform_node->first_attribute("To");
+        if (!from_attr || !to_attr || std::string(from_attr->value()) != "Image" || std::string(to_attr->value()) != "Probe")
+            continue;
+
+        rapidxml::xml_attribute<>* matrix_attr = transform_node->first_attribute("Matrix");
+        if (!matrix_attr) continue;
+
+        std::istringstream iss(matrix_attr->value());
+        for (int row = 0; row < 4; ++row)
+            for (int col = 0; col < 4; ++col)
+                iss >> config.imageToProbe(row, col);
+        foundCalibration = !iss.fail();
+    }
+    if (!foundCalibration) {
+        std::cerr << "VolumeReconstructor::loadConfig() There is no ImageToProbe transformation in " << filename << std::endl;
+        return false;
+    }
+
+    // the parameters of the reconstruction are optional
+    rapidxml::xml_node<>* reconstruction_node = root_node->first_node("VolumeReconstruction");
+    if (reconstruction_node) {
+        readAttribute(reconstruction_node, "OutputSpacing", config.outputSpacing);
+        readAttribute(reconstruction_node, "ClipRectangleOrigin", config.clipOrigin);
+        readAttribute(reconstruction_node, "ClipRectangleSize", config.clipSize);
+        rapidxml::xml_attribute<>* fillholes_attr = reconstruction_node->first_attribute("FillHoles");
+        if (fillholes_attr) config.fillHoles = (std::string(fillholes_attr->value()) != "OFF");
+    }
+
+    for (double spacing : config.outputSpacing) {
+        if (!(spacing > 0)) {
+            std::cerr << "VolumeReconstructor::loadConfig() OutputSpacing must be positive" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+VolumeReconstructor::VolumeReconstructor(const VolumeReconstructor::Config& config)
+    : config_(config)
+{
+}
+
+const VolumeReconstructor::Config& VolumeReconstructor::getConfig() const
+{
+    return config_;
+}
+
+bool VolumeReconstructor::reconstruct(MHAReader& sequence, MHAReader::MHAHeader& header, BrickedVolume& volume,
+                                      const std::function<bool()>& cancelled)
+{
+    // the frames, one after another, each is one slice of the "volume" of the sequence
+    MHAReader::MHAHeader sequenceHeader = sequence.getMHAHeader();
+    MHAReader::VoxelSpan pixels = sequence.getMHAVolume();
+    const std::vector<MHAReader::SequenceFrame>& frames = sequence.getSequenceFrames();
+    if (sequenceHeader.DimSize.size() < 3 || sequenceHeader.ElementType != "MET_UCHAR") {
+        std::cerr << "VolumeReconstructor::reconstruct() The sequence is not a sequence of 8 bit images." << std::endl;
+        return false;
+    }
+    setClipRectangle(sequenceHeader.DimSize[0], sequenceHeader.DimSize[1]);
+    const std::size_t frameSize = static_cast<std::size_t>(imageWidth_) * imageHeight_;
+    const std::size_t nFrames   = std::min({static_cast<std::size_t>(sequenceHeader.DimSize[2]), frames.size(),
+                                            frameSize > 0 ? pixels.size / frameSize : std::size_t(0)});
+
+    // the clip rectangle must be inside the image
+    if (clipBegin_[0] >= clipEnd_[0] || clipBegin_[1] >= clipEnd_[1]) {
+        std::cerr << "VolumeReconstructor::reconstruct() The clip rectangle is outside of the images." << std::endl;
+        return false;
+    }
+
+    // ImageToReference of every frame, the frames that were not tracked are skipped
+    using RowMajorMatrix = Eigen::Matrix<double, 4, 4, Eigen::RowMajor>;
+    std::vector<std::size_t> frameIndices;
+    std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>> imageToReference;
+    for (std::size_t f = 0; f < nFrames; ++f) {
+        if (!frames[f].probeValid || !frames[f].referenceValid) continue;
+        const Eigen::Matrix4d probeToTracker     = Eigen::Map<const RowMajorMatrix>(frames[f].probeToTracker.data());
+        const Eigen::Matrix4d referenceToTracker = Eigen::Map<const RowMajorMatrix>(frames[f].referenceToTracker.data());
+        const Eigen::Matrix4d transform = referenceToTracker.inverse() * probeToTracker * config_.imageToProbe;
+        if (!transform.allFinite()) continue;
+        frameIndices.push_back(f);
+        imageToReference.push_back(transform);
+    }
+    if (frameIndices.empty()) {
+        std::cerr << "VolumeReconstructor::reconstruct() There is no frame with valid transformations." << std::endl;
+        return false;
+    }
+
+    // the extent of the volume, the corners of the clip rectangles of all frames
+    Eigen::Vector3d minimum = Eigen::Vector3d::Constant(std::numeric_limits<double>::max());
+    Eigen::Vector3d maximum = Eigen::Vector3d::Constant(std::numeric_limits<double>::lowest());
+    for (const Eigen::Matrix4d& transform : imageToReference) {
+        for (int corner = 0; corner < 4; ++corner) {
+            const Eigen::Vector4d pixel((corner & 1) ? clipEnd_[0] - 1 : clipBegin_[0], (corner & 2) ? clipEnd_[1] - 1 : clipBegin_[1], 0, 1);
+            const Eigen::Vector3d position = (transform * pixel).head<3>();
+            minimum = minimum.cwiseMin(position);
+            maximum = maximum.cwiseMax(position);
+        }
+    }
+    const Eigen::Vector3d spacing(config_.outputSpacing[0], config_.outputSpacing[1], config_.outputSpacing[2]);
+    std::size_t total = 1;
+    for (int k = 0; k < 3; ++k) {
+        const double extent = std::floor((maximum[k] - minimum[k]) / spacing[k]) + 1;
+        if (!(extent < MAXIMUM_VOXELS)) {
+            std::cerr << "VolumeReconstructor::reconstruct() The volume is too big, check the transformations and OutputSpacing." << std::endl;
+            return false;
+        }
+        dim_[k] = static_cast<int>(extent);
+        total  *= static_cast<std::size_t>(dim_[k]);
+    }
+    if (total > MAXIMUM_VOXELS) {
+        std::cerr << "VolumeReconstructor::reconstruct() The volume is too big (" << dim_[0] << "x" << dim_[1] << "x" << dim_[2]
+                  << "), use a bigger OutputSpacing." << std::endl;
+        return false;
+    }
+
+    try {
+        accumulator_.assign(total, 0);
+    } catch (const std::bad_alloc&) {
+        std::cerr << "VolumeReconstructor::reconstruct() Out of memory for " << total << " voxels." << std::endl;
+        return false;
+    }
+
+    // ReferenceToVoxel, then a pixel goes directly to the (continuous) voxel coordinates
+    Eigen::Matrix4d referenceToVoxel = Eigen::Matrix4d::Identity();
+    for (int k = 0; k < 3; ++k) {
+        referenceToVoxel(k, k) = 1.0 / spacing[k];
+        referenceToVoxel(k, 3) = -minimum[k] / spacing[k];
+    }
+
+    // 1) paste all frames, every thread takes the next frame
+    const int nValid = static_cast<int>(frameIndices.size());
+    std::atomic<bool> aborted{false};
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < nValid; ++i) {
+        if (aborted || (cancelled && cancelled())) {
+            aborted = true;
+            continue;
+        }
+        pasteFrame(pixels.data + frameIndices[i] * frameSize, referenceToVoxel * imageToReference[i]);
+    }
+    if (aborted) {
+        std::vector<std::uint64_t>().swap(accumulator_);
+        return false;
+    }
+
+    // 2) the mean of every voxel that got pixels (the rest is a hole), and 3) the holes between the frames filled,
+    //    slab by slab straight into the bricks
+    const std::size_t sliceSize = static_cast<std::size_t>(dim_[0]) * dim_[1];
+    volume = buildVolume([this, sliceSize](int z, unsigned char* values, unsigned char* known) {
+        const std::uint64_t* accumulator = accumulator_.data() + z * sliceSize;
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < dim_[1]; ++y) {
+            for (std::size_t v = static_cast<std::size_t>(y) * dim_[0]; v < static_cast<std::size_t>(y + 1) * dim_[0]; ++v) {
+                const std::uint64_t count = accumulator[v] >> ACCUMULATOR_COUNT_SHIFT;
+                const std::uint64_t sum   = accumulator[v] & ACCUMULATOR_SUM_MASK;
+                values[v] = count > 0 ? static_cast<unsigned char>((sum + count / 2) / count) : 0;
+                known[v]  = count > 0;
+            }
+        }
+    }, minimum, cancelled);
+    std::vector<std::uint64_t>().swap(accumulator_);
+    if (volume.empty()) return false;
+
+    header = volumeHeader(minimum);
+    return true;
+}
+
+void VolumeReconstructor::pasteFrame(const unsigned char* pixels, const Eigen::Matrix4d& imageToVoxel)
+{
+    // the voxel coordinates of the next pixel of a row are the ones of this pixel plus the first column
+    const double stepX = imageToVoxel(0, 0), stepY = imageToVoxel(1, 0), stepZ = imageToVoxel(2, 0);
+    const double limitX = dim_[0] - 0.5, limitY = dim_[1] - 0.5, limitZ = dim_[2] - 0.5;
+    const std::size_t sliceSize = static_cast<std::size_t>(dim_[0]) * dim_[1];
+
+    for (int y = clipBegin_[1]; y < clipEnd_[1]; ++y) {
+        const Eigen::Vector4d start = imageToVoxel * Eigen::Vector4d(clipBegin_[0], y, 0, 1);
+        double vx = start[0], vy = start[1], vz = start[2];
+        const unsigned char* row = pixels + static_cast<std::size_t>(y) * imageWidth_;
+
+        for (int x = clipBegin_[0]; x < clipEnd_[0]; ++x, vx += stepX, vy += stepY, vz += stepZ) {
+            // the nearest voxel, the check first so that the rounding below only sees positive numbers
+            if (vx < -0.5 || vx >= limitX || vy < -0.5 || vy >= limitY || vz < -0.5 || vz >= limitZ) continue;
+            const std::size_t index = static_cast<std::size_t>(vz + 0.5) * sliceSize +
+                                      static_cast<std::size_t>(vy + 0.5) * dim_[0] +
+                                      static_cast<std::size_t>(vx + 0.5);
+            const std::uint64_t sample = ACCUMULATOR_COUNT_ONE | row[x];
+            #pragma omp atomic
+            accumulator_[index] += sample;
+        }
+    }
+}
+
+void VolumeReconstructor::fillHolesSlice(int z, const SliceWindow& before, unsigned char* values, unsigned char* known) const
+{
+    // a hole only looks at the voxels that were known before this pass (the slices z-1, z, z+1 of before), what it
+    // fills goes to this pass, so the threads never read what another thread writes
+    const unsigned char* beforeValues = before.values[z % 3].data();
+    const unsigned char* beforeKnown  = before.known[z % 3].data();
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < dim_[1]; ++y) {
+        for (int x = 0; x < dim_[0]; ++x) {
+            const std::size_t v = static_cast<std::size_t>(y) * dim_[0] + x;
+            values[v] = beforeValues[v];
+            known[v]  = beforeKnown[v];
+            if (known[v]) continue;
+
+            int count = 0, sum = 0;
+            for (int dz = std::max(z - 1, 0); dz <= std::min(z + 1, dim_[2] - 1); ++dz) {
+                const unsigned char* sliceValues = before.values[dz % 3].data();
+                const unsigned char* sliceKnown  = before.known[dz % 3].data();
+                for (int dy = std::max(y - 1, 0); dy <= std::min(y + 1, dim_[1] - 1); ++dy) {
+                    const std::size_t rowStart = static_cast<std::size_t>(dy) * dim_[0];
+                    for (int dx = std::max(x - 1, 0); dx <= std::min(x + 1, dim_[0] - 1); ++dx) {
+                        if (!sliceKnown[rowStart + dx]) continue;
+                        count++;
+                        sum += sliceValues[rowStart + dx];
+                    }
+                }
+            }
+            if (count < HOLEFILL_MINIMUM_NEIGHBOURS) continue;
+
+            values[v] = static_cast<unsigned char>((sum + count / 2) / count);
+            known[v]  = 1;
+        }
+    }
+}
+
+BrickedVolume VolumeReconstructor::buildVolume(const std::function<void(int, unsigned char*, unsigned char*)>& meanSlice, const Eigen::Vector3d& origin,
+                                               const std::function<bool()>& cancelled) const
+{
+    // Every stage (the mean, then every pass of the hole filling) keeps the last 3 slices it made, a pass at slice z
+    // only needs the slices z-1, z, z+1 of the stage before. So the volume is made one slice after another with a few
+    // slices per stage, and goes slab by slab into the bricks, the dense volume is never in memory.
+    const std::size_t sliceSize = static_cast<std::size_t>(dim_[0]) * dim_[1];
+    const int passes = config_.fillHoles ? HOLEFILL_PASSES : 0;
+    std::vector<SliceWindow> stages(passes + 1);
+    std::vector<int> made(passes + 1, -1);
+    std::vector<unsigned char> slab;
+    try {
+        for (SliceWindow& stage : stages) {
+            for (int i = 0; i < 3; ++i) {
+                stage.values[i].resize(sliceSize);
+                stage.known[i].resize(sliceSize);
+            }
+        }
+        slab.resize(sliceSize * BrickedVolume::BRICK_SIZE);
+    } catch (const std::bad_alloc&) {
+        std::cerr << "VolumeReconstructor::buildVolume() Out of memory for the slices of " << sliceSize << " voxels." << std::endl;
+        return BrickedVolume();
+    }
+
+    return BrickedVolume(dim_,
+                         {origin[0], origin[1], origin[2]},
+                         config_.outputSpacing,
+                         [&](int z0, int slices) -> const unsigned char* {
+        if (cancelled && cancelled()) return nullptr;
+        for (int z = z0; z < z0 + slices; ++z) {
+            // stage s is made until slice z + (passes - s), so the next stage has the slice after the one it makes
+            for (int s = 0; s <= passes; ++s) {
+                const int until = std::min(z + passes - s, dim_[2] - 1);
+                while (made[s] < until) {
+                    const int next = ++made[s];
+                    unsigned char* values = stages[s].values[next % 3].data();
+                    unsigned char* known  = stages[s].known[next % 3].data();
+                    if (s == 0) meanSlice(next, values, known);
+                    else fillHolesSlice(next, stages[s - 1], values, known);
+                }
+            }
+            std::memcpy(slab.data() + (z - z0) * sliceSize, stages[passes].values[z % 3].data(), sliceSize);
+        }
+        return slab.data();
+    });
+}
+
+MHAReader::MHAHeader VolumeReconstructor::volumeHeader(const Eigen::Vector3d& origin) const
+{
+    // the header of the volume, like the one Plus writes
+    MHAReader::MHAHeader header;
+    header.ObjectType             = "Image";
+    header.NDims                  = 3;
+    header.BinaryData             = true;
+    header.BinaryDataByteOrderMSB = false;
+    header.CompressedData         = false;
+    header.CompressedDataSize     = 0;
+    header.TransformMatrix        = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    header.DimSize                = {dim_[0], dim_[1], dim_[2]};
+    header.Offset                 = {origin[0], origin[1], origin[2]};
+    header.CenterOfRotation       = {0, 0, 0};
+    header.AnatomicalOrientation  = "RAI";
+    header.ElementSpacing         = {config_.outputSpacing[0], config_.outputSpacing[1], config_.outputSpacing[2]};
+    header.ElementType            = "MET_UCHAR";
+    header.ElementDataFile        = "LOCAL";
+    return header;
+}
+
+void VolumeReconstructor::setClipRectangle(int width, int height)
+{
+    imageWidth_  = width;
+    imageHeight_ = height;
+    clipBegin_ = { std::clamp(config_.clipOrigin[0], 0, imageWidth_), std::clamp(config_.clipOrigin[1], 0, imageHeight_) };
+    clipEnd_   = { config_.clipSize[0] > 0 ? std::min(clipBegin_[0] + config_.clipSize[0], imageWidth_) : imageWidth_,
+                   config_.clipSize[1] > 0 ? std::min(clipBegin_[1] + config_.clipSize[1], imageHeight_) : imageHeight_ };
+}
+
+// The key of a brick in bricks_, its three brick coordinates (they can be negative) in 21 bits each
+static std::uint64_t brickKey(int bx, int by, int bz)
+{
+    constexpr std::uint64_t mask = (std::uint64_t(1) << 21) - 1;
+    return ((static_cast<std::uint64_t>(bx) & mask) << 42) | ((static_cast<std::uint64_t>(by) & mask) << 21) | (static_cast<std::uint64_t>(bz) & mask);
+}
+
+// floor(a / BRICK_SIZE) also for negative a
+static int brickOf(int voxel)
+{
+    return voxel >= 0 ? voxel / VolumeReconstructor::BRICK_SIZE : -((-voxel + VolumeReconstructor::BRICK_SIZE - 1) / VolumeReconstructor::BRICK_SIZE);
+}
+
+bool VolumeReconstructor::addFrame(const unsigned char* pixels, int width, int height, const Eigen::Matrix4d& imageToReference)
+{
+    if (!imageToReference.allFinite()) return false;
+    if (width != imageWidth_ || height != imageHeight_) setClipRectangle(width, height);
+    if (clipBegin_[0] >= clipEnd_[0] || clipBegin_[1] >= clipEnd_[1]) return false;
+
+    // the grid of the live volume starts at the origin of the Reference, so every frame lands on the same grid
+    Eigen::Matrix4d imageToVoxel = imageToReference;
+    for (int k = 0; k < 3; ++k) imageToVoxel.row(k) /= config_.outputSpacing[k];
+
+    // the bricks this frame can touch (the box around its corners)
+    std::array<int, 3> brickBegin, brickEnd;
+    for (int k = 0; k < 3; ++k) {
+        double minimum = std::numeric_limits<double>::max(), maximum = std::numeric_limits<double>::lowest();
+        for (int corner = 0; corner < 4; ++corner) {
+            const double x = (corner & 1) ? clipEnd_[0] - 1 : clipBegin_[0];
+            const double y = (corner & 2) ? clipEnd_[1] - 1 : clipBegin_[1];
+            const double v = imageToVoxel(k, 0) * x + imageToVoxel(k, 1) * y + imageToVoxel(k, 3);
+            minimum = std::min(minimum, v);
+            maximum = std::max(maximum, v);
+        }
+        if (std::abs(minimum) > LIVE_MAXIMUM_VOXEL || std::abs(maximum) > LIVE_MAXIMUM_VOXEL) return false;
+        brickBegin[k] = brickOf(static_cast<int>(std::floor(minimum + 0.5)));
+        brickEnd[k]   = brickOf(static_cast<int>(std::floor(maximum + 0.5))) + 1;
+    }
+    const int bricksX = brickEnd[0] - brickBegin[0], bricksY = brickEnd[1] - brickBegin[1], bricksZ = brickEnd[2] - brickBegin[2];
+    const std::size_t nBricks = static_cast<std::size_t>(bricksX) * bricksY * bricksZ;
+    if (nBricks > LIVE_MAXIMUM_FRAME_BRICKS) return false;
+
+    // a table of the bricks of the box for this frame, the threads allocate the missing ones when a pixel needs them
+    std::unique_ptr<std::atomic<Brick*>[]> table(new std::atomic<Brick*>[nBricks]);
+    std::unique_ptr<std::atomic<bool>[]> touched(new std::atomic<bool>[nBricks]);
+    std::vector<unsigned char> existed(nBricks);
+    for (int bz = 0; bz < bricksZ; ++bz) {
+        for (int by = 0; by < bricksY; ++by) {
+            for (int bx = 0; bx < bricksX; ++bx) {
+                const std::size_t b = (static_cast<std::size_t>(bz) * bricksY + by) * bricksX + bx;
+                auto found = bricks_.find(brickKey(brickBegin[0] + bx, brickBegin[1] + by, brickBegin[2] + bz));
+                table[b].store(found == bricks_.end() ? nullptr : found->second.get(), std::memory_order_relaxed);
+                existed[b] = found != bricks_.end();
+                touched[b].store(false, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    const int rows = clipEnd_[1] - clipBegin_[1];
+    #pragma omp parallel for schedule(static)
+    for (int r = 0; r < rows; ++r) {
+        const int y = clipBegin_[1] + r;
+        const Eigen::Vector4d start = imageToVoxel * Eigen::Vector4d(0, y, 0, 1);
+        const unsigned char* row = pixels + static_cast<std::size_t>(y) * imageWidth_;
+
+        for (int x = clipBegin_[0]; x < clipEnd_[0]; ++x) {
+            // every position from the matrix (no += along the row, that drifts), so it is the same as for the corners
+            const double vx = start[0] + x * imageToVoxel(0, 0), vy = start[1] + x * imageToVoxel(1, 0), vz = start[2] + x * imageToVoxel(2, 0);
+            const int ix = static_cast<int>(std::floor(vx + 0.5)), iy = static_cast<int>(std::floor(vy + 0.5)), iz = static_cast<int>(std::floor(vz + 0.5));
+            const int bx = brickOf(ix), by = brickOf(iy), bz = brickOf(iz);
+
+            // a pixel right on a corner can still round to the next brick, it is outside the table, skip it
+            if (bx < brickBegin[0] || bx >= brickEnd[0] || by < brickBegin[1] || by >= brickEnd[1] || bz < brickBegin[2] || bz >= brickEnd[2]) continue;
+            const std::size_t b = (static_cast<std::size_t>(bz - brickBegin[2]) * bricksY + (by - brickBegin[1])) * bricksX + (bx - brickBegin[0]);
+
+            Brick* brick = table[b].load(std::memory_order_acquire);
+            if (brick == nullptr) {
+                // the first pixel in this brick, whoever is first puts its brick in the table
+                Brick* fresh = new Brick();
+                if (table[b].compare_exchange_strong(brick, fresh, std::memory_order_acq_rel)) brick = fresh;
+                else delete fresh;
+            }
+            if (!touched[b].load(std::memory_order_relaxed)) touched[b].store(true, std::memory_order_relaxed);
+
+            const std::size_t local = (static_cast<std::size_t>(iz - bz * BRICK_SIZE) * BRICK_SIZE + (iy - by * BRICK_SIZE)) * BRICK_SIZE + (ix - bx * BRICK_SIZE);
+            const std::uint64_t sample = ACCUMULATOR_COUNT_ONE | row[x];
+            #pragma omp atomic
+            brick->accumulator[local] += sample;
+        }
+    }
+
+    // the new bricks go to the volume, and the bricks that got pixels are remembered for copyLiveVolume()
+    for (int bz = 0; bz < bricksZ; ++bz) {
+        for (int by = 0; by < bricksY; ++by) {
+            for (int bx = 0; bx < bricksX; ++bx) {
+                const std::size_t b = (static_cast<std::size_t>(bz) * bricksY + by) * bricksX + bx;
+                Brick* brick = table[b].load(std::memory_order_relaxed);
+                if (brick == nullptr || !touched[b].load(std::memory_order_relaxed)) continue;
+                const std::array<int, 3> coordinate = {brickBegin[0] + bx, brickBegin[1] + by, brickBegin[2] + bz};
+                if (!existed[b]) insertBrick(coordinate, std::unique_ptr<Brick>(brick));
+                if (!brick->changed) {
+                    brick->changed = true;
+                    changedBricks_.push_back(coordinate);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void VolumeReconstructor::insertBrick(const std::array<int, 3>& coordinate, std::unique_ptr<Brick> brick)
+{
+    bricks_.emplace(brickKey(coordinate[0], coordinate[1], coordinate[2]), std::move(brick));
+    for (int k = 0; k < 3; ++k) {
+        brickMin_[k] = bricks_.size() == 1 ? coordinate[k] : std::min(brickMin_[k], coordinate[k]);
+        brickMax_[k] = bricks_.size() == 1 ? coordinate[k] : std::max(brickMax_[k], coordinate[k]);
+    }
+    brickCoordinates_.push_back(coordinate);
+}
+
+void VolumeReconstructor::copyLiveVolume(VolumeReconstructor& target)
+{
+    // only the bricks that got pixels since the last copy, a frame only touches a few of them
+    for (const std::array<int, 3>& coordinate : changedBricks_) {
+        const std::uint64_t key = brickKey(coordinate[0], coordinate[1], coordinate[2]);
+        Brick& brick = *bricks_.at(key);
+        brick.changed = false;
+
+        auto found = target.bricks_.find(key);
+        if (found == target.bricks_.end()) {
+            target.insertBrick(coordinate, std::make_unique<Brick>(brick));
+        } else {
+            found->second->accumulator = brick.accumulator;
+        }
+    }
+    changedBricks_.clear();
+}
+
+bool VolumeReconstructor::snapshot(MHAReader::MHAHeader& header, BrickedVolume& volume)
+{
+    if (bricks_.empty()) return false;
+
+    // the box around all bricks so far
+    std::size_t total = 1;
+    for (int k = 0; k < 3; ++k) {
+        dim_[k] = (brickMax_[k] - brickMin_[k] + 1) * BRICK_SIZE;
+        total  *= static_cast<std::size_t>(dim_[k]);
+    }
+    if (total > MAXIMUM_VOXELS) {
+        std::cerr << "VolumeReconstructor::snapshot() The volume is too big (" << dim_[0] << "x" << dim_[1] << "x" << dim_[2] << ")." << std::endl;
+        return false;
+    }
+
+    // the mean of every voxel of slice z, brick by brick (a missing brick is all holes)
+    const int bricksX = brickMax_[0] - brickMin_[0] + 1, bricksY = brickMax_[1] - brickMin_[1] + 1;
+    auto meanSlice = [this, bricksX, bricksY](int z, unsigned char* values, unsigned char* known) {
+        const int bz = brickMin_[2] + z / BRICK_SIZE, inBrickZ = z % BRICK_SIZE;
+        #pragma omp parallel for schedule(static)
+        for (int by = 0; by < bricksY; ++by) {
+            for (int bx = 0; bx < bricksX; ++bx) {
+                auto found = bricks_.find(brickKey(brickMin_[0] + bx, brickMin_[1] + by, bz));
+                for (int y = 0; y < BRICK_SIZE; ++y) {
+                    const std::size_t rowStart = static_cast<std::size_t>(by * BRICK_SIZE + y) * dim_[0] + bx * BRICK_SIZE;
+                    if (found == bricks_.end()) {
+                        std::memset(values + rowStart, 0, BRICK_SIZE);
+                        std::memset(known + rowStart, 0, BRICK_SIZE);
+                        continue;
+                    }
+                    const std::uint64_t* accumulator = found->second->accumulator.data() + (inBrickZ * BRICK_SIZE + y) * BRICK_SIZE;
+                    for (int x = 0; x < BRICK_SIZE; ++x) {
+                        const std::uint64_t count = accumulator[x] >> ACCUMULATOR_COUNT_SHIFT;
+                        const std::uint64_t sum   = accumulator[x] & ACCUMULATOR_SUM_MASK;
+                        values[rowStart + x] = count > 0 ? static_cast<unsigned char>((sum + count / 2) / count) : 0;
+                        known[rowStart + x]  = count > 0;
+                    }
+                }
+            }
+        }
+    };
+
+    const Eigen::Vector3d origin(brickMin_[0] * BRICK_SIZE * config_.outputSpacing[0],
+                                 brickMin_[1] * BRICK_SIZE * config_.outputSpacing[1],
+                                 brickMin_[2] * BRICK_SIZE * config_.outputSpacing[2]);
+    volume = buildVolume(meanSlice, origin, nullptr);
+    if (volume.empty()) return false;
+    header = volumeHeader(origin);
+    return true;
+}
+
+bool VolumeReconstructor::writeVolume(const std::string& filename, const MHAReader::MHAHeader& header, const BrickedVolume& volume)
+{
+    if (volume.empty()) return false;
+
+    // Compress the voxels first (one zlib stream, like MetaIO), the header needs CompressedDataSize. The slices come
+    // one after another out of the bricks. Most of a reconstructed volume is empty, so this is a lot smaller.
+    const std::array<int, 3>& dim = volume.getDim();
+    std::vector<unsigned char> slice(static_cast<std::size_t>(dim[0]) * dim[1]);
+    std::vector<unsigned char> compressed;
+    z_stream zs = {};
+    if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        std::cerr << "VolumeReconstructor::writeVolume() Error initializing zlib for compression." << std::endl;
+        return false;
+    }
+    int ret = Z_OK;
+    for (int z = 0; z < dim[2] && ret == Z_OK; ++z) {
+        // a slice is less than MAXIMUM_VOXELS, it fits in a uInt, the last slice finishes the stream
+        volume.copySlice(z, slice.data());
+        zs.next_in  = slice.data();
+        zs.avail_in = static_cast<uInt>(slice.size());
+        const int flush = (z == dim[2] - 1) ? Z_FINISH : Z_NO_FLUSH;
+
+        // deflate until it took the whole slice (or finished the stream)
+        do {
+            const std::size_t outPos = compressed.size();
+            compressed.resize(outPos + VOLUME_DEFLATE_CHUNK_SIZE);
+            zs.next_out  = compressed.data() + outPos;
+            zs.avail_out = static_cast<uInt>(VOLUME_DEFLATE_CHUNK_SIZE);
+            ret = deflate(&zs, flush);
+            compressed.resize(compressed.size() - zs.avail_out);
+        } while (ret == Z_OK && (zs.avail_in > 0 || (flush == Z_FINISH && zs.avail_out == 0)));
+    }
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        std::cerr << "VolumeReconstructor::writeVolume() Error compressing the voxels." << std::endl;
+        return false;
+    }
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "VolumeReconstructor::writeVolume() Unable to open file: " << filename << std::endl;
+        return false;
+    }
+
+    file << "ObjectType = "             << header.ObjectType << std::endl;
+    file << "NDims = "                  << header.NDims << std::endl;
+    file << "AnatomicalOrientation = "  << header.AnatomicalOrientation << std::endl;
+    file << "BinaryData = "             << (header.BinaryData ? "True" : "False") << std::endl;
+    file << "BinaryDataByteOrderMSB = " << (header.BinaryDataByteOrderMSB ? "True" : "False") << std::endl;
+    file << "CenterOfRotation = "       << header.CenterOfRotation.at(0) << " " << header.CenterOfRotation.at(1) << " " << header.CenterOfRotation.at(2) << std::endl;
+    file << "CompressedData = True"     << std::endl;
+    file << "CompressedDataSize = "     << compressed.size() << std::endl;
+    file << "DimSize = "                << header.DimSize.at(0) << " " << header.DimSize.at(1) << " " << header.DimSize.at(2) << std::endl;
+    file << "ElementSpacing = "         << header.ElementSpacing.at(0) << " " << header.ElementSpacing.at(1) << " " << header.ElementSpacing.at(2) << std::endl;
+    file << "Offset = "                 << header.Offset.at(0) << " " << header.Offset.at(1) << " " << header.Offset.at(2) << std::endl;
+    file << "TransformMatrix = "        << header.TransformMatrix.at(0) << " " << header.TransformMatrix.at(1) << " " << header.TransformMatrix.at(2) << " "
+                                        << header.TransformMatrix.at(3) << " " << header.TransformMatrix.at(4) << " " << header.TransformMatrix.at(5) << " "
+                                        << header.TransformMatrix.at(6) << " " << header.TransformMatrix.at(7) << " " << header.TransformMatrix.at(8) << std::endl;
+    file << "ElementType = "            << header.ElementType << std::endl;
+    file << "ElementDataFile = LOCAL"   << std::endl;
+    file.write(reinterpret_cast<const char*>(compressed.data()), static_cast<std::streamsize>(compressed.size()));
+
+    if (!file) {
+        std::cerr << "VolumeReconstructor::writeVolume() Error in writing " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
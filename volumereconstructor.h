@@ -0,0 +1,179 @@
+#ifndef VOLUMERECONSTRUCTOR_H
+#define VOLUMERECONSTRUCTOR_H
+
+#include <array>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+#include <Eigen/Dense>
+
+#include "mhareader.h"
+#include "brickedvolume.h"
+
+/**
+ * @class VolumeReconstructor
+ * @brief Reconstructs the volume from a freehand B-mode sweep (the Sequence Image that MHAWriter records), in process.
+ *
+ * For the context. We used to call VolumeReconstructor.exe of PlusToolkit (a hard-coded path, Windows only), which wrote
+ * the volume to a file that we then had to read again, and it took minutes after every sweep. This class does the same
+ * thing here: it takes the frames and the transformations of the recorded sequence, and the calibration (ImageToProbe)
+ * and the VolumeReconstruction parameters from the same Plus configuration file (.xml) that fCal produced.
+ *
+ * The reconstruction is pixel nearest neighbour (PNN) with mean compounding, like Plus does with
+ * Interpolation="NEAREST_NEIGHBOR" and CompoundingMode="MEAN". Every pixel of the clip rectangle of every frame goes
+ * to the voxel it falls in, and every voxel becomes the mean of all pixels it got. The frames are pasted in parallel
+ * (all cores), the sum and the count of a voxel are packed in one 64 bit integer so that a pixel is one atomic add.
+ * The transformation from the pixel to the voxel is affine, so along a row of the image the voxel coordinates simply
+ * increase by a constant step. Afterwards the holes (voxels that no pixel hit, between two frames that are too far
+ * from each other) are filled with the mean of their neighbours, if enough of the neighbours are known. The means and
+ * the hole filling go slice by slice (a pass only needs the slices next to it) straight into a BrickedVolume, so the
+ * dense output volume is never in memory.
+ *
+ * The result is the header and the bricks of a volume in memory, the same as MHAReader would give for a file, so it
+ * can directly be wrapped in an MHAReader and shown by Volume3DController. The output volume is in the Reference
+ * coordinate frame (ImageToReference, like --image-to-reference-transform=ImageToReference of Plus).
+ *
+ * It can also reconstruct while the sweep is still going (see LiveVolumeReconstructor): addFrame() pastes one frame
+ * at a time (the rows in parallel) into a sparse volume that grows with the sweep. The volume is made of bricks of
+ * 16x16x16 voxels on a grid that starts at the origin of the Reference, a brick is only allocated when a pixel falls
+ * in it. snapshot() makes a normal volume (bricked, with the holes filled) of what is there so far, to be shown.
+ *
+ */
+
+class VolumeReconstructor
+{
+public:
+
+    static constexpr int BRICK_SIZE = 16;       //!< Voxels along one side of a brick of the live volume
+
+    /**
+     * @struct Config
+     * @brief The calibration and the parameters of the reconstruction
+     */
+    struct Config {
+        Eigen::Matrix4d        imageToProbe = Eigen::Matrix4d::Identity(); // calibration, from the pixels (with their size) to the probe marker
+        std::array<double, 3>  outputSpacing = {0.5, 0.5, 0.5};            // size of the voxels (mm)
+        std::array<int, 2>     clipOrigin = {0, 0};                         // the part of the image that is used (pixels)
+        std::array<int, 2>     clipSize = {0, 0};                           // 0 means until the end of the image
+        bool                   fillHoles = true;
+    };
+
+    /**
+     * @brief Reads the calibration (Transform From="Image" To="Probe") and the VolumeReconstruction element of a Plus
+     * configuration file. What is not in the file keeps its default.
+     */
+    static bool loadConfig(const std::string& filename, VolumeReconstructor::Config& config);
+
+    /**
+     * @brief Constructor function
+     */
+    explicit VolumeReconstructor(const VolumeReconstructor::Config& config);
+
+    /**
+     * @brief GET the calibration and the parameters of the reconstruction
+     */
+    const VolumeReconstructor::Config& getConfig() const;
+
+    /**
+     * @brief Reconstructs the volume from a (B-mode) Sequence Image that is already read. The frames with an invalid
+     * transformation are skipped. It stops early (returns false) if cancelled() returns true.
+     */
+    bool reconstruct(MHAReader& sequence, MHAReader::MHAHeader& header, BrickedVolume& volume,
+                     const std::function<bool()>& cancelled = nullptr);
+
+    /**
+     * @brief Writes a volume to a zlib-compressed .mha file (CompressedData = True), so it can be loaded again later
+     */
+    static bool writeVolume(const std::string& filename, const MHAReader::MHAHeader& header, const BrickedVolume& volume);
+
+    /**
+     * @brief Pastes one frame into the live (sparse) volume. Returns false if the frame is skipped (broken transformation).
+     */
+    bool addFrame(const unsigned char* pixels, int width, int height, const Eigen::Matrix4d& imageToReference);
+
+    /**
+     * @brief Makes a volume (with the holes filled) of the live volume so far. Returns false if it is still empty.
+     */
+    bool snapshot(MHAReader::MHAHeader& header, BrickedVolume& volume);
+
+    /**
+     * @brief Copies the bricks of the live volume that changed since the last copy into target (made with the same
+     * Config), so that target.snapshot() can run in another thread while this one keeps adding frames.
+     */
+    void copyLiveVolume(VolumeReconstructor& target);
+
+private:
+
+    /**
+     * @struct Brick
+     * @brief BRICK_SIZE^3 voxels of the live volume, the same packed count and sum as accumulator_
+     */
+    struct Brick {
+        std::array<std::uint64_t, BRICK_SIZE * BRICK_SIZE * BRICK_SIZE> accumulator{};
+        bool changed = false;                   // it got pixels since the last copyLiveVolume(), it is in changedBricks_
+    };
+
+    /**
+     * @brief Sets the size of the frames and clips the clip rectangle of the configuration to it
+     */
+    void setClipRectangle(int width, int height);
+
+    /**
+     * @brief Puts a new brick into the live volume, and grows the box around all bricks
+     */
+    void insertBrick(const std::array<int, 3>& coordinate, std::unique_ptr<Brick> brick);
+
+    /**
+     * @brief Pastes the pixels of one frame into accumulator_ (thread-safe, atomic adds)
+     */
+    void pasteFrame(const unsigned char* pixels, const Eigen::Matrix4d& imageToVoxel);
+
+    /**
+     * @struct SliceWindow
+     * @brief The last 3 slices of one stage of buildVolume() (the means, or a pass of the hole filling), slice z is [z % 3]
+     */
+    struct SliceWindow {
+        std::array<std::vector<unsigned char>, 3> values;
+        std::array<std::vector<unsigned char>, 3> known;   // the voxel got pixels, or was filled
+    };
+
+    /**
+     * @brief One pass of the hole filling for slice z: the voxels that are not known get the mean of their known
+     * neighbours in the pass before (before), if enough of them are known
+     */
+    void fillHolesSlice(int z, const SliceWindow& before, unsigned char* values, unsigned char* known) const;
+
+    /**
+     * @brief Makes the output volume (dim_) slab by slab straight into bricks: meanSlice(z, values, known) gives the
+     * mean of every voxel of slice z and whether it got pixels, then the passes of the hole filling. Returns an empty
+     * volume if cancelled() returns true.
+     */
+    BrickedVolume buildVolume(const std::function<void(int, unsigned char*, unsigned char*)>& meanSlice, const Eigen::Vector3d& origin,
+                              const std::function<bool()>& cancelled) const;
+
+    /**
+     * @brief The header of the output volume (dim_, the spacing of the configuration) that starts at origin
+     */
+    MHAReader::MHAHeader volumeHeader(const Eigen::Vector3d& origin) const;
+
+    Config config_;                             //!< The calibration and the parameters
+    int imageWidth_ = 0;                        //!< Size of the frames
+    int imageHeight_ = 0;
+    std::array<int, 2> clipBegin_ = {0, 0};     //!< The clip rectangle, clipped to the frames (pixels)
+    std::array<int, 2> clipEnd_ = {0, 0};
+    std::array<int, 3> dim_ = {0, 0, 0};        //!< Size of the output volume
+    std::vector<std::uint64_t> accumulator_;    //!< Per voxel, the number of pixels (upper bits) and their sum (lower bits)
+
+    // the live volume, see addFrame()
+    std::unordered_map<std::uint64_t, std::unique_ptr<Brick>> bricks_; //!< The allocated bricks, by their packed coordinates
+    std::vector<std::array<int, 3>> brickCoordinates_; //!< The coordinates of the allocated bricks, in the order they came
+    std::vector<std::array<int, 3>> changedBricks_; //!< The coordinates of the bricks that got pixels since the last copyLiveVolume()
+    std::array<int, 3> brickMin_ = {0, 0, 0};   //!< The box around all bricks (brick coordinates)
+    std::array<int, 3> brickMax_ = {0, 0, 0};
+};
+
+#endif // VOLUMERECONSTRUCTOR_H
@@ -0,0 +1,138 @@
+#include "volumereslicer.h"
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "amodebeamcaster.h"
+#include "ultrasoundconfig.h"
+
+// The size of a pixel of the slice (mm), bigger if the slice would have more than SLICE_MAX_PIXELS on a side
+static constexpr double SLICE_PIXEL_MM = 0.5;
+static constexpr int SLICE_MAX_PIXELS  = 400;
+// How much of the volume is shown around the tips and the beams (mm)
+static constexpr double SLICE_MARGIN_MM = 10.0;
+
+VolumeReslicer::VolumeReslicer(const std::vector<AmodeConfig::Data>& amodegroupdata)
+    : T_plane_holder_(Eigen::Isometry3d::Identity())
+{
+    // the tips and the ends of the beams, relative to the holder
+    const double maxDepth = UltrasoundConfig::N_SAMPLE * UltrasoundConfig::DS;
+    std::vector<Eigen::Vector3d> tips, beamEnds;
+    for (const AmodeConfig::Data& amodedata : amodegroupdata) {
+        const Eigen::Isometry3d T_ustip_holder = AmodeBeamCaster::transducerToHolder(amodedata);
+        tips.push_back(T_ustip_holder.translation());
+        beamEnds.push_back(T_ustip_holder.translation() + maxDepth * T_ustip_holder.linear().col(2));
+    }
+    if (tips.empty()) return;
+
+    std::vector<Eigen::Vector3d> points = tips;
+    points.insert(points.end(), beamEnds.begin(), beamEnds.end());
+    Eigen::Vector3d center = Eigen::Vector3d::Zero();
+    for (const Eigen::Vector3d& point : points) center += point;
+    center /= static_cast<double>(points.size());
+
+    // the plane through the points: the two main directions of their spread (the normal is the smallest one)
+    Eigen::Matrix3d covariance = Eigen::Matrix3d::Zero();
+    for (const Eigen::Vector3d& point : points) covariance += (point - center) * (point - center).transpose();
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(covariance);
+    Eigen::Vector3d axisX = solver.eigenvectors().col(2);
+    Eigen::Vector3d axisY = solver.eigenvectors().col(1);
+    if (solver.eigenvalues()(1) < 1e-6 * std::max(1.0, solver.eigenvalues()(2))) {
+        // all in a line (one transducer), the plane of the beam and the x axis of the holder (or y if they are parallel)
+        axisX = (beamEnds[0] - tips[0]).normalized();
+        const Eigen::Vector3d side = (std::abs(axisX.x()) < 0.9) ? Eigen::Vector3d::UnitX() : Eigen::Vector3d::UnitY();
+        axisY = (side - side.dot(axisX) * axisX).normalized();
+    }
+    const Eigen::Vector3d normal = axisX.cross(axisY).normalized();
+    axisY = normal.cross(axisX);
+
+    // the image covers everything plus the margin
+    Eigen::Vector2d lower(std::numeric_limits<double>::max(), std::numeric_limits<double>::max());
+    Eigen::Vector2d upper = -lower;
+    for (const Eigen::Vector3d& point : points) {
+        const Eigen::Vector2d inPlane((point - center).dot(axisX), (point - center).dot(axisY));
+        lower = lower.cwiseMin(inPlane);
+        upper = upper.cwiseMax(inPlane);
+    }
+    lower.array() -= SLICE_MARGIN_MM;
+    upper.array() += SLICE_MARGIN_MM;
+    const Eigen::Vector2d extent = upper - lower;
+    pixelSpacing_ = std::max(SLICE_PIXEL_MM, extent.maxCoeff() / SLICE_MAX_PIXELS);
+    width_  = static_cast<int>(std::ceil(extent.x() / pixelSpacing_)) + 1;
+    height_ = static_cast<int>(std::ceil(extent.y() / pixelSpacing_)) + 1;
+    image_.assign(static_cast<std::size_t>(width_) * height_, 0);
+
+    T_plane_holder_.linear().col(0) = axisX;
+    T_plane_holder_.linear().col(1) = axisY;
+    T_plane_holder_.linear().col(2) = normal;
+    T_plane_holder_.translation()   = center + lower.x() * axisX + lower.y() * axisY;
+
+    // the transducers don't move in the holder, so they are always at the same place in the image
+    const Eigen::Isometry3d T_holder_plane = T_plane_holder_.inverse();
+    for (std::size_t i = 0; i < tips.size(); ++i) {
+        tipPixels_.push_back((T_holder_plane * tips[i]).head<2>() / pixelSpacing_);
+        beamEndPixels_.push_back((T_holder_plane * beamEnds[i]).head<2>() / pixelSpacing_);
+    }
+}
+
+void VolumeReslicer::setVolume(const BrickedVolume* volume)
+{
+    volume_ = volume;
+}
+
+bool VolumeReslicer::hasVolume() const
+{
+    return volume_ != nullptr && !volume_->empty();
+}
+
+int VolumeReslicer::getWidth() const
+{
+    return width_;
+}
+
+int VolumeReslicer::getHeight() const
+{
+    return height_;
+}
+
+double VolumeReslicer::getPixelSpacing() const
+{
+    return pixelSpacing_;
+}
+
+const std::vector<Eigen::Vector2d>& VolumeReslicer::getTipPixels() const
+{
+    return tipPixels_;
+}
+
+const std::vector<Eigen::Vector2d>& VolumeReslicer::getBeamEndPixels() const
+{
+    return beamEndPixels_;
+}
+
+const std::vector<unsigned char>& VolumeReslicer::getImage() const
+{
+    return image_;
+}
+
+bool VolumeReslicer::reslice(const Eigen::Isometry3d& T_holder_ref)
+{
+    if (!hasVolume() || image_.empty()) return false;
+
+    // the plane in voxel coordinates: the first pixel, and the steps to the next column and to the next row
+    const Eigen::Isometry3d T_plane_ref = T_holder_ref * T_plane_holder_;
+    const std::array<double, 3>& origin  = volume_->getOrigin();
+    const std::array<double, 3>& spacing = volume_->getSpacing();
+    Eigen::Vector3d start, stepColumn, stepRow;
+    for (int i = 0; i < 3; ++i) {
+        start[i]      = (T_plane_ref.translation()[i] - origin[i]) / spacing[i];
+        stepColumn[i] = T_plane_ref.linear()(i, 0) * pixelSpacing_ / spacing[i];
+        stepRow[i]    = T_plane_ref.linear()(i, 1) * pixelSpacing_ / spacing[i];
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int row = 0; row < height_; ++row)
+        volume_->sampleRow(start + stepRow * row, stepColumn, width_, image_.data() + static_cast<std::size_t>(row) * width_);
+    return true;
+}
@@ -0,0 +1,82 @@
+#ifndef VOLUMERESLICER_H
+#define VOLUMERESLICER_H
+
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "amodeconfig.h"
+#include "brickedvolume.h"
+
+/**
+ * @class VolumeReslicer
+ * @brief Cuts the reconstructed volume along the plane of the transducers of a holder, for every mocap frame.
+ *
+ * For the context. The 3D scatter shows where the beams are relative to the bone, but the user has to rotate it to see
+ * what tissue a beam goes through. The transducers of a holder (and their beams) lie more or less in one plane, around
+ * the leg. So the volume is sampled on that plane, it is like the B-mode image that the holder would make, with the
+ * beams drawn on it, next to the A-mode signals.
+ *
+ * The plane is fit once to the tips and the ends of the beams (relative to the holder), the image covers them plus a
+ * margin. With one transducer (or all of them in a line) the plane is the one of the beam and the holder x axis. Per
+ * frame, every row of the image is one line through the volume (BrickedVolume::sampleRow(), trilinear, the background
+ * is filled without reading voxels), the rows in parallel, into the same buffer every time.
+ *
+ */
+
+class VolumeReslicer
+{
+public:
+
+    /**
+     * @brief Constructor function. Requires the A-mode group data, the local transformation of every transducer.
+     */
+    explicit VolumeReslicer(const std::vector<AmodeConfig::Data>& amodegroupdata);
+
+    /**
+     * @brief SET the volume (it must live as long as it is set, nullptr to remove it)
+     */
+    void setVolume(const BrickedVolume* volume);
+
+    /**
+     * @brief There is a volume to slice
+     */
+    bool hasVolume() const;
+
+    /**
+     * @brief GET the size of the image (pixels) and of a pixel (mm)
+     */
+    int getWidth() const;
+    int getHeight() const;
+    double getPixelSpacing() const;
+
+    /**
+     * @brief GET where the tip and the end of the beam of every transducer are in the image (pixels, column and row)
+     */
+    const std::vector<Eigen::Vector2d>& getTipPixels() const;
+    const std::vector<Eigen::Vector2d>& getBeamEndPixels() const;
+
+    /**
+     * @brief Samples the plane, the holder is in the coordinate system of the volume (Reference). The image is
+     * getImage(), it stays valid until the next reslice(). Returns false if there is no volume.
+     */
+    bool reslice(const Eigen::Isometry3d& T_holder_ref);
+
+    /**
+     * @brief GET the image of the latest reslice() (getWidth() * getHeight() bytes, row after row)
+     */
+    const std::vector<unsigned char>& getImage() const;
+
+private:
+
+    Eigen::Isometry3d T_plane_holder_;              //!< The plane relative to the holder, the origin is pixel (0, 0), x along a row, y down the rows
+    int width_ = 0;                                 //!< Columns of the image
+    int height_ = 0;                                //!< Rows of the image
+    double pixelSpacing_ = 1.0;                     //!< Size of a pixel (mm)
+    std::vector<Eigen::Vector2d> tipPixels_;        //!< The tips in the image
+    std::vector<Eigen::Vector2d> beamEndPixels_;    //!< The ends of the beams in the image
+    const BrickedVolume* volume_ = nullptr;         //!< The reconstructed volume, owned by MHAReader
+    std::vector<unsigned char> image_;              //!< The image, reused for every frame
+};
+
+#endif // VOLUMERESLICER_H